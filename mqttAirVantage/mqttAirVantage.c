@@ -45,6 +45,8 @@
 #include "mqttInterface.h"
 #include "mqttAirVantage.h"
 #include "swir_json.h"
+#include "swir_cbor.h"
+#include "MQTTLog.h"
 
 #include <stdio.h>
 #include <signal.h>
@@ -61,9 +63,18 @@
 #define 	TOPIC_NAME_PUBLISH				"/messages/json"
 #define 	TOPIC_NAME_SUBSCRIBE			"/tasks/json"
 #define 	TOPIC_NAME_ACK					"/acks/json"
+#define 	TOPIC_NAME_PUBLISH_CBOR			"/messages/cbor"
+#define 	TOPIC_NAME_SUBSCRIBE_CBOR		"/tasks/cbor"
+#define 	TOPIC_NAME_ACK_CBOR				"/acks/cbor"
 
 #define		AV_MQTT_KEEP_ALIVE				30
 #define		AV_MQTT_QOS						QOS0
+#define		AV_BATCH_MIN_BYTES				64
+#define		AV_ACK_STACK_SIZE				256		//acks formatted on the stack up to that size
+#define		AV_JSON_STACK_TOKENS			64		//incoming payloads indexed on the stack up to that many values
+#define		AV_CBOR_STACK_SIZE				256		//CBOR samples encoded on the stack up to that size
+#define		AV_COMMAND_STACK_PARAMS			32		//parameters handed to a command handler from the stack up to that many
+#define		AV_COMMAND_MIN_SLOTS			16
 
 
 mqtt_interface_st*				g_mqttObject = NULL;
@@ -71,6 +82,46 @@ mqtt_interface_st*				g_mqttObject = NULL;
 incomingMessageHandler			g_pfnUserCommandHandler = NULL;
 softwareInstallRequestHandler	g_pfnUserSWInstallHandler = NULL;
 
+//handlers registered for a command id (key NULL), or for one parameter of it : open addressing, linear probing
+typedef struct {
+	char*					id;			//NULL for a free slot
+	char*					key;
+	unsigned int			hash;
+	commandHandler			pfnCommand;
+	incomingMessageHandler	pfnParameter;
+	void*					context;
+} av_command_st;
+
+static struct {
+	av_command_st*			slots;
+	size_t					size;		//a power of 2, at most 3/4 used
+	size_t					count;
+	size_t					keyed;		//entries for a parameter : none, and a command takes a single lookup
+} g_commands;
+
+//<deviceId>/messages/json and <deviceId>/acks/json, made once per session
+static char*					g_pszPublishTopic = NULL;
+static char*					g_pszAckTopic = NULL;
+
+//AV_ENCODING_JSON or AV_ENCODING_CBOR : the one set for the sessions started from then on, the one of the session
+static int						g_nEncoding = AV_ENCODING_JSON;
+static int						g_nSessionEncoding = AV_ENCODING_JSON;
+
+//samples waiting to be published together, see mqtt_avBatchStart
+typedef struct {
+	char*				buffer;		//preallocated, size + 1 bytes
+	size_t				size;		//byte budget of a document
+	size_t				len;		//document so far, its closing braces left out
+	int					maxSamples;
+	int					maxDelayMs;
+	int					samples;	//in the document
+	unsigned long long	timestamp;	//of the last sample : the next one with the same goes in the same object
+	unsigned long long	deadline;	//monotonic_ms by which the document is published, 0 when empty
+	av_batch_stats_st	stats;
+} av_batch_st;
+
+static av_batch_st				g_batch;
+
 //-------------------------------------------------------------------------------------------------------
 char* getDeviceId()
 {
@@ -81,208 +132,752 @@ char* getDeviceId()
 
 	return "";
 }
+//-------------------------------------------------------------------------------------------------------
+static char* makeTopic(const char* deviceId, const char* suffix)
+{
+	char* 	pTopic = (char *) malloc(strlen(deviceId) + strlen(suffix) + 1);
+
+	if (pTopic)
+	{
+		sprintf(pTopic, "%s%s", deviceId, suffix);
+	}
+	return pTopic;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void freeTopics()
+{
+	free(g_pszPublishTopic);
+	free(g_pszAckTopic);
+	g_pszPublishTopic = NULL;
+	g_pszAckTopic = NULL;
+}
+
 //-------------------------------------------------------------------------------------------------------
 int  mqtt_avPublishData(const char* szKey, const char* szValue)
 {
-	char* 	pTopic = (char *) malloc(strlen(getDeviceId()) + strlen(TOPIC_NAME_PUBLISH) + 1);
-	sprintf(pTopic, "%s%s", getDeviceId(), TOPIC_NAME_PUBLISH);
+	if (g_pszPublishTopic == NULL)
+	{
+		return FAILURE;
+	}
+	if (g_nSessionEncoding == AV_ENCODING_JSON)
+	{
+		return mqtt_PublishKeyValue(g_mqttObject, szKey, szValue, g_pszPublishTopic);
+	}
 
-	int rc = mqtt_PublishKeyValue(g_mqttObject, szKey, szValue, pTopic);
+	//{key: value} in CBOR, encoded on the stack unless too large for it
+	unsigned char	buffer[AV_CBOR_STACK_SIZE];
+	unsigned char*	pPayload = buffer;
+	int				len = swircbor_szSerializeTo(buffer, sizeof(buffer), szKey, szValue, 0);
 
-	free(pTopic);
+	if (len >= (int) sizeof(buffer))
+	{
+		if ((pPayload = (unsigned char*) malloc(len + 1)) == NULL)
+		{
+			return FAILURE;
+		}
+		swircbor_szSerializeTo(pPayload, len + 1, szKey, szValue, 0);
+	}
 
+	int rc = mqtt_PublishData(g_mqttObject, (char*) pPayload, len, g_pszPublishTopic);
+
+	if (pPayload != buffer)
+	{
+		free(pPayload);
+	}
 	return rc;
 }
 
 //-------------------------------------------------------------------------------------------------------
-int mqtt_avProcessEvent()
+int mqtt_avBatchStart(size_t maxBytes, int maxSamples, int maxDelayMs)
 {
-	return mqtt_ProcessEvent(g_mqttObject, 1000);
+	/*
+		From now on, mqtt_avBatchAdd gathers samples into a single AirVantage timestamped document,
+		{"<ms>":{"key":"value",...},...}, published on the /messages/json topic once :
+		  - it would grow past maxBytes (the buffer is allocated here, once)
+		  - or it holds maxSamples samples, 0 : no limit
+		  - or its first sample has waited maxDelayMs, 0 : no limit. Checked by mqtt_avProcessEvent
+		  - or a sample comes with a timestamp older than the previous one's, so that no "<ms>" key repeats
+	*/
+	if (maxBytes < AV_BATCH_MIN_BYTES || maxSamples < 0 || maxDelayMs < 0)
+	{
+		return FAILURE;
+	}
+	mqtt_avBatchStop();
+
+	g_batch.buffer = (char *) malloc(maxBytes + 1);
+	if (g_batch.buffer == NULL)
+	{
+		return FAILURE;
+	}
+	g_batch.size = maxBytes;
+	g_batch.maxSamples = maxSamples;
+	g_batch.maxDelayMs = maxDelayMs;
+
+	return SUCCESS;
 }
 
 //-------------------------------------------------------------------------------------------------------
-int mqtt_avPublishAck(const char* szUid, int nAck, char* szMessage)
+int mqtt_avBatchFlush()
 {
-	char* szPayload = (char*) malloc(strlen(szUid)+strlen(szMessage)+48);
+	/*
+		Publishes the samples gathered so far, if any
+	*/
+	if (g_batch.samples == 0)
+	{
+		return SUCCESS;
+	}
+
+	memcpy(g_batch.buffer + g_batch.len, (g_nSessionEncoding == AV_ENCODING_CBOR) ? "\xFF\xFF" : "}}", 2);
+	g_batch.len += 2;
+
+	int rc = (g_pszPublishTopic == NULL) ? FAILURE : mqtt_PublishData(g_mqttObject, g_batch.buffer, g_batch.len, g_pszPublishTopic);
 
-	if (nAck == 0)
+	if (rc == SUCCESS)
 	{
-		sprintf(szPayload, "[{\"uid\": \"%s\", \"status\" : \"OK\"", szUid);
+		g_batch.stats.messages++;
+		g_batch.stats.bytes += g_batch.len;
 	}
 	else
 	{
-		sprintf(szPayload, "[{\"uid\": \"%s\", \"status\" : \"ERROR\"", szUid);
+		g_batch.stats.failures++;
 	}
+	MQTT_DEBUG("Batch of %d samples, %zu bytes : %d", g_batch.samples, g_batch.len, rc);
 
-	if (strlen(szMessage) > 0)
+	g_batch.len = 0;
+	g_batch.samples = 0;
+	g_batch.deadline = 0;
+
+	return rc;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int appendSample(const char* szKey, const char* szValue, unsigned long long timestampMs)
+{
+	//0 when the document has no room left for it : the closing braces always fit
+	size_t			room = g_batch.size - g_batch.len - 2;
+	swirjson_writer	writer;
+	int				len;
+
+	swirjson_writerInit(&writer, g_batch.buffer + g_batch.len, room + 1);
+	if (g_nSessionEncoding == AV_ENCODING_CBOR)
 	{
-		sprintf(szPayload, "%s, \"message\" : \"%s\"}]", szPayload, szMessage);
+		//maps of indefinite length, ended by the break bytes : {<ms>:{ to start with, }<ms>:{ for another timestamp
+		if (g_batch.samples == 0 || timestampMs != g_batch.timestamp)
+		{
+			if (g_batch.samples == 0)
+			{
+				swircbor_writeMap(&writer, SWIRCBOR_INDEFINITE);
+			}
+			else
+			{
+				swircbor_writeBreak(&writer);
+			}
+			swircbor_writeUInt(&writer, timestampMs);
+			swircbor_writeMap(&writer, SWIRCBOR_INDEFINITE);
+		}
+		swircbor_writeString(&writer, szKey);
+		swircbor_writeString(&writer, szValue);
 	}
 	else
 	{
-		sprintf(szPayload, "%s}]", szPayload);
+		if (g_batch.samples == 0 || timestampMs != g_batch.timestamp)
+		{
+			//{"<ms>":{ to start with, },"<ms>":{ for another timestamp
+			swirjson_writeRaw(&writer, (g_batch.samples == 0) ? "{\"" : "},\"", (g_batch.samples == 0) ? 2 : 3);
+			swirjson_writeUInt(&writer, timestampMs);
+			swirjson_writeRaw(&writer, "\":{", 3);
+		}
+		else
+		{
+			swirjson_writeChar(&writer, ',');
+		}
+		swirjson_writeString(&writer, szKey);
+		swirjson_writeChar(&writer, ':');
+		swirjson_writeString(&writer, szValue);
 	}
 
-	printf("Sending ACK: %s\n", szPayload);
+	len = swirjson_writerEnd(&writer);
+	if (len < 0 || (size_t) len > room)
+	{
+		return 0;
+	}
 
-	char* 	pTopic = (char *) malloc(strlen(getDeviceId()) + strlen(TOPIC_NAME_ACK) + 1);
-	sprintf(pTopic, "%s%s", getDeviceId(), TOPIC_NAME_ACK);
+	g_batch.len += len;
+	g_batch.timestamp = timestampMs;
+	if (g_batch.samples++ == 0 && g_batch.maxDelayMs > 0)
+	{
+		g_batch.deadline = monotonic_ms() + g_batch.maxDelayMs;
+	}
+	return 1;
+}
 
-	int rc =  mqtt_PublishData(g_mqttObject, szPayload, strlen(szPayload), pTopic);
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avBatchAdd(const char* szKey, const char* szValue, unsigned long long timestampMs)
+{
+	/*
+		Adds a sample to the document, timestampMs in milliseconds since the epoch, 0 : now.
+		Returns the outcome of the publish this triggered, if any
+	*/
+	int rc = SUCCESS;
 
-	free(pTopic);
-	free(szPayload);
+	if (g_batch.buffer == NULL)
+	{
+		return FAILURE;
+	}
+	if (timestampMs == 0)
+	{
+		struct timeval	now;
+
+		gettimeofday(&now, NULL);
+		timestampMs = (unsigned long long) now.tv_sec * 1000 + now.tv_usec / 1000;
+	}
+
+	//the document's timestamps only go up : one older than the last would open its object a second time
+	if (g_batch.samples > 0 && timestampMs < g_batch.timestamp)
+	{
+		rc = mqtt_avBatchFlush();
+	}
+
+	if (!appendSample(szKey, szValue, timestampMs))
+	{
+		int flushRc = mqtt_avBatchFlush();
+		rc = (rc == SUCCESS) ? flushRc : rc;
+		if (!appendSample(szKey, szValue, timestampMs))
+		{
+			MQTT_WARN("Sample %s larger than the batch, dropped", szKey);
+			return FAILURE;
+		}
+	}
+	g_batch.stats.samples++;
 
+	if (g_batch.maxSamples > 0 && g_batch.samples >= g_batch.maxSamples)
+	{
+		int flushRc = mqtt_avBatchFlush();
+		rc = (rc == SUCCESS) ? flushRc : rc;
+	}
 	return rc;
 }
 
 //-------------------------------------------------------------------------------------------------------
-void onIncomingMessage(MessageData* md)
+int mqtt_avBatchStop()
 {
 	/*
-		This is a callback function (handler), invoked by MQTT client whenever there is an incoming message
-		It performs the following actions :
-		  - deserialize the incoming MQTT JSON-formatted message
-		  - call convertDataToCSV()
+		Publishes what is left, then back to one message per mqtt_avPublishData
 	*/
+	int rc = SUCCESS;
 
-	MQTTMessage* message = md->message;
-	MQTTString*  topicName = md->topicName;
+	if (g_batch.buffer)
+	{
+		rc = mqtt_avBatchFlush();
+		MQTT_INFO("Batched publish : %lu samples in %lu messages, %lu bytes", g_batch.stats.samples, g_batch.stats.messages, g_batch.stats.bytes);
+		free(g_batch.buffer);
+	}
+	av_batch_stats_st	stats = g_batch.stats;
 
-	int payloadLen = (int)message->payloadlen;
+	memset(&g_batch, 0, sizeof(g_batch));
+	g_batch.stats = stats;
 
-	char* topic = malloc(topicName->lenstring.len + 1);
-	memcpy(topic, topicName->lenstring.data, topicName->lenstring.len);
-	topic[topicName->lenstring.len] = 0;
+	return rc;
+}
 
-	printf("\nIncoming data from topic %s :\n", topic);
-	printf("%.*s\n", payloadLen, (char*)message->payload);
+//-------------------------------------------------------------------------------------------------------
+void mqtt_avGetBatchStats(av_batch_stats_st* stats)
+{
+	*stats = g_batch.stats;
+}
 
-	payloadLen++;
-	char* szPayload = (char *) malloc(payloadLen);
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avProcessEvent()
+{
+	//waits up to 1s, less when a batch is due before
+	unsigned int	waitDelayMs = 1000;
 
-	memcpy(szPayload, (char*)message->payload, payloadLen);
-	szPayload[payloadLen] = 0;
+	if (g_batch.deadline)
+	{
+		unsigned long long now = monotonic_ms();
+
+		waitDelayMs = (g_batch.deadline <= now) ? 0 : (g_batch.deadline - now < waitDelayMs) ? g_batch.deadline - now : waitDelayMs;
+	}
 
-	//decode JSON payload
+	int rc = mqtt_ProcessEvent(g_mqttObject, waitDelayMs);
 
-	char* pszCommand = swirjson_getValue(szPayload, -1, (char *) "command");
-	if (pszCommand)
+	if (g_batch.deadline && g_batch.deadline <= monotonic_ms())
 	{
-		char*	pszUid = swirjson_getValue(szPayload, -1, (char *) "uid");
-		char*	pszTimestamp = swirjson_getValue(szPayload, -1, (char *) "timestamp");
-		char*	pszId = swirjson_getValue(pszCommand, -1, (char *) "id");
-		char*	pszParam = swirjson_getValue(pszCommand, -1, (char *) "params");
+		mqtt_avBatchFlush();
+	}
+	return rc;
+}
 
-		int     i;
-		int		rc = 0;
+//-------------------------------------------------------------------------------------------------------
+static void writeAck(swirjson_writer* pWriter, const char* szUid, int nAck, const char* szMessage)
+{
+	//[{"uid": "<uid>", "status" : "OK|ERROR", "message" : "<message>"}], no message when it is empty
+	if (g_nSessionEncoding == AV_ENCODING_CBOR)
+	{
+		swircbor_writeArray(pWriter, 1);
+		swircbor_writeMap(pWriter, *szMessage ? 3 : 2);
+		swircbor_writeString(pWriter, "uid");
+		swircbor_writeString(pWriter, szUid);
+		swircbor_writeString(pWriter, "status");
+		swircbor_writeString(pWriter, (nAck == 0) ? "OK" : "ERROR");
+		if (*szMessage)
+		{
+			swircbor_writeString(pWriter, "message");
+			swircbor_writeString(pWriter, szMessage);
+		}
+		return;
+	}
+	swirjson_writeRaw(pWriter, "[{\"uid\": ", 9);
+	swirjson_writeString(pWriter, szUid);
+	swirjson_writeRaw(pWriter, ", \"status\" : ", 13);
+	swirjson_writeString(pWriter, (nAck == 0) ? "OK" : "ERROR");
+	if (*szMessage)
+	{
+		swirjson_writeRaw(pWriter, ", \"message\" : ", 14);
+		swirjson_writeString(pWriter, szMessage);
+	}
+	swirjson_writeRaw(pWriter, "}]", 2);
+}
 
-		#define     AV_JSON_KEY_MAX_COUNT       	10
-		#define     AV_JSON_KEY_MAX_LENGTH      	32
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avPublishAck(const char* szUid, int nAck, char* szMessage)
+{
+	//formatted on the stack, unless too large for it
+	char			buffer[AV_ACK_STACK_SIZE];
+	swirjson_writer	writer;
+	int				len;
 
-		for (i=0; i<AV_JSON_KEY_MAX_COUNT; i++)
-		{
-			char szKey[AV_JSON_KEY_MAX_LENGTH];
+	if (g_pszAckTopic == NULL)
+	{
+		return FAILURE;
+	}
 
-			char * pszValue = swirjson_getValue(pszParam, i, szKey);
+	swirjson_writerInit(&writer, buffer, sizeof(buffer));
+	writeAck(&writer, szUid, nAck, szMessage);
+	len = swirjson_writerEnd(&writer);
+	if (len >= (int) sizeof(buffer))
+	{
+		swirjson_writerInitAlloc(&writer, len + 1);
+		writeAck(&writer, szUid, nAck, szMessage);
+		len = swirjson_writerEnd(&writer);
+	}
+	if (len < 0)
+	{
+		free(writer.szBuffer);
+		return FAILURE;
+	}
 
-			if (pszValue)
-			{
-				if (g_pfnUserCommandHandler)
-				{
-					if (g_pfnUserCommandHandler(pszId, szKey, pszValue, pszTimestamp))
-					{
-						rc = 1;
-					}
-				}
-				else
-				{
-					fprintf(stdout, "Command[%d] : %s, %s, %s, %s\n", i, pszId, szKey, pszValue, pszTimestamp);	
-				}
-				free(pszValue);
-			}
-			else
-			{
-				break;
-			}
+	MQTT_DEBUG("Sending ACK: %s", (g_nSessionEncoding == AV_ENCODING_CBOR) ? "(CBOR)" : writer.szBuffer);
+
+	int rc =  mqtt_PublishData(g_mqttObject, writer.szBuffer, len, g_pszAckTopic);
+
+	if (writer.szBuffer != buffer)
+	{
+		free(writer.szBuffer);
+	}
+
+	return rc;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static char* valueOf(const swirjson_token* pTokens, int nToken)
+{
+	/*
+		The value as a string, in place : the payload is a copy, its character following the value (closing
+		quote, or separator) is overwritten with the terminator. NULL for a missing value (-1)
+	*/
+	if (nToken < 0)
+	{
+		return NULL;
+	}
+	char* pszValue = (char *) pTokens[nToken].pStart;
+
+	pszValue[pTokens[nToken].nLen] = 0;
+	return pszValue;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned int hashCommand(const char* id, const char* key)
+{
+	//FNV-1a of the id, then of a byte no string has and of the key
+	unsigned int	hash = 2166136261u;
+	const char*		p;
+
+	for (p = id; *p; p++)
+	{
+		hash = (hash ^ (unsigned char) *p) * 16777619u;
+	}
+	if (key)
+	{
+		hash = (hash ^ 0xFF) * 16777619u;
+		for (p = key; *p; p++)
+		{
+			hash = (hash ^ (unsigned char) *p) * 16777619u;
 		}
+	}
+	return hash;
+}
 
-		mqtt_avPublishAck(pszUid, rc, (char *) "");
+//-------------------------------------------------------------------------------------------------------
+static av_command_st* findSlot(const char* id, const char* key, unsigned int hash)
+{
+	//the entry for id and key, else the free slot it would go in
+	size_t	mask = g_commands.size - 1;
+	size_t	i;
 
-		free(pszCommand);
+	for (i = hash & mask; g_commands.slots[i].id; i = (i + 1) & mask)
+	{
+		av_command_st*	pEntry = &g_commands.slots[i];
 
-		if (pszId)
+		if (pEntry->hash == hash && strcmp(pEntry->id, id) == 0
+			&& (pEntry->key == key || (pEntry->key && key && strcmp(pEntry->key, key) == 0)))
 		{
-			free(pszId);
+			return pEntry;
 		}
-		if (pszParam)
+	}
+	return &g_commands.slots[i];
+}
+
+//-------------------------------------------------------------------------------------------------------
+static av_command_st* lookupCommand(const char* id, const char* key)
+{
+	av_command_st*	pEntry;
+
+	if (g_commands.count == 0 || id == NULL || (key && g_commands.keyed == 0))
+	{
+		return NULL;
+	}
+	pEntry = findSlot(id, key, hashCommand(id, key));
+	return pEntry->id ? pEntry : NULL;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int growCommands()
+{
+	av_command_st*	pOld = g_commands.slots;
+	size_t			oldSize = g_commands.size;
+	size_t			i;
+
+	g_commands.size = (oldSize == 0) ? AV_COMMAND_MIN_SLOTS : oldSize * 2;
+	g_commands.slots = (av_command_st *) calloc(g_commands.size, sizeof(av_command_st));
+	if (g_commands.slots == NULL)
+	{
+		g_commands.slots = pOld;
+		g_commands.size = oldSize;
+		return 0;
+	}
+	for (i = 0; i < oldSize; i++)
+	{
+		if (pOld[i].id)
 		{
-			free(pszParam);
+			*findSlot(pOld[i].id, pOld[i].key, pOld[i].hash) = pOld[i];
 		}
-		if (pszTimestamp)
+	}
+	free(pOld);
+	return 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void removeCommand(av_command_st* pEntry)
+{
+	//the entries after it that could have gone in its slot move back into it, leaving no hole in their probe
+	size_t	mask = g_commands.size - 1;
+	size_t	hole = pEntry - g_commands.slots;
+	size_t	i;
+
+	g_commands.keyed -= (pEntry->key != NULL);
+	g_commands.count--;
+	free(pEntry->id);
+	free(pEntry->key);
+	for (i = (hole + 1) & mask; g_commands.slots[i].id; i = (i + 1) & mask)
+	{
+		size_t	home = g_commands.slots[i].hash & mask;
+
+		if (((i - home) & mask) >= ((i - hole) & mask))
 		{
-			free(pszTimestamp);
+			g_commands.slots[hole] = g_commands.slots[i];
+			hole = i;
 		}
-		if (pszUid)
+	}
+	memset(&g_commands.slots[hole], 0, sizeof(av_command_st));
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int registerHandler(const char* id, const char* key, commandHandler pfnCommand, incomingMessageHandler pfnParameter, void* context)
+{
+	unsigned int	hash = hashCommand(id, key);
+	av_command_st*	pEntry = (g_commands.size > 0) ? findSlot(id, key, hash) : NULL;
+
+	if (pfnCommand == NULL && pfnParameter == NULL)
+	{
+		if (pEntry && pEntry->id)
 		{
-			free(pszUid);
+			removeCommand(pEntry);
 		}
+		return SUCCESS;
 	}
-	else
+	if (pEntry == NULL || pEntry->id == NULL)
 	{
-		pszCommand = swirjson_getValue(szPayload, -1, (char *) "swinstall");
-		if (pszCommand)
+		if ((g_commands.count + 1) * 4 > g_commands.size * 3)
 		{
-			char*	uid = swirjson_getValue(szPayload, -1, (char *) "uid");
-			char*	pszTimestamp = swirjson_getValue(szPayload, -1, (char *) "timestamp");
-			char*	type = swirjson_getValue(pszCommand, -1, (char *) "type");
-			char*	revision = swirjson_getValue(pszCommand, -1, (char *) "revision");
-			char*	url = swirjson_getValue(pszCommand, -1, (char *) "url");
-
-			if (g_pfnUserSWInstallHandler)
+			if (!growCommands())
 			{
-				g_pfnUserSWInstallHandler(uid, type, revision, url, pszTimestamp);
-			}
-			else
-			{
-				fprintf(stdout, "SW install Request : %s, %s, %s, %s, %s\n", uid, type, revision, url, pszTimestamp);	
+				return FAILURE;
 			}
+			pEntry = findSlot(id, key, hash);
+		}
+		if ((pEntry->id = strdup(id)) == NULL || (key && (pEntry->key = strdup(key)) == NULL))
+		{
+			free(pEntry->id);
+			memset(pEntry, 0, sizeof(av_command_st));
+			return FAILURE;
+		}
+		pEntry->hash = hash;
+		g_commands.count++;
+		g_commands.keyed += (key != NULL);
+	}
+	pEntry->pfnCommand = pfnCommand;
+	pEntry->pfnParameter = pfnParameter;
+	pEntry->context = context;
+
+	return SUCCESS;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avRegisterCommandHandler(const char* id, commandHandler pHandler, void* context)
+{
+	/*
+		pHandler gets the commands of that id, all their parameters at once, instead of the handler of
+		mqtt_avSetIncomingMsgHandler. NULL unregisters it
+	*/
+	return registerHandler(id, NULL, pHandler, NULL, context);
+}
 
-			free(pszCommand);
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avRegisterParameterHandler(const char* id, const char* key, incomingMessageHandler pHandler)
+{
+	/*
+		pHandler gets that parameter of the commands of that id, instead of the handler of
+		mqtt_avSetIncomingMsgHandler. NULL unregisters it
+	*/
+	return registerHandler(id, key, NULL, pHandler, NULL);
+}
 
-			if (uid)
+//-------------------------------------------------------------------------------------------------------
+static void onCommand(const swirjson_token* pTokens, int nRequest, int nCommand)
+{
+	//[{"uid" : "...", "timestamp" : ..., "command" : {"id" : "...", "params" : {"key" : value, ...}}}]
+	int		nUid = swirjson_find(pTokens, nRequest, "uid");
+	int		nTimestamp = swirjson_find(pTokens, nRequest, "timestamp");
+	int		nId = swirjson_find(pTokens, nCommand, "id");
+	int		nParams = swirjson_find(pTokens, nCommand, "params");
+	int		nKey, nValue, i;
+	int		rc = 0;
+
+	//the terminators go in once every token needed has been looked up
+	char*	pszUid = valueOf(pTokens, nUid);
+	char*	pszTimestamp = valueOf(pTokens, nTimestamp);
+	char*	pszId = valueOf(pTokens, nId);
+
+	//keys and values in turn, up to the end of params
+	int		nEnd = (nParams >= 0 && pTokens[nParams].type == SWIRJSON_OBJECT) ? pTokens[nParams].nNext : 0;
+
+	//the handler registered for that id, if any, gets them all at once
+	av_command_st*	pCommand = lookupCommand(pszId, NULL);
+	av_param_st		params[AV_COMMAND_STACK_PARAMS];
+	av_param_st*	pParams = params;
+	int				nCount = 0;
+
+	if (pCommand && nEnd > 0 && pTokens[nParams].nCount / 2 > AV_COMMAND_STACK_PARAMS)
+	{
+		pParams = (av_param_st *) malloc(pTokens[nParams].nCount / 2 * sizeof(av_param_st));
+		if (pParams == NULL)
+		{
+			pCommand = NULL;
+			nEnd = 0;
+			rc = 1;
+		}
+	}
+
+	for (i = 0, nKey = nParams + 1; nKey < nEnd && (nValue = pTokens[nKey].nNext) < nEnd; i++, nKey = pTokens[nValue].nNext)
+	{
+		char*			pszKey = valueOf(pTokens, nKey);
+		char*			pszValue = valueOf(pTokens, nValue);
+		av_command_st*	pParameter = lookupCommand(pszId, pszKey);
+
+		if (pCommand)
+		{
+			pParams[nCount].key = pszKey;
+			pParams[nCount].value = pszValue;
+			nCount++;
+		}
+
+		if (pParameter)
+		{
+			if (pParameter->pfnParameter(pszId, pszKey, pszValue, pszTimestamp))
 			{
-				free(uid);
+				rc = 1;
 			}
-			if (type)
+		}
+		else if (pCommand == NULL && g_pfnUserCommandHandler)
+		{
+			if (g_pfnUserCommandHandler(pszId, pszKey, pszValue, pszTimestamp))
 			{
-				free(type);
+				rc = 1;
 			}
-			if (pszTimestamp)
+		}
+		else if (pCommand == NULL)
+		{
+			MQTT_INFO("Command[%d] : %s, %s, %s, %s", i, pszId, pszKey, pszValue, pszTimestamp);
+		}
+	}
+
+	if (pCommand && pCommand->pfnCommand(pszUid, pszId, pParams, nCount, pszTimestamp, pCommand->context))
+	{
+		rc = 1;
+	}
+	if (pParams != params)
+	{
+		free(pParams);
+	}
+
+	if (pszUid)
+	{
+		mqtt_avPublishAck(pszUid, rc, (char *) "");
+	}
+	else
+	{
+		MQTT_WARN("Command %s without uid, not acknowledged", pszId ? pszId : "");
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onSoftwareInstall(const swirjson_token* pTokens, int nRequest, int nInstall)
+{
+	//[{"uid" : "...", "timestamp" : ..., "swinstall" : {"type" : "...", "revision" : "...", "url" : "..."}}]
+	int		nUid = swirjson_find(pTokens, nRequest, "uid");
+	int		nTimestamp = swirjson_find(pTokens, nRequest, "timestamp");
+	int		nType = swirjson_find(pTokens, nInstall, "type");
+	int		nRevision = swirjson_find(pTokens, nInstall, "revision");
+	int		nUrl = swirjson_find(pTokens, nInstall, "url");
+
+	char*	uid = valueOf(pTokens, nUid);
+	char*	pszTimestamp = valueOf(pTokens, nTimestamp);
+	char*	type = valueOf(pTokens, nType);
+	char*	revision = valueOf(pTokens, nRevision);
+	char*	url = valueOf(pTokens, nUrl);
+
+	if (g_pfnUserSWInstallHandler)
+	{
+		g_pfnUserSWInstallHandler(uid, type, revision, url, pszTimestamp);
+	}
+	else
+	{
+		MQTT_INFO("SW install Request : %s, %s, %s, %s, %s", uid, type, revision, url, pszTimestamp);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+void onIncomingMessage(MessageData* md)
+{
+	/*
+		This is a callback function (handler), invoked by MQTT client whenever there is an incoming message
+		It performs the following actions :
+		  - index the JSON payload in a single pass (swirjson_tokenize), on a copy of it : in a CBOR session,
+		    on the JSON the payload decodes to
+		  - for each request of the payload, command or software install, call the user handler
+		    with views of the values, made strings in place : nothing else is copied
+	*/
+
+	MQTTMessage* message = md->message;
+	MQTTString*  topicName = md->topicName;
+
+	int payloadLen = (int)message->payloadlen;
+
+	MQTT_DEBUG("Incoming data from topic %.*s (%d)", topicName->lenstring.len, topicName->lenstring.data, payloadLen);
+	MQTT_TRACE("%.*s", payloadLen, (char*)message->payload);
+
+	char* szPayload;
+
+	if (g_nSessionEncoding == AV_ENCODING_CBOR)
+	{
+		swirjson_writer		writer;
+
+		swirjson_writerInitAlloc(&writer, 2 * payloadLen + 16);
+		if (swircbor_toJson((const unsigned char*) message->payload, payloadLen, &writer) < 0)
+		{
+			MQTT_WARN("Incoming data from topic %.*s : not CBOR", topicName->lenstring.len, topicName->lenstring.data);
+			free(writer.szBuffer);
+			return;
+		}
+		if ((payloadLen = swirjson_writerEnd(&writer)) < 0)
+		{
+			free(writer.szBuffer);
+			return;
+		}
+		szPayload = writer.szBuffer;
+	}
+	else if ((szPayload = (char *) malloc(payloadLen + 1)) != NULL)
+	{
+		memcpy(szPayload, (char*)message->payload, payloadLen);
+		szPayload[payloadLen] = 0;
+	}
+	if (szPayload == NULL)
+	{
+		return;
+	}
+
+	//decode JSON payload : tokens on the stack, unless there are too many for it
+
+	swirjson_token	tokens[AV_JSON_STACK_TOKENS];
+	swirjson_token*	pTokens = tokens;
+	int				nTokens = swirjson_tokenize(szPayload, payloadLen, pTokens, AV_JSON_STACK_TOKENS);
+
+	if (nTokens > AV_JSON_STACK_TOKENS)
+	{
+		pTokens = (swirjson_token *) malloc(nTokens * sizeof(swirjson_token));
+		if (pTokens == NULL || swirjson_tokenize(szPayload, payloadLen, pTokens, nTokens) != nTokens)
+		{
+			nTokens = -1;
+		}
+	}
+
+	if (nTokens <= 0)
+	{
+		MQTT_WARN("Incoming data from topic %.*s : not JSON", topicName->lenstring.len, topicName->lenstring.data);
+	}
+	else
+	{
+		//an array of requests, or a request on its own
+		int nRequest = (pTokens[0].type == SWIRJSON_ARRAY) ? 1 : 0;
+		int nEnd = pTokens[0].nNext;
+
+		for (; nRequest < nEnd; nRequest = pTokens[nRequest].nNext)
+		{
+			int nCommand = swirjson_find(pTokens, nRequest, "command");
+			int nInstall = swirjson_find(pTokens, nRequest, "swinstall");
+
+			if (nCommand >= 0 && pTokens[nCommand].type == SWIRJSON_OBJECT)
 			{
-				free(pszTimestamp);
+				onCommand(pTokens, nRequest, nCommand);
 			}
-			if (revision)
+			else if (nInstall >= 0 && pTokens[nInstall].type == SWIRJSON_OBJECT)
 			{
-				free(revision);
+				onSoftwareInstall(pTokens, nRequest, nInstall);
 			}
-			if (url)
+			if (pTokens[0].type != SWIRJSON_ARRAY)
 			{
-				free(url);
+				break;
 			}
 		}
 	}
 
-	if (topic)
+	if (pTokens != tokens)
 	{
-		free(topic);
+		free(pTokens);
 	}
-	if (szPayload)
-	{
-		free(szPayload);
-	}
-
-	fflush(stdout);
+	free(szPayload);
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -297,6 +892,21 @@ void mqtt_avSetSoftwareInstallRequestHandler(softwareInstallRequestHandler pHand
 	g_pfnUserSWInstallHandler = pHandler;
 }
 
+//-------------------------------------------------------------------------------------------------------
+int mqtt_avSetEncoding(int encoding)
+{
+	/*
+		AV_ENCODING_JSON or AV_ENCODING_CBOR, for the data, commands and acks of the sessions started next.
+		A session keeps the encoding it was started with, whatever is set while it runs
+	*/
+	if (encoding != AV_ENCODING_JSON && encoding != AV_ENCODING_CBOR)
+	{
+		return FAILURE;
+	}
+	g_nEncoding = encoding;
+	return SUCCESS;
+}
+
 //-------------------------------------------------------------------------------------------------------
 int mqtt_avStartSession(const char* deviceId, const char* secret, int useTls)
 {
@@ -312,10 +922,21 @@ int mqtt_avStartSession(const char* deviceId, const char* secret, int useTls)
 								AV_MQTT_QOS);
 	}
 
+	//a batch begun in the previous session's encoding goes out first, on its topic
+	if (g_nEncoding != g_nSessionEncoding)
+	{
+		mqtt_avBatchFlush();
+	}
+	freeTopics();
+	g_nSessionEncoding = g_nEncoding;
+	int bCbor = (g_nSessionEncoding == AV_ENCODING_CBOR);
+
+	g_pszPublishTopic = makeTopic(deviceId, bCbor ? TOPIC_NAME_PUBLISH_CBOR : TOPIC_NAME_PUBLISH);
+	g_pszAckTopic = makeTopic(deviceId, bCbor ? TOPIC_NAME_ACK_CBOR : TOPIC_NAME_ACK);
+
 	if (SUCCESS == mqtt_StartSession(g_mqttObject))
 	{
-		char* 	pTopic = (char *) malloc(strlen(deviceId) + strlen(TOPIC_NAME_SUBSCRIBE) + 1);
-		sprintf(pTopic, "%s%s", deviceId, TOPIC_NAME_SUBSCRIBE);
+		char* 	pTopic = makeTopic(deviceId, bCbor ? TOPIC_NAME_SUBSCRIBE_CBOR : TOPIC_NAME_SUBSCRIBE);
 		int rc = mqtt_SubscribeTopic(g_mqttObject, pTopic, onIncomingMessage);
 
 		free(pTopic);
@@ -329,9 +950,12 @@ int mqtt_avStartSession(const char* deviceId, const char* secret, int useTls)
 //-------------------------------------------------------------------------------------------------------
 int mqtt_avStopSession()
 {
+	mqtt_avBatchStop();
+
 	int rc = mqtt_StopSession(g_mqttObject);
 
 	g_mqttObject = mqtt_DeleteInstance(g_mqttObject);
+	freeTopics();
 	return rc;
 }
 
@@ -43,15 +43,41 @@
 #ifndef _MQTT_AV_INTERFACE_H_
 #define _MQTT_AV_INTERFACE_H_
 
+#include <stddef.h>
+
+#define AV_ENCODING_JSON	0		//<deviceId>/messages/json, /tasks/json and /acks/json : what AirVantage speaks
+#define AV_ENCODING_CBOR	1		//<deviceId>/messages/cbor, /tasks/cbor and /acks/cbor : the same documents in CBOR (swir_cbor.h)
+
+typedef struct {
+	unsigned long	samples;	//added with mqtt_avBatchAdd
+	unsigned long	messages;	//documents they were published in : samples / messages is the saving in messages
+	unsigned long	bytes;		//size of these documents
+	unsigned long	failures;	//documents that could not be published, their samples are lost
+} av_batch_stats_st;
+
+typedef struct {
+	const char*		key;
+	const char*		value;
+} av_param_st;
+
 typedef int (*incomingMessageHandler)(const char* id, const char* key, const char* value, const char* timestamp);
+typedef int (*commandHandler)(const char* uid, const char* id, const av_param_st* params, int count, const char* timestamp, void* context);
 typedef int (*softwareInstallRequestHandler)(const char* uid, const char* type, const char* revision, const char* url, const char* timestamp);
 
+int mqtt_avSetEncoding(int encoding);
 int mqtt_avStartSession(const char* deviceId, const char* secret, int useTls);
 void mqtt_avSetIncomingMsgHandler(incomingMessageHandler pHandler);
 void mqtt_avSetSoftwareInstallRequestHandler(softwareInstallRequestHandler pHandler);
+int mqtt_avRegisterCommandHandler(const char* id, commandHandler pHandler, void* context);
+int mqtt_avRegisterParameterHandler(const char* id, const char* key, incomingMessageHandler pHandler);
 int mqtt_avProcessEvent();
 int mqtt_avPublishAck(const char* szUid, int nAck, char* szMessage);
 int mqtt_avPublishData(const char* szKey, const char* szValue);
+int mqtt_avBatchStart(size_t maxBytes, int maxSamples, int maxDelayMs);
+int mqtt_avBatchAdd(const char* szKey, const char* szValue, unsigned long long timestampMs);
+int mqtt_avBatchFlush();
+int mqtt_avBatchStop();
+void mqtt_avGetBatchStats(av_batch_stats_st* stats);
 int mqtt_avStopSession();
 
 #endif	//_MQTT_AV_INTERFACE_H_
\ No newline at end of file
@@ -0,0 +1,423 @@
+/*
+ * swir_cbor.c
+ *
+ *	CBOR (RFC 8949) counterpart of swir_json : the same key/value/timestamp samples, in binary.
+ *	Bytes go through a swirjson_writer, into a caller's buffer or one grown as needed
+ *
+ *	{key: value}, or {timestamp in ms: {key: value}} when there is a timestamp : keys are text,
+ *	timestamps unsigned integers, values text, integers or single precision floats
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "swir_cbor.h"
+
+
+#define CBOR_UINT				0
+#define CBOR_NEGINT				1
+#define CBOR_BYTES				2
+#define CBOR_TEXT				3
+#define CBOR_ARRAY				4
+#define CBOR_MAP				5
+#define CBOR_TAG				6
+#define CBOR_SIMPLE				7
+
+#define CBOR_FALSE				20
+#define CBOR_TRUE				21
+#define CBOR_NULL				22
+#define CBOR_UNDEFINED			23
+#define CBOR_HALF				25
+#define CBOR_FLOAT				26
+#define CBOR_DOUBLE				27
+#define CBOR_INDEFINITE_INFO	31
+#define CBOR_BREAK				0xFF
+
+#define CBOR_MAX_DEPTH			32		//nesting swircbor_toJson follows, the stack it takes is bounded by that
+
+
+void swircbor_writeHead(swirjson_writer* pWriter, int nMajor, unsigned long long ullValue)
+{
+	//major type in the top 3 bits of the first byte, the value in the rest of it, or in the 1, 2, 4 or 8 bytes that follow
+	unsigned char	head[9];
+	int				nBytes, i;
+
+	if (ullValue < 24)
+	{
+		head[0] = (nMajor << 5) | (unsigned char) ullValue;
+		nBytes = 0;
+	}
+	else
+	{
+		int		nInfo = (ullValue <= 0xFF) ? 24 : (ullValue <= 0xFFFF) ? 25 : (ullValue <= 0xFFFFFFFFULL) ? 26 : 27;
+
+		head[0] = (nMajor << 5) | nInfo;
+		nBytes = 1 << (nInfo - 24);
+	}
+	for (i = nBytes; i > 0; i--)
+	{
+		head[i] = ullValue & 0xFF;
+		ullValue >>= 8;
+	}
+	swirjson_writeRaw(pWriter, (const char*) head, nBytes + 1);
+}
+
+void swircbor_writeUInt(swirjson_writer* pWriter, unsigned long long ullValue)
+{
+	swircbor_writeHead(pWriter, CBOR_UINT, ullValue);
+}
+
+void swircbor_writeInt(swirjson_writer* pWriter, long long llValue)
+{
+	if (llValue < 0)
+	{
+		swircbor_writeHead(pWriter, CBOR_NEGINT, (unsigned long long) (-1 - llValue));
+	}
+	else
+	{
+		swircbor_writeHead(pWriter, CBOR_UINT, (unsigned long long) llValue);
+	}
+}
+
+void swircbor_writeFloat(swirjson_writer* pWriter, float fValue)
+{
+	unsigned char	bytes[5];
+	uint32_t		nBits;
+
+	memcpy(&nBits, &fValue, sizeof(nBits));
+	bytes[0] = (CBOR_SIMPLE << 5) | CBOR_FLOAT;
+	bytes[1] = nBits >> 24;
+	bytes[2] = nBits >> 16;
+	bytes[3] = nBits >> 8;
+	bytes[4] = nBits;
+	swirjson_writeRaw(pWriter, (const char*) bytes, sizeof(bytes));
+}
+
+void swircbor_writeString(swirjson_writer* pWriter, const char* szString)
+{
+	size_t	len = strlen(szString);
+
+	swircbor_writeHead(pWriter, CBOR_TEXT, len);
+	swirjson_writeRaw(pWriter, szString, len);
+}
+
+void swircbor_writeMap(swirjson_writer* pWriter, int nPairs)
+{
+	if (nPairs == SWIRCBOR_INDEFINITE)
+	{
+		swirjson_writeChar(pWriter, (char) ((CBOR_MAP << 5) | CBOR_INDEFINITE_INFO));
+	}
+	else
+	{
+		swircbor_writeHead(pWriter, CBOR_MAP, nPairs);
+	}
+}
+
+void swircbor_writeArray(swirjson_writer* pWriter, int nItems)
+{
+	if (nItems == SWIRCBOR_INDEFINITE)
+	{
+		swirjson_writeChar(pWriter, (char) ((CBOR_ARRAY << 5) | CBOR_INDEFINITE_INFO));
+	}
+	else
+	{
+		swircbor_writeHead(pWriter, CBOR_ARRAY, nItems);
+	}
+}
+
+void swircbor_writeBreak(swirjson_writer* pWriter)
+{
+	swirjson_writeChar(pWriter, (char) CBOR_BREAK);
+}
+
+//---------------------------------------------------------------------------------------------------------
+//	Samples, as swirjson_szSerializeTo : into the caller's buffer, returning the length, bufferLen or more when
+//	it did not fit
+
+static void openSample(swirjson_writer* pWriter, unsigned char* pBuffer, size_t bufferLen, const char* szKey, unsigned long ulTimestamp)
+{
+	//up to the value
+	swirjson_writerInit(pWriter, (char*) pBuffer, bufferLen);
+	if (ulTimestamp != 0)
+	{
+		swircbor_writeMap(pWriter, 1);
+		swircbor_writeUInt(pWriter, ulTimestamp * 1000ULL);
+	}
+	swircbor_writeMap(pWriter, 1);
+	swircbor_writeString(pWriter, szKey);
+}
+
+int swircbor_szSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, const char* szValue, unsigned long ulTimestamp)
+{
+	swirjson_writer		writer;
+
+	openSample(&writer, pBuffer, bufferLen, szKey, ulTimestamp);
+	swircbor_writeString(&writer, szValue);
+
+	return swirjson_writerEnd(&writer);
+}
+
+int swircbor_nSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, int nValue, unsigned long ulTimestamp)
+{
+	swirjson_writer		writer;
+
+	openSample(&writer, pBuffer, bufferLen, szKey, ulTimestamp);
+	swircbor_writeInt(&writer, nValue);
+
+	return swirjson_writerEnd(&writer);
+}
+
+int swircbor_fSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, float fValue, unsigned long ulTimestamp)
+{
+	swirjson_writer		writer;
+
+	openSample(&writer, pBuffer, bufferLen, szKey, ulTimestamp);
+	swircbor_writeFloat(&writer, fValue);
+
+	return swirjson_writerEnd(&writer);
+}
+
+//---------------------------------------------------------------------------------------------------------
+//	Decoding, to the JSON the same document would be in
+
+static int readHead(const unsigned char** ppData, const unsigned char* pEnd, int* pnMajor, int* pnInfo, unsigned long long* pullValue)
+{
+	//0 when it runs past the end or uses a reserved length
+	const unsigned char*	p = *ppData;
+	int						nBytes;
+
+	if (p >= pEnd)
+	{
+		return 0;
+	}
+	*pnMajor = *p >> 5;
+	*pnInfo = *p++ & 0x1F;
+	*pullValue = *pnInfo;
+	if (*pnInfo >= 24 && *pnInfo < CBOR_INDEFINITE_INFO)
+	{
+		if (*pnInfo > 27)
+		{
+			return 0;
+		}
+		nBytes = 1 << (*pnInfo - 24);
+		if (pEnd - p < nBytes)
+		{
+			return 0;
+		}
+		for (*pullValue = 0; nBytes > 0; nBytes--)
+		{
+			*pullValue = (*pullValue << 8) | *p++;
+		}
+	}
+	*ppData = p;
+	return 1;
+}
+
+static float halfToFloat(unsigned int nHalf)
+{
+	//sign, 5 bits of exponent, 10 of mantissa : widened to a float's 8 and 23
+	unsigned int	nExponent = (nHalf >> 10) & 0x1F;
+	unsigned int	nMantissa = nHalf & 0x3FF;
+	uint32_t		nBits;
+	float			fValue;
+
+	if (nExponent == 0)
+	{
+		fValue = nMantissa / 16777216.0f;		//subnormal : mantissa * 2^-24
+		return (nHalf & 0x8000) ? -fValue : fValue;
+	}
+	nBits = ((uint32_t) (nHalf & 0x8000) << 16) | ((nExponent == 31) ? 0xFF : nExponent - 15 + 127) << 23 | nMantissa << 13;
+	memcpy(&fValue, &nBits, sizeof(fValue));
+	return fValue;
+}
+
+static int decodeString(const unsigned char** ppData, const unsigned char* pEnd, swirjson_writer* pWriter, int nMajor, int nInfo, unsigned long long ullLen)
+{
+	//text as it is, escaped ; bytes in hex. Of indefinite length, chunks of the same type follow, up to a break
+	const unsigned char*	p = *ppData;
+	int						bChunked = (nInfo == CBOR_INDEFINITE_INFO);
+
+	swirjson_writeChar(pWriter, '"');
+	do
+	{
+		if (bChunked)
+		{
+			int		nChunkMajor;
+
+			if (p < pEnd && *p == CBOR_BREAK)
+			{
+				p++;
+				break;
+			}
+			if (!readHead(&p, pEnd, &nChunkMajor, &nInfo, &ullLen) || nChunkMajor != nMajor || nInfo == CBOR_INDEFINITE_INFO)
+			{
+				return -1;
+			}
+		}
+		if (ullLen > (unsigned long long) (pEnd - p))
+		{
+			return -1;
+		}
+		if (nMajor == CBOR_TEXT)
+		{
+			swirjson_writeEscapedLen(pWriter, (const char*) p, ullLen);
+		}
+		else
+		{
+			size_t	i;
+
+			for (i = 0; i < ullLen; i++)
+			{
+				swirjson_writeChar(pWriter, "0123456789abcdef"[p[i] >> 4]);
+				swirjson_writeChar(pWriter, "0123456789abcdef"[p[i] & 0xF]);
+			}
+		}
+		p += ullLen;
+	} while (bChunked);
+	swirjson_writeChar(pWriter, '"');
+
+	*ppData = p;
+	return 0;
+}
+
+static int decodeItem(const unsigned char** ppData, const unsigned char* pEnd, swirjson_writer* pWriter, int nDepth, int bKey)
+{
+	/*
+		One item and what it holds, 0 when done, -1 if malformed.  JSON keys being strings, a map key (bKey) must
+		be text, or an integer, which is quoted
+	*/
+	int						nMajor, nInfo;
+	unsigned long long		ullValue, i;
+
+	if (nDepth > CBOR_MAX_DEPTH || !readHead(ppData, pEnd, &nMajor, &nInfo, &ullValue))
+	{
+		return -1;
+	}
+	if (nInfo == CBOR_INDEFINITE_INFO && (nMajor == CBOR_UINT || nMajor == CBOR_NEGINT || nMajor == CBOR_TAG || nMajor == CBOR_SIMPLE))
+	{
+		return -1;		//a break where no item of indefinite length is open, or nonsense
+	}
+	if (bKey && nMajor != CBOR_UINT && nMajor != CBOR_NEGINT && nMajor != CBOR_TEXT && nMajor != CBOR_TAG)
+	{
+		return -1;
+	}
+
+	switch (nMajor)
+	{
+		case CBOR_UINT:
+		case CBOR_NEGINT:
+			if (bKey)
+			{
+				swirjson_writeChar(pWriter, '"');
+			}
+			if (nMajor == CBOR_NEGINT)
+			{
+				//-1 - value, which may be one past what 64 bits hold
+				swirjson_writeChar(pWriter, '-');
+				if (ullValue == 0xFFFFFFFFFFFFFFFFULL)
+				{
+					swirjson_writeRaw(pWriter, "18446744073709551616", 20);
+				}
+				else
+				{
+					swirjson_writeUInt(pWriter, ullValue + 1);
+				}
+			}
+			else
+			{
+				swirjson_writeUInt(pWriter, ullValue);
+			}
+			if (bKey)
+			{
+				swirjson_writeChar(pWriter, '"');
+			}
+			return 0;
+
+		case CBOR_BYTES:
+		case CBOR_TEXT:
+			return decodeString(ppData, pEnd, pWriter, nMajor, nInfo, ullValue);
+
+		case CBOR_ARRAY:
+		case CBOR_MAP:
+			swirjson_writeChar(pWriter, (nMajor == CBOR_MAP) ? '{' : '[');
+			for (i = 0; nInfo == CBOR_INDEFINITE_INFO || i < ullValue; i++)
+			{
+				if (nInfo == CBOR_INDEFINITE_INFO && *ppData < pEnd && **ppData == CBOR_BREAK)
+				{
+					(*ppData)++;
+					break;
+				}
+				if (i > 0)
+				{
+					swirjson_writeChar(pWriter, ',');
+				}
+				if (nMajor == CBOR_MAP)
+				{
+					if (decodeItem(ppData, pEnd, pWriter, nDepth + 1, 1) < 0)
+					{
+						return -1;
+					}
+					swirjson_writeChar(pWriter, ':');
+				}
+				if (decodeItem(ppData, pEnd, pWriter, nDepth + 1, 0) < 0)
+				{
+					return -1;
+				}
+			}
+			swirjson_writeChar(pWriter, (nMajor == CBOR_MAP) ? '}' : ']');
+			return 0;
+
+		case CBOR_TAG:
+			return decodeItem(ppData, pEnd, pWriter, nDepth + 1, bKey);		//dates, bignums... : the tagged item as it is
+
+		default:
+			switch (nInfo)
+			{
+				case CBOR_FALSE:
+					swirjson_writeRaw(pWriter, "false", 5);
+					return 0;
+				case CBOR_TRUE:
+					swirjson_writeRaw(pWriter, "true", 4);
+					return 0;
+				case CBOR_HALF:
+					swirjson_writeDouble(pWriter, halfToFloat((unsigned int) ullValue), 5);
+					return 0;
+				case CBOR_FLOAT:
+				{
+					uint32_t	nBits = (uint32_t) ullValue;
+					float		fValue;
+
+					memcpy(&fValue, &nBits, sizeof(fValue));
+					swirjson_writeDouble(pWriter, fValue, 9);
+					return 0;
+				}
+				case CBOR_DOUBLE:
+				{
+					double		dValue;
+
+					memcpy(&dValue, &ullValue, sizeof(dValue));
+					swirjson_writeDouble(pWriter, dValue, 17);
+					return 0;
+				}
+				default:
+					swirjson_writeRaw(pWriter, "null", 4);		//null, undefined and the other simple values
+					return 0;
+			}
+	}
+}
+
+int swircbor_toJson(const unsigned char* pData, size_t len, swirjson_writer* pWriter)
+{
+	/*
+		Writes the JSON text of one CBOR item : maps become objects, their integer keys strings, byte strings
+		hex strings, tags are dropped.  0 if successful, -1 if the item is malformed, or does not end the data
+	*/
+	const unsigned char*	pEnd = pData + len;
+
+	if (decodeItem(&pData, pEnd, pWriter, 0, 0) < 0 || pData != pEnd)
+	{
+		return -1;
+	}
+	return 0;
+}
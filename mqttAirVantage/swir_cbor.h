@@ -0,0 +1,37 @@
+/*
+ * swir_cbor.h
+ *
+ *	CBOR (RFC 8949) counterpart of swir_json : the same key/value/timestamp samples, in binary.
+ *	Bytes go through a swirjson_writer, into a caller's buffer or one grown as needed
+ *
+ *	{key: value}, or {timestamp in ms: {key: value}} when there is a timestamp : keys are text,
+ *	timestamps unsigned integers, values text, integers or single precision floats
+ */
+
+#ifndef _SWIR_CBOR_H_
+#define _SWIR_CBOR_H_
+
+#include <stddef.h>
+
+#include "swir_json.h"
+
+
+#define SWIRCBOR_INDEFINITE		-1		//map or array whose items end with swircbor_writeBreak
+
+void		swircbor_writeHead(swirjson_writer* pWriter, int nMajor, unsigned long long ullValue);
+void		swircbor_writeUInt(swirjson_writer* pWriter, unsigned long long ullValue);
+void		swircbor_writeInt(swirjson_writer* pWriter, long long llValue);
+void		swircbor_writeFloat(swirjson_writer* pWriter, float fValue);
+void		swircbor_writeString(swirjson_writer* pWriter, const char* szString);
+void		swircbor_writeMap(swirjson_writer* pWriter, int nPairs);
+void		swircbor_writeArray(swirjson_writer* pWriter, int nItems);
+void		swircbor_writeBreak(swirjson_writer* pWriter);
+
+int			swircbor_szSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, const char* szValue, unsigned long ulTimestamp);
+int			swircbor_nSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, int nValue, unsigned long ulTimestamp);
+int			swircbor_fSerializeTo(unsigned char* pBuffer, size_t bufferLen, const char* szKey, float fValue, unsigned long ulTimestamp);
+
+int			swircbor_toJson(const unsigned char* pData, size_t len, swirjson_writer* pWriter);
+
+
+#endif	//_SWIR_CBOR_H_
@@ -13,11 +13,18 @@
 #include <ctype.h>
 
 #include <memory.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <locale.h>
 
-#include "swir_json.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SWIRJSON_X86
+#endif
 
+#include "swir_json.h"
 
-#define JSON_MAX_PAYLOAD_SIZE	2048
 
 #define JSON_KEY_VAL_SEPARATOR	':'
 #define JSON_KEY_VAL_END_MARKER	','
@@ -28,90 +35,876 @@
 #define JSON_ARRAY_END			']'
 
 
-char* swirjson_szSerialize(const char* szKey, const char* szValue, unsigned long ulTimestamp)
+//---------------------------------------------------------------------------------------------------------
+//	Writer : appends to a caller's buffer, counting on past its end as snprintf does, or to one it grows
+
+#define JSON_WRITER_MIN_SIZE	64
+
+static const char g_szDigitPairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const unsigned long long g_ullPow10[] =
+	{1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+
+void swirjson_writerInit(swirjson_writer* pWriter, char* szBuffer, size_t bufferLen)
+{
+	//into szBuffer, bufferLen bytes with the terminating NUL : NULL, 0 only counts
+	pWriter->szBuffer = szBuffer;
+	pWriter->nSize = bufferLen;
+	pWriter->nLen = 0;
+	pWriter->bGrow = 0;
+	pWriter->bFailed = 0;
+}
+
+void swirjson_writerInitAlloc(swirjson_writer* pWriter, size_t sizeHint)
+{
+	//into a buffer malloc'd and grown as needed, which swirjson_writerEnd hands over to the caller
+	swirjson_writerInit(pWriter, NULL, 0);
+	pWriter->bGrow = 1;
+	pWriter->szBuffer = (char*) malloc(sizeHint < JSON_WRITER_MIN_SIZE ? JSON_WRITER_MIN_SIZE : sizeHint);
+	if (pWriter->szBuffer)
+	{
+		pWriter->nSize = sizeHint < JSON_WRITER_MIN_SIZE ? JSON_WRITER_MIN_SIZE : sizeHint;
+	}
+	else
+	{
+		pWriter->bFailed = 1;
+	}
+}
+
+int swirjson_writerEnd(swirjson_writer* pWriter)
+{
+	/*
+		NUL terminates the text and returns its length : bufferLen or more when it was cut short to fit
+		the caller's buffer, -1 when a buffer could not be grown (szBuffer is still to be freed)
+	*/
+	if (pWriter->nSize > 0)
+	{
+		pWriter->szBuffer[pWriter->nLen < pWriter->nSize ? pWriter->nLen : pWriter->nSize - 1] = 0;
+	}
+	return pWriter->bFailed ? -1 : (int) pWriter->nLen;
+}
+
+static int grow(swirjson_writer* pWriter, size_t nNeeded)
+{
+	size_t	nSize = pWriter->nSize * 2;
+	char*	szBuffer;
+
+	if (nSize < nNeeded)
+	{
+		nSize = nNeeded;
+	}
+	if (pWriter->bFailed || (szBuffer = (char*) realloc(pWriter->szBuffer, nSize)) == NULL)
+	{
+		pWriter->bFailed = 1;
+		return 0;
+	}
+	pWriter->szBuffer = szBuffer;
+	pWriter->nSize = nSize;
+	return 1;
+}
+
+void swirjson_writeRaw(swirjson_writer* pWriter, const char* pData, size_t len)
+{
+	size_t	nRoom = (pWriter->nSize > pWriter->nLen) ? pWriter->nSize - pWriter->nLen - 1 : 0;
+
+	if (len > nRoom && pWriter->bGrow && grow(pWriter, pWriter->nLen + len + 1))
+	{
+		nRoom = len;
+	}
+	if (nRoom > 0)
+	{
+		memcpy(pWriter->szBuffer + pWriter->nLen, pData, len < nRoom ? len : nRoom);
+	}
+	pWriter->nLen += len;
+}
+
+void swirjson_writeChar(swirjson_writer* pWriter, char cChar)
+{
+	if (pWriter->nLen + 1 < pWriter->nSize)
+	{
+		pWriter->szBuffer[pWriter->nLen++] = cChar;
+	}
+	else
+	{
+		swirjson_writeRaw(pWriter, &cChar, 1);
+	}
+}
+
+void swirjson_writeEscapedLen(swirjson_writer* pWriter, const char* pString, size_t len)
+{
+	//the inside of a JSON string : quotes, backslashes and control characters escaped, runs of others copied at once
+	const char*		pRun = pString;
+	const char*		pEnd = pString + len;
+	const char*		p;
+
+	for (p = pString; p < pEnd; p++)
+	{
+		unsigned char	cChar = *p;
+		char			szEscape[6] = {'\\', 0, '0', '0', 0, 0};
+		size_t			nEscapeLen = 2;
+
+		if (cChar >= ' ' && cChar != JSON_QUOTE && cChar != '\\')
+		{
+			continue;
+		}
+		swirjson_writeRaw(pWriter, pRun, p - pRun);
+		pRun = p + 1;
+		switch (cChar)
+		{
+			case JSON_QUOTE:	szEscape[1] = JSON_QUOTE;	break;
+			case '\\':			szEscape[1] = '\\';			break;
+			case '\n':			szEscape[1] = 'n';			break;
+			case '\r':			szEscape[1] = 'r';			break;
+			case '\t':			szEscape[1] = 't';			break;
+			case '\b':			szEscape[1] = 'b';			break;
+			case '\f':			szEscape[1] = 'f';			break;
+			default:
+				szEscape[1] = 'u';
+				szEscape[4] = "0123456789abcdef"[cChar >> 4];
+				szEscape[5] = "0123456789abcdef"[cChar & 0xF];
+				nEscapeLen = 6;
+				break;
+		}
+		swirjson_writeRaw(pWriter, szEscape, nEscapeLen);
+	}
+	swirjson_writeRaw(pWriter, pRun, p - pRun);
+}
+
+void swirjson_writeEscaped(swirjson_writer* pWriter, const char* szString)
+{
+	swirjson_writeEscapedLen(pWriter, szString, strlen(szString));
+}
+
+void swirjson_writeString(swirjson_writer* pWriter, const char* szString)
+{
+	swirjson_writeChar(pWriter, JSON_QUOTE);
+	swirjson_writeEscaped(pWriter, szString);
+	swirjson_writeChar(pWriter, JSON_QUOTE);
+}
+
+static char* formatUInt(char* pEnd, unsigned long long ullValue, int nMinDigits)
+{
+	//digits written backwards, two at a time, ending at pEnd : returns where they start
+	char*	p = pEnd;
+
+	while (ullValue >= 100)
+	{
+		const char*		pPair = g_szDigitPairs + (ullValue % 100) * 2;
+
+		ullValue /= 100;
+		*--p = pPair[1];
+		*--p = pPair[0];
+	}
+	if (ullValue >= 10)
+	{
+		*--p = g_szDigitPairs[ullValue * 2 + 1];
+		*--p = g_szDigitPairs[ullValue * 2];
+	}
+	else
+	{
+		*--p = '0' + (char) ullValue;
+	}
+	while (pEnd - p < nMinDigits)
+	{
+		*--p = '0';
+	}
+	return p;
+}
+
+void swirjson_writeUInt(swirjson_writer* pWriter, unsigned long long ullValue)
+{
+	char	szDigits[20];
+	char*	p = formatUInt(szDigits + sizeof(szDigits), ullValue, 1);
+
+	swirjson_writeRaw(pWriter, p, szDigits + sizeof(szDigits) - p);
+}
+
+void swirjson_writeInt(swirjson_writer* pWriter, long long llValue)
+{
+	char	szDigits[21];
+	char*	p = formatUInt(szDigits + sizeof(szDigits), (llValue < 0) ? 0ULL - (unsigned long long) llValue : (unsigned long long) llValue, 1);
+
+	if (llValue < 0)
+	{
+		*--p = '-';
+	}
+	swirjson_writeRaw(pWriter, p, szDigits + sizeof(szDigits) - p);
+}
+
+static locale_t			g_cLocale = (locale_t) 0;
+static pthread_once_t	g_cLocaleCreated = PTHREAD_ONCE_INIT;
+
+static void createCLocale(void)
+{
+	g_cLocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0);
+}
+
+static void writeFloatC(swirjson_writer* pWriter, const char* szFormat, double dValue, int nPrecision)
+{
+	//snprintf's %.*f or %.*g with a point, whatever the locale of the process : uselocale only applies to this thread
+	char		szBuffer[330];
+	locale_t	previous = (locale_t) 0;
+	int			nLen;
+
+	pthread_once(&g_cLocaleCreated, createCLocale);
+	if (g_cLocale != (locale_t) 0)
+	{
+		previous = uselocale(g_cLocale);
+	}
+	nLen = snprintf(szBuffer, sizeof(szBuffer), szFormat, nPrecision, dValue);
+	if (previous != (locale_t) 0)
+	{
+		uselocale(previous);
+	}
+	swirjson_writeRaw(pWriter, szBuffer, (nLen < (int) sizeof(szBuffer)) ? nLen : sizeof(szBuffer) - 1);
+}
+
+void swirjson_writeFloat(swirjson_writer* pWriter, double dValue, int nDecimals)
 {
-	char	szPayload[JSON_MAX_PAYLOAD_SIZE];
+	/*
+		nDecimals (0 to 9) after the point : printf's %.*f, ties to even included, but always with a point
+		whatever the locale. The value scaled by 10^nDecimals is rounded from its exact binary value, mantissa
+		times 10^nDecimals in 128 bits, not from dValue * 10^nDecimals, which is itself rounded : 34.945 is
+		34.945000000000000284 and gives 34.95 as with printf, where 3494.5 would tie to 34.94. Values too large
+		for 64 bits once scaled, nan and inf go through snprintf, in the C locale
+	*/
+	double				dScaled;
+	char				szDigits[24];
+	char*				pEnd = szDigits + sizeof(szDigits);
+	char*				p;
+	uint64_t			ullBits, ullMantissa;
+	int					nExponent;
+	unsigned __int128	product;
+	unsigned long long	ullScaled = 0;
 
-	memset(szPayload, 0, sizeof(szPayload));
+	nDecimals = (nDecimals < 0) ? 0 : (nDecimals > 9) ? 9 : nDecimals;
+	dScaled = dValue * g_ullPow10[nDecimals];
+	if (!(dScaled > -1.8e19 && dScaled < 1.8e19))
+	{
+		writeFloatC(pWriter, "%.*f", dValue, nDecimals);
+		return;
+	}
 
-	if (ulTimestamp == 0)
+	//|dValue| = ullMantissa * 2^nExponent, exactly
+	memcpy(&ullBits, &dValue, sizeof(ullBits));
+	nExponent = (ullBits >> 52) & 0x7FF;
+	ullMantissa = ullBits & ((1ULL << 52) - 1);
+	if (nExponent == 0)
 	{
-		//sprintf(szPayload, "[{\"%s\": [{\"timestamp\" : 1426939843000, \"value\" : \"%s\"}]}]", szKey, szValue);
-		//sprintf(szPayload, "[{\"%s\": [{\"timestamp\" : \"\", \"value\" : \"%s\"}]}]", szKey, szValue);
-		sprintf(szPayload, "\"%s\":\"%s\"", szKey, szValue);	
+		nExponent = -1074;
 	}
 	else
 	{
-		//sprintf(szPayload, "[{\"%s\": [{\"timestamp\" : %lu, \"value\" : \"%s\"}]}]", szKey, ulTimestamp, szValue);
-		sprintf(szPayload, "\"%lu000\":{\"%s\":\"%s\"}", ulTimestamp, szKey, szValue);
+		ullMantissa |= 1ULL << 52;
+		nExponent -= 1075;
+	}
+	product = (unsigned __int128) ullMantissa * g_ullPow10[nDecimals];
+
+	if (nExponent >= 0)
+	{
+		ullScaled = (unsigned long long) (product << nExponent);
+	}
+	else if (nExponent > -128)
+	{
+		//the bits shifted out against half of the last unit kept
+		unsigned __int128	remainder = product & ((((unsigned __int128) 1) << -nExponent) - 1);
+		unsigned __int128	half = ((unsigned __int128) 1) << (-nExponent - 1);
+
+		ullScaled = (unsigned long long) (product >> -nExponent);
+		if (remainder > half || (remainder == half && (ullScaled & 1)))
+		{
+			ullScaled++;
+		}
+	}
+	//else : product is under 2^83, less than half of 2^128, and rounds to 0
+
+	if (nDecimals > 0)
+	{
+		pEnd = formatUInt(pEnd, ullScaled % g_ullPow10[nDecimals], nDecimals);
+		*--pEnd = '.';
+	}
+	p = formatUInt(pEnd, ullScaled / g_ullPow10[nDecimals], 1);
+	if (ullBits >> 63)
+	{
+		*--p = '-';
+	}
+	swirjson_writeRaw(pWriter, p, szDigits + sizeof(szDigits) - p);
+}
+
+void swirjson_writeDouble(swirjson_writer* pWriter, double dValue, int nDigits)
+{
+	//nDigits significant digits (1 to 17) : printf's %.*g with a point whatever the locale, null for nan and inf
+	if (!(dValue - dValue == 0))
+	{
+		swirjson_writeRaw(pWriter, "null", 4);
+		return;
+	}
+	writeFloatC(pWriter, "%.*g", dValue, (nDigits < 1) ? 1 : (nDigits > 17) ? 17 : nDigits);
+}
+
+//---------------------------------------------------------------------------------------------------------
+//	AirVantage serializers :  "key":"value", or "<timestamp>000":{"key":"value"} when there is a timestamp
+
+static void openSample(swirjson_writer* pWriter, const char* szKey, unsigned long ulTimestamp)
+{
+	//up to the value's opening quote
+	if (ulTimestamp != 0)
+	{
+		swirjson_writeChar(pWriter, JSON_QUOTE);
+		swirjson_writeUInt(pWriter, ulTimestamp);
+		swirjson_writeRaw(pWriter, "000\":{", 6);
+	}
+	swirjson_writeString(pWriter, szKey);
+	swirjson_writeRaw(pWriter, ":\"", 2);
+}
+
+static void closeSample(swirjson_writer* pWriter, unsigned long ulTimestamp)
+{
+	swirjson_writeChar(pWriter, JSON_QUOTE);
+	if (ulTimestamp != 0)
+	{
+		swirjson_writeChar(pWriter, JSON_OBJECT_END);
+	}
+}
+
+static char* endAlloc(swirjson_writer* pWriter)
+{
+	if (swirjson_writerEnd(pWriter) < 0)
+	{
+		free(pWriter->szBuffer);
+		return NULL;
 	}
+	return pWriter->szBuffer;
+}
+
+int swirjson_szSerializeTo(char* szBuffer, size_t bufferLen, const char* szKey, const char* szValue, unsigned long ulTimestamp)
+{
+	//into the caller's buffer : returns the length, bufferLen or more when it did not fit (snprintf)
+	swirjson_writer		writer;
 
-	char*	pszJson = (char*) malloc(strlen(szPayload)+1);
+	swirjson_writerInit(&writer, szBuffer, bufferLen);
+	openSample(&writer, szKey, ulTimestamp);
+	swirjson_writeEscaped(&writer, szValue);
+	closeSample(&writer, ulTimestamp);
 
-	strcpy(pszJson, szPayload);
+	return swirjson_writerEnd(&writer);
+}
+
+char* swirjson_szSerialize(const char* szKey, const char* szValue, unsigned long ulTimestamp)
+{
+	swirjson_writer		writer;
+
+	swirjson_writerInitAlloc(&writer, strlen(szKey) + strlen(szValue) + 32);
+	openSample(&writer, szKey, ulTimestamp);
+	swirjson_writeEscaped(&writer, szValue);
+	closeSample(&writer, ulTimestamp);
 
-	return pszJson;
+	return endAlloc(&writer);
 }
 
 char* swirjson_fSerialize(char* szKey, float fValue, unsigned long ulTimestamp)
 {
-	char szValue[16];
+	swirjson_writer		writer;
 
-	sprintf(szValue, "%.2f", fValue);
+	swirjson_writerInitAlloc(&writer, strlen(szKey) + 48);
+	openSample(&writer, szKey, ulTimestamp);
+	swirjson_writeFloat(&writer, fValue, 2);
+	closeSample(&writer, ulTimestamp);
 
-	return swirjson_szSerialize(szKey, szValue, ulTimestamp);
+	return endAlloc(&writer);
 }
 
 char* swirjson_nSerialize(char* szKey, int nValue, unsigned long ulTimestamp)
 {
-	char szValue[16];
+	swirjson_writer		writer;
 
-	sprintf(szValue, "%d", nValue);
+	swirjson_writerInitAlloc(&writer, strlen(szKey) + 48);
+	openSample(&writer, szKey, ulTimestamp);
+	swirjson_writeInt(&writer, nValue);
+	closeSample(&writer, ulTimestamp);
 
-	return swirjson_szSerialize(szKey, szValue, ulTimestamp);
+	return endAlloc(&writer);
 }
 
 char* swirjson_lstSerialize(char* szKey, int nValueCount, char** pszValueList, unsigned long* pulTimestampList)
 {
-        char*	szPayload = (char *) malloc(JSON_MAX_PAYLOAD_SIZE);
-
-		memset(szPayload, 0, JSON_MAX_PAYLOAD_SIZE);
-
-        sprintf(szPayload, "{\"%s\": [", szKey);
-
-        int i = 0;
-        for (i=0; i<nValueCount; i++)
-        {
-            if (pulTimestampList == NULL)
-            {
-				sprintf(szPayload, "%s {\"timestamp\" : \"\", \"value\" : \"%s\"}", szPayload, pszValueList[i]);	//format 2, not working
-				//sprintf(szPayload, "{\"%s\":%s}", szKey, szValue);		//format 1
-            }
-            else if (pulTimestampList[i] == 0)
-	        {
-		        sprintf(szPayload, "%s {\"timestamp\" : \"\", \"value\" : \"%s\"}", szPayload, pszValueList[i]);	//format 2, not working
-		        //sprintf(szPayload, "{\"%s\":%s}", szKey, szValue);		//format 1
-	        }
-	        else
-	        {
-	        	sprintf(szPayload, "%s {\"timestamp\" : %lu, \"value\" : \"%s\"}", szPayload, pulTimestampList[i], pszValueList[i]);	//format 2, not working
-	        	//sprintf(szPayload, "{\"%lu\":{\"%s\":%s}}", ulTimestamp, szKey, szValue);		//format 1
-            }
-            free(pszValueList[i]);
-            
-            if (i < nValueCount-1)
-            {
-                strcat(szPayload, ",");
-            }
-    }
-
-        strcat(szPayload, "]}");
-
-        return szPayload;
+	//{"key": [ {"timestamp" : <ms>, "value" : "v"}, ...]} : takes pszValueList's strings, freed here
+	swirjson_writer		writer;
+	int					i;
+
+	swirjson_writerInitAlloc(&writer, strlen(szKey) + 64 * (size_t) nValueCount + 8);
+	swirjson_writeChar(&writer, JSON_OBJECT_START);
+	swirjson_writeString(&writer, szKey);
+	swirjson_writeRaw(&writer, ": [", 3);
+
+	for (i = 0; i < nValueCount; i++)
+	{
+		if (pulTimestampList == NULL || pulTimestampList[i] == 0)
+		{
+			swirjson_writeRaw(&writer, " {\"timestamp\" : \"\"", 18);
+		}
+		else
+		{
+			swirjson_writeRaw(&writer, " {\"timestamp\" : ", 16);
+			swirjson_writeUInt(&writer, pulTimestampList[i]);
+		}
+		swirjson_writeRaw(&writer, ", \"value\" : ", 12);
+		swirjson_writeString(&writer, pszValueList[i]);
+		swirjson_writeChar(&writer, JSON_OBJECT_END);
+		free(pszValueList[i]);
+
+		if (i < nValueCount-1)
+		{
+			swirjson_writeChar(&writer, JSON_KEY_VAL_END_MARKER);
+		}
+	}
+
+	swirjson_writeRaw(&writer, "]}", 2);
+
+	return endAlloc(&writer);
+}
+
+//---------------------------------------------------------------------------------------------------------
+//	Structural scan : the payload is read 64 bytes at a time, a classifier marking in bit masks where its
+//	quotes, backslashes, brackets, separators and spaces are, the rest being bit operations on those masks
+//	(simdjson's stage 1) : no character is looked at again, string contents are not looked at at all
+
+typedef struct
+{
+	uint64_t	quote;
+	uint64_t	backslash;
+	uint64_t	bracket;	//{ } [ ]
+	uint64_t	separator;	//: ,
+	uint64_t	space;		//0x20 and below
+} swirjson_masks;
+
+typedef void (*swirjson_classifier)(const char* pBlock, swirjson_masks* pMasks);
+
+static void classifyScalar(const char* pBlock, swirjson_masks* pMasks)
+{
+	int		i;
+
+	memset(pMasks, 0, sizeof(*pMasks));
+	for (i = 0; i < 64; i++)
+	{
+		unsigned char	cChar = pBlock[i];
+		uint64_t		bit = (uint64_t) 1 << i;
+
+		switch (cChar)
+		{
+			case JSON_QUOTE:
+				pMasks->quote |= bit;
+				break;
+			case '\\':
+				pMasks->backslash |= bit;
+				break;
+			case JSON_OBJECT_START:
+			case JSON_OBJECT_END:
+			case JSON_ARRAY_START:
+			case JSON_ARRAY_END:
+				pMasks->bracket |= bit;
+				break;
+			case JSON_KEY_VAL_SEPARATOR:
+			case JSON_KEY_VAL_END_MARKER:
+				pMasks->separator |= bit;
+				break;
+			default:
+				if (cChar <= ' ')
+				{
+					pMasks->space |= bit;
+				}
+				break;
+		}
+	}
+}
+
+#if defined(SWIRJSON_X86)
+
+/*
+	'[' and ']' are '{' and '}' with bit 5 cleared : or-ing 0x20 in finds the four brackets in two compares.
+	Spaces are the bytes whose unsigned max with ' ' is ' '
+*/
+__attribute__((target("sse2")))
+static void classifySSE2(const char* pBlock, swirjson_masks* pMasks)
+{
+	const __m128i	quote = _mm_set1_epi8(JSON_QUOTE), backslash = _mm_set1_epi8('\\');
+	const __m128i	open = _mm_set1_epi8(JSON_OBJECT_START), close = _mm_set1_epi8(JSON_OBJECT_END), lower = _mm_set1_epi8(0x20);
+	const __m128i	colon = _mm_set1_epi8(JSON_KEY_VAL_SEPARATOR), comma = _mm_set1_epi8(JSON_KEY_VAL_END_MARKER);
+	int				i;
+
+	memset(pMasks, 0, sizeof(*pMasks));
+	for (i = 0; i < 64; i += 16)
+	{
+		__m128i		v = _mm_loadu_si128((const __m128i*) (pBlock + i));
+		__m128i		folded = _mm_or_si128(v, lower);
+
+		pMasks->quote |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << i;
+		pMasks->backslash |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)) << i;
+		pMasks->bracket |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close))) << i;
+		pMasks->separator |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma))) << i;
+		pMasks->space |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lower), lower)) << i;
+	}
+}
+
+__attribute__((target("avx2")))
+static void classifyAVX2(const char* pBlock, swirjson_masks* pMasks)
+{
+	const __m256i	quote = _mm256_set1_epi8(JSON_QUOTE), backslash = _mm256_set1_epi8('\\');
+	const __m256i	open = _mm256_set1_epi8(JSON_OBJECT_START), close = _mm256_set1_epi8(JSON_OBJECT_END), lower = _mm256_set1_epi8(0x20);
+	const __m256i	colon = _mm256_set1_epi8(JSON_KEY_VAL_SEPARATOR), comma = _mm256_set1_epi8(JSON_KEY_VAL_END_MARKER);
+	int				i;
+
+	memset(pMasks, 0, sizeof(*pMasks));
+	for (i = 0; i < 64; i += 32)
+	{
+		__m256i		v = _mm256_loadu_si256((const __m256i*) (pBlock + i));
+		__m256i		folded = _mm256_or_si256(v, lower);
+
+		pMasks->quote |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << i;
+		pMasks->backslash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash)) << i;
+		pMasks->bracket |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close))) << i;
+		pMasks->separator |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma))) << i;
+		pMasks->space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, lower), lower)) << i;
+	}
+}
+
+#endif	//SWIRJSON_X86
+
+static swirjson_classifier	g_pfnClassify = classifyScalar;
+static const char*			g_szScanner = "scalar";
+static pthread_once_t		g_scannerPicked = PTHREAD_ONCE_INIT;
+
+static int useScanner(const char* szScanner)
+{
+	if (strcmp(szScanner, "scalar") == 0)
+	{
+		g_pfnClassify = classifyScalar;
+		g_szScanner = "scalar";
+		return 0;
+	}
+#if defined(SWIRJSON_X86)
+	__builtin_cpu_init();
+	if (strcmp(szScanner, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+	{
+		g_pfnClassify = classifySSE2;
+		g_szScanner = "sse2";
+		return 0;
+	}
+	if (strcmp(szScanner, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+	{
+		g_pfnClassify = classifyAVX2;
+		g_szScanner = "avx2";
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+static void pickScanner(void)
+{
+	//the widest the CPU has, unless SWIRJSON_SCANNER (scalar, sse2 or avx2) asks for narrower
+	const char*		szWanted = getenv("SWIRJSON_SCANNER");
+
+	if (szWanted && useScanner(szWanted) == 0)
+	{
+		return;
+	}
+	if (useScanner("avx2") != 0 && useScanner("sse2") != 0)
+	{
+		useScanner("scalar");
+	}
+}
+
+const char* swirjson_scanner(void)
+{
+	pthread_once(&g_scannerPicked, pickScanner);
+	return g_szScanner;
+}
+
+int swirjson_setScanner(const char* szScanner)
+{
+	/*
+		scalar, sse2 or avx2 from now on, for tests and benchmarks : -1 if the CPU does not have it.
+		Not to be called while other threads tokenize
+	*/
+	pthread_once(&g_scannerPicked, pickScanner);
+	return useScanner(szScanner);
+}
+
+static uint64_t escapedMask(uint64_t backslash, uint64_t* pPrevEscaped)
+{
+	/*
+		Characters following an odd run of backslashes, *pPrevEscaped carrying one over to the next block.
+		Subtracting the run starts from the odd bits carries through each run, which leaves the parity of its
+		length at the bit after it
+	*/
+	const uint64_t	oddBits = 0xAAAAAAAAAAAAAAAAULL;
+	uint64_t		escaped = *pPrevEscaped;
+	uint64_t		potential, escapeAndTerminal;
+
+	if (backslash == 0)
+	{
+		*pPrevEscaped = 0;
+		return escaped;
+	}
+	potential = backslash & ~escaped;
+	escapeAndTerminal = (((potential << 1) | oddBits) - potential) ^ oddBits;
+	*pPrevEscaped = (escapeAndTerminal & backslash) >> 63;
+	return escapeAndTerminal ^ (backslash | escaped);
+}
+
+static uint64_t prefixXor(uint64_t bits)
+{
+	//bit i is the parity of bits 0..i : set from an opening quote up to, not including, its closing quote
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
+
+typedef struct
+{
+	uint64_t	prevEscaped;
+	uint64_t	prevInString;
+	uint64_t	prevPrimitive;
+} swirjson_scan;
+
+static void scanBlock(swirjson_scan* pScan, const char* pBlock, size_t nLeft, swirjson_block* pOut)
+{
+	/*
+		Stage 1 of one block, nLeft bytes from pBlock on (64 or more : a whole block), the state of the blocks
+		before in *pScan : escaped characters, quotes that are not, brackets outside strings, and where primitives
+		start and end
+	*/
+	swirjson_masks	masks;
+	char			szTail[64];
+	uint64_t		primitive;
+
+	if (nLeft < 64)
+	{
+		//the last block, padded with spaces
+		memset(szTail, ' ', sizeof(szTail));
+		memcpy(szTail, pBlock, nLeft);
+		pBlock = szTail;
+	}
+	g_pfnClassify(pBlock, &masks);
+
+	pOut->escaped = escapedMask(masks.backslash, &pScan->prevEscaped);
+	pOut->quote = masks.quote & ~pOut->escaped;
+	pOut->inString = prefixXor(pOut->quote) ^ pScan->prevInString;
+	pScan->prevInString = (uint64_t) ((int64_t) pOut->inString >> 63);
+	pOut->bracket = masks.bracket & ~pOut->inString;
+	primitive = ~(pOut->quote | masks.bracket | masks.separator | masks.space | pOut->inString);
+	pOut->primitiveStart = primitive & ~((primitive << 1) | pScan->prevPrimitive);
+	pOut->primitiveEnd = ~primitive & ((primitive << 1) | pScan->prevPrimitive);
+	pScan->prevPrimitive = primitive >> 63;
+
+	if (nLeft < 64)
+	{
+		uint64_t	inPayload = ((uint64_t) 1 << nLeft) - 1;
+
+		pOut->escaped &= inPayload;
+		pOut->inString &= inPayload;
+		pOut->bracket &= inPayload;
+		pOut->primitiveStart &= inPayload;
+		pOut->primitiveEnd &= inPayload;
+	}
+}
+
+int swirjson_stage1(const char* szJson, size_t len, swirjson_block* pBlocks)
+{
+	/*
+		The masks swirjson_tokenize works from, one swirjson_block per 64 bytes of the payload, the last one
+		partial : (len + 63) / 64 of them. Returns -1 when a string is left open, 0 otherwise
+	*/
+	swirjson_scan	scan = {0, 0, 0};
+	size_t			nBlock;
+
+	pthread_once(&g_scannerPicked, pickScanner);
+	for (nBlock = 0; nBlock < len; nBlock += 64)
+	{
+		scanBlock(&scan, szJson + nBlock, len - nBlock, &pBlocks[nBlock / 64]);
+	}
+	return (scan.prevInString == 0) ? 0 : -1;
+}
+
+static void addToken(swirjson_token* pTokens, int nMaxTokens, int nCount, int nParent, swirjson_type type, const char* pStart, int nLen)
+{
+	if (pTokens != NULL && nCount < nMaxTokens)
+	{
+		swirjson_token*		pToken = &pTokens[nCount];
+
+		pToken->type = type;
+		pToken->pStart = pStart;
+		pToken->nLen = nLen;
+		pToken->nNext = nCount + 1;		//objects and arrays : set once closed
+		pToken->nCount = 0;
+		pToken->nParent = nParent;
+		if (nParent >= 0)
+		{
+			pTokens[nParent].nCount++;
+		}
+	}
+}
+
+int swirjson_tokenize(const char* szJson, size_t len, swirjson_token* pTokens, int nMaxTokens)
+{
+	/*
+		Indexes the whole payload in one pass : one token per value, key strings included, in the order
+		they appear. Returns the number of tokens, -1 if the payload is malformed.
+		When that is more than nMaxTokens, the tokens are not usable : call again with as many (pTokens may be
+		NULL to only count them).
+		Primitives (numbers, true, false, null) run up to the next space, bracket, separator or quote
+	*/
+	int				nCount = 0, nParent = -1, nDepth = 0;
+	swirjson_scan	scan = {0, 0, 0};
+	size_t			nBlock, nString = 0, nPrimitive = 0;
+	int				bInPrimitive = 0;
+
+	pthread_once(&g_scannerPicked, pickScanner);
+
+	for (nBlock = 0; nBlock < len; nBlock += 64)
+	{
+		swirjson_block	block;
+		uint64_t		quotes, inString, starts, ends, brackets, events;
+
+		scanBlock(&scan, szJson + nBlock, len - nBlock, &block);
+		quotes = block.quote;
+		inString = block.inString;
+		brackets = block.bracket;
+		starts = block.primitiveStart;
+		ends = block.primitiveEnd;
+		events = brackets | quotes | starts | ends;
+
+		while (events)
+		{
+			int			nBit = __builtin_ctzll(events);
+			uint64_t	bit = (uint64_t) 1 << nBit;
+			size_t		nPos = nBlock + nBit;
+			char		cChar = szJson[nPos];
+
+			events &= events - 1;
+			if (ends & bit)
+			{
+				addToken(pTokens, nMaxTokens, nCount++, nParent, SWIRJSON_PRIMITIVE, szJson + nPrimitive, nPos - nPrimitive);
+				bInPrimitive = 0;
+			}
+			if (starts & bit)
+			{
+				nPrimitive = nPos;
+				bInPrimitive = 1;
+			}
+			else if (quotes & bit)
+			{
+				if (inString & bit)
+				{
+					nString = nPos;
+				}
+				else
+				{
+					addToken(pTokens, nMaxTokens, nCount++, nParent, SWIRJSON_STRING, szJson + nString + 1, nPos - nString - 1);
+				}
+			}
+			else if ((brackets & bit) && (cChar == JSON_OBJECT_START || cChar == JSON_ARRAY_START))
+			{
+				addToken(pTokens, nMaxTokens, nCount, nParent, (cChar == JSON_OBJECT_START) ? SWIRJSON_OBJECT : SWIRJSON_ARRAY, szJson + nPos, 0);
+				if (pTokens != NULL && nCount < nMaxTokens)
+				{
+					nParent = nCount;
+				}
+				nCount++;
+				nDepth++;
+			}
+			else if (brackets & bit)
+			{
+				if (nDepth-- == 0)
+				{
+					return -1;
+				}
+				if (pTokens != NULL && nCount <= nMaxTokens)
+				{
+					swirjson_token*		pToken = &pTokens[nParent];
+
+					if (pToken->type != ((cChar == JSON_OBJECT_END) ? SWIRJSON_OBJECT : SWIRJSON_ARRAY))
+					{
+						return -1;
+					}
+					pToken->nLen = szJson + nPos + 1 - pToken->pStart;
+					pToken->nNext = nCount;
+					nParent = pToken->nParent;
+				}
+			}
+		}
+	}
+
+	if (bInPrimitive)
+	{
+		addToken(pTokens, nMaxTokens, nCount++, nParent, SWIRJSON_PRIMITIVE, szJson + nPrimitive, len - nPrimitive);
+	}
+	return (nDepth == 0 && scan.prevInString == 0) ? nCount : -1;
+}
+
+int swirjson_equals(const swirjson_token* pToken, const char* szString)
+{
+	return strncmp(pToken->pStart, szString, pToken->nLen) == 0 && szString[pToken->nLen] == 0;
+}
+
+int swirjson_member(const swirjson_token* pTokens, int nObject, int nIndex, int* pnKey)
+{
+	//value of the nIndex-th key of an object, -1 when there are not that many. *pnKey is set to the key
+	int		nEnd = pTokens[nObject].nNext;
+	int		nKey = nObject + 1;
+
+	if (pTokens[nObject].type != SWIRJSON_OBJECT)
+	{
+		return -1;
+	}
+	while (nKey < nEnd && pTokens[nKey].nNext < nEnd)
+	{
+		int		nValue = pTokens[nKey].nNext;
+
+		if (nIndex-- == 0)
+		{
+			if (pnKey)
+			{
+				*pnKey = nKey;
+			}
+			return nValue;
+		}
+		nKey = pTokens[nValue].nNext;
+	}
+	return -1;
+}
+
+int swirjson_find(const swirjson_token* pTokens, int nObject, const char* szKey)
+{
+	//value of a key of an object, its own keys only : -1 when it has none of that name
+	int		nEnd = pTokens[nObject].nNext;
+	int		nKey, nValue;
+
+	if (pTokens[nObject].type != SWIRJSON_OBJECT)
+	{
+		return -1;
+	}
+	for (nKey = nObject + 1; nKey < nEnd && (nValue = pTokens[nKey].nNext) < nEnd; nKey = pTokens[nValue].nNext)
+	{
+		if (pTokens[nKey].type == SWIRJSON_STRING && swirjson_equals(&pTokens[nKey], szKey))
+		{
+			return nValue;
+		}
+	}
+	return -1;
 }
 
 char * swirjson_getValue(char* szJson, int nKeyIndex, char* szSearchKey)
 {
+	//legacy, no longer called : incoming payloads are indexed by swirjson_tokenize
 	//use case 1 : nKeyIndex = -1 --> search by KeyName using szSearchKey as input
 	//use case 2 : nKeyIndex > -1 --> search by index, szSearchKey, as output, will be filled with the keyName indexed by nIndexKey 
 	char *	pszValue = NULL;
@@ -122,6 +915,7 @@ char * swirjson_getValue(char* szJson, int nKeyIndex, char* szSearchKey)
 
 	int		nKeyStartPos = -1, nKeyEndPos = -1;
 	int 	nValStartPos = -1, nValEndPos = -1;
+	int		nJsonLen = (int)strlen(szJson);
 
 	do
 	{
@@ -282,7 +1076,7 @@ char * swirjson_getValue(char* szJson, int nKeyIndex, char* szSearchKey)
 
 		nPos++;
 
-	} while (nPos <= (int)strlen(szJson));
+	} while (nPos <= nJsonLen);
 
 	return pszValue;
 }
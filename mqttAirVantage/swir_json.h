@@ -11,12 +11,78 @@
 #ifndef _SWIR_JSON_H_
 #define _SWIR_JSON_H_
 
+#include <stddef.h>
+#include <stdint.h>
 
 
+typedef enum
+{
+	SWIRJSON_OBJECT,
+	SWIRJSON_ARRAY,
+	SWIRJSON_STRING,
+	SWIRJSON_PRIMITIVE		//number, true, false, null
+} swirjson_type;
+
+//a view of a value in the payload, made by swirjson_tokenize : nothing is copied
+typedef struct
+{
+	swirjson_type	type;
+	const char*		pStart;		//strings without their quotes, objects and arrays with their brackets
+	int				nLen;
+	int				nNext;		//index of the token following this one and everything it contains
+	int				nCount;		//tokens directly inside an object (keys and values) or an array
+	int				nParent;	//-1 at the top
+} swirjson_token;
+
+//stage 1 of swirjson_tokenize for a 64-byte block of the payload, bit i for its byte i : see swirjson_stage1
+typedef struct
+{
+	uint64_t	escaped;			//following an odd run of backslashes
+	uint64_t	quote;				//not escaped
+	uint64_t	inString;			//from an opening quote up to, not including, its closing quote
+	uint64_t	bracket;			//outside strings
+	uint64_t	primitiveStart;		//first byte of a number, true, false or null
+	uint64_t	primitiveEnd;		//byte after its last one, within the block
+} swirjson_block;
+
+const char*	swirjson_scanner(void);
+int			swirjson_setScanner(const char* szScanner);
+int			swirjson_stage1(const char* szJson, size_t len, swirjson_block* pBlocks);
+int			swirjson_tokenize(const char* szJson, size_t len, swirjson_token* pTokens, int nMaxTokens);
+int			swirjson_find(const swirjson_token* pTokens, int nObject, const char* szKey);
+int			swirjson_member(const swirjson_token* pTokens, int nObject, int nIndex, int* pnKey);
+int			swirjson_equals(const swirjson_token* pToken, const char* szString);
+
+//JSON text appended to a buffer, see swirjson_writerInit and swirjson_writerInitAlloc
+typedef struct
+{
+	char*		szBuffer;
+	size_t		nSize;		//bytes in szBuffer, the terminating NUL included
+	size_t		nLen;		//written so far : nSize or more once the text is cut short
+	int			bGrow;		//szBuffer is malloc'd, grown as needed
+	int			bFailed;	//it could not be
+} swirjson_writer;
+
+void		swirjson_writerInit(swirjson_writer* pWriter, char* szBuffer, size_t bufferLen);
+void		swirjson_writerInitAlloc(swirjson_writer* pWriter, size_t sizeHint);
+int			swirjson_writerEnd(swirjson_writer* pWriter);
+void		swirjson_writeRaw(swirjson_writer* pWriter, const char* pData, size_t len);
+void		swirjson_writeChar(swirjson_writer* pWriter, char cChar);
+void		swirjson_writeString(swirjson_writer* pWriter, const char* szString);
+void		swirjson_writeEscaped(swirjson_writer* pWriter, const char* szString);
+void		swirjson_writeEscapedLen(swirjson_writer* pWriter, const char* pString, size_t len);
+void		swirjson_writeInt(swirjson_writer* pWriter, long long llValue);
+void		swirjson_writeUInt(swirjson_writer* pWriter, unsigned long long ullValue);
+void		swirjson_writeFloat(swirjson_writer* pWriter, double dValue, int nDecimals);
+void		swirjson_writeDouble(swirjson_writer* pWriter, double dValue, int nDigits);
+
+int			swirjson_szSerializeTo(char* szBuffer, size_t bufferLen, const char* szKey, const char* szValue, unsigned long ulTimestamp);
 char*		swirjson_szSerialize(const char* szKey, const char* szValue, unsigned long ulTimestamp);
 char*		swirjson_fSerialize(char* szKey, float fValue, unsigned long ulTimestamp);
 char*		swirjson_nSerialize(char* szKey, int nValue, unsigned long ulTimestamp);
 char*		swirjson_lstSerialize(char* szKey, int nValueCount, char** pszValueList, unsigned long* pulTimestampList);
+
+//legacy : rescans the payload and copies the value at each call, kept to measure swirjson_tokenize against
 char *		swirjson_getValue(char* szJson, int nKeyIndex, char* szSearchKey);
 
 
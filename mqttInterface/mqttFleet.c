@@ -0,0 +1,931 @@
+/*******************************************************************************************************************
+
+ MQTT fleet simulator
+
+	Load generator : thousands of mqttInterface sessions in one process, to see how a broker (and this client)
+	behave when a whole device fleet connects and publishes at once.
+
+		- sessions are shared out among a few worker threads, each running an event loop over its own
+		- each worker has a connector thread making its connections, so that a slow one does not hold up the loop
+		- connections are ramped up at a given rate, lost ones are restored after a random delay
+		- every device publishes on its own schedule : fixed interval, or Poisson arrivals of the same mean
+		- payload sizes are drawn between a minimum and a maximum
+
+	Reports, once a second on stderr : connected devices, connects, publishes, acknowledgements and errors.
+	At the end : connect rate, publish throughput, memory per session, and percentiles of the connect time,
+	of the QoS1/2 acknowledgement latency and, with -e, of the round trip through the broker.
+	stdout keeps the traces of mqttInterface (one per connection)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "mqttInterface.h"
+#include "MQTTEventLoop.h"
+
+
+#define		FLEET_KEEP_ALIVE				30
+#define		FLEET_TOPIC_PREFIX				"fleet"
+#define		MAX_WORKERS						64
+#define		RECONNECT_MIN_MS				1000	//lost connections come back after 1 to 2 times that, at random
+#define		HANDOVER_MS						10		//sessions the connector is done with join the loop within that
+#define		PAYLOAD_HEADER					12		//publish time (us) and sequence number, leading each payload
+#define		MAX_PAYLOAD						(1024 * 1024)
+
+//latency histogram : 16 linear sub-buckets per power of two, about 6% precision from 1 us to hours
+#define		HISTO_SUB_BITS					4
+#define		HISTO_SUB						(1 << HISTO_SUB_BITS)
+#define		HISTO_BUCKETS					(64 * HISTO_SUB)
+
+#define		COUNT(counter, n)				__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define		READ(counter)					__atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef struct {
+	unsigned long long	counts[HISTO_BUCKETS];
+	unsigned long long	total;
+	unsigned long long	max;
+} Histogram;
+
+struct Worker;
+
+typedef struct Device {
+	mqtt_interface_st*	session;
+	struct Worker*		worker;
+	struct Device*		next;				//in the connector's queue, or in the list of those it is done with
+	int					connectRc;			//of the last attempt, for the worker
+	struct EventLoopClient*	loopEntry;		//in the worker's loop, NULL while offline
+	char				topic[64];
+	WheelTimer			publishTimer;
+	WheelTimer			reconnectTimer;
+	unsigned int		seq;
+	int					subscribed;
+	//publish times of the QoS1/2 publishes awaiting their ack : the broker acknowledges them in order
+	unsigned long long	sent[MAX_INFLIGHT_MESSAGES];
+	unsigned int		sentHead;
+	unsigned int		sentCount;
+} Device;
+
+typedef struct Worker {
+	pthread_t			thread;
+	EventLoop			loop;
+	Device*				devices;
+	int					count;
+
+	//mqtt_StartSession blocks until CONNACK : the connector thread calls it, the loop only takes the sessions it connected
+	pthread_t			connector;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wakeup;
+	Device*				toConnect;			//reconnections due, for the connector
+	Device*				attempted;			//back from the connector, connected or not, for the loop
+	int					started;			//devices whose first connection was attempted
+	unsigned long long	rampEndUs;			//when the last of them was
+	unsigned int		seed;
+	unsigned char*		payload;
+
+	//written by the worker, read by the reporting thread
+	unsigned long		connected;
+	unsigned long		connects;
+	unsigned long		connectFailures;
+	unsigned long		disconnects;
+	unsigned long		published;
+	unsigned long		deferred;			//publish due while offline, or with the inflight window full
+	unsigned long		publishFailures;
+	unsigned long		acked;
+	unsigned long		ackFailures;
+	unsigned long		received;
+	unsigned long long	bytesOut;
+
+	//read once the worker is done
+	size_t				memory;				//held by its connected sessions when the run ended
+	int					sessions;
+	Histogram			connectLatency;
+	Histogram			ackLatency;
+	Histogram			echoLatency;
+} Worker;
+
+typedef struct {
+	const char*			host;
+	int					port;
+	int					useTLS;
+	int					devices;
+	int					workers;
+	int					intervalMs;
+	int					poisson;
+	int					payloadMin;
+	int					payloadMax;
+	int					qos;
+	int					durationS;
+	int					connectRate;		//new connections per second over the whole fleet, 0 : no limit
+	int					echo;
+	int					coalesceBytes;
+	int					keepAlive;
+	const char*			prefix;
+} FleetConfig;
+
+static FleetConfig				g_config;
+static Worker					g_workers[MAX_WORKERS];
+static volatile int				g_toStop = 0;
+static unsigned long long		g_startUs = 0;
+static unsigned long long		g_nextConnectUs = 0;	//ramp : slot of the next connection, shared by the workers
+static __thread Worker*			t_worker = NULL;		//for the message handler, which has no context
+
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned long long nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int histoIndex(unsigned long long value)
+{
+	if (value < HISTO_SUB)
+	{
+		return (int) value;
+	}
+	int shift = 63 - __builtin_clzll(value) - HISTO_SUB_BITS;
+	return (shift + 1) * HISTO_SUB + (int) ((value >> shift) & (HISTO_SUB - 1));
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned long long histoValue(int index)
+{
+	if (index < HISTO_SUB)
+	{
+		return index;
+	}
+	int shift = index / HISTO_SUB - 1;
+	return (unsigned long long) (HISTO_SUB + index % HISTO_SUB) << shift;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void histoRecord(Histogram* histo, unsigned long long value)
+{
+	histo->counts[histoIndex(value)]++;
+	histo->total++;
+	if (value > histo->max)
+	{
+		histo->max = value;
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void histoMerge(Histogram* to, const Histogram* from)
+{
+	int i;
+
+	for (i = 0; i < HISTO_BUCKETS; i++)
+	{
+		to->counts[i] += from->counts[i];
+	}
+	to->total += from->total;
+	if (from->max > to->max)
+	{
+		to->max = from->max;
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned long long histoPercentile(const Histogram* histo, double percent)
+{
+	unsigned long long rank = (unsigned long long) ceil(histo->total * percent / 100.0);
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < HISTO_BUCKETS; i++)
+	{
+		seen += histo->counts[i];
+		if (seen >= rank && seen > 0)
+		{
+			unsigned long long value = histoValue(i);
+			return value < histo->max ? value : histo->max;
+		}
+	}
+	return histo->max;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void histoPrint(const char* name, const Histogram* histo)
+{
+	if (histo->total == 0)
+	{
+		fprintf(stderr, "%-16s -\n", name);
+		return;
+	}
+	fprintf(stderr, "%-16s n=%llu  p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms\n", name,
+			histo->total,
+			histoPercentile(histo, 50) / 1000.0,
+			histoPercentile(histo, 90) / 1000.0,
+			histoPercentile(histo, 99) / 1000.0,
+			histoPercentile(histo, 99.9) / 1000.0,
+			histo->max / 1000.0);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned int nextPublishDelay(Worker* worker)
+{
+	if (!g_config.poisson)
+	{
+		return g_config.intervalMs;
+	}
+	//exponential inter-arrival times : the fleet publishes as a Poisson process
+	double u = (rand_r(&worker->seed) + 1.0) / ((double) RAND_MAX + 2.0);
+	return (unsigned int) (-log(u) * g_config.intervalMs);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onPublishComplete(unsigned short packetid, int rc, void* context)
+{
+	Device* device = (Device*) context;
+	Worker* worker = device->worker;
+
+	if (packetid == 0 || device->sentCount == 0)
+	{
+		//QoS0 : nothing to wait for
+		return;
+	}
+	unsigned long long sent = device->sent[device->sentHead];
+	device->sentHead = (device->sentHead + 1) % MAX_INFLIGHT_MESSAGES;
+	device->sentCount--;
+
+	if (rc == SUCCESS)
+	{
+		if (t_worker == worker)
+		{
+			//acks read by the connector while it restores the session are counted, not timed
+			histoRecord(&worker->ackLatency, nowUs() - sent);
+		}
+		COUNT(worker->acked, 1);
+	}
+	else if (!g_toStop)
+	{
+		//those still in flight when the run ends are dropped, they did not fail
+		COUNT(worker->ackFailures, 1);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onEcho(MessageData* md)
+{
+	unsigned long long sent;
+
+	if (t_worker == NULL || md->message->payloadlen < PAYLOAD_HEADER)
+	{
+		return;
+	}
+	memcpy(&sent, md->message->payload, sizeof(sent));
+	histoRecord(&t_worker->echoLatency, nowUs() - sent);
+	COUNT(t_worker->received, 1);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void publish(Device* device)
+{
+	Worker* worker = device->worker;
+	Client* c = &device->session->mqttClient;
+
+	if (device->loopEntry == NULL || (g_config.qos > QOS0 && c->inflight_count >= c->inflight_window))
+	{
+		//a real device would queue it, here it just shows up as back-pressure
+		COUNT(worker->deferred, 1);
+		return;
+	}
+
+	int len = g_config.payloadMin;
+	if (g_config.payloadMax > g_config.payloadMin)
+	{
+		len += rand_r(&worker->seed) % (g_config.payloadMax - g_config.payloadMin + 1);
+	}
+	unsigned long long sent = nowUs();
+	memcpy(worker->payload, &sent, sizeof(sent));
+	memcpy(worker->payload + sizeof(sent), &device->seq, sizeof(device->seq));
+	device->seq++;
+
+	if (g_config.qos > QOS0)
+	{
+		device->sent[(device->sentHead + device->sentCount) % MAX_INFLIGHT_MESSAGES] = sent;
+		device->sentCount++;
+	}
+
+	if (mqtt_PublishDataAsync(device->session, (const char*) worker->payload, len, device->topic, onPublishComplete, device) == SUCCESS)
+	{
+		COUNT(worker->published, 1);
+		COUNT(worker->bytesOut, len);
+	}
+	else
+	{
+		if (g_config.qos > QOS0)
+		{
+			//not taken in flight : no completion will come for it
+			device->sentCount--;
+		}
+		COUNT(worker->publishFailures, 1);
+	}
+	//the publish may sit in the coalescing buffer : the loop has to know when to flush it
+	EventLoopSchedule(device->loopEntry);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onPublishTimer(WheelTimer* timer, void* context)
+{
+	Device* device = (Device*) context;
+
+	publish(device);
+	TimerWheelAdd(&device->worker->loop.wheel, timer, monotonic_ms() + nextPublishDelay(device->worker));
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void scheduleReconnect(Device* device)
+{
+	Worker* worker = device->worker;
+	unsigned int delay = RECONNECT_MIN_MS + rand_r(&worker->seed) % RECONNECT_MIN_MS;
+
+	TimerWheelAdd(&worker->loop.wheel, &device->reconnectTimer, monotonic_ms() + delay);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void connectDevice(Device* device)
+{
+	//connector thread : the session is not in the loop, nothing else touches it
+	Worker* worker = device->worker;
+	unsigned long long start = nowUs();
+
+	device->connectRc = mqtt_StartSession(device->session);
+	if (device->connectRc == SUCCESS)
+	{
+		histoRecord(&worker->connectLatency, nowUs() - start);
+		COUNT(worker->connects, 1);
+
+		if (g_config.echo && !device->subscribed)
+		{
+			//kept by the client from then on, and restored with the session
+			device->subscribed = (mqtt_SubscribeTopic(device->session, device->topic, onEcho) == SUCCESS);
+		}
+	}
+	else
+	{
+		COUNT(worker->connectFailures, 1);
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	device->next = worker->attempted;
+	worker->attempted = device;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void waitConnector(Worker* worker, unsigned long long untilUs)
+{
+	//worker->lock held ; wakeup runs on CLOCK_MONOTONIC, as nowUs
+	unsigned long long limitUs = nowUs() + 100000;
+	struct timespec until;
+
+	if (untilUs > limitUs)
+	{
+		//g_toStop is checked that often
+		untilUs = limitUs;
+	}
+	until.tv_sec = untilUs / 1000000ULL;
+	until.tv_nsec = (untilUs % 1000000ULL) * 1000;
+	pthread_cond_timedwait(&worker->wakeup, &worker->lock, &until);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void* connectorRun(void* arg)
+{
+	Worker* worker = (Worker*) arg;
+	unsigned long long slot = 0;		//of the next new device on the fleet-wide ramp, 0 : not taken yet
+
+	pthread_mutex_lock(&worker->lock);
+	while (!g_toStop)
+	{
+		Device* device = worker->toConnect;
+		unsigned long long now = nowUs();
+
+		if (device != NULL)
+		{
+			//reconnections first, the ramp can wait
+			worker->toConnect = device->next;
+		}
+		else if (worker->started < worker->count)
+		{
+			//ramp : every new connection takes the next slot of the fleet-wide schedule
+			if (slot == 0)
+			{
+				slot = now;
+				if (g_config.connectRate > 0)
+				{
+					unsigned long long step = 1000000ULL / g_config.connectRate;
+					slot = __atomic_fetch_add(&g_nextConnectUs, step, __ATOMIC_RELAXED);
+				}
+			}
+			if (slot > now)
+			{
+				waitConnector(worker, slot);
+				continue;
+			}
+			device = &worker->devices[worker->started++];
+			slot = 0;
+		}
+		else
+		{
+			waitConnector(worker, now + 100000);
+			continue;
+		}
+
+		pthread_mutex_unlock(&worker->lock);
+		connectDevice(device);
+		pthread_mutex_lock(&worker->lock);
+
+		if (worker->started == worker->count && worker->rampEndUs == 0)
+		{
+			worker->rampEndUs = nowUs();
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void takeAttempted(Worker* worker)
+{
+	//the connector's results, into the loop
+	Device* device;
+
+	if (__atomic_load_n(&worker->attempted, __ATOMIC_RELAXED) == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	device = worker->attempted;
+	worker->attempted = NULL;
+	pthread_mutex_unlock(&worker->lock);
+
+	while (device != NULL)
+	{
+		Device* next = device->next;
+
+		if (device->connectRc != SUCCESS)
+		{
+			scheduleReconnect(device);
+		}
+		else if ((device->loopEntry = EventLoopAdd(&worker->loop, &device->session->mqttClient, device)) == NULL)
+		{
+			mqtt_StopSession(device->session);
+			COUNT(worker->connectFailures, 1);
+			scheduleReconnect(device);
+		}
+		else
+		{
+			COUNT(worker->connected, 1);
+
+			if (!WheelTimerArmed(&device->publishTimer))
+			{
+				//first connection : devices start at random phases, not all in the same millisecond
+				TimerWheelAdd(&worker->loop.wheel, &device->publishTimer, monotonic_ms() + rand_r(&worker->seed) % (g_config.intervalMs + 1));
+			}
+		}
+		device = next;
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onReconnectTimer(WheelTimer* timer, void* context)
+{
+	Device* device = (Device*) context;
+	Worker* worker = device->worker;
+
+	if (!g_toStop)
+	{
+		pthread_mutex_lock(&worker->lock);
+		device->next = worker->toConnect;
+		worker->toConnect = device;
+		pthread_cond_signal(&worker->wakeup);
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onConnectionLost(Client* c, void* context)
+{
+	Device* device = (Device*) context;
+	Worker* worker = device->worker;
+
+	device->loopEntry = NULL;			//freed by the loop already
+	device->session->network.disconnect(&device->session->network);
+	COUNT(worker->connected, -1);
+	COUNT(worker->disconnects, 1);
+	scheduleReconnect(device);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void* workerRun(void* arg)
+{
+	Worker* worker = (Worker*) arg;
+	char value[16];
+	int i;
+
+	t_worker = worker;
+	for (i = 0; i < worker->count; i++)
+	{
+		Device* device = &worker->devices[i];
+		int n = (int) (worker - g_workers) + i * g_config.workers;		//devices are dealt out round-robin
+		char deviceId[32];
+
+		snprintf(deviceId, sizeof(deviceId), "%s-%d", g_config.prefix, n);
+		snprintf(device->topic, sizeof(device->topic), "%s/%s/data", FLEET_TOPIC_PREFIX, deviceId);
+		device->worker = worker;
+		device->session = mqtt_CreateInstance(g_config.host, g_config.port, g_config.useTLS, deviceId, deviceId, g_config.keepAlive, g_config.qos);
+
+		//one attempt at a time, the loop must keep running for the others
+		mqtt_SetConfig(device->session, MQTT_CONNECT_RETRIES, "1");
+		snprintf(value, sizeof(value), "%d", g_config.coalesceBytes);
+		mqtt_SetConfig(device->session, MQTT_COALESCE, value);
+		if (g_config.echo)
+		{
+			//our own publishes come back
+			snprintf(value, sizeof(value), "%d", g_config.payloadMax + 256);
+			mqtt_SetConfig(device->session, MQTT_MAX_PACKET, value);
+		}
+		WheelTimerInit(&device->publishTimer, onPublishTimer, device);
+		WheelTimerInit(&device->reconnectTimer, onReconnectTimer, device);
+	}
+
+	if (pthread_create(&worker->connector, NULL, connectorRun, worker) != 0)
+	{
+		fprintf(stderr, "Failed to start the connector of worker %d\n", (int) (worker - g_workers));
+		g_toStop = 1;
+		return NULL;
+	}
+	while (!g_toStop)
+	{
+		takeAttempted(worker);
+		EventLoopRun(&worker->loop, HANDOVER_MS);
+	}
+	pthread_join(worker->connector, NULL);
+
+	for (i = 0; i < worker->count; i++)
+	{
+		if (worker->devices[i].loopEntry != NULL)
+		{
+			worker->memory += mqtt_GetMemoryUsage(worker->devices[i].session);
+			worker->sessions++;
+		}
+	}
+	for (i = 0; i < worker->count; i++)
+	{
+		Device* device = &worker->devices[i];
+		if (device->loopEntry != NULL)
+		{
+			EventLoopRemove(device->loopEntry);
+			device->loopEntry = NULL;
+			mqtt_StopSession(device->session);
+			COUNT(worker->connected, -1);
+		}
+		else if (atomic_load_explicit(&device->session->mqttClient.isconnected, memory_order_acquire))
+		{
+			//connected by the connector, not yet in the loop
+			mqtt_StopSession(device->session);
+		}
+		TimerWheelCancel(&worker->loop.wheel, &device->publishTimer);
+		TimerWheelCancel(&worker->loop.wheel, &device->reconnectTimer);
+		device->session = mqtt_DeleteInstance(device->session);
+	}
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int initConnector(Worker* worker)
+{
+	pthread_condattr_t attr;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_mutex_init(&worker->lock, NULL) || pthread_cond_init(&worker->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	return rc;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void onExit(int sig)
+{
+	g_toStop = 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void usage(void)
+{
+	printf("Usage: mqttFleet broker port tls(0-1) [options]\n");
+	printf("    -n devices      sessions to simulate (100)\n");
+	printf("    -w workers      threads sharing them (4)\n");
+	printf("    -i ms           publish interval of each device (1000)\n");
+	printf("    -s schedule     fixed or poisson (fixed)\n");
+	printf("    -p min[:max]    payload size in bytes (64)\n");
+	printf("    -q qos          0 to 2 (1)\n");
+	printf("    -d seconds      duration of the run (30)\n");
+	printf("    -r rate         new connections per second, 0 : as fast as possible (0)\n");
+	printf("    -e              subscribe each device to its own topic and measure the round trip\n");
+	printf("    -c bytes        coalesce small packets up to that many bytes (0 : off)\n");
+	printf("    -k seconds      keepalive (%d)\n", FLEET_KEEP_ALIVE);
+	printf("    -x prefix       device ids are prefix-N (fleet)\n");
+	printf("    for instance: ./mqttFleet localhost 1883 0 -n 5000 -w 4 -i 2000 -s poisson -p 32:512 -r 500 -d 60\n");
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int parseArgs(int argc, char** argv)
+{
+	int opt;
+
+	g_config.devices = 100;
+	g_config.workers = 4;
+	g_config.intervalMs = 1000;
+	g_config.payloadMin = g_config.payloadMax = 64;
+	g_config.qos = QOS1;
+	g_config.durationS = 30;
+	g_config.keepAlive = FLEET_KEEP_ALIVE;
+	g_config.prefix = "fleet";
+
+	if (argc < 4)
+	{
+		return FAILURE;
+	}
+	g_config.host = argv[1];
+	g_config.port = atoi(argv[2]);
+	g_config.useTLS = atoi(argv[3]);
+
+	optind = 4;
+	while ((opt = getopt(argc, argv, "n:w:i:s:p:q:d:r:ec:k:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':	g_config.devices = atoi(optarg);			break;
+			case 'w':	g_config.workers = atoi(optarg);			break;
+			case 'i':	g_config.intervalMs = atoi(optarg);			break;
+			case 's':	g_config.poisson = (strcmp(optarg, "poisson") == 0);	break;
+			case 'q':	g_config.qos = atoi(optarg);				break;
+			case 'd':	g_config.durationS = atoi(optarg);			break;
+			case 'r':	g_config.connectRate = atoi(optarg);		break;
+			case 'e':	g_config.echo = 1;							break;
+			case 'c':	g_config.coalesceBytes = atoi(optarg);		break;
+			case 'k':	g_config.keepAlive = atoi(optarg);			break;
+			case 'x':	g_config.prefix = optarg;					break;
+			case 'p':
+				g_config.payloadMin = g_config.payloadMax = atoi(optarg);
+				if (strchr(optarg, ':'))
+				{
+					g_config.payloadMax = atoi(strchr(optarg, ':') + 1);
+				}
+				break;
+			default:
+				return FAILURE;
+		}
+	}
+
+	if (g_config.devices <= 0 || g_config.workers <= 0 || g_config.intervalMs <= 0 || g_config.qos < QOS0 || g_config.qos > QOS2)
+	{
+		return FAILURE;
+	}
+	if (g_config.workers > MAX_WORKERS)
+	{
+		g_config.workers = MAX_WORKERS;
+	}
+	if (g_config.workers > g_config.devices)
+	{
+		g_config.workers = g_config.devices;
+	}
+	//the payload and its topic have to fit the session buffer
+	if (g_config.payloadMin < PAYLOAD_HEADER)
+	{
+		g_config.payloadMin = PAYLOAD_HEADER;
+	}
+	if (g_config.payloadMax > MAX_PAYLOAD)
+	{
+		g_config.payloadMax = MAX_PAYLOAD;
+	}
+	if (g_config.payloadMax < g_config.payloadMin)
+	{
+		g_config.payloadMax = g_config.payloadMin;
+	}
+	return SUCCESS;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void raiseFileLimit(void)
+{
+	//a socket per device
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) g_config.devices + 64)
+	{
+		fprintf(stderr, "warning: %lu file descriptors for %d devices\n", (unsigned long) limit.rlim_cur, g_config.devices);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static size_t residentBytes(void)
+{
+	unsigned long size = 0, resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+
+	if (statm)
+	{
+		if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+		{
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+//-------------------------------------------------------------------------------------------------------
+typedef struct {
+	unsigned long		connected;
+	unsigned long		connects;
+	unsigned long		connectFailures;
+	unsigned long		disconnects;
+	unsigned long		published;
+	unsigned long		deferred;
+	unsigned long		publishFailures;
+	unsigned long		acked;
+	unsigned long		ackFailures;
+	unsigned long		received;
+	unsigned long long	bytesOut;
+} FleetTotals;
+
+static void sumWorkers(FleetTotals* totals)
+{
+	int i;
+
+	memset(totals, 0, sizeof(FleetTotals));
+	for (i = 0; i < g_config.workers; i++)
+	{
+		Worker* worker = &g_workers[i];
+		totals->connected += READ(worker->connected);
+		totals->connects += READ(worker->connects);
+		totals->connectFailures += READ(worker->connectFailures);
+		totals->disconnects += READ(worker->disconnects);
+		totals->published += READ(worker->published);
+		totals->deferred += READ(worker->deferred);
+		totals->publishFailures += READ(worker->publishFailures);
+		totals->acked += READ(worker->acked);
+		totals->ackFailures += READ(worker->ackFailures);
+		totals->received += READ(worker->received);
+		totals->bytesOut += READ(worker->bytesOut);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	FleetTotals		last, now;
+	Histogram		connectLatency, ackLatency, echoLatency;
+	int				i;
+
+	if (parseArgs(argc, argv) != SUCCESS)
+	{
+		usage();
+		return 1;
+	}
+
+	signal(SIGINT, onExit);
+	signal(SIGTERM, onExit);
+	raiseFileLimit();
+
+	size_t residentBefore = residentBytes();
+	size_t residentAfter, poolInUse, poolCached;
+
+	g_startUs = g_nextConnectUs = nowUs();
+	for (i = 0; i < g_config.workers; i++)
+	{
+		Worker* worker = &g_workers[i];
+
+		worker->count = g_config.devices / g_config.workers + (i < g_config.devices % g_config.workers ? 1 : 0);
+		worker->devices = (Device*) calloc(worker->count, sizeof(Device));
+		worker->payload = (unsigned char*) malloc(g_config.payloadMax);
+		worker->seed = (unsigned int) g_startUs ^ (unsigned int) (i * 2654435761u);
+		memset(worker->payload, 'x', g_config.payloadMax);
+
+		if (worker->devices == NULL || worker->payload == NULL || EventLoopInit(&worker->loop, onConnectionLost) != SUCCESS
+				|| initConnector(worker) != 0 || pthread_create(&worker->thread, NULL, workerRun, worker) != 0)
+		{
+			fprintf(stderr, "Failed to start worker %d\n", i);
+			g_toStop = 1;
+			g_config.workers = i;
+			break;
+		}
+	}
+
+	fprintf(stderr, "%d devices on %d workers, publishing %d to %d bytes at QoS%d every %d ms (%s)\n",
+			g_config.devices, g_config.workers, g_config.payloadMin, g_config.payloadMax, g_config.qos,
+			g_config.intervalMs, g_config.poisson ? "poisson" : "fixed");
+
+	memset(&last, 0, sizeof(last));
+	for (i = 1; i <= g_config.durationS && !g_toStop; i++)
+	{
+		sleep(1);
+		sumWorkers(&now);
+		fprintf(stderr, "%4ds  connected %6lu  connects/s %6lu  publish/s %7lu  acks/s %7lu  recv/s %7lu  deferred %lu  errors %lu\n",
+				i, now.connected,
+				now.connects - last.connects,
+				now.published - last.published,
+				now.acked - last.acked,
+				now.received - last.received,
+				now.deferred,
+				now.connectFailures + now.disconnects + now.publishFailures + now.ackFailures);
+		last = now;
+	}
+
+	//steady state, before anything is torn down
+	residentAfter = residentBytes();
+	mqtt_GetBufferPoolUsage(&poolInUse, &poolCached);
+	g_toStop = 1;
+	unsigned long long elapsedUs = nowUs() - g_startUs;
+	unsigned long long rampEndUs = g_startUs;
+	int rampDone = 1;
+
+	memset(&connectLatency, 0, sizeof(Histogram));
+	memset(&ackLatency, 0, sizeof(Histogram));
+	memset(&echoLatency, 0, sizeof(Histogram));
+	size_t memory = 0;
+	int sessions = 0;
+	for (i = 0; i < g_config.workers; i++)
+	{
+		Worker* worker = &g_workers[i];
+
+		pthread_join(worker->thread, NULL);
+		EventLoopClose(&worker->loop);
+		histoMerge(&connectLatency, &worker->connectLatency);
+		histoMerge(&ackLatency, &worker->ackLatency);
+		histoMerge(&echoLatency, &worker->echoLatency);
+		memory += worker->memory;
+		sessions += worker->sessions;
+		if (worker->rampEndUs == 0)
+		{
+			rampDone = 0;
+		}
+		else if (worker->rampEndUs > rampEndUs)
+		{
+			rampEndUs = worker->rampEndUs;
+		}
+	}
+	sumWorkers(&now);
+
+	double rampS = ((rampDone ? rampEndUs : g_startUs + elapsedUs) - g_startUs) / 1e6;
+	double elapsedS = elapsedUs / 1e6;
+
+	fprintf(stderr, "\n");
+	fprintf(stderr, "connects         %lu ok, %lu failed, %lu connections lost%s\n", now.connects, now.connectFailures,
+			now.disconnects, rampDone ? "" : " (ramp not complete)");
+	fprintf(stderr, "connect rate     %.1f /s (first connection of every device in %.2f s)\n",
+			rampS > 0 ? now.connects / rampS : 0.0, rampS);
+	fprintf(stderr, "publish          %lu sent, %lu failed, %lu deferred, %.1f /s, %.1f KB/s\n", now.published,
+			now.publishFailures, now.deferred, now.published / elapsedS, now.bytesOut / elapsedS / 1024);
+	if (g_config.qos > QOS0)
+	{
+		fprintf(stderr, "acknowledged     %lu, %lu failed, %.1f /s\n", now.acked, now.ackFailures, now.acked / elapsedS);
+	}
+	if (g_config.echo)
+	{
+		fprintf(stderr, "received         %lu, %.1f /s\n", now.received, now.received / elapsedS);
+	}
+	if (sessions > 0)
+	{
+		fprintf(stderr, "memory           %zu bytes per session (instance and packet buffers), %.0f KB resident per session\n",
+				memory / sessions, residentAfter > residentBefore ? (residentAfter - residentBefore) / 1024.0 / sessions : 0.0);
+		fprintf(stderr, "buffer pool      %zu KB in use, %zu KB cached\n", poolInUse / 1024, poolCached / 1024);
+	}
+	histoPrint("connect time", &connectLatency);
+	if (g_config.qos > QOS0)
+	{
+		histoPrint("ack latency", &ackLatency);
+	}
+	if (g_config.echo)
+	{
+		histoPrint("round trip", &echoLatency);
+	}
+
+	for (i = 0; i < g_config.workers; i++)
+	{
+		free(g_workers[i].devices);
+		free(g_workers[i].payload);
+	}
+	return 0;
+}
@@ -35,8 +35,11 @@
 *******************************************************************************************************************/
 
 #include <stdio.h>
+#include <stdint.h>
 #include <memory.h>
 #include "mqttInterface.h"
+#include "MQTTLog.h"
+#include "MQTTCompress.h"
 
 /*---------- Default parameters ---------------------------------*/
 #define 	TIMEOUT_MS					5000	//second time-out, MQTT client init
@@ -45,7 +48,37 @@
 #define		DEFAULT_PORT				1883
 #define		DEFAULT_KEEP_ALIVE			30
 #define		DEFAULT_QOS					QOS0
+#define		DEFAULT_INFLIGHT_WINDOW		MAX_INFLIGHT_MESSAGES
+#define		DEFAULT_COALESCE_DELAY_MS	2
+#define		DEFAULT_REPLAY_RATE			10
+#define		DEFAULT_CONNECT_RETRIES		3
+#define		DEFAULT_RECONNECT_MIN_MS	500
+#define		DEFAULT_RECONNECT_MAX_MS	60000
+#define		DEFAULT_MAX_PACKET_SIZE		(256 * 1024)
+#define		DEFAULT_BUFFER_IDLE_MS		10000
+#define		COMPRESS_STACK_SIZE			1024	//payloads compressed on the stack up to that size
+#define		KEY_VALUE_STACK_SIZE		512		//mqtt_PublishKeyValue writes on the stack up to that size
+
+//packet buffers of every instance come from there : an idle connection only holds two small ones
+static MQTTArena	g_bufferPool = MQTTArena_initializer;
+
+static const char*	g_packetNames[] =
+{
+	"RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+	"SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "RESERVED"
+};
+
+//-------------------------------------------------------------------------------------------------------
+static void closeNetwork(mqtt_interface_st * mqttObject)
+{
+	//the socket's counters go with it : they are added up first
+	unsigned long	sent, received;
 
+	linux_records(&mqttObject->network, &sent, &received);
+	mqttObject->tlsRecordsSent += sent;
+	mqttObject->tlsRecordsReceived += received;
+	linux_disconnect(&mqttObject->network);
+}
 
 
 //-------------------------------------------------------------------------------------------------------
@@ -55,8 +88,8 @@ mqtt_interface_st * mqtt_CreateInstance(const char* brokerUrl, int brokerPort, i
 
 	memset(mqttObject, 0, sizeof(mqtt_interface_st));
 
-	strcpy(mqttObject->deviceId, deviceId);
-	strcpy(mqttObject->serverUrl, brokerUrl);
+	mqttObject->deviceId = strdup(deviceId);
+	mqttObject->serverUrl = strdup(brokerUrl);
 	if (brokerPort <= 0)
 	{
 		mqttObject->serverPort = DEFAULT_PORT;
@@ -66,7 +99,7 @@ mqtt_interface_st * mqtt_CreateInstance(const char* brokerUrl, int brokerPort, i
 		mqttObject->serverPort = brokerPort;
 	}
 	mqttObject->useTLS = useTLS;
-	strcpy(mqttObject->secret, secret);
+	mqttObject->secret = strdup(secret);
 	if (keepAlive <= 0)
 	{
 		mqttObject->keepAlive = DEFAULT_KEEP_ALIVE;	
@@ -83,6 +116,24 @@ mqtt_interface_st * mqtt_CreateInstance(const char* brokerUrl, int brokerPort, i
 	{
 		mqttObject->qoS = qos;
 	}
+	mqttObject->protocolVersion = MQTT_VERSION;
+	mqttObject->inflightWindow = DEFAULT_INFLIGHT_WINDOW;
+	mqttObject->coalesceBytes = 0;
+	mqttObject->coalesceDelayMs = DEFAULT_COALESCE_DELAY_MS;
+	mqttObject->cleanSession = 0;
+	mqttObject->connectRetries = DEFAULT_CONNECT_RETRIES;
+	mqttObject->reconnectMinMs = DEFAULT_RECONNECT_MIN_MS;
+	mqttObject->reconnectMaxMs = DEFAULT_RECONNECT_MAX_MS;
+	mqttObject->jitterSeed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^ (unsigned int) (uintptr_t) mqttObject;
+	for (const char* p = deviceId; *p; p++)
+	{
+		//devices started at the same second still get their own backoff sequence
+		mqttObject->jitterSeed = mqttObject->jitterSeed * 31 + (unsigned char) *p;
+	}
+	mqttObject->offlineTtl = 0;
+	mqttObject->replayRate = DEFAULT_REPLAY_RATE;
+	mqttObject->maxPacketSize = DEFAULT_MAX_PACKET_SIZE;
+	mqttObject->bufferIdleMs = DEFAULT_BUFFER_IDLE_MS;
 
 	return mqttObject;
 }
@@ -91,11 +142,124 @@ mqtt_interface_st* mqtt_DeleteInstance(mqtt_interface_st* mqttObject)
 {
 	if (mqttObject)
 	{
+		MQTTThreadStop(&mqttObject->networkThread);
+		MQTTDropInflight(&mqttObject->mqttClient);
+		MQTTClearSubscriptions(&mqttObject->mqttClient);
+		MQTTClearTopicAliases(&mqttObject->mqttClient);
+		MQTTStoreClose(&mqttObject->offlineQueue);
+		closeNetwork(mqttObject);
+		MQTTFreeBuffers(&mqttObject->mqttClient);
+		free(mqttObject->deviceId);
+		free(mqttObject->serverUrl);
+		free(mqttObject->secret);
+		free(mqttObject->statsFile);
+		free(mqttObject->compressTopics);
 		free(mqttObject);
 	}
 
 	return NULL;
 }
+//-------------------------------------------------------------------------------------------------------
+static int publishMessage(mqtt_interface_st * mqttObject, const char* topicName, MQTTMessage* msg)
+{
+	if (MQTTThreadRunning(&mqttObject->networkThread))
+	{
+		//threaded mode : queued for the network thread, not waiting for the broker
+		return MQTTThreadPublish(&mqttObject->networkThread, topicName, msg, NULL, NULL, TIMEOUT_MS);
+	}
+	return MQTTPublish(&mqttObject->mqttClient, topicName, msg);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int topicMatches(const char* filter, const char* filterEnd, const char* topic)
+{
+	//MQTT wildcards : '+' one level, '#' all the levels below
+	while (filter < filterEnd)
+	{
+		if (*filter == '#' || (*topic == 0 && filterEnd - filter == 2 && strncmp(filter, "/#", 2) == 0))
+		{
+			return 1;
+		}
+		if (*filter == '+')
+		{
+			while (*topic && *topic != '/')
+			{
+				topic++;
+			}
+			filter++;
+		}
+		else if (*filter++ != *topic++)
+		{
+			return 0;
+		}
+	}
+	return *topic == 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int compressedTopic(mqtt_interface_st * mqttObject, const char* topicName)
+{
+	const char*	filter = mqttObject->compressTopics;
+
+	while (filter && *filter)
+	{
+		const char*	end = strchr(filter, ',');
+
+		if (end == NULL)
+		{
+			end = filter + strlen(filter);
+		}
+		if (end > filter && topicMatches(filter, end, topicName))
+		{
+			return 1;
+		}
+		filter = (*end) ? end + 1 : end;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned char* compressMessage(mqtt_interface_st * mqttObject, const char* topicName, MQTTMessage* msg,
+									  unsigned char* buffer, size_t bufferLen)
+{
+	/*
+		On the topics of MqttCompressTopics, the payload is replaced with its compressed form when that is smaller.
+		A payload that would pass for a compressed one is always compressed, for the receiver not to be misled.
+		Returns the buffer to free, when the stack one was too small
+	*/
+	unsigned char*	allocated = NULL;
+	size_t			outLen;
+	int				len;
+
+	if (msg->payloadlen == 0 || !compressedTopic(mqttObject, topicName))
+	{
+		return NULL;
+	}
+	outLen = MQTTIsCompressed(msg->payload, msg->payloadlen) ? MQTTCompressBound(msg->payloadlen) : msg->payloadlen - 1;
+	if (outLen > bufferLen)
+	{
+		if ((allocated = malloc(outLen)) == NULL)
+		{
+			return NULL;
+		}
+		buffer = allocated;
+	}
+
+	len = MQTTCompress(msg->payload, msg->payloadlen, buffer, outLen, MQTT_DICTIONARY_AIRVANTAGE);
+	if (len < 0)
+	{
+		//not worth it, sent as is
+		free(allocated);
+		return NULL;
+	}
+	__atomic_fetch_add(&mqttObject->compressedBytesIn, msg->payloadlen, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mqttObject->compressedBytesOut, len, __ATOMIC_RELAXED);
+	msg->payload = buffer;
+	msg->payloadlen = len;
+
+	return allocated;
+}
+
 //-------------------------------------------------------------------------------------------------------
 int mqtt_PublishData(mqtt_interface_st * mqttObject, const char* data, size_t dataLen, const char* topicName)
 {
@@ -110,38 +274,175 @@ int mqtt_PublishData(mqtt_interface_st * mqttObject, const char* data, size_t da
 	msg.payload = (void *) data;
 	msg.payloadlen = dataLen;
 
-	printf("Publishing data on %s : %s ... ", topicName, data);
-	fflush(stdout);
+	MQTT_TRACE("Publishing data on %s : %.*s", topicName, (int)dataLen, data);
 
-	int rc = MQTTPublish(&mqttObject->mqttClient, topicName, &msg);
-	if (rc != SUCCESS)
+	unsigned char	compressed[COMPRESS_STACK_SIZE];
+	unsigned char*	allocated = compressMessage(mqttObject, topicName, &msg, compressed, sizeof(compressed));
+
+	int rc = FAILURE;
+	if (atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire))
+	{
+		rc = publishMessage(mqttObject, topicName, &msg);
+	}
+	if (rc != SUCCESS && rc != SERVER_LIMITS && MQTTStoreIsOpen(&mqttObject->offlineQueue))
+	{
+		//kept for when the broker is back
+		rc = MQTTStoreAppend(&mqttObject->offlineQueue, topicName, &msg, mqttObject->offlineTtl);
+		MQTT_DEBUG("Published %zu bytes on %s : queued offline (%lu)", dataLen, topicName, MQTTStoreCount(&mqttObject->offlineQueue));
+	}
+	else if (rc != SUCCESS)
+	{
+		MQTT_WARN("Publishing %zu bytes on %s : error %d", dataLen, topicName, rc);
+	}
+	else
+	{
+		MQTT_DEBUG("Published %zu bytes on %s : OK", dataLen, topicName);
+	}
+	free(allocated);
+
+	return rc;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_PublishDataAsync(mqtt_interface_st * mqttObject, const char* data, size_t dataLen, const char* topicName,
+						  publishCompletionHandler onComplete, void* context)
+{
+	//does not wait for PUBACK/PUBCOMP, onComplete is invoked once the broker acknowledged the message
+	//FAILURE : the message was not taken, onComplete will not be invoked for it
+	//SERVER_LIMITS : nor was it, for asking more than the broker takes (MQTT 5 Maximum QoS or Maximum Packet Size)
+	MQTTMessage		msg;
+	msg.qos = mqttObject->qoS;
+	msg.retained = 0;
+	msg.dup = 0;
+	msg.id = 0;
+	msg.payload = (void *) data;
+	msg.payloadlen = dataLen;
+
+	//both copy the payload before returning
+	unsigned char	compressed[COMPRESS_STACK_SIZE];
+	unsigned char*	allocated = compressMessage(mqttObject, topicName, &msg, compressed, sizeof(compressed));
+	int				rc;
+
+	if (MQTTThreadRunning(&mqttObject->networkThread))
 	{
-		printf("publish error: %d\n", rc);
-		
+		//threaded mode : onComplete is invoked from the network thread
+		rc = MQTTThreadPublish(&mqttObject->networkThread, topicName, &msg, onComplete, context, TIMEOUT_MS);
 	}
 	else
 	{
-		printf("OK\n");
+		rc = MQTTPublishAsync(&mqttObject->mqttClient, topicName, &msg, onComplete, context);
 	}
-	fflush(stdout);
+	free(allocated);
 
 	return rc;
 }
 
+//-------------------------------------------------------------------------------------------------------
+static size_t writeJsonString(char* buffer, size_t size, size_t len, const char* szString)
+{
+	//szString quoted and escaped, from buffer[len] on : what does not fit is counted, not written
+	static const char	hex[] = "0123456789abcdef";
+	const char*			p;
+
+	#define PUT(c)		do { if (len < size) buffer[len] = (c); len++; } while (0)
+	PUT('"');
+	for (p = szString; *p; p++)
+	{
+		unsigned char	c = (unsigned char) *p;
+
+		if (c == '"' || c == '\\')
+		{
+			PUT('\\');
+			PUT(c);
+		}
+		else if (c == '\n')
+		{
+			PUT('\\');
+			PUT('n');
+		}
+		else if (c < 0x20)
+		{
+			//\u00XX for the other control characters
+			PUT('\\');
+			PUT('u');
+			PUT('0');
+			PUT('0');
+			PUT(hex[c >> 4]);
+			PUT(hex[c & 0xF]);
+		}
+		else
+		{
+			PUT(c);
+		}
+	}
+	PUT('"');
+	#undef PUT
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static size_t writeKeyValue(char* buffer, size_t size, const char* szKey, const char* szValue)
+{
+	//{"key":"value"}, both escaped, NUL terminated if it fits : its length either way
+	size_t	len;
+
+	if (size > 0)
+	{
+		buffer[0] = '{';
+	}
+	len = writeJsonString(buffer, size, 1, szKey);
+	if (len < size)
+	{
+		buffer[len] = ':';
+	}
+	len = writeJsonString(buffer, size, len + 1, szValue);
+	if (len + 1 < size)
+	{
+		buffer[len] = '}';
+		buffer[len + 1] = 0;
+	}
+	return len + 1;
+}
+
 //-------------------------------------------------------------------------------------------------------
 int  mqtt_PublishKeyValue(mqtt_interface_st * mqttObject, const char* szKey, const char* szValue, const char* topicName)
 {
-	char * message = malloc(strlen(szKey) + strlen(szValue) + 10);
+	//written on the stack, unless too large for it
+	char	buffer[KEY_VALUE_STACK_SIZE];
+	char *	message = buffer;
+	size_t	len = writeKeyValue(buffer, sizeof(buffer), szKey, szValue);
 
-	sprintf(message, "{\"%s\":\"%s\"}", szKey, szValue);	
+	if (len >= sizeof(buffer))
+	{
+		if ((message = malloc(len + 1)) == NULL)
+		{
+			return FAILURE;
+		}
+		writeKeyValue(message, len + 1, szKey, szValue);
+	}
 
-	int rc = mqtt_PublishData(mqttObject, message, strlen(message), topicName);
+	int rc = mqtt_PublishData(mqttObject, message, len, topicName);
 
-	free(message);
+	if (message != buffer)
+	{
+		free(message);
+	}
 
 	return rc;
 }
 
+//-------------------------------------------------------------------------------------------------------
+static void setString(char** field, const char* value)
+{
+	char* copy = strdup(value);
+
+	if (copy)
+	{
+		free(*field);
+		*field = copy;
+	}
+}
+
 //-------------------------------------------------------------------------------------------------------
 int mqtt_SetConfig(mqtt_interface_st * mqttObject, const char* configName, const char * value)
 {
@@ -154,7 +455,7 @@ int mqtt_SetConfig(mqtt_interface_st * mqttObject, const char* configName, const
 
 	if (strcasecmp(MQTT_BROKER, configName) == 0)
 	{
-		strcpy(mqttObject->serverUrl, value);
+		setString(&mqttObject->serverUrl, value);
 	}
 	else if (strcasecmp(MQTT_PORT, configName) == 0)
 	{
@@ -162,11 +463,11 @@ int mqtt_SetConfig(mqtt_interface_st * mqttObject, const char* configName, const
 	}
 	else if (strcasecmp(MQTT_ENDPOINT, configName) == 0)
 	{
-		strcpy(mqttObject->deviceId, value);
+		setString(&mqttObject->deviceId, value);
 	}
 	else if (strcasecmp(MQTT_SECRET, configName) == 0)
 	{
-		strcpy(mqttObject->secret, value);
+		setString(&mqttObject->secret, value);
 	}
 	else if (strcasecmp(MQTT_KEEPALIVE, configName) == 0)
 	{
@@ -184,6 +485,161 @@ int mqtt_SetConfig(mqtt_interface_st * mqttObject, const char* configName, const
 	{
 		mqttObject->qoS = atoi(value);
 	}
+	else if (strcasecmp(MQTT_INFLIGHT, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val > 0 && val <= MAX_INFLIGHT_MESSAGES)
+		{
+			mqttObject->inflightWindow = val;
+			MQTTSetInflightWindow(&mqttObject->mqttClient, val);
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_COALESCE, configName) == 0 || strcasecmp(MQTT_COALESCE_DELAY, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val >= 0)
+		{
+			if (strcasecmp(MQTT_COALESCE, configName) == 0)
+			{
+				mqttObject->coalesceBytes = val;
+			}
+			else
+			{
+				mqttObject->coalesceDelayMs = val;
+			}
+			if (!MQTTThreadRunning(&mqttObject->networkThread))
+			{
+				//otherwise applies to the next session
+				linux_coalesce(&mqttObject->network, mqttObject->coalesceBytes, mqttObject->coalesceDelayMs);
+			}
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_PROTOCOL, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val >= 3 && val <= 5)
+		{
+			mqttObject->protocolVersion = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_CLEAN_SESSION, configName) == 0)
+	{
+		mqttObject->cleanSession = (atoi(value) != 0);
+	}
+	else if (strcasecmp(MQTT_CONNECT_RETRIES, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val > 0)
+		{
+			mqttObject->connectRetries = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_RECONNECT_MIN, configName) == 0 || strcasecmp(MQTT_RECONNECT_MAX, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val > 0)
+		{
+			if (strcasecmp(MQTT_RECONNECT_MIN, configName) == 0)
+			{
+				mqttObject->reconnectMinMs = val;
+			}
+			else
+			{
+				mqttObject->reconnectMaxMs = val;
+			}
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_OFFLINE_TTL, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val >= 0)
+		{
+			mqttObject->offlineTtl = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_REPLAY_RATE, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val > 0)
+		{
+			mqttObject->replayRate = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_MAX_PACKET, configName) == 0)
+	{
+		//applies to sessions started afterwards
+		int val = atoi(value);
+		if (val >= MIN_BUFFER_SIZE && (size_t) val <= ARENA_MAX_SIZE)
+		{
+			mqttObject->maxPacketSize = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_BUFFER_IDLE, configName) == 0)
+	{
+		//applies to sessions started afterwards
+		int val = atoi(value);
+		if (val >= 0)
+		{
+			mqttObject->bufferIdleMs = val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_STATS_INTERVAL, configName) == 0)
+	{
+		int val = atoi(value);
+		if (val >= 0)
+		{
+			mqttObject->statsIntervalMs = val;
+			mqttObject->statsTime = monotonic_ms() + val;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+	else if (strcasecmp(MQTT_STATS_FILE, configName) == 0)
+	{
+		setString(&mqttObject->statsFile, value);
+	}
+	else if (strcasecmp(MQTT_COMPRESS_TOPICS, configName) == 0)
+	{
+		setString(&mqttObject->compressTopics, value);
+	}
 
 	return ret;
 }
@@ -198,29 +654,89 @@ int mqtt_GetConfig(mqtt_interface_st * mqttObject, const char* configName, char
 
 	int ret = 0;
 
-	if (strcasecmp(MQTT_BROKER, configName))
+	if (strcasecmp(MQTT_BROKER, configName) == 0)
 	{
 		strncpy(value, mqttObject->serverUrl, valueLen);
 	}
-	else if (strcasecmp(MQTT_PORT, configName))
+	else if (strcasecmp(MQTT_PORT, configName) == 0)
 	{
-		sprintf(value, "%d", mqttObject->serverPort);
+		snprintf(value, valueLen, "%d", mqttObject->serverPort);
 	}
-	else if (strcasecmp(MQTT_ENDPOINT, configName))
+	else if (strcasecmp(MQTT_ENDPOINT, configName) == 0)
 	{
 		strncpy(value, mqttObject->deviceId, valueLen);
 	}
-	else if (strcasecmp(MQTT_SECRET, configName))
+	else if (strcasecmp(MQTT_SECRET, configName) == 0)
 	{
 		strncpy(value, mqttObject->secret, valueLen);
 	}
-	else if (strcasecmp(MQTT_KEEPALIVE, configName))
+	else if (strcasecmp(MQTT_KEEPALIVE, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->keepAlive);
+	}
+	else if (strcasecmp(MQTT_QOS, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->qoS);
+	}
+	else if (strcasecmp(MQTT_INFLIGHT, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->inflightWindow);
+	}
+	else if (strcasecmp(MQTT_COALESCE, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->coalesceBytes);
+	}
+	else if (strcasecmp(MQTT_COALESCE_DELAY, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->coalesceDelayMs);
+	}
+	else if (strcasecmp(MQTT_PROTOCOL, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->protocolVersion);
+	}
+	else if (strcasecmp(MQTT_CLEAN_SESSION, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->cleanSession);
+	}
+	else if (strcasecmp(MQTT_CONNECT_RETRIES, configName) == 0)
 	{
-		sprintf(value, "%d", mqttObject->keepAlive);
+		snprintf(value, valueLen, "%d", mqttObject->connectRetries);
 	}
-	else if (strcasecmp(MQTT_QOS, configName))
+	else if (strcasecmp(MQTT_RECONNECT_MIN, configName) == 0)
 	{
-		sprintf(value, "%d", mqttObject->qoS);
+		snprintf(value, valueLen, "%d", mqttObject->reconnectMinMs);
+	}
+	else if (strcasecmp(MQTT_RECONNECT_MAX, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->reconnectMaxMs);
+	}
+	else if (strcasecmp(MQTT_OFFLINE_TTL, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->offlineTtl);
+	}
+	else if (strcasecmp(MQTT_REPLAY_RATE, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->replayRate);
+	}
+	else if (strcasecmp(MQTT_MAX_PACKET, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->maxPacketSize);
+	}
+	else if (strcasecmp(MQTT_BUFFER_IDLE, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->bufferIdleMs);
+	}
+	else if (strcasecmp(MQTT_STATS_INTERVAL, configName) == 0)
+	{
+		snprintf(value, valueLen, "%d", mqttObject->statsIntervalMs);
+	}
+	else if (strcasecmp(MQTT_STATS_FILE, configName) == 0)
+	{
+		snprintf(value, valueLen, "%s", mqttObject->statsFile ? mqttObject->statsFile : "");
+	}
+	else if (strcasecmp(MQTT_COMPRESS_TOPICS, configName) == 0)
+	{
+		snprintf(value, valueLen, "%s", mqttObject->compressTopics ? mqttObject->compressTopics : "");
 	}
 	else
 	{
@@ -232,62 +748,544 @@ int mqtt_GetConfig(mqtt_interface_st * mqttObject, const char* configName, char
 }
 
 //-------------------------------------------------------------------------------------------------------
-int mqtt_ProcessEvent(mqtt_interface_st * mqttObject, unsigned waitDelayMs)
+static void replayOfflineQueue(mqtt_interface_st * mqttObject)
 {
-	return MQTTYield(&mqttObject->mqttClient, 1000);
+	/*
+		Token bucket : replayRate publishes per second, at most one second's worth at once,
+		so that a long outage does not end in a burst
+	*/
+	char*			topicName;
+	MQTTMessage		msg;
+	unsigned long long now = monotonic_ms();
+	unsigned long long credit;
+
+	if (!atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire) || MQTTStoreCount(&mqttObject->offlineQueue) == 0)
+	{
+		mqttObject->replayTime = now;
+		return;
+	}
+
+	credit = (now - mqttObject->replayTime) * mqttObject->replayRate / 1000;
+	if (credit > (unsigned long long) mqttObject->replayRate)
+	{
+		credit = mqttObject->replayRate;
+		mqttObject->replayTime = now;
+	}
+	else
+	{
+		mqttObject->replayTime += credit * 1000 / mqttObject->replayRate;
+	}
+
+	while (credit-- > 0 && MQTTStorePeek(&mqttObject->offlineQueue, &topicName, &msg))
+	{
+		int rc = publishMessage(mqttObject, topicName, &msg);
+
+		if (rc == SERVER_LIMITS)
+		{
+			MQTT_WARN("Offline message on %s dropped : the broker would not take it", topicName);
+		}
+		else if (rc != SUCCESS)
+		{
+			break;	//kept for the next session
+		}
+		MQTTStorePop(&mqttObject->offlineQueue);
+	}
 }
 
 //-------------------------------------------------------------------------------------------------------
-int mqtt_StartSession(mqtt_interface_st * mqttObject)
+static unsigned int nextReconnectDelay(mqtt_interface_st * mqttObject)
+{
+	/*
+		Decorrelated jitter : random between the minimum and three times the previous delay, capped.
+		Devices dropped by the same broker restart spread their attempts instead of coming back at once
+	*/
+	unsigned int low = mqttObject->reconnectMinMs;
+	unsigned int high = mqttObject->reconnectDelayMs * 3;
+
+	if (high <= low)
+	{
+		high = low + 1;
+	}
+	mqttObject->reconnectDelayMs = low + rand_r(&mqttObject->jitterSeed) % (high - low);
+	if (mqttObject->reconnectDelayMs > (unsigned int) mqttObject->reconnectMaxMs)
+	{
+		mqttObject->reconnectDelayMs = mqttObject->reconnectMaxMs;
+	}
+	return mqttObject->reconnectDelayMs;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int connectOnce(mqtt_interface_st * mqttObject, int attempt, int attempts)
 {
 	int 			rc = 0;
-	
-	int				nMaxRetry = 3;
-	int				nRetry = 0;
 
+	closeNetwork(mqttObject);
+	NewNetwork(&mqttObject->network);
+	linux_arena(&mqttObject->network, &g_bufferPool);
+	linux_coalesce(&mqttObject->network, mqttObject->coalesceBytes, mqttObject->coalesceDelayMs);
+	mqttObject->network.connect(&mqttObject->network, mqttObject->serverUrl, mqttObject->serverPort, mqttObject->useTLS);
 
-	for (nRetry=0; nRetry<nMaxRetry; nRetry++)
+	if (mqttObject->mqttClient.ipstack == NULL)
+	{
+		//once per instance: publishes in flight and subscriptions must survive the reconnection
+		MQTTClient(&mqttObject->mqttClient, &mqttObject->network, TIMEOUT_MS, NULL, 0, NULL, 0);
+		MQTTSetInflightWindow(&mqttObject->mqttClient, mqttObject->inflightWindow);
+		setStreamMessageHandler(&mqttObject->mqttClient, mqttObject->streamHandler);
+	}
+	if (mqttObject->mqttClient.arena == NULL)
+	{
+		//small to begin with, grown by the packets that need it
+		MQTTSetBufferArena(&mqttObject->mqttClient, &g_bufferPool, mqttObject->maxPacketSize, mqttObject->bufferIdleMs);
+	}
+	atomic_store_explicit(&mqttObject->mqttClient.isconnected, 0, memory_order_release);		//fresh network connection, MQTT session still to be established
+ 
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;       
+	data.willFlag = 0;
+	data.MQTTVersion = mqttObject->protocolVersion;
+	data.clientID.cstring = mqttObject->deviceId;
+	data.username.cstring = mqttObject->deviceId;
+	data.password.cstring = mqttObject->secret;
+
+	data.keepAliveInterval = mqttObject->keepAlive;
+	data.cleansession = mqttObject->cleanSession;
+
+	//subscriptions already made are restored by MQTTConnect, unless the broker kept our session
+	rc = MQTTConnect(&mqttObject->mqttClient, &data);
+	if (rc == SUCCESS)
+	{
+		MQTT_INFO("Connected (%d/%d) to tcp://%s:%d%s", attempt, attempts, mqttObject->serverUrl, mqttObject->serverPort,
+				  mqttObject->mqttClient.sessionPresent ? " (session resumed)" : "");
+		//the offline queue starts replaying from now on
+		mqttObject->replayTime = monotonic_ms();
+		mqttObject->reconnectDelayMs = mqttObject->reconnectMinMs;
+		mqttObject->reconnectTime = 0;
+		mqttObject->connects++;
+	}
+	else
 	{
-		linux_disconnect(&mqttObject->network);
-		NewNetwork(&mqttObject->network);
-		mqttObject->network.connect(&mqttObject->network, mqttObject->serverUrl, mqttObject->serverPort, mqttObject->useTLS);
+		MQTT_WARN("Failed (%d/%d) to connect to tcp://%s:%d", attempt, attempts, mqttObject->serverUrl, mqttObject->serverPort);
+		if (mqttObject->protocolVersion == 5 && (rc == 1 || rc == 0x84))
+		{
+			//unacceptable protocol version, answered by an MQTT 3 broker or by an MQTT 5 one
+			MQTT_WARN("MQTT 5 refused by the broker, MQTT 3.1.1 from now on");
+			mqttObject->protocolVersion = 4;
+		}
+		atomic_store_explicit(&mqttObject->mqttClient.isconnected, 0, memory_order_release);
+		mqttObject->connectFailures++;
+		closeNetwork(mqttObject);
+	}
+
+	return rc;
+}
 
-		MQTTClient(&mqttObject->mqttClient, &mqttObject->network, TIMEOUT_MS, mqttObject->mqttBuffer, sizeof(mqttObject->mqttBuffer), mqttObject->mqttReadBuffer, sizeof(mqttObject->mqttReadBuffer));
-	 
-		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;       
-		data.willFlag = 0;
-		data.MQTTVersion = MQTT_VERSION;
-		data.clientID.cstring = mqttObject->deviceId;
-		data.username.cstring = mqttObject->deviceId;
-		data.password.cstring = mqttObject->secret;
+//-------------------------------------------------------------------------------------------------------
+static void connectionLost(mqtt_interface_st * mqttObject)
+{
+	//the client keeps its subscriptions and publishes in flight : only the connection is replaced
+	MQTTThreadStop(&mqttObject->networkThread);
+	atomic_store_explicit(&mqttObject->mqttClient.isconnected, 0, memory_order_release);
+	mqttObject->connectionsLost++;
+	closeNetwork(mqttObject);
+	mqttObject->reconnectTime = monotonic_ms() + nextReconnectDelay(mqttObject);
+
+	if (mqttObject->mqttClient.server.disconnect_reason != 0)
+	{
+		MQTT_WARN("Disconnected by the broker, reason 0x%02x", mqttObject->mqttClient.server.disconnect_reason);
+	}
+	MQTT_WARN("Connection lost, reconnecting in %u ms", mqttObject->reconnectDelayMs);
+}
 
-		data.keepAliveInterval = mqttObject->keepAlive;
-		data.cleansession = 1;
-		printf("Attempting (%d/%d) to connect to tcp://%s:%d... ", nRetry+1, nMaxRetry, mqttObject->serverUrl, mqttObject->serverPort);
+//-------------------------------------------------------------------------------------------------------
+static int reconnect(mqtt_interface_st * mqttObject, unsigned waitDelayMs)
+{
+	unsigned long long now = monotonic_ms();
 
-		fflush(stdout);
-	
-		rc = MQTTConnect(&mqttObject->mqttClient, &data);
-		//printf("Connected %d\n", rc);
-		printf("%s\n", rc == SUCCESS ? "OK" : "Failed");
-	    fflush(stdout);
+	if (mqttObject->reconnectTime == 0)
+	{
+		//lost by the network thread
+		connectionLost(mqttObject);
+		return FAILURE;
+	}
+	if (now < mqttObject->reconnectTime)
+	{
+		unsigned long long wait = mqttObject->reconnectTime - now;
+		usleep((wait < waitDelayMs ? wait : waitDelayMs) * 1000);
+		return FAILURE;
+	}
 
-		if (rc == SUCCESS) 
+	if (connectOnce(mqttObject, 1, 1) != SUCCESS)
+	{
+		mqttObject->reconnectTime = monotonic_ms() + nextReconnectDelay(mqttObject);
+		return FAILURE;
+	}
+	if (mqttObject->threadQueueSize > 0)
+	{
+		MQTTThreadStart(&mqttObject->networkThread, &mqttObject->mqttClient, mqttObject->threadQueueSize, NULL, NULL);
+	}
+	return SUCCESS;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void dumpStats(mqtt_interface_st * mqttObject)
+{
+	char			line[4096];
+	FILE*			output = stderr;
+	unsigned long long now = monotonic_ms();
+
+	if (mqttObject->statsIntervalMs == 0 || now < mqttObject->statsTime)
+	{
+		return;
+	}
+	mqttObject->statsTime = now + mqttObject->statsIntervalMs;
+
+	mqtt_FormatStats(mqttObject, line, sizeof(line));
+	if (mqttObject->statsFile && strlen(mqttObject->statsFile) && (output = fopen(mqttObject->statsFile, "a")) == NULL)
+	{
+		MQTT_WARN("Cannot write the statistics to %s", mqttObject->statsFile);
+		return;
+	}
+	fprintf(output, "%s\n", line);
+	if (output != stderr)
+	{
+		fclose(output);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_ProcessEvent(mqtt_interface_st * mqttObject, unsigned waitDelayMs)
+{
+	dumpStats(mqttObject);
+
+	if (mqttObject->autoReconnect && !atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire))
+	{
+		return reconnect(mqttObject, waitDelayMs);
+	}
+
+	replayOfflineQueue(mqttObject);
+
+	if (MQTTThreadRunning(&mqttObject->networkThread))
+	{
+		//threaded mode : the network thread does the work
+		usleep(waitDelayMs * 1000);
+		return atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire) ? SUCCESS : FAILURE;
+	}
+
+	//0 : what can be done without waiting, for callers polling mqtt_GetFd themselves
+	int rc = (waitDelayMs == 0) ? MQTTProcess(&mqttObject->mqttClient) : MQTTYield(&mqttObject->mqttClient, waitDelayMs);
+	if (rc != SUCCESS && mqttObject->autoReconnect)
+	{
+		connectionLost(mqttObject);
+	}
+	return rc;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_GetFd(mqtt_interface_st * mqttObject)
+{
+	/*
+		Descriptor to watch for reading, -1 when there is none to watch : not connected, or threaded mode
+		where the network thread has it.  It changes with each reconnection, so ask again after every
+		mqtt_ProcessEvent before polling
+	*/
+	if (!atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire) || mqttObject->mqttClient.ipstack == NULL
+		|| MQTTThreadRunning(&mqttObject->networkThread))
+	{
+		return -1;
+	}
+	return linux_getfd(&mqttObject->network);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int earliest(int timeout, unsigned long long deadline, unsigned long long now)
+{
+	int left = (deadline > now) ? (int) (deadline - now) : 0;
+
+	return (timeout < 0 || left < timeout) ? left : timeout;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_GetTimeout(mqtt_interface_st * mqttObject)
+{
+	/*
+		Milliseconds until mqtt_ProcessEvent has work to do even though mqtt_GetFd stays quiet : keepalive,
+		coalesced writes, reconnection, offline replay, statistics.  0 : call it now, -1 : nothing is due.
+		Together they let an application's own poll/epoll loop call mqtt_ProcessEvent(mqttObject, 0)
+		exactly when needed :
+
+			struct pollfd fd = {mqtt_GetFd(mqttObject), POLLIN, 0};
+			poll(&fd, 1, mqtt_GetTimeout(mqttObject));
+			mqtt_ProcessEvent(mqttObject, 0);
+	*/
+	Client*			c = &mqttObject->mqttClient;
+	unsigned long long now = monotonic_ms();
+	int				timeout = -1;
+
+	if (mqttObject->statsIntervalMs > 0)
+	{
+		timeout = earliest(timeout, mqttObject->statsTime, now);
+	}
+
+	if (!atomic_load_explicit(&c->isconnected, memory_order_acquire))
+	{
+		if (mqttObject->autoReconnect)
 		{
-			//connected			
-			break;
+			//0 when lost by the network thread and not noticed yet
+			timeout = earliest(timeout, mqttObject->reconnectTime, now);
 		}
-		else
+		return timeout;
+	}
+
+	if (MQTTStoreCount(&mqttObject->offlineQueue) > 0)
+	{
+		timeout = earliest(timeout, mqttObject->replayTime + 1000 / mqttObject->replayRate, now);
+	}
+
+	if (!MQTTThreadRunning(&mqttObject->networkThread))
+	{
+		int next = (linux_pending(c->ipstack) > 0) ? 0 : MQTTNextTimeout(c);
+
+		if (next >= 0 && (timeout < 0 || next < timeout))
 		{
-			MQTTDisconnect(&mqttObject->mqttClient);
-			mqttObject->network.disconnect(&mqttObject->network);
+			timeout = next;
+		}
+	}
+	return timeout;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_OpenOfflineQueue(mqtt_interface_st * mqttObject, const char* path, size_t sizeBytes)
+{
+	/*
+		Store-and-forward : from now on, publishes that cannot be sent (not connected, or failed) are
+		kept in a ring file at path, of sizeBytes, and replayed at MqttReplayRate once connected.
+		A queue left by a previous run is picked up where it stopped, with its own size
+	*/
+	MQTTStoreClose(&mqttObject->offlineQueue);
+	return MQTTStoreOpen(&mqttObject->offlineQueue, path, sizeBytes);
+}
+
+//-------------------------------------------------------------------------------------------------------
+unsigned long mqtt_OfflineQueueCount(mqtt_interface_st * mqttObject)
+{
+	return MQTTStoreCount(&mqttObject->offlineQueue);
+}
+
+//-------------------------------------------------------------------------------------------------------
+size_t mqtt_GetMemoryUsage(mqtt_interface_st * mqttObject)
+{
+	//what the instance holds right now, packet buffers included; the TLS layer's own are not counted
+	size_t bytes = sizeof(mqtt_interface_st);
+
+	bytes += strlen(mqttObject->deviceId) + strlen(mqttObject->serverUrl) + strlen(mqttObject->secret) + 3;
+	if (mqttObject->mqttClient.ipstack != NULL)
+	{
+		bytes += MQTTBufferUsage(&mqttObject->mqttClient);
+	}
+	return bytes;
+}
+
+//-------------------------------------------------------------------------------------------------------
+void mqtt_GetBufferPoolUsage(size_t* inUse, size_t* cached)
+{
+	//packet buffers shared by all instances : handed out, and kept for reuse
+	MQTTArenaUsage(&g_bufferPool, inUse, cached);
+}
+
+//-------------------------------------------------------------------------------------------------------
+void mqtt_GetStats(mqtt_interface_st * mqttObject, mqtt_stats_st * stats)
+{
+	/*
+		To be called from the thread driving the instance (mqtt_ProcessEvent) : it owns the socket.
+		The client's own counters, stats->client, can be read from any thread with MQTTGetStats
+	*/
+	unsigned long	sent, received;
+
+	MQTTGetStats(&mqttObject->mqttClient, &stats->client);
+	linux_records(&mqttObject->network, &sent, &received);
+	stats->tlsRecordsSent = mqttObject->tlsRecordsSent + sent;
+	stats->tlsRecordsReceived = mqttObject->tlsRecordsReceived + received;
+	stats->connects = mqttObject->connects;
+	stats->connectFailures = mqttObject->connectFailures;
+	stats->connectionsLost = mqttObject->connectionsLost;
+	stats->offlineQueued = MQTTStoreCount(&mqttObject->offlineQueue);
+	stats->offlineDropped = MQTTStoreIsOpen(&mqttObject->offlineQueue) ? mqttObject->offlineQueue.header->dropped : 0;
+	stats->compressedBytesIn = __atomic_load_n(&mqttObject->compressedBytesIn, __ATOMIC_RELAXED);
+	stats->compressedBytesOut = __atomic_load_n(&mqttObject->compressedBytesOut, __ATOMIC_RELAXED);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int formatCounts(char* buffer, size_t bufferLen, const char* name, unsigned long long* counts)
+{
+	//{"PUBLISH":12,...} : packet types never seen are left out
+	int		len = snprintf(buffer, bufferLen, ",\"%s\":{", name);
+	int		first = 1;
+
+	for (int type = 0; type < 16 && (size_t) len < bufferLen; type++)
+	{
+		if (counts[type] > 0)
+		{
+			len += snprintf(buffer + len, bufferLen - len, "%s\"%s\":%llu", first ? "" : ",", g_packetNames[type], counts[type]);
+			first = 0;
+		}
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += snprintf(buffer + len, bufferLen - len, "}");
+	}
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int formatRoundTrips(char* buffer, size_t bufferLen, const char* separator, const char* name, unsigned long long* buckets)
+{
+	/*
+		"qos1":{"count":n,"p50":us,"p90":us,"p99":us,"max":us,"buckets":[...]}
+		Bucket i holds the round trips under 2^i us : the percentiles are the upper bound of theirs
+	*/
+	unsigned long long	count = 0, seen = 0;
+	unsigned long long	percentiles[4] = {0};
+	const int			per[3] = {50, 90, 99};
+	int					last = -1, p = 0, len;
+
+	for (int i = 0; i < MQTT_STATS_RTT_BUCKETS; i++)
+	{
+		count += buckets[i];
+		if (buckets[i] > 0)
+		{
+			last = i;
+		}
+	}
+	for (int i = 0; i <= last; i++)
+	{
+		seen += buckets[i];
+		while (p < 3 && seen * 100 >= count * per[p])
+		{
+			percentiles[p++] = 1ULL << i;
+		}
+	}
+	percentiles[3] = (last < 0) ? 0 : 1ULL << last;
+
+	len = snprintf(buffer, bufferLen, "%s\"%s\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu,\"buckets\":[",
+				   separator, name, count, percentiles[0], percentiles[1], percentiles[2], percentiles[3]);
+	for (int i = 0; i <= last && (size_t) len < bufferLen; i++)
+	{
+		len += snprintf(buffer + len, bufferLen - len, "%s%llu", i ? "," : "", buckets[i]);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += snprintf(buffer + len, bufferLen - len, "]}");
+	}
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_FormatStats(mqtt_interface_st * mqttObject, char * buffer, size_t bufferLen)
+{
+	/*
+		mqtt_GetStats as a single-line JSON object, for logs and scrapers.
+		Returns its length : bufferLen or more when it did not fit, and was cut short
+	*/
+	mqtt_stats_st	stats;
+	int				len;
+
+	mqtt_GetStats(mqttObject, &stats);
+
+	len = snprintf(buffer, bufferLen, "{\"time\":%ld,\"device\":\"%s\",\"connected\":%d,\"connects\":%lu,"
+				   "\"connectFailures\":%lu,\"connectionsLost\":%lu,\"tlsRecordsSent\":%lu,\"tlsRecordsReceived\":%lu,"
+				   "\"offlineQueued\":%lu,\"offlineDropped\":%lu,\"compressedBytesIn\":%llu,\"compressedBytesOut\":%llu,"
+				   "\"publishesRefused\":%llu,\"yieldCalls\":%llu,\"yieldUs\":%llu",
+				   (long) time(NULL), mqttObject->deviceId, atomic_load_explicit(&mqttObject->mqttClient.isconnected, memory_order_acquire), stats.connects,
+				   stats.connectFailures, stats.connectionsLost, stats.tlsRecordsSent, stats.tlsRecordsReceived,
+				   stats.offlineQueued, stats.offlineDropped, stats.compressedBytesIn, stats.compressedBytesOut,
+				   stats.client.publishes_refused, stats.client.yield_calls, stats.client.yield_us);
+	if ((size_t) len < bufferLen)
+	{
+		len += formatCounts(buffer + len, bufferLen - len, "packetsOut", stats.client.packets_out);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += formatCounts(buffer + len, bufferLen - len, "bytesOut", stats.client.bytes_out);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += formatCounts(buffer + len, bufferLen - len, "packetsIn", stats.client.packets_in);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += formatCounts(buffer + len, bufferLen - len, "bytesIn", stats.client.bytes_in);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += snprintf(buffer + len, bufferLen - len, ",\"ackRttUs\":{");
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += formatRoundTrips(buffer + len, bufferLen - len, "", "qos1", stats.client.ack_rtt[0]);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += formatRoundTrips(buffer + len, bufferLen - len, ",", "qos2", stats.client.ack_rtt[1]);
+	}
+	if ((size_t) len < bufferLen)
+	{
+		len += snprintf(buffer + len, bufferLen - len, "}}");
+	}
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_StartThread(mqtt_interface_st * mqttObject, unsigned int queueSize)
+{
+	/*
+		Threaded mode : a dedicated thread owns the connection, any number of threads may then
+		publish concurrently (mqtt_PublishData, mqtt_PublishDataAsync, mqtt_PublishKeyValue).
+		Subscriptions are to be made before, or after mqtt_StopThread
+	*/
+	if (MQTTThreadRunning(&mqttObject->networkThread))
+	{
+		return SUCCESS;
+	}
+	if (queueSize == 0)
+	{
+		queueSize = DEFAULT_PUBLISH_QUEUE_SIZE;
+	}
+	mqttObject->threadQueueSize = queueSize;
+	return MQTTThreadStart(&mqttObject->networkThread, &mqttObject->mqttClient, queueSize, NULL, NULL);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_StopThread(mqtt_interface_st * mqttObject)
+{
+	mqttObject->threadQueueSize = 0;
+	return MQTTThreadStop(&mqttObject->networkThread);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int mqtt_StartSession(mqtt_interface_st * mqttObject)
+{
+	int 			rc = 0;
+	int				nRetry = 0;
+
+	mqttObject->reconnectDelayMs = mqttObject->reconnectMinMs;
+	for (nRetry=0; nRetry<mqttObject->connectRetries; nRetry++)
+	{
+		if (nRetry > 0)
+		{
+			usleep(nextReconnectDelay(mqttObject) * 1000);
+		}
+		if ((rc = connectOnce(mqttObject, nRetry+1, mqttObject->connectRetries)) == SUCCESS)
+		{
+			break;
 		}
 	}
 
 	if (rc != SUCCESS)
 	{
-		printf("Failed to connect to AirVantage server\n");
-		fflush(stdout);
+		MQTT_ERROR("Failed to connect to tcp://%s:%d", mqttObject->serverUrl, mqttObject->serverPort);
+	}
+	else
+	{
+		mqttObject->autoReconnect = 1;
 	}
 
 	return rc;
@@ -308,27 +1306,27 @@ void mqtt_DefaultIncomingMessageHandler(MessageData* md)
 
 	int payloadLen = (int)message->payloadlen;
 
-	char* topic = malloc(topicName->lenstring.len + 1);
-	memcpy(topic, topicName->lenstring.data, topicName->lenstring.len);
-	topic[topicName->lenstring.len] = 0;
-
-	printf("\nIncoming data from topic '%s' (%d) :\n", topic, payloadLen);
-	printf("%.*s\n", payloadLen, (char*)message->payload);
+	MQTT_DEBUG("Incoming data from topic '%.*s' (%d)", topicName->lenstring.len, topicName->lenstring.data, payloadLen);
+	MQTT_TRACE("%.*s", payloadLen, (char*)message->payload);
 }
 
 //-------------------------------------------------------------------------------------------------------
 int mqtt_SubscribeTopic(mqtt_interface_st * mqttObject, const char* topicName, messageHandler msgHandler)
 {
-	printf("Subscribing to topic %s... ", topicName);
 	if (msgHandler == NULL)
 	{
 		msgHandler = mqtt_DefaultIncomingMessageHandler;
 	}
 
 	int rc = MQTTSubscribe(&mqttObject->mqttClient, topicName, mqttObject->qoS, msgHandler);
-	printf("%s\n", rc == 0 ? "OK" : "Failed");
-	//printf("Subscribed %d\n", rc);
-	fflush(stdout);
+	if (rc == SUCCESS)
+	{
+		MQTT_INFO("Subscribed to topic %s", topicName);
+	}
+	else
+	{
+		MQTT_WARN("Subscribing to topic %s failed", topicName);
+	}
 
 	return rc;
 }
@@ -337,20 +1335,36 @@ int mqtt_SubscribeTopic(mqtt_interface_st * mqttObject, const char* topicName, m
 //-------------------------------------------------------------------------------------------------------
 int mqtt_UnscribeTopic(mqtt_interface_st * mqttObject, const char* topicName)
 {
-	printf("Unsubscribing to %s\n", topicName);
 	int rc = MQTTUnsubscribe(&mqttObject->mqttClient, topicName);
-	printf("Unsubscribed %d\n", rc);
-	fflush(stdout);
+	MQTT_INFO("Unsubscribed from %s : %d", topicName, rc);
 
 	return rc;
 }
 
+//-------------------------------------------------------------------------------------------------------
+void mqtt_SetStreamHandler(mqtt_interface_st * mqttObject, streamMessageHandler streamHandler)
+{
+	/*
+		Messages larger than MqttMaxPacketSize are not dropped :
+		streamHandler gets their topic and payload, chunk by chunk, with the offset and total length
+	*/
+	mqttObject->streamHandler = streamHandler;
+	if (mqttObject->mqttClient.ipstack != NULL)
+	{
+		setStreamMessageHandler(&mqttObject->mqttClient, streamHandler);
+	}
+}
+
 //-------------------------------------------------------------------------------------------------------
 int mqtt_StopSession(mqtt_interface_st * mqttObject)
 {
+	mqttObject->autoReconnect = 0;
+	mqttObject->threadQueueSize = 0;
+	MQTTThreadStop(&mqttObject->networkThread);
+
 	int rc = MQTTDisconnect(&mqttObject->mqttClient);
 
-	mqttObject->network.disconnect(&mqttObject->network);
+	closeNetwork(mqttObject);
 
 	return rc;
 }
@@ -38,6 +38,8 @@
 #define _MQTT_INTERFACE_H_
 
 #include "MQTTClient.h"
+#include "MQTTThread.h"
+#include "MQTTStore.h"
 
 #define MQTT_BROKER		"MqttBrokerUrl"
 #define	MQTT_PORT		"MqttBrokerPort"
@@ -45,24 +47,80 @@
 #define MQTT_SECRET		"MqttSecret"
 #define MQTT_KEEPALIVE	"MqttKeepAlive"
 #define MQTT_QOS		"MqttQoS"
-
-#define 	MAX_PAYLOAD_SIZE			2048	//Default payload buffer size
+#define MQTT_PROTOCOL	"MqttProtocolVersion"	//3 (3.1), 4 (3.1.1) or 5 (5.0 : topic aliases, broker limits)
+#define MQTT_INFLIGHT	"MqttInflightWindow"	//max QoS1/2 asynchronous publishes awaiting ack
+#define MQTT_COALESCE	"MqttCoalesceBytes"		//small packets are written out together once that many bytes wait, 0 : off
+#define MQTT_COALESCE_DELAY	"MqttCoalesceDelayMs"	//... or once the oldest has waited that long
+#define MQTT_CLEAN_SESSION	"MqttCleanSession"		//1 : the broker forgets our subscriptions and pending messages on each connection
+#define MQTT_CONNECT_RETRIES	"MqttConnectRetries"	//connection attempts made by mqtt_StartSession
+#define MQTT_RECONNECT_MIN	"MqttReconnectMinMs"	//backoff between connection attempts, see mqtt_ProcessEvent
+#define MQTT_RECONNECT_MAX	"MqttReconnectMaxMs"
+#define MQTT_OFFLINE_TTL	"MqttOfflineTtl"		//seconds a publish waits in the offline queue before being dropped, 0 : no limit
+#define MQTT_REPLAY_RATE	"MqttReplayRate"		//publishes per second replayed from the offline queue once connected
+#define MQTT_MAX_PACKET		"MqttMaxPacketSize"		//packet buffers grow up to that, larger incoming messages are streamed
+#define MQTT_BUFFER_IDLE	"MqttBufferIdleMs"		//packet buffers shrink back after that long without a large packet
+#define MQTT_STATS_INTERVAL	"MqttStatsIntervalMs"	//mqtt_ProcessEvent appends mqtt_FormatStats to MqttStatsFile that often, 0 : never
+#define MQTT_STATS_FILE		"MqttStatsFile"			//one JSON object per line; stderr when empty
+#define MQTT_COMPRESS_TOPICS	"MqttCompressTopics"	//comma separated topic filters whose payloads are compressed, see MQTTCompress.h
 
 typedef struct {
-	char			deviceId[32];
-	char			serverUrl[256];
+	char*			deviceId;
+	char*			serverUrl;
 	int				serverPort;
 	int				useTLS;
-	char			secret[32];
+	char*			secret;
 	int				keepAlive;
 	int				qoS;
+	int				protocolVersion;
+	int				inflightWindow;
+	int				coalesceBytes;
+	int				coalesceDelayMs;
+	int				cleanSession;
+	int				connectRetries;
+	int				reconnectMinMs;
+	int				reconnectMaxMs;
+	unsigned int	reconnectDelayMs;	//last backoff delay
+	unsigned int	jitterSeed;
+	unsigned long long	reconnectTime;	//next connection attempt, 0 when connected
+	int				autoReconnect;	//a session was started, and not stopped : mqtt_ProcessEvent restores it when lost
+	unsigned int	threadQueueSize;	//threaded mode, resumed after a reconnection; 0 when not threaded
+	int				offlineTtl;
+	int				replayRate;
+	unsigned long long	replayTime;	//replay credit accrues from there, see mqtt_ProcessEvent
+	int				maxPacketSize;
+	int				bufferIdleMs;
+	streamMessageHandler	streamHandler;	//incoming messages larger than maxPacketSize, handed over in chunks
+	int				statsIntervalMs;
+	char*			statsFile;
+	unsigned long long	statsTime;	//next periodic dump
+	char*			compressTopics;
+	unsigned long long	compressedBytesIn;	//payloads compressed, before and after
+	unsigned long long	compressedBytesOut;
+	unsigned long	connects;	//statistics, see mqtt_GetStats
+	unsigned long	connectFailures;
+	unsigned long	connectionsLost;
+	unsigned long	tlsRecordsSent;	//... of the connections closed so far
+	unsigned long	tlsRecordsReceived;
 
 	Network 		network;
 	Client 			mqttClient;
-	unsigned char	mqttBuffer[MAX_PAYLOAD_SIZE];
-	unsigned char	mqttReadBuffer[MAX_PAYLOAD_SIZE];
+	MQTTThread		networkThread;	//threaded mode, see mqtt_StartThread
+	MQTTStore		offlineQueue;	//store-and-forward, see mqtt_OpenOfflineQueue
 } mqtt_interface_st;
 
+typedef struct {
+	MQTTStats		client;		//packets and bytes per type, acknowledgement round trips, time spent in MQTTYield
+	unsigned long	tlsRecordsSent;
+	unsigned long	tlsRecordsReceived;
+	unsigned long	connects;	//MQTT sessions established, the first one included
+	unsigned long	connectFailures;
+	unsigned long	connectionsLost;
+	unsigned long	offlineQueued;	//publishes waiting in the offline queue
+	unsigned long	offlineDropped;	//... overwritten or expired before they could be replayed
+	unsigned long long	compressedBytesIn;	//payloads sent compressed, MqttCompressTopics : their original size
+	unsigned long long	compressedBytesOut;	//... and their compressed size
+} mqtt_stats_st;
+
 mqtt_interface_st * mqtt_CreateInstance(
 								const char* brokerUrl,
 								int brokerPort,
@@ -80,11 +138,28 @@ int mqtt_StopSession(mqtt_interface_st * mqttObject);
 
 int mqtt_SubscribeTopic(mqtt_interface_st * mqttObject, const char* topicName, messageHandler msgHandler);
 int mqtt_UnscribeTopic(mqtt_interface_st * mqttObject, const char* topicName);
+void mqtt_SetStreamHandler(mqtt_interface_st * mqttObject, streamMessageHandler streamHandler);
 
 int mqtt_ProcessEvent(mqtt_interface_st * mqttObject, unsigned waitDelayMs);
+int mqtt_GetFd(mqtt_interface_st * mqttObject);
+int mqtt_GetTimeout(mqtt_interface_st * mqttObject);
+
+int mqtt_StartThread(mqtt_interface_st * mqttObject, unsigned int queueSize);
+int mqtt_StopThread(mqtt_interface_st * mqttObject);
+
+int mqtt_OpenOfflineQueue(mqtt_interface_st * mqttObject, const char* path, size_t sizeBytes);
+unsigned long mqtt_OfflineQueueCount(mqtt_interface_st * mqttObject);
+
+size_t mqtt_GetMemoryUsage(mqtt_interface_st * mqttObject);
+void mqtt_GetBufferPoolUsage(size_t* inUse, size_t* cached);
+
+void mqtt_GetStats(mqtt_interface_st * mqttObject, mqtt_stats_st * stats);
+int mqtt_FormatStats(mqtt_interface_st * mqttObject, char * buffer, size_t bufferLen);
 
 int  mqtt_PublishKeyValue(mqtt_interface_st * mqttObject, const char* szKey, const char* szValue, const char* topicName);
 int  mqtt_PublishData(mqtt_interface_st * mqttObject, const char* data, size_t dataLen, const char* topicName);
+int  mqtt_PublishDataAsync(mqtt_interface_st * mqttObject, const char* data, size_t dataLen, const char* topicName,
+						   publishCompletionHandler onComplete, void* context);
 
 
 #endif	//_MQTT_INTERFACE_H_
@@ -103,9 +103,8 @@ int main(int argc, char** argv)
 		fprintf(stdout, ".");
 		fflush(stdout);
 		//Must call this on a regular basis in order to process inbound mqtt messages & keep alive
+		//waits up to 1s, incoming messages are handled as soon as they arrive
 		mqtt_ProcessEvent(g_mqttObject, 1000);
-
-		sleep(1);
 		
 		i++;
 
@@ -0,0 +1,122 @@
+/*******************************************************************************************************************
+
+ Payload compression benchmark
+
+	Ratio and speed of MQTTCompress and MQTTDecompress on AirVantage payloads, from a single key-value to batches
+	past 64 KB, with the AirVantage dictionary and without : what MqttCompressTopics costs per publish, and what
+	it saves on the wire.  Speeds are in MB of uncompressed payload per second, the time per call next to them
+
+	usage : compressBench [MB per measure]		(64)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MQTTCompress.h"
+#include "MQTTLinux.h"
+
+
+typedef struct {
+	const char*		name;
+	size_t			size;				//0 : the text itself
+	const char*		text;
+} BenchPayload;
+
+static const BenchPayload g_payloads[] = {
+	{"key-value",		0,		"{\"temperature\":\"21.5\"}"},
+	{"ack",				0,		"[{\"uid\": \"4f5a0c2d8e\", \"status\" : \"OK\"}]"},
+	{"data points",		0,		"{\"temperature\":\"21.5\",\"humidity\":\"40\",\"luminosity\":\"412\",\"light\":\"1.00\",\"counter\":\"17\"}"},
+	{"batch 256 B",		256,	NULL},
+	{"batch 1 KB",		1024,	NULL},
+	{"batch 16 KB",		16384,	NULL},
+	{"batch 256 KB",	262144,	NULL},
+};
+
+static volatile int	g_sink;
+
+
+//-------------------------------------------------------------------------------------------------------
+static size_t telemetry(char* buffer, size_t size)
+{
+	//timestamped samples, as mqtt_avBatchAdd gathers them
+	unsigned int	seed = 1;
+	long long		timestamp = 1700000000000LL;
+	size_t			len = 1;
+
+	buffer[0] = '{';
+	while (len + 100 < size)
+	{
+		timestamp += 1000 + rand_r(&seed) % 1000;
+		len += sprintf(buffer + len, "%s\"%lld\":{\"temperature\":\"%d.%d\",\"humidity\":\"%d\",\"counter\":\"%u\"}",
+					   len > 1 ? "," : "", timestamp, 15 + rand_r(&seed) % 15, rand_r(&seed) % 10, 30 + rand_r(&seed) % 60,
+					   rand_r(&seed) % 100000);
+	}
+	buffer[len++] = '}';
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void bench(const BenchPayload* payload, const char* data, size_t len, int dictionary, size_t bytesPerMeasure)
+{
+	size_t				bound = MQTTCompressBound(len);
+	unsigned char*		compressed = malloc(bound);
+	char*				restored = malloc(len);
+	int					clen = MQTTCompress(data, len, compressed, bound, dictionary);
+	long				iterations = bytesPerMeasure / len + 1;
+	unsigned long long	start, compressUs, decompressUs;
+
+	if (clen < 0 || MQTTDecompress(compressed, clen, restored, len) != (int) len || memcmp(restored, data, len) != 0)
+	{
+		printf("%-14s %s : round trip failed\n", payload->name, dictionary ? "dictionary" : "none      ");
+		exit(1);
+	}
+
+	start = monotonic_us();
+	for (long i = 0; i < iterations; i++)
+	{
+		g_sink = MQTTCompress(data, len, compressed, bound, dictionary);
+	}
+	compressUs = monotonic_us() - start + 1;
+
+	start = monotonic_us();
+	for (long i = 0; i < iterations; i++)
+	{
+		g_sink = MQTTDecompress(compressed, clen, restored, len);
+	}
+	decompressUs = monotonic_us() - start + 1;
+
+	printf("%-14s %s %8zu -> %8d  %5.1f %%   compress %7.1f MB/s %9.2f us   decompress %7.1f MB/s %9.2f us\n",
+		   payload->name, dictionary ? "dictionary" : "none      ", len, clen, clen * 100.0 / len,
+		   (double) len * iterations / compressUs, (double) compressUs / iterations,
+		   (double) len * iterations / decompressUs, (double) decompressUs / iterations);
+
+	free(compressed);
+	free(restored);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	size_t	bytesPerMeasure = ((argc > 1) ? atoi(argv[1]) : 64) * 1024 * 1024;
+	char*	buffer = malloc(262144);
+
+	printf("%-14s %-10s %8s    %8s  %7s\n", "payload", "dictionary", "bytes", "sent", "ratio");
+	for (size_t i = 0; i < sizeof(g_payloads) / sizeof(g_payloads[0]); i++)
+	{
+		const BenchPayload*	payload = &g_payloads[i];
+		const char*			data = payload->text;
+		size_t				len = payload->size ? telemetry(buffer, payload->size) : strlen(payload->text);
+
+		if (payload->size)
+		{
+			data = buffer;
+		}
+		bench(payload, data, len, MQTT_DICTIONARY_NONE, bytesPerMeasure);
+		bench(payload, data, len, MQTT_DICTIONARY_AIRVANTAGE, bytesPerMeasure);
+	}
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,300 @@
+/*******************************************************************************************************************
+
+ Payload compression round trips
+
+	MQTTCompress then MQTTDecompress must give back the payload byte for byte, with either dictionary : empty and
+	short payloads, AirVantage JSON, payloads past 64 KB (further back than a match offset reaches), incompressible
+	ones, and payloads starting with the marker, which mqttInterface compresses whatever their size.
+	Matches reaching into the dictionary and running on into the output are decoded as the format says, and
+	truncated or corrupted payloads are refused rather than decoded past their buffers
+
+	usage : compressTest
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MQTTCompress.h"
+#include "testCheck.h"
+
+
+#define		LARGE_SIZE				(300 * 1024)
+#define		MUTATIONS				20000
+
+static int		g_roundTrips = 0;
+
+//random payloads of those sizes are literals only, runs of one byte a literal then a match of the rest
+static const size_t	g_countSizes[] = {14, 15, 16, 18, 19, 20, 23, 24, 100, 268, 269, 270, 271, 272, 273, 277, 278, 279, 600};
+
+
+//-------------------------------------------------------------------------------------------------------
+static void roundTrip(const char* name, const unsigned char* data, size_t len)
+{
+	//with each dictionary, into the bound MQTTCompress cannot fail with, then into a buffer of the exact length
+	size_t			bound = MQTTCompressBound(len);
+	unsigned char*	compressed = malloc(bound);
+	unsigned char*	restored = malloc(len + 1);
+
+	for (int dictionary = MQTT_DICTIONARY_NONE; dictionary <= MQTT_DICTIONARY_AIRVANTAGE; dictionary++)
+	{
+		int clen = MQTTCompress(data, len, compressed, bound, dictionary);
+		int dlen;
+
+		CHECK(clen > 0, "%s (%zu bytes, dictionary %d) : compression failed", name, len, dictionary);
+		if (clen <= 0)
+		{
+			continue;
+		}
+		CHECK(MQTTIsCompressed(compressed, clen), "%s (dictionary %d) : not recognised as compressed", name, dictionary);
+		CHECK(MQTTDecompressedLength(compressed, clen) == (int) len, "%s (dictionary %d) : announces %d bytes, not %zu",
+			  name, dictionary, MQTTDecompressedLength(compressed, clen), len);
+
+		memset(restored, 0xAA, len + 1);
+		dlen = MQTTDecompress(compressed, clen, restored, len);
+		CHECK(dlen == (int) len && memcmp(restored, data, len) == 0, "%s (%zu bytes, dictionary %d) : restored %d bytes, not the same",
+			  name, len, dictionary, dlen);
+		CHECK(restored[len] == 0xAA, "%s (dictionary %d) : wrote past the decompressed length", name, dictionary);
+		if (len > 0)
+		{
+			CHECK(MQTTDecompress(compressed, clen, restored, len - 1) == -1, "%s (dictionary %d) : decompressed into too small a buffer",
+				  name, dictionary);
+		}
+		g_roundTrips++;
+	}
+	free(compressed);
+	free(restored);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void roundTripString(const char* name, const char* text)
+{
+	roundTrip(name, (const unsigned char*) text, strlen(text));
+}
+
+//-------------------------------------------------------------------------------------------------------
+static size_t telemetry(unsigned char* buffer, size_t size, unsigned int seed)
+{
+	//timestamped AirVantage batches, one after the other, as mqtt_avBatchAdd publishes them
+	size_t			len = 0;
+	long long		timestamp = 1700000000000LL;
+
+	while (len + 128 < size)
+	{
+		timestamp += 1000 + rand_r(&seed) % 1000;
+		len += sprintf((char*) buffer + len, "{\"%lld\":{\"temperature\":\"%d.%02d\",\"humidity\":\"%d\",\"counter\":\"%u\"}}",
+					   timestamp, 15 + rand_r(&seed) % 15, rand_r(&seed) % 100, 30 + rand_r(&seed) % 60, rand_r(&seed));
+	}
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void randomBytes(unsigned char* buffer, size_t len, unsigned int seed)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		buffer[i] = rand_r(&seed) >> 7;
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int decodeDictionaryMatch(unsigned char* out, size_t outsize, size_t literals, size_t offset, size_t matchLength)
+{
+	/*
+		Decodes a hand-made payload : "literals" bytes of 'x', then a match going "offset" bytes back, past the
+		start of the output into the AirVantage dictionary, for matchLength bytes
+	*/
+	unsigned char	payload[64];
+	unsigned char*	p = payload;
+	size_t			total = literals + matchLength;
+
+	*p++ = MQTT_COMPRESS_MARKER;
+	*p++ = MQTT_DICTIONARY_AIRVANTAGE;
+	*p++ = (unsigned char) total;			//kept under 128 : one byte
+	*p++ = (unsigned char) ((literals << 4) | (matchLength - 4));
+	memset(p, 'x', literals);
+	p += literals;
+	*p++ = offset & 0xFF;
+	*p++ = offset >> 8;
+
+	return MQTTDecompress(payload, p - payload, out, outsize);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void dictionaryMatches(void)
+{
+	/*
+		A match reaching back past the start of the output is taken from the end of the dictionary, and runs on into
+		the output from its start when longer than what is left of the dictionary
+	*/
+	unsigned char	tail[8], straddling[16], expected[16];
+	unsigned char	payload[64];
+	int				len;
+
+	//the last 8 bytes of the dictionary, on their own
+	CHECK(decodeDictionaryMatch(tail, sizeof(tail), 0, 8, 8) == 8, "a match within the dictionary is refused");
+
+	//5 bytes from the dictionary, then 9 from the output : the first 5 again, then the start of the second copy
+	len = decodeDictionaryMatch(straddling, sizeof(straddling), 0, 5, 14);
+	memcpy(expected, tail + 3, 5);
+	for (int i = 5; i < 14; i++)
+	{
+		expected[i] = expected[i - 5];
+	}
+	CHECK(len == 14 && memcmp(straddling, expected, 14) == 0, "a match straddling the dictionary and the output is decoded wrong");
+
+	//after literals : the match starts that many bytes further back in the dictionary, then reaches the literals
+	len = decodeDictionaryMatch(straddling, sizeof(straddling), 2, 2 + 3, 10);
+	memcpy(expected, "xx", 2);
+	memcpy(expected + 2, tail + 5, 3);
+	for (int i = 5; i < 12; i++)
+	{
+		expected[i] = expected[i - 5];
+	}
+	CHECK(len == 12 && memcmp(straddling, expected, 12) == 0, "a match straddling the dictionary after literals is decoded wrong");
+
+	//further back than the dictionary goes
+	CHECK(decodeDictionaryMatch(straddling, sizeof(straddling), 0, 0xFFFF, 8) == -1, "a match before the dictionary is accepted");
+	CHECK(decodeDictionaryMatch(straddling, sizeof(straddling), 2, 0, 8) == -1, "a match at offset 0 is accepted");
+
+	//the encoder sees the dictionary's end in a payload, then the same again : whatever it makes of them decodes back
+	memcpy(payload, tail, 8);
+	memcpy(payload + 8, tail, 8);
+	memcpy(payload + 16, tail + 4, 4);
+	roundTrip("dictionary tail repeated", payload, 20);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void damaged(const unsigned char* data, size_t len)
+{
+	/*
+		Every truncation of a compressed payload is refused, and random corruptions either are, or decode to the
+		announced length without writing past it
+	*/
+	size_t			bound = MQTTCompressBound(len);
+	unsigned char*	compressed = malloc(bound);
+	unsigned char*	mutated = malloc(bound);
+	unsigned char*	restored = malloc(len + 64);
+	unsigned int	seed = 7;
+	int				clen = MQTTCompress(data, len, compressed, bound, MQTT_DICTIONARY_AIRVANTAGE);
+	int				truncatedOk = 0, overruns = 0;
+
+	for (int cut = 0; cut < clen; cut++)
+	{
+		if (MQTTDecompress(compressed, cut, restored, len) != -1)
+		{
+			truncatedOk++;
+		}
+	}
+	CHECK(truncatedOk == 0, "%d truncations of a %d byte payload decoded", truncatedOk, clen);
+
+	for (int i = 0; i < MUTATIONS; i++)
+	{
+		int	announced, dlen;
+
+		memcpy(mutated, compressed, clen);
+		for (int n = 1 + rand_r(&seed) % 3; n > 0; n--)
+		{
+			mutated[2 + rand_r(&seed) % (clen - 2)] ^= 1 << (rand_r(&seed) % 8);
+		}
+		announced = MQTTDecompressedLength(mutated, clen);
+		if (announced < 0 || announced > (int) len)
+		{
+			continue;
+		}
+		memset(restored + announced, 0xAA, 64);
+		dlen = MQTTDecompress(mutated, clen, restored, announced);
+		for (int k = 0; k < 64; k++)
+		{
+			if (restored[announced + k] != 0xAA)
+			{
+				overruns++;
+				break;
+			}
+		}
+		CHECK(dlen == -1 || dlen == announced, "a corrupted payload decoded to %d bytes, announcing %d", dlen, announced);
+	}
+	CHECK(overruns == 0, "%d corrupted payloads were decoded past their announced length", overruns);
+
+	free(compressed);
+	free(mutated);
+	free(restored);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	unsigned char*	large = malloc(LARGE_SIZE);
+	unsigned char	colliding[256];
+	size_t			len;
+
+	//empty and short
+	roundTrip("empty", (const unsigned char*) "", 0);
+	roundTripString("1 byte", "a");
+	roundTripString("3 bytes", "abc");
+	roundTripString("4 bytes", "abcd");
+	roundTripString("repeated", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+	roundTripString("key value", "{\"temperature\":\"21.5\"}");
+	roundTripString("batch", "{\"1700000000000\":{\"temperature\":\"21.5\",\"humidity\":\"40\"},\"1700000001000\":{\"temperature\":\"21.6\"}}");
+	roundTripString("ack", "[{\"uid\": \"4f5a\", \"status\" : \"OK\"}]");
+	roundTripString("dictionary words only", "\"luminosity\":\"\"humidity\":\"\"temperature\":\"");
+
+	//the extensions of literal and match counts, at and around their 15 and 255 steps
+	for (int i = 0; i < (int) (sizeof(g_countSizes) / sizeof(g_countSizes[0])); i++)
+	{
+		char name[32];
+
+		len = g_countSizes[i];
+		randomBytes(large, len, len);
+		snprintf(name, sizeof(name), "%zu random bytes", len);
+		roundTrip(name, large, len);
+		memset(large, 'z', len);
+		snprintf(name, sizeof(name), "%zu equal bytes", len);
+		roundTrip(name, large, len);
+	}
+
+	//past 64 KB
+	len = telemetry(large, LARGE_SIZE, 1);
+	roundTrip("300 KB of telemetry", large, len);
+	randomBytes(large, LARGE_SIZE, 2);
+	roundTrip("300 KB of random bytes", large, LARGE_SIZE);
+	for (size_t distance = 65534; distance <= 65537; distance++)
+	{
+		char name[48];
+
+		//a block seen again right at, or just beyond, what an offset reaches
+		randomBytes(large, distance + 1024, 3);
+		memcpy(large + distance, large, 1024);
+		snprintf(name, sizeof(name), "block repeated %zu bytes later", distance);
+		roundTrip(name, large, distance + 1024);
+	}
+
+	//starting with the marker : they pass for compressed ones, mqttInterface compresses them whatever it costs
+	for (int id = 0; id < 4; id++)
+	{
+		char name[32];
+
+		randomBytes(colliding, sizeof(colliding), id);
+		colliding[0] = MQTT_COMPRESS_MARKER;
+		colliding[1] = id;
+		snprintf(name, sizeof(name), "marker then %d", id);
+		roundTrip(name, colliding, 3);
+		roundTrip(name, colliding, sizeof(colliding));
+		CHECK(MQTTIsCompressed(colliding, sizeof(colliding)) == (id <= MQTT_DICTIONARY_AIRVANTAGE),
+			  "a payload starting with the marker then %d is%s taken for a compressed one", id, (id <= MQTT_DICTIONARY_AIRVANTAGE) ? " not" : "");
+	}
+	memset(colliding, 0, sizeof(colliding));
+	roundTrip("zeroes", colliding, sizeof(colliding));
+
+	dictionaryMatches();
+
+	len = telemetry(large, 4096, 4);
+	damaged(large, len);
+
+	free(large);
+
+	printf("%d round trips, %d mutations\n", g_roundTrips, MUTATIONS);
+	return testResult(NULL);
+}
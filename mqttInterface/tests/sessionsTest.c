@@ -0,0 +1,138 @@
+/*******************************************************************************************************************
+
+ Memory per session, at 10k sessions
+
+	Connects that many mqttInterface instances to a stand-in broker (standInBroker.c) and checks what
+	mqtt_GetMemoryUsage reports for each once idle : the instance, its strings and packet buffers shrunk back to
+	MIN_BUFFER_SIZE, the network staging buffers given back.
+	The shared buffer pool must hold no more than those buffers, and nothing once the instances are deleted
+
+	usage : sessionsTest [sessions]		(10000)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "mqttInterface.h"
+#include "MQTTLog.h"
+#include "standInBroker.h"
+#include "testCheck.h"
+
+
+#define		IDLE_MS					"1"			//MqttBufferIdleMs : buffers shrink back that soon after the last packet
+
+
+//-------------------------------------------------------------------------------------------------------
+static size_t residentBytes(void)
+{
+	unsigned long size = 0, resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+
+	if (statm)
+	{
+		if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+		{
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	int						count = (argc > 1) ? atoi(argv[1]) : 10000;
+	mqtt_interface_st**		sessions = calloc(count, sizeof(mqtt_interface_st*));
+	struct rlimit			limit;
+	size_t					total = 0, largest = 0, inUse, cached, residentBefore, residentAfter;
+	int						port, connected = 0, oversized = 0, i;
+	pid_t					broker;
+
+	//a socket per session
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (sessions == NULL || getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < (rlim_t) count + 64)
+	{
+		fprintf(stderr, "FAIL : %d sessions need %d file descriptors\n", count, count + 64);
+		return 1;
+	}
+	if ((broker = standInBrokerStart(count, &port)) < 0)
+	{
+		fprintf(stderr, "FAIL : cannot start the stand-in broker\n");
+		return 1;
+	}
+
+	MQTTLogSetLevel(MQTT_LOG_WARN);
+	residentBefore = residentBytes();
+
+	for (i = 0; i < count; i++)
+	{
+		char deviceId[32];
+
+		snprintf(deviceId, sizeof(deviceId), "session-%d", i);
+		sessions[i] = mqtt_CreateInstance("127.0.0.1", port, 0, deviceId, deviceId, 60, QOS1);
+		mqtt_SetConfig(sessions[i], MQTT_CONNECT_RETRIES, "1");
+		mqtt_SetConfig(sessions[i], MQTT_BUFFER_IDLE, IDLE_MS);
+		if (mqtt_StartSession(sessions[i]) == SUCCESS)
+		{
+			connected++;
+		}
+	}
+	CHECK(connected == count, "%d of %d sessions connected", connected, count);
+
+	//idle : what each session keeps between packets
+	usleep(atoi(IDLE_MS) * 1000 + 1000);
+	for (i = 0; i < count; i++)
+	{
+		mqtt_ProcessEvent(sessions[i], 0);
+	}
+
+	residentAfter = residentBytes();
+	for (i = 0; i < count; i++)
+	{
+		mqtt_interface_st*	s = sessions[i];
+		size_t				usage = mqtt_GetMemoryUsage(s);
+		size_t				bound = sizeof(mqtt_interface_st) + strlen(s->deviceId) + strlen(s->serverUrl) + strlen(s->secret) + 3
+									+ 2 * MIN_BUFFER_SIZE;
+
+		if (usage > bound)
+		{
+			oversized++;
+		}
+		total += usage;
+		if (usage > largest)
+		{
+			largest = usage;
+		}
+	}
+	CHECK(oversized == 0, "%d sessions hold more than the instance, its strings and two %d-byte buffers", oversized, MIN_BUFFER_SIZE);
+	mqtt_GetBufferPoolUsage(&inUse, &cached);
+	CHECK(inUse <= (size_t) count * 2 * MIN_BUFFER_SIZE, "buffer pool has %zu bytes in use for %d sessions", inUse, count);
+
+	printf("%d sessions : %zu bytes per session on average, %zu at most (%zu of them the instance itself)\n",
+		   count, total / count, largest, sizeof(mqtt_interface_st));
+	printf("buffer pool : %zu KB in use, %zu KB cached ; %.1f KB resident per session, TLS-less\n",
+		   inUse / 1024, cached / 1024, residentAfter > residentBefore ? (residentAfter - residentBefore) / 1024.0 / count : 0.0);
+
+	for (i = 0; i < count; i++)
+	{
+		mqtt_StopSession(sessions[i]);
+		sessions[i] = mqtt_DeleteInstance(sessions[i]);
+	}
+	mqtt_GetBufferPoolUsage(&inUse, &cached);
+	CHECK(inUse == 0, "%zu bytes still in use once every session is deleted", inUse);
+
+	standInBrokerStop(broker);
+	free(sessions);
+
+	return testResult(NULL);
+}
@@ -0,0 +1,215 @@
+/*******************************************************************************************************************
+
+ Stand-in broker, for tests and benchmarks
+
+	A child process answering CONNECT, PINGREQ, SUBSCRIBE and QoS 1 PUBLISH on a loopback port, nothing more :
+	publishes are taken and dropped, never delivered.  It dies with the process that started it
+
+*******************************************************************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "MQTTClient.h"
+#include "standInBroker.h"
+
+
+#define		BROKER_BUFFER			512			//the packets of the tests are all smaller
+
+typedef struct {
+	unsigned char	data[BROKER_BUFFER];
+	int				len;
+	int				skip;			//rest of a publish too large for data, dropped as it arrives
+} BrokerConnection;
+
+
+//-------------------------------------------------------------------------------------------------------
+static int answer(int fd, BrokerConnection* conn)
+{
+	//complete packets at the start of conn->data : 0 when more is needed, -1 to close the connection
+	while (conn->len >= 2)
+	{
+		int				remaining = 0, multiplier = 1, header = 1, type = conn->data[0] >> 4;
+		unsigned char	reply[5];
+		int				replyLen = 0;
+
+		do
+		{
+			if (header >= conn->len)
+			{
+				return 0;
+			}
+			remaining += (conn->data[header] & 127) * multiplier;
+			multiplier *= 128;
+		}
+		while ((conn->data[header++] & 128) != 0 && header < 5);
+
+		if (header + remaining > BROKER_BUFFER && type != PUBLISH)
+		{
+			return -1;
+		}
+		if (header + remaining > conn->len && (header + remaining <= BROKER_BUFFER || conn->len < header + 2))
+		{
+			return 0;
+		}
+
+		switch (type)
+		{
+			case CONNECT:
+				memcpy(reply, "\x20\x02\x00\x00", 4);
+				replyLen = 4;
+				break;
+			case PINGREQ:
+				memcpy(reply, "\xD0\x00", 2);
+				replyLen = 2;
+				break;
+			case SUBSCRIBE:
+				//packet id, then one granted QoS 0 whatever the number of filters : enough for these sessions
+				reply[0] = 0x90;
+				reply[1] = 3;
+				memcpy(&reply[2], &conn->data[header], 2);
+				replyLen = 5;
+				reply[4] = 0;
+				break;
+			case PUBLISH:
+				if (((conn->data[0] >> 1) & 3) == QOS1)
+				{
+					int topicLen = (conn->data[header] << 8) | conn->data[header + 1];
+
+					if (header + 2 + topicLen + 2 > conn->len)
+					{
+						return (conn->len == BROKER_BUFFER) ? -1 : 0;
+					}
+					reply[0] = 0x40;
+					reply[1] = 2;
+					memcpy(&reply[2], &conn->data[header + 2 + topicLen], 2);
+					replyLen = 4;
+				}
+				break;
+			case DISCONNECT:
+				return -1;
+		}
+		if (replyLen > 0 && write(fd, reply, replyLen) != replyLen)
+		{
+			return -1;
+		}
+
+		if (header + remaining > conn->len)
+		{
+			conn->skip = header + remaining - conn->len;
+			conn->len = 0;
+			return 0;
+		}
+		conn->len -= header + remaining;
+		memmove(conn->data, conn->data + header + remaining, conn->len);
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void runBroker(int listenFd, int maxConnections)
+{
+	//child process : its own descriptor table, the sessions get all of the parent's
+	BrokerConnection**	conns = calloc(maxConnections + 64, sizeof(BrokerConnection*));
+	struct epoll_event	ev, events[64];
+	int					epfd = epoll_create1(0);
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = listenFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev);
+
+	for (;;)
+	{
+		int n = epoll_wait(epfd, events, 64, -1);
+		int i;
+
+		for (i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if (fd == listenFd)
+			{
+				int client = accept(listenFd, NULL, NULL);
+
+				if (client >= 0 && client < maxConnections + 64)
+				{
+					conns[client] = calloc(1, sizeof(BrokerConnection));
+					ev.data.fd = client;
+					epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev);
+				}
+				else if (client >= 0)
+				{
+					close(client);
+				}
+				continue;
+			}
+
+			BrokerConnection* conn = conns[fd];
+			int rc = read(fd, conn->data + conn->len, BROKER_BUFFER - conn->len);
+
+			if (rc > 0 && rc <= conn->skip)
+			{
+				conn->skip -= rc;
+				continue;
+			}
+			if (rc > 0)
+			{
+				memmove(conn->data + conn->len, conn->data + conn->len + conn->skip, rc - conn->skip);
+				conn->len += rc - conn->skip;
+				conn->skip = 0;
+			}
+			if (rc <= 0 || answer(fd, conn) != 0)
+			{
+				epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+				free(conn);
+				conns[fd] = NULL;
+			}
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+pid_t standInBrokerStart(int maxConnections, int* port)
+{
+	struct sockaddr_in	address;
+	socklen_t			len = sizeof(address);
+	int					listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	pid_t				pid;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listenFd, 1024) != 0
+			|| getsockname(listenFd, (struct sockaddr*) &address, &len) != 0)
+	{
+		return -1;
+	}
+	*port = ntohs(address.sin_port);
+
+	if ((pid = fork()) == 0)
+	{
+		runBroker(listenFd, maxConnections);
+		_exit(0);
+	}
+	close(listenFd);
+	return pid;
+}
+
+//-------------------------------------------------------------------------------------------------------
+void standInBrokerStop(pid_t broker)
+{
+	kill(broker, SIGKILL);
+	waitpid(broker, NULL, 0);
+}
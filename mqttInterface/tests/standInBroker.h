@@ -0,0 +1,16 @@
+/*******************************************************************************************************************
+
+ Stand-in broker, for tests and benchmarks : see standInBroker.c
+
+*******************************************************************************************************************/
+
+#ifndef _STAND_IN_BROKER_H_
+#define _STAND_IN_BROKER_H_
+
+#include <sys/types.h>
+
+//listening on 127.0.0.1, its port in *port : the broker's pid, -1 when it could not be started
+pid_t standInBrokerStart(int maxConnections, int* port);
+void standInBrokerStop(pid_t broker);
+
+#endif	//_STAND_IN_BROKER_H_
@@ -0,0 +1,33 @@
+/*******************************************************************************************************************
+
+ Checks for tests : CHECK reports a failed condition on stderr and counts it, testResult ends main with the
+ verdict, PASSED or FAILED, on stdout
+
+*******************************************************************************************************************/
+
+#ifndef _TEST_CHECK_H_
+#define _TEST_CHECK_H_
+
+#include <stdio.h>
+
+
+#define		CHECK(cond, ...)		do { if (!(cond)) { fprintf(stderr, "FAIL %s:%d : ", __FILE__, __LINE__); \
+										fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); g_failures++; } } while (0)
+
+static int		g_failures = 0;
+
+
+//-------------------------------------------------------------------------------------------------------
+static inline int testResult(const char* szDetail)
+{
+	//PASSED or FAILED (count), followed by szDetail if not NULL : main's exit status
+	if (g_failures != 0)
+	{
+		printf("FAILED (%d)%s%s\n", g_failures, szDetail ? ", " : "", szDetail ? szDetail : "");
+		return 1;
+	}
+	printf("PASSED%s%s\n", szDetail ? ", " : "", szDetail ? szDetail : "");
+	return 0;
+}
+
+#endif	//_TEST_CHECK_H_
@@ -0,0 +1,132 @@
+/*******************************************************************************************************************
+
+ Timer wheel benchmark
+
+	Cost per tick of TimerWheelAdvance, with a fleet's worth of keepalive-like timers armed : each one fires once
+	per period and is re-armed from its handler, as the event loop does after every MQTTProcess.
+	Every tick of a period is walked one by one, so the figures include the ticks where nothing fires as well as
+	the cascades of the upper levels.  Then the cost of arming, re-arming and cancelling on their own
+
+	usage : timerWheelBench [period_ms]		(60000 : a keepalive of one minute)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "MQTTTimerWheel.h"
+#include "MQTTLinux.h"
+
+
+typedef struct {
+	WheelTimer			timer;
+	unsigned int		period;
+} BenchTimer;
+
+static TimerWheel			g_wheel;
+static unsigned long long	g_fired;
+
+//-------------------------------------------------------------------------------------------------------
+static void onTimer(WheelTimer* timer, void* context)
+{
+	BenchTimer* t = (BenchTimer*) context;
+
+	g_fired++;
+	TimerWheelAdd(&g_wheel, timer, g_wheel.now + t->period);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void benchTicks(BenchTimer* timers, int count, unsigned int period)
+{
+	unsigned int		seed = 1;
+	unsigned long long	start, elapsed, tick;
+	int					i;
+
+	TimerWheelInit(&g_wheel, 0);
+	for (i = 0; i < count; i++)
+	{
+		WheelTimerInit(&timers[i].timer, onTimer, &timers[i]);
+		timers[i].period = period;
+		TimerWheelAdd(&g_wheel, &timers[i].timer, 1 + rand_r(&seed) % period);
+	}
+
+	g_fired = 0;
+	start = monotonic_us();
+	for (tick = 1; tick <= period; tick++)
+	{
+		TimerWheelAdvance(&g_wheel, tick);
+	}
+	elapsed = monotonic_us() - start;
+
+	printf("%9d timers  %9llu fired  %9.1f ns/tick  %6.1f ns/timer fired\n", count, g_fired,
+		   elapsed * 1000.0 / period, g_fired ? elapsed * 1000.0 / g_fired : 0.0);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void benchArming(BenchTimer* timers, int count, unsigned int period)
+{
+	unsigned int		seed = 1;
+	unsigned long long	start, armed, rearmed, cancelled;
+	int					i;
+
+	TimerWheelInit(&g_wheel, 0);
+	for (i = 0; i < count; i++)
+	{
+		WheelTimerInit(&timers[i].timer, onTimer, &timers[i]);
+	}
+
+	start = monotonic_us();
+	for (i = 0; i < count; i++)
+	{
+		TimerWheelAdd(&g_wheel, &timers[i].timer, 1 + rand_r(&seed) % period);
+	}
+	armed = monotonic_us() - start;
+
+	start = monotonic_us();
+	for (i = 0; i < count; i++)
+	{
+		TimerWheelAdd(&g_wheel, &timers[i].timer, 1 + rand_r(&seed) % period);
+	}
+	rearmed = monotonic_us() - start;
+
+	start = monotonic_us();
+	for (i = 0; i < count; i++)
+	{
+		TimerWheelCancel(&g_wheel, &timers[i].timer);
+	}
+	cancelled = monotonic_us() - start;
+
+	printf("%9d timers  arm %6.1f ns  re-arm %6.1f ns  cancel %6.1f ns\n", count,
+		   armed * 1000.0 / count, rearmed * 1000.0 / count, cancelled * 1000.0 / count);
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	static const int	counts[] = {1000, 10000, 100000, 1000000};
+	unsigned int		period = (argc > 1) ? atoi(argv[1]) : 60000;
+	BenchTimer*			timers = malloc(sizeof(BenchTimer) * counts[sizeof(counts) / sizeof(counts[0]) - 1]);
+	size_t				i;
+
+	if (timers == NULL || period == 0)
+	{
+		fprintf(stderr, "usage : timerWheelBench [period_ms]\n");
+		return 1;
+	}
+
+	printf("TimerWheelAdvance, one tick at a time over a %u ms period\n", period);
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		benchTicks(timers, counts[i], period);
+	}
+
+	printf("TimerWheelAdd and TimerWheelCancel\n");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		benchArming(timers, counts[i], period);
+	}
+
+	free(timers);
+	return 0;
+}
@@ -58,6 +58,27 @@ int OnIncomingMessage(
 	return 0; //return 0 to ACK positively, 1 to ACK negatively
 }
 
+//-------------------------------------------------------------------------------------------------------
+int OnMessageCommand(
+				const char* uid,
+				const char* id,
+				const av_param_st* params,
+				int count,
+				const char* timestamp,
+				void* context)
+{
+	//registered for the "Message" command : all its parameters at once
+	int i;
+
+	fprintf(stdout, "Received %s command %s (%d parameters):\n", id, uid ? uid : "", count);
+	for (i = 0; i < count; i++)
+	{
+		fprintf(stdout, "   %s: %s\n", params[i].key, params[i].value);
+	}
+
+	return 0; //return 0 to ACK positively, 1 to ACK negatively
+}
+
 //-------------------------------------------------------------------------------------------------------
 int OnSoftwareInstallRequest(
 				const char* uid,
@@ -102,6 +123,7 @@ int main(int argc, char** argv)
 
 	//Set handler for AirVantage incoming message/command/SW-install
 	mqtt_avSetIncomingMsgHandler(OnIncomingMessage);
+	mqtt_avRegisterCommandHandler("Message", OnMessageCommand, NULL);
 	mqtt_avSetSoftwareInstallRequestHandler(OnSoftwareInstallRequest);
 
 	int useTls = 0;
@@ -130,10 +152,9 @@ int main(int argc, char** argv)
 		fprintf(stdout, ".");
 		fflush(stdout);
 		//Must call this on a regular basis in order to process inbound mqtt messages & keep alive
+		//waits up to 1s, incoming commands are handled as soon as they arrive
 		mqtt_avProcessEvent();
 
-		sleep(1);
-
 		count++;
 		i++;
 
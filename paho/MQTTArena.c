@@ -0,0 +1,151 @@
+/*******************************************************************************
+ * MQTT buffer arena
+ *
+ *    Size-classed pool the connections draw their packet buffers from : a
+ *    buffer is as big as the largest packet it recently had to hold, rounded
+ *    up to a power of two, instead of a fixed worst case per connection.
+ *    Buffers given back are kept per class for the next connection that
+ *    grows, up to a bound; past it they go back to the system
+ *
+ *******************************************************************************/
+
+#include "MQTTArena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+static int sizeClass(size_t size)
+{
+    int c = 0;
+
+    while (((size_t)1 << (ARENA_MIN_SHIFT + c)) < size)
+        c++;
+    return c;
+}
+
+
+// the size actually handed out for a request of size bytes, 0 if that is more than the arena serves
+size_t MQTTArenaClassSize(size_t size)
+{
+    if (size > ARENA_MAX_SIZE)
+        return 0;
+    return (size_t)1 << (ARENA_MIN_SHIFT + sizeClass(size));
+}
+
+
+/* A buffer of at least *size bytes; *size is set to what it really holds, to be given back with it.
+   NULL if that cannot be had */
+unsigned char* MQTTArenaAlloc(MQTTArena* a, size_t* size)
+{
+    size_t granted = MQTTArenaClassSize(*size);
+    void* buf = NULL;
+    int c;
+
+    if (granted == 0)
+        return NULL;
+    c = sizeClass(granted);
+
+    pthread_mutex_lock(&a->lock);
+    if ((buf = a->free[c]) != NULL)
+    {
+        a->free[c] = *(void**)buf;
+        a->cached[c] -= granted;
+    }
+    a->inuse += granted;
+    pthread_mutex_unlock(&a->lock);
+
+    if (buf == NULL && (buf = malloc(granted)) == NULL)
+    {
+        pthread_mutex_lock(&a->lock);
+        a->inuse -= granted;
+        pthread_mutex_unlock(&a->lock);
+        return NULL;
+    }
+    *size = granted;
+    return buf;
+}
+
+
+void MQTTArenaFree(MQTTArena* a, unsigned char* buf, size_t size)
+{
+    int c;
+
+    if (buf == NULL)
+        return;
+    c = sizeClass(size);
+
+    pthread_mutex_lock(&a->lock);
+    a->inuse -= size;
+    if (a->cached[c] + size <= ARENA_CACHE_BYTES)
+    {
+        *(void**)buf = a->free[c];
+        a->free[c] = buf;
+        a->cached[c] += size;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&a->lock);
+    free(buf);
+}
+
+
+/* Swaps buf (of *size bytes) for one of newsize, either way: the first keep bytes are carried over.
+   On failure buf is left as it was and NULL is returned */
+unsigned char* MQTTArenaRealloc(MQTTArena* a, unsigned char* buf, size_t* size, size_t newsize, size_t keep)
+{
+    size_t granted = newsize;
+    unsigned char* grown;
+
+    if (buf != NULL && MQTTArenaClassSize(newsize) == *size)
+        return buf;
+    if ((grown = MQTTArenaAlloc(a, &granted)) == NULL)
+        return NULL;
+    if (buf != NULL)
+    {
+        if (keep > *size)
+            keep = *size;
+        memcpy(grown, buf, (keep < granted) ? keep : granted);
+        MQTTArenaFree(a, buf, *size);
+    }
+    *size = granted;
+    return grown;
+}
+
+
+// hands every cached buffer back to the system
+void MQTTArenaTrim(MQTTArena* a)
+{
+    int c;
+
+    for (c = 0; c < ARENA_CLASSES; ++c)
+    {
+        void* list;
+
+        pthread_mutex_lock(&a->lock);
+        list = a->free[c];
+        a->free[c] = NULL;
+        a->cached[c] = 0;
+        pthread_mutex_unlock(&a->lock);
+
+        while (list != NULL)
+        {
+            void* next = *(void**)list;
+            free(list);
+            list = next;
+        }
+    }
+}
+
+
+// bytes held by the buffers handed out, and by the cached ones
+void MQTTArenaUsage(MQTTArena* a, size_t* inuse, size_t* cached)
+{
+    int c;
+
+    pthread_mutex_lock(&a->lock);
+    *inuse = a->inuse;
+    *cached = 0;
+    for (c = 0; c < ARENA_CLASSES; ++c)
+        *cached += a->cached[c];
+    pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * MQTT buffer arena
+ *
+ *    Size-classed pool the connections draw their packet buffers from : a
+ *    buffer is as big as the largest packet it recently had to hold, rounded
+ *    up to a power of two, instead of a fixed worst case per connection.
+ *    Buffers given back are kept per class for the next connection that
+ *    grows, up to a bound; past it they go back to the system
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_ARENA_
+#define __MQTT_ARENA_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define ARENA_MIN_SHIFT 7               // smallest class: 128 bytes
+#define ARENA_CLASSES 18                // ... up to 16 MB
+#define ARENA_MAX_SIZE ((size_t)1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+#define ARENA_CACHE_BYTES (256 * 1024)  // free buffers kept per class
+
+typedef struct MQTTArena MQTTArena;
+
+size_t MQTTArenaClassSize(size_t);
+unsigned char* MQTTArenaAlloc(MQTTArena*, size_t*);
+unsigned char* MQTTArenaRealloc(MQTTArena*, unsigned char*, size_t*, size_t, size_t);
+void MQTTArenaFree(MQTTArena*, unsigned char*, size_t);
+void MQTTArenaTrim(MQTTArena*);
+void MQTTArenaUsage(MQTTArena*, size_t*, size_t*);
+
+struct MQTTArena {
+    pthread_mutex_t lock;               // buffers change hands on growth and release only, not per packet
+    void* free[ARENA_CLASSES];          // singly linked through the first bytes of each free buffer
+    size_t cached[ARENA_CLASSES];       // bytes on each free list
+    size_t inuse;                       // bytes handed out
+};
+
+#define MQTTArena_initializer {PTHREAD_MUTEX_INITIALIZER, {0}, {0}, 0}
+
+#endif
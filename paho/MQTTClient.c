@@ -15,6 +15,17 @@
  *******************************************************************************/
 
 #include "MQTTClient.h"
+#include "MQTTLog.h"
+
+/* Statistics have a single writer: a relaxed atomic store keeps each counter whole for readers on
+   other threads, for the price of a plain one */
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+/* MQTT 5 packets carry a property list, empty unless said otherwise; MQTT 3 ones have none at all */
+static MQTTProperties no_properties = MQTTProperties_initializer;
+#define PROPERTIES(c) (((c)->MQTTVersion == 5) ? &no_properties : NULL)
+
+#define MAX_CONNACK_PROPERTIES 16
 
 void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessgage) {
     md->topicName = aTopicName;
@@ -23,18 +34,40 @@ void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessg
 
 
 int getNextPacketId(Client *c) {
-    return c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    // skip ids still held by an in-flight publish, their acks would be taken for ours
+    do
+        c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    while (c->inflight[c->next_packetid % MAX_INFLIGHT_MESSAGES].id == c->next_packetid);
+    return c->next_packetid;
 }
 
 
-int sendPacket(Client* c, int length, Timer* timer)
+static void countOut(Client* c, unsigned char firstByte, int length)
+{
+    STAT_ADD(c->stats.packets_out[firstByte >> 4], 1);
+    STAT_ADD(c->stats.bytes_out[firstByte >> 4], length);
+}
+
+
+static void countRoundTrip(Client* c, int qos, unsigned long long sent_us)
+{
+    unsigned long long rtt = monotonic_us() - sent_us;
+    int bucket = (rtt == 0) ? 0 : 64 - __builtin_clzll(rtt);
+
+    if (bucket >= MQTT_STATS_RTT_BUCKETS)
+        bucket = MQTT_STATS_RTT_BUCKETS - 1;
+    STAT_ADD(c->stats.ack_rtt[qos - 1][bucket], 1);
+}
+
+
+int sendBuffer(Client* c, unsigned char* buf, int length, Timer* timer)
 {
     int rc = FAILURE, 
         sent = 0;
     
     while (sent < length && !expired(timer))
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, left_ms(timer));
+        rc = c->ipstack->mqttwrite(c->ipstack, &buf[sent], length - sent, left_ms(timer));
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -42,6 +75,7 @@ int sendPacket(Client* c, int length, Timer* timer)
     if (sent == length)
     {
         countdown(&c->ping_timer, c->keepAliveInterval); // record the fact that we have successfully sent the packet    
+        countOut(c, buf[0], length);
         rc = SUCCESS;
     }
     else
@@ -50,142 +84,652 @@ int sendPacket(Client* c, int length, Timer* timer)
 }
 
 
+int sendPacket(Client* c, int length, Timer* timer)
+{
+    return sendBuffer(c, c->buf, length, timer);
+}
+
+
+/* Writes the buffers back to back as one packet, resuming after partial writes.  Consumes the iovec array */
+int sendVector(Client* c, struct iovec* iov, int iovcnt, Timer* timer)
+{
+    int rc = FAILURE, i, length = 0;
+    unsigned char firstByte = *(unsigned char*)iov[0].iov_base;
+
+    for (i = 0; i < iovcnt; ++i)
+        length += iov[i].iov_len;
+
+    while (iovcnt > 0 && !expired(timer))
+    {
+        rc = c->ipstack->mqttwritev(c->ipstack, iov, iovcnt, left_ms(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+        while (iovcnt > 0 && rc >= (int)iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    if (iovcnt == 0)
+    {
+        countdown(&c->ping_timer, c->keepAliveInterval); // record the fact that we have successfully sent the packet
+        countOut(c, firstByte, length);
+        rc = SUCCESS;
+    }
+    else
+        rc = FAILURE;
+    return rc;
+}
+
+
+/* Arena mode: makes room in buf for a packet of len bytes, up to max_packet_size.  Otherwise, or if that fails,
+   buf stays as it is and serializing the packet fails as it always did */
+static void reserveBuf(Client* c, int len)
+{
+    unsigned char* grown;
+
+    if (c->arena == NULL || len <= (int)c->buf_size || (size_t)len > c->max_packet_size)
+        return;
+    if ((grown = MQTTArenaRealloc(c->arena, c->buf, &c->buf_size, len, 0)) != NULL)
+        c->buf = grown;
+    countdown_ms(&c->idle_timer, c->buffer_idle_ms);
+}
+
+
+/* MQTT 5: the broker takes QoS up to its maximum, and packets up to its maximum size.  Anything else would get
+   us disconnected: refused here, the message left as it is for the caller to send otherwise */
+static int withinServerLimits(Client* c, MQTTString topic, MQTTMessage* message)
+{
+    if (message->qos > c->server.maximum_qos)
+        MQTT_WARN("Publish on %s refused: QoS %d, the broker takes up to %d", topic.cstring, message->qos, c->server.maximum_qos);
+    else if (c->server.maximum_packet_size != 0 && (unsigned int)MQTTPacket_len(MQTTV5Serialize_publishLength(message->qos,
+              topic, message->payloadlen, PROPERTIES(c)) + 3) > c->server.maximum_packet_size)   // a topic alias takes 3 bytes
+        MQTT_WARN("Publish on %s refused: %zu bytes of payload, the broker takes packets up to %u bytes", topic.cstring,
+                  message->payloadlen, c->server.maximum_packet_size);
+    else
+        return SUCCESS;
+    STAT_ADD(c->stats.publishes_refused, 1);
+    return SERVER_LIMITS;
+}
+
+
+/* MQTT 5: the properties to publish on topic with.  A topic already given an alias on this connection goes as an
+   empty string and its alias; a new one in full with the alias it gets from then on, while the broker allows more.
+   NULL for MQTT 3 */
+static MQTTProperties* publishProperties(Client* c, MQTTString* topic, MQTTProperties* props)
+{
+    MQTTProperty alias;
+    int i;
+
+    if (c->MQTTVersion != 5)
+        return NULL;
+    props->count = props->length = 0;
+    if (topic->cstring == NULL)
+        return props;
+
+    for (i = 0; i < c->topic_alias_count && strcmp(c->topic_aliases[i], topic->cstring) != 0; ++i)
+        ;
+    if (i < c->topic_alias_count)
+        topic->cstring = "";
+    else if (i >= c->server.topic_alias_maximum || i >= MAX_TOPIC_ALIASES || (c->topic_aliases[i] = strdup(topic->cstring)) == NULL)
+        return props;
+    else
+        c->topic_alias_count++;
+
+    alias.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+    alias.value.integer2 = i + 1;
+    MQTTProperties_add(props, &alias);
+    return props;
+}
+
+
+/* Only the header goes through c->buf, the payload is written from payload: no copy, no size limit */
+static int sendPublishPayload(Client* c, MQTTString topic, MQTTMessage* message, unsigned char* payload, Timer* timer)
+{
+    MQTTProperty property;
+    MQTTProperties props = {0, 1, 0, &property};
+    MQTTProperties* properties = publishProperties(c, &topic, &props);
+    struct iovec iov[2];
+    int len;
+
+    reserveBuf(c, MQTTV5Serialize_publishLength(message->qos, topic, 0, properties) + 5);    // fixed header at its largest
+    len = MQTTV5Serialize_publishHeader(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
+              topic, properties, message->payloadlen);
+
+    if (len <= 0)
+        return FAILURE;
+
+    iov[0].iov_base = c->buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = message->payloadlen;
+    return sendVector(c, iov, 2, timer);
+}
+
+
+int sendPublish(Client* c, MQTTString topic, MQTTMessage* message, Timer* timer)
+{
+    return sendPublishPayload(c, topic, message, message->payload, timer);
+}
+
+
+/* Forgets the topic aliases: they only hold for the connection they were set up on */
+void MQTTClearTopicAliases(Client* c)
+{
+    while (c->topic_alias_count > 0)
+        free(c->topic_aliases[--c->topic_alias_count]);
+}
+
+
+/* What the broker takes, from its MQTT 5 CONNACK properties.  NULL: no limits, as for MQTT 3 */
+static void readServerLimits(Client* c, MQTTProperties* props)
+{
+    unsigned int value;
+
+    c->server.receive_maximum = 65535;
+    c->server.maximum_packet_size = 0;
+    c->server.topic_alias_maximum = 0;
+    c->server.maximum_qos = QOS2;
+    c->server.disconnect_reason = 0;
+
+    if (MQTTProperties_getNumber(props, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, &value) && value > 0)
+        c->server.receive_maximum = value;
+    if (MQTTProperties_getNumber(props, MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, &value))
+        c->server.maximum_packet_size = value;
+    if (MQTTProperties_getNumber(props, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, &value))
+        c->server.topic_alias_maximum = value;
+    if (MQTTProperties_getNumber(props, MQTTPROPERTY_CODE_MAXIMUM_QOS, &value) && value < QOS2)
+        c->server.maximum_qos = value;
+    if (MQTTProperties_getNumber(props, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, &value))
+    {   // the broker's keepalive takes precedence over ours
+        c->keepAliveInterval = value;
+        countdown(&c->ping_timer, c->keepAliveInterval);
+    }
+}
+
+
+/* MQTT 5: the largest packet we take, announced in CONNECT so that the broker does not send bigger ones.  Those
+   would be read and dropped here anyway, unless a stream handler is there to take them: then 0, no limit */
+static unsigned int inboundPacketLimit(Client* c)
+{
+    if (c->streamHandler != NULL)
+        return 0;
+    return (c->arena != NULL) ? c->max_packet_size : c->readbuf_size;
+}
+
+
+/* Asynchronous publishes allowed in flight: ours, or less if the broker says so */
+static unsigned int inflightWindow(Client* c)
+{
+    return (c->server.receive_maximum < c->inflight_window) ? c->server.receive_maximum : c->inflight_window;
+}
+
+
+struct InflightMessage* findInflight(Client* c, unsigned short id)
+{
+    struct InflightMessage* m = &c->inflight[id % MAX_INFLIGHT_MESSAGES];
+    return (id != 0 && m->id == id) ? m : NULL;
+}
+
+
+/* In-flight packets come from the arena in arena mode: a steady flow of asynchronous publishes reuses
+   the buffers of the ones acknowledged, instead of a malloc and a free each */
+static unsigned char* allocPacket(Client* c, size_t* size)
+{
+    if (c->arena != NULL)
+        return MQTTArenaAlloc(c->arena, size);
+    return malloc(*size);
+}
+
+
+static void freePacket(Client* c, unsigned char* packet, size_t size)
+{
+    if (c->arena != NULL)
+        MQTTArenaFree(c->arena, packet, size);
+    else
+        free(packet);
+}
+
+
+void completeInflight(Client* c, struct InflightMessage* m, int rc)
+{
+    unsigned short id = m->id;
+    publishCompletionHandler fp = m->fp;
+    void* context = m->context;
+    MQTTHeader header;
+
+    header.byte = m->packet[0];
+    if (rc == SUCCESS)
+        countRoundTrip(c, header.bits.qos, m->sent_us);
+    freePacket(c, m->packet, m->size);
+    memset(m, 0, sizeof(struct InflightMessage));
+    c->inflight_count--;
+
+    if (fp != NULL)
+        fp(id, rc, context);
+}
+
+
+/* The stored PUBLISH serialized again for the connection's protocol, when it fell back from MQTT 5 to 3.1.1 (or the
+   other way): the same topic and payload, with or without the properties.  0 if it could not be */
+static int reserializeInflight(Client* c, struct InflightMessage* m)
+{
+    MQTTProperties properties = MQTTProperties_initializer;
+    MQTTString topic = MQTTString_initializer;
+    unsigned char dup, retained, *payload, *packet;
+    unsigned short id;
+    int qos, payloadlen, len;
+    size_t size;
+
+    if (MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &topic, (m->version == 5) ? &properties : NULL,
+            &payload, &payloadlen, m->packet, m->len) != 1)
+        return 0;
+    len = MQTTPacket_len(MQTTV5Serialize_publishLength(qos, topic, payloadlen, PROPERTIES(c)));
+    size = len;
+    if ((packet = allocPacket(c, &size)) == NULL)
+        return 0;
+    if (MQTTV5Serialize_publish(packet, len, dup, qos, retained, id, topic, PROPERTIES(c), payload, payloadlen) != len)
+    {
+        freePacket(c, packet, size);
+        return 0;
+    }
+    freePacket(c, m->packet, m->size);
+    m->packet = packet;
+    m->len = len;
+    m->size = size;
+    m->version = c->MQTTVersion;
+    return 1;
+}
+
+
+/* After a reconnect to the session they were sent in: publishes not yet acknowledged go again with DUP set, PUBRELs
+   are repeated.  A new session knows none of their packet ids: publishes go as new ones, and QoS2 exchanges already
+   past PUBREC fail, the broker having forgotten whether it delivered them.  A publish the connection's protocol
+   version cannot carry as stored, and that cannot be serialized again, fails */
+int resendInflight(Client* c, Timer* timer)
+{
+    int i, rc = SUCCESS;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES && rc == SUCCESS; ++i)
+    {
+        struct InflightMessage* m = &c->inflight[i];
+
+        if (m->id == 0)
+            continue;
+        if ((m->pubrel && !c->sessionPresent)
+            || (!m->pubrel && m->version != c->MQTTVersion && !reserializeInflight(c, m)))
+        {
+            completeInflight(c, m, FAILURE);
+            continue;
+        }
+        if (m->pubrel)
+        {
+            int len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, m->id);
+            rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+        }
+        else
+        {
+            MQTTHeader header;
+            header.byte = m->packet[0];
+            header.bits.dup = c->sessionPresent;
+            m->packet[0] = header.byte;
+            rc = sendBuffer(c, m->packet, m->len, timer);
+        }
+    }
+    return rc;
+}
+
+
+/* MQTTTransport grow function, arena mode: readbuf grows to hold an incoming packet of *len bytes, up to
+   max_packet_size; a bigger one gets that much, for large chunks.  *len is set to the size of the new readbuf.
+   A message handler being called has pointers into readbuf, and may read further packets (a blocking publish, say):
+   the buffer it was given is only released once it returns */
+static unsigned char* growReadbuf(void* sck, int* len)
+{
+    Client* c = (Client*)sck;
+    size_t size = ((size_t)*len > c->max_packet_size) ? c->max_packet_size : (size_t)*len;
+    unsigned char* grown;
+
+    if (c->arena == NULL || size <= c->readbuf_size || (c->delivering && c->retired != NULL))
+        return NULL;
+    if (c->delivering)
+    {
+        if ((grown = MQTTArenaAlloc(c->arena, &size)) == NULL)
+            return NULL;
+        memcpy(grown, c->readbuf, 5);       // the fixed header read so far
+        c->retired = c->readbuf;
+        c->retired_size = c->readbuf_size;
+        c->readbuf_size = size;
+    }
+    else if ((grown = MQTTArenaRealloc(c->arena, c->readbuf, &c->readbuf_size, size, 5)) == NULL)
+        return NULL;
+    c->readbuf = grown;
+    *len = c->readbuf_size;
+    countdown_ms(&c->idle_timer, c->buffer_idle_ms);
+    return grown;
+}
+
+
+/* Arena mode: once idle_ms have gone by without a large packet, buf and readbuf shrink back to MIN_BUFFER_SIZE
+   and the network gives its buffers back.  Not while a packet is half read or a handler runs */
+static void trimBuffers(Client* c)
+{
+    unsigned char* shrunk;
+
+    if (c->arena == NULL || !expired(&c->idle_timer) || c->transport.state != 0 || c->transport.overflow > 0
+            || c->stream.active || c->delivering)
+        return;
+    if (c->readbuf_size > MIN_BUFFER_SIZE && (shrunk = MQTTArenaRealloc(c->arena, c->readbuf, &c->readbuf_size, MIN_BUFFER_SIZE, 0)) != NULL)
+        c->readbuf = shrunk;
+    if (c->buf_size > MIN_BUFFER_SIZE && (shrunk = MQTTArenaRealloc(c->arena, c->buf, &c->buf_size, MIN_BUFFER_SIZE, 0)) != NULL)
+        c->buf = shrunk;
+    linux_trim(c->ipstack);
+    countdown_ms(&c->idle_timer, c->buffer_idle_ms);
+}
+
+
+/* MQTTTransport read function: waits on the socket while read_timer is set, otherwise only takes what is readable */
+static int transportRead(void* sck, unsigned char* buf, int len)
+{
+    Client* c = (Client*)sck;
+    int rc;
+
+    if (c->read_timer == NULL)
+        return c->ipstack->mqttreadnb(c->ipstack, buf, len);
+
+    rc = c->ipstack->mqttread(c->ipstack, buf, len, left_ms(c->read_timer));
+    return (rc < 0) ? -1 : rc;
+}
+
+
 void MQTTClient(Client* c, Network* network, unsigned int command_timeout_ms, unsigned char* buf, size_t buf_size, unsigned char* readbuf, size_t readbuf_size)
 {
     c->ipstack = network;
     
-    memset(&c->messageHandlers, 0, MAX_MESSAGE_HANDLERS * sizeof(MessageHandlers));
-    /*
-    int i;
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = NULL;
-        */
+    memset(&c->subscriptions, 0, sizeof(TopicNode));
     c->command_timeout_ms = command_timeout_ms;
     c->buf = buf;
     c->buf_size = buf_size;
     c->readbuf = readbuf;
     c->readbuf_size = readbuf_size;
-    c->isconnected = 0;
+    atomic_store_explicit(&c->isconnected, 0, memory_order_release);
+    c->sessionPresent = 0;
+    c->MQTTVersion = 0;
+    memset(&c->server, 0, sizeof(c->server));
+    c->topic_alias_count = 0;
     c->ping_outstanding = 0;
     c->defaultMessageHandler = NULL;
+    c->streamHandler = NULL;
+    memset(&c->stream, 0, sizeof(c->stream));
     InitTimer(&c->ping_timer);
+
+    memset(&c->transport, 0, sizeof(MQTTTransport));
+    c->transport.getfn = transportRead;
+    c->transport.sck = c;
+    c->read_timer = NULL;
+
+    c->arena = NULL;
+    c->max_packet_size = 0;
+    c->buffer_idle_ms = 0;
+    InitTimer(&c->idle_timer);
+    c->delivering = 0;
+    c->retired = NULL;
+    c->retired_size = 0;
+
+    memset(&c->inflight, 0, sizeof(c->inflight));
+    c->inflight_window = MAX_INFLIGHT_MESSAGES;
+    c->inflight_count = 0;
+    memset(&c->stats, 0, sizeof(MQTTStats));
+    readServerLimits(c, NULL);
 }
 
 
-int decodePacket(Client* c, int* value, int timeout)
+/* A copy of the client's counters, safe to take from any thread: each counter is whole, though a
+   packet counted in one may not yet be in another */
+void MQTTGetStats(Client* c, MQTTStats* stats)
 {
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    unsigned long long* from = (unsigned long long*)&c->stats;
+    unsigned long long* to = (unsigned long long*)stats;
+    size_t i;
 
-    *value = 0;
-    do
+    for (i = 0; i < sizeof(MQTTStats) / sizeof(unsigned long long); ++i)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+
+/* Number of asynchronous QoS1/2 publishes that may await their acknowledgement at once */
+void MQTTSetInflightWindow(Client* c, unsigned int window)
+{
+    if (window == 0 || window > MAX_INFLIGHT_MESSAGES)
+        window = MAX_INFLIGHT_MESSAGES;
+    c->inflight_window = window;
+}
+
+
+/* Handler for the PUBLISH packets too big for readbuf: their payload is handed over chunk by chunk.
+   Without one such messages are read and acknowledged, but not delivered */
+void setStreamMessageHandler(Client* c, streamMessageHandler fp)
+{
+    c->streamHandler = fp;
+}
+
+
+/* Gives up on every publish still in flight, their completion handlers get FAILURE */
+void MQTTDropInflight(Client* c)
+{
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        if (c->inflight[i].id != 0)
+            completeInflight(c, &c->inflight[i], FAILURE);
+    }
+}
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
+
+/* Forgets every subscription: handlers and what MQTTConnect would subscribe to again */
+void MQTTClearSubscriptions(Client* c)
+{
+    MQTTTopicTree_free(&c->subscriptions);
 }
 
 
-int readPacket(Client* c, Timer* timer) 
+/* Arena mode, instead of the buffers given to MQTTClient: buf and readbuf are drawn from arena, MIN_BUFFER_SIZE
+   at first.  They grow with the packets to send or receive, up to max_packet_size (bigger inbound ones are
+   streamed, see setStreamMessageHandler), and shrink back once idle_ms go by without any.  The network's own
+   buffers then go back to the arena as well */
+int MQTTSetBufferArena(Client* c, MQTTArena* arena, size_t max_packet_size, unsigned int idle_ms)
+{
+    size_t buf_size = MIN_BUFFER_SIZE, readbuf_size = MIN_BUFFER_SIZE;
+    unsigned char* buf = MQTTArenaAlloc(arena, &buf_size);
+    unsigned char* readbuf = MQTTArenaAlloc(arena, &readbuf_size);
+
+    if (buf == NULL || readbuf == NULL)
+    {
+        MQTTArenaFree(arena, buf, buf_size);
+        MQTTArenaFree(arena, readbuf, readbuf_size);
+        return FAILURE;
+    }
+    MQTTFreeBuffers(c);
+    c->arena = arena;
+    c->buf = buf;
+    c->buf_size = buf_size;
+    c->readbuf = readbuf;
+    c->readbuf_size = readbuf_size;
+    c->max_packet_size = (max_packet_size < MIN_BUFFER_SIZE) ? MIN_BUFFER_SIZE : max_packet_size;
+    c->buffer_idle_ms = idle_ms;
+    countdown_ms(&c->idle_timer, idle_ms);
+    c->transport.growfn = growReadbuf;
+    return SUCCESS;
+}
+
+
+/* arena mode: gives buf and readbuf back, the client cannot be used any more until MQTTSetBufferArena.
+   Publishes in flight hold arena buffers too: MQTTDropInflight first */
+void MQTTFreeBuffers(Client* c)
+{
+    if (c->arena == NULL)
+        return;
+    MQTTArenaFree(c->arena, c->buf, c->buf_size);
+    MQTTArenaFree(c->arena, c->readbuf, c->readbuf_size);
+    MQTTArenaFree(c->arena, c->retired, c->retired_size);
+    c->buf = c->readbuf = c->retired = NULL;
+    c->buf_size = c->readbuf_size = c->retired_size = 0;
+    c->transport.growfn = NULL;
+    c->arena = NULL;
+}
+
+
+// bytes of packet buffers held right now: the client's, the publishes in flight, the network's
+size_t MQTTBufferUsage(Client* c)
+{
+    size_t bytes = c->buf_size + c->readbuf_size + c->retired_size;
+    int i;
+
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+    {
+        if (c->inflight[i].id != 0)
+            bytes += c->inflight[i].size;
+    }
+    if (c->ipstack != NULL)
+        bytes += linux_buffered(c->ipstack);
+    return bytes;
+}
+
+
+int ackPublish(Client* c, MQTTMessage* msg, Timer* timer)
 {
-    int rc = FAILURE;
-    MQTTHeader header = {0};
     int len = 0;
-    int rem_len = 0;
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if (c->ipstack->mqttread(c->ipstack, c->readbuf, 1, left_ms(timer)) != 1)
-        goto exit;
+    if (msg->qos == QOS0)
+        return SUCCESS;
+    if (msg->qos == QOS1)
+        len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK, 0, msg->id);
+    else if (msg->qos == QOS2)
+        len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC, 0, msg->id);
+    return (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+}
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, left_ms(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, left_ms(timer)) != rem_len))
-        goto exit;
+void deliverChunk(Client* c, unsigned char* chunk, int len)
+{
+    if (c->stream.hdr >= 0 && c->streamHandler != NULL)
+    {
+        MessageData md;
+        c->stream.message.payload = chunk;
+        c->stream.message.payloadlen = len;
+        NewMessageData(&md, &c->stream.topicName, &c->stream.message);
+        c->streamHandler(&md, c->stream.offset, c->stream.total);
+    }
+    c->stream.offset += len;
+}
 
-    header.byte = c->readbuf[0];
-    rc = header.bits.type;
-exit:
-    return rc;
+
+/* A PUBLISH filled readbuf: hands over the first chunk, the rest follows from readStream() */
+void startStream(Client* c, MQTTString* topicName, MQTTMessage* msg)
+{
+    int hdr = (unsigned char*)msg->payload - c->readbuf;
+
+    c->stream.active = 1;
+    c->stream.message = *msg;
+    c->stream.topicName = *topicName;
+    c->stream.offset = 0;
+    c->stream.total = msg->payloadlen;
+    c->stream.hdr = hdr;
+    if (hdr >= c->readbuf_size)
+        c->stream.hdr = -1;     // not even the topic fits: the message can only be skipped
+    else
+        deliverChunk(c, &c->readbuf[hdr], c->readbuf_size - hdr);
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-char isTopicMatched(char* topicFilter, MQTTString* topicName)
+/* Reads and hands over what has arrived of a streamed payload, chunks go after the topic which stays in readbuf.
+   Returns 1 once the whole message is read and acknowledged, 0 to call again, FAILURE on error */
+int readStream(Client* c)
 {
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
-    
-    while (*curf && curn < curn_end)
+    int hdr = (c->stream.hdr < 0) ? 0 : c->stream.hdr;
+    int rc;
+
+    while (c->transport.overflow > 0)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-    
-    return (curn == curn_end) && (*curf == '\0');
+        if ((rc = MQTTPacket_readnbChunk(&c->readbuf[hdr], c->readbuf_size - hdr, &c->transport)) <= 0)
+            return rc;
+        deliverChunk(c, &c->readbuf[hdr], rc);
+    }
+    c->stream.active = 0;
+
+    Timer timer;
+    InitTimer(&timer);
+    countdown_ms(&timer, c->command_timeout_ms);
+    return (ackPublish(c, &c->stream.message, &timer) == SUCCESS) ? 1 : FAILURE;
 }
 
 
-int deliverMessage(Client* c, MQTTString* topicName, MQTTMessage* message)
+/* Next step of reading packets: the end of a streamed payload first, then MQTTPacket_readnb */
+int readStep(Client* c)
 {
-    int i;
-    int rc = FAILURE;
+    int rc;
 
-    // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    if (c->stream.active)
     {
-        if (c->messageHandlers[i].topicFilter != NULL && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName)))
-        {
-            if (c->messageHandlers[i].fp != NULL)
-            {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md);
-                rc = SUCCESS;
-            }
-        }
+        rc = readStream(c);
+        if (rc <= 0)
+            return rc;
     }
+    rc = MQTTPacket_readnb(c->readbuf, c->readbuf_size, &c->transport);
+    if (rc > 0)
+    {
+        STAT_ADD(c->stats.packets_in[rc], 1);
+        STAT_ADD(c->stats.bytes_in[rc], c->transport.len + c->transport.overflow);
+        if (c->readbuf_size > MIN_BUFFER_SIZE && c->transport.len > MIN_BUFFER_SIZE)
+            countdown_ms(&c->idle_timer, c->buffer_idle_ms);   // still in use, not idle
+    }
+    return rc;
+}
+
+
+/* Blocking read of one packet into readbuf.  A packet partly read by MQTTProcess() is resumed, not lost */
+int readPacket(Client* c, Timer* timer) 
+{
+    int rc;
+
+    c->read_timer = timer;
+    while ((rc = readStep(c)) == 0 && !expired(timer))
+        ;
+    c->read_timer = NULL;
+
+    return (rc < 0) ? FAILURE : rc;     // 0: timed out
+}
+
+
+int deliverMessage(Client* c, MQTTString* topicName, MQTTMessage* message)
+{
+    int rc = FAILURE;
+    MessageData md;
+
+    // we have to find the right message handlers - indexed by topic
+    NewMessageData(&md, topicName, message);
+    c->delivering++;
+    if (MQTTTopicTree_match(&c->subscriptions, topicName, &md) > 0)
+        rc = SUCCESS;
     
     if (rc == FAILURE && c->defaultMessageHandler != NULL) 
     {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
         c->defaultMessageHandler(&md);
         rc = SUCCESS;
     }   
+    if (--c->delivering == 0 && c->retired != NULL)
+    {   // readbuf had to grow under the handlers' feet
+        MQTTArenaFree(c->arena, c->retired, c->retired_size);
+        c->retired = NULL;
+        c->retired_size = 0;
+    }
     
     return rc;
 }
@@ -193,13 +737,10 @@ int deliverMessage(Client* c, MQTTString* topicName, MQTTMessage* message)
 
 int keepalive(Client* c)
 {
-    int rc = FAILURE;
+    int rc = SUCCESS;
 
     if (c->keepAliveInterval == 0)
-    {
-        rc = SUCCESS;
         goto exit;
-    }
 
     if (expired(&c->ping_timer))
     {
@@ -211,7 +752,11 @@ int keepalive(Client* c)
             int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
             if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS) // send the ping packet
                 c->ping_outstanding = 1;
+            else
+                rc = FAILURE;
         }
+        else
+            rc = FAILURE; // no PINGRESP within a whole keepalive interval: the connection is dead
     }
 
 exit:
@@ -219,67 +764,101 @@ exit:
 }
 
 
-int cycle(Client* c, Timer* timer)
+/* Acts on a packet that has just been read into readbuf */
+int handlePacket(Client* c, int packet_type, Timer* timer)
 {
-    // read the socket, see what work is due
-    unsigned short packet_type = readPacket(c, timer);
-    
     int len = 0,
         rc = SUCCESS;
 
     switch (packet_type)
     {
         case CONNACK:
-        case PUBACK:
         case SUBACK:
             break;
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type, reason;
+            struct InflightMessage* m;
+            if (MQTTV5Deserialize_ack(&type, &dup, &mypacketid, &reason, NULL, c->readbuf, c->readbuf_size) == 1 &&
+                    (m = findInflight(c, mypacketid)) != NULL)
+                completeInflight(c, m, (reason >= 0x80) ? FAILURE : SUCCESS);   // MQTT 5: refused by the broker
+            break;
+        }
         case PUBLISH:
         {
             MQTTString topicName;
             MQTTMessage msg;
-            if (MQTTDeserialize_publish((unsigned char*)&msg.dup, (int*)&msg.qos, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
+            MQTTProperties props = MQTTProperties_initializer;     // skipped: we allow no topic alias in
+            int payloadlen;
+            if (MQTTV5Deserialize_publish((unsigned char*)&msg.dup, (int*)&msg.qos, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+               (c->MQTTVersion == 5) ? &props : NULL, (unsigned char**)&msg.payload, &payloadlen, c->readbuf, c->readbuf_size) != 1)
                 goto exit;
+            msg.payloadlen = payloadlen;
 
-            deliverMessage(c, &topicName, &msg);
-            if (msg.qos != QOS0)
-            {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC, 0, msg.id);
-                if (len <= 0)
-                    rc = FAILURE;
-                   else
-                       rc = sendPacket(c, len, timer);
-                if (rc == FAILURE)
-                    goto exit; // there was a problem
+            if (c->transport.overflow > 0)
+            {   // too big for readbuf: the payload is handed over in chunks, acknowledged once all of it is read
+                startStream(c, &topicName, &msg);
+                break;
             }
+
+            deliverMessage(c, &topicName, &msg);
+            rc = ackPublish(c, &msg, timer);
             break;
         }
         case PUBREC:
         {
             unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            unsigned char dup, type, reason;
+            struct InflightMessage* m;
+            if (MQTTV5Deserialize_ack(&type, &dup, &mypacketid, &reason, NULL, c->readbuf, c->readbuf_size) != 1)
                 rc = FAILURE;
+            else if (reason >= 0x80)
+            {   // MQTT 5: refused by the broker, the exchange ends here
+                if ((m = findInflight(c, mypacketid)) != NULL)
+                    completeInflight(c, m, FAILURE);
+                break;
+            }
             else if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, mypacketid)) <= 0)
                 rc = FAILURE;
             else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
                 rc = FAILURE; // there was a problem
             if (rc == FAILURE)
                 goto exit; // there was a problem
+            if ((m = findInflight(c, mypacketid)) != NULL)
+                m->pubrel = 1;
             break;
         }
-        case PUBCOMP:
-            break;
         case PINGRESP:
             c->ping_outstanding = 0;
             break;
+        case DISCONNECT:    // MQTT 5: the broker is closing the connection, and tells us why
+            MQTTV5Deserialize_disconnect(NULL, &c->server.disconnect_reason, c->readbuf, c->readbuf_size);
+            rc = FAILURE;
+            break;
     }
-    keepalive(c);
 exit:
-    if (rc == SUCCESS)
+    return rc;
+}
+
+
+int cycle(Client* c, Timer* timer)
+{
+    // read the socket, see what work is due
+    int packet_type = readPacket(c, timer);
+
+    if (packet_type == FAILURE)
+        return FAILURE;     // the connection is gone
+
+    // the acks we owe get their own time budget, the read may have used up all of the caller's
+    Timer ack_timer;
+    InitTimer(&ack_timer);
+    countdown_ms(&ack_timer, c->command_timeout_ms);
+
+    int rc = handlePacket(c, packet_type, &ack_timer);
+
+    if (rc == SUCCESS && (rc = keepalive(c)) == SUCCESS)
         rc = packet_type;
     return rc;
 }
@@ -289,6 +868,7 @@ int MQTTYield(Client* c, int timeout_ms)
 {
     int rc = SUCCESS;
     Timer timer;
+    unsigned long long start_us = monotonic_us();
 
     InitTimer(&timer);    
     countdown_ms(&timer, timeout_ms);
@@ -300,11 +880,65 @@ int MQTTYield(Client* c, int timeout_ms)
             break;
         }
     }
+    if (rc == SUCCESS)
+        trimBuffers(c);
+    STAT_ADD(c->stats.yield_calls, 1);
+    STAT_ADD(c->stats.yield_us, monotonic_us() - start_us);
         
     return rc;
 }
 
 
+/* Non-blocking counterpart of MQTTYield: handles every packet that can be read without waiting,
+   sends a PINGREQ if one is due, then returns.  FAILURE means the connection is no longer usable */
+int MQTTProcess(Client* c)
+{
+    int rc = SUCCESS,
+        packet_type;
+    Timer timer;
+    unsigned long long start_us = monotonic_us();
+
+    InitTimer(&timer);
+    countdown_ms(&timer, c->command_timeout_ms); // bounds the acks we may have to send back
+
+    while ((packet_type = readStep(c)) > 0)
+    {
+        if ((rc = handlePacket(c, packet_type, &timer)) != SUCCESS)
+            break;
+    }
+    if (packet_type < 0)
+        rc = FAILURE;
+
+    // coalescing mode: packets held back long enough go out now
+    if (rc == SUCCESS && c->ipstack->txlen > 0 && expired(&c->ipstack->txtimer)
+            && c->ipstack->mqttflush(c->ipstack, left_ms(&timer)) < 0)
+        rc = FAILURE;
+
+    if (rc == SUCCESS)
+        rc = keepalive(c);
+    if (rc == SUCCESS)
+        trimBuffers(c);
+    STAT_ADD(c->stats.yield_calls, 1);
+    STAT_ADD(c->stats.yield_us, monotonic_us() - start_us);
+    return rc;
+}
+
+
+/* Milliseconds until MQTTProcess has keepalive or coalesced writes to do, -1 if nothing is due */
+int MQTTNextTimeout(Client* c)
+{
+    int next = (c->keepAliveInterval == 0) ? -1 : left_ms(&c->ping_timer);
+
+    if (c->ipstack->txlen > 0)
+    {
+        int flush = left_ms(&c->ipstack->txtimer);
+        if (next < 0 || flush < next)
+            next = flush;
+    }
+    return next;
+}
+
+
 // only used in single-threaded mode where one command at a time is in process
 int waitfor(Client* c, int packet_type, Timer* timer)
 {
@@ -315,23 +949,116 @@ int waitfor(Client* c, int packet_type, Timer* timer)
         if (expired(timer)) 
             break; // we timed out
     }
-    while ((rc = cycle(c, timer)) != packet_type);  
+    while ((rc = cycle(c, timer)) != packet_type && rc != FAILURE);
     
     return rc;
 }
 
 
+struct Resubscription {
+    MQTTString topics[MAX_RESUBSCRIBE_BATCH];
+    int qos[MAX_RESUBSCRIBE_BATCH];
+    int count;
+    Client* c;
+    Timer* timer;
+};
+
+
+static int readSuback(Client* c, unsigned short* packetid, int maxcount, int* count, int granted[])
+{
+    MQTTProperties props = MQTTProperties_initializer;
+
+    return MQTTV5Deserialize_suback(packetid, (c->MQTTVersion == 5) ? &props : NULL, maxcount, count, granted,
+              c->readbuf, c->readbuf_size);
+}
+
+
+static int flushResubscription(struct Resubscription* r)
+{
+    Client* c = r->c;
+    int len, i, rc = FAILURE;
+
+    if (r->count == 0)
+        return SUCCESS;
+
+    reserveBuf(c, MQTTPacket_len(MQTTV5Serialize_subscribeLength(r->count, r->topics, PROPERTIES(c))));
+    len = MQTTV5Serialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), PROPERTIES(c), r->count, r->topics, r->qos);
+    if (len > 0 && sendPacket(c, len, r->timer) == SUCCESS && waitfor(c, SUBACK, r->timer) == SUBACK)
+    {
+        int count = 0, granted[MAX_RESUBSCRIBE_BATCH];
+        unsigned short mypacketid;
+        if (readSuback(c, &mypacketid, MAX_RESUBSCRIBE_BATCH, &count, granted) == 1)
+            rc = SUCCESS;   // a refused filter (0x80) stays registered here, and is asked for again next time
+    }
+
+    for (i = 0; i < r->count; ++i)
+        free(r->topics[i].cstring);
+    r->count = 0;
+    return rc;
+}
+
+
+static int addResubscription(const char* topicFilter, int qos, void* context)
+{
+    struct Resubscription* r = (struct Resubscription*)context;
+    MQTTString topic = MQTTString_initializer;
+
+    if ((topic.cstring = strdup(topicFilter)) == NULL)
+        return FAILURE;
+
+    // as many filters per SUBSCRIBE as fit in c->buf, or in what it may grow to
+    r->topics[r->count] = topic;
+    if (r->count > 0 && MQTTPacket_len(MQTTV5Serialize_subscribeLength(r->count + 1, r->topics, PROPERTIES(r->c)))
+                > (int)(r->c->arena ? r->c->max_packet_size : r->c->buf_size)
+            && flushResubscription(r) != SUCCESS)
+    {
+        free(topic.cstring);
+        return FAILURE;
+    }
+    r->topics[r->count] = topic;
+    r->qos[r->count] = qos;
+    if (++r->count == MAX_RESUBSCRIBE_BATCH)
+        return flushResubscription(r);
+    return SUCCESS;
+}
+
+
+/* Subscribes again to every filter of c->subscriptions, a few per packet */
+static int resubscribe(Client* c, Timer* timer)
+{
+    struct Resubscription r;
+    int rc;
+
+    r.count = 0;
+    r.c = c;
+    r.timer = timer;
+    rc = MQTTTopicTree_walk(&c->subscriptions, addResubscription, &r);
+    if (rc == SUCCESS)
+        rc = flushResubscription(&r);
+    else
+    {
+        int i;
+        for (i = 0; i < r.count; ++i)
+            free(r.topics[i].cstring);
+    }
+    return rc;
+}
+
+
 int MQTTConnect(Client* c, MQTTPacket_connectData* options)
 {
     Timer connect_timer;
     int rc = FAILURE;
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    MQTTProperty connect_property[2], connack_property[MAX_CONNACK_PROPERTIES];
+    MQTTProperties connect_properties = {0, 2, 0, connect_property},
+                   connack_properties = {0, MAX_CONNACK_PROPERTIES, 0, connack_property};
     int len = 0;
     
     InitTimer(&connect_timer);
     countdown_ms(&connect_timer, c->command_timeout_ms);
 
-    if (c->isconnected) // don't send connect packet again if we are already connected
+    if (atomic_load_explicit(&c->isconnected, memory_order_acquire)) // don't send connect packet again if we are already connected
         goto exit;
 
     if (options == 0)
@@ -339,7 +1066,32 @@ int MQTTConnect(Client* c, MQTTPacket_connectData* options)
     
     c->keepAliveInterval = options->keepAliveInterval;
     countdown(&c->ping_timer, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+    c->ping_outstanding = 0;
+    c->transport.state = 0; // whatever was being read belonged to the previous connection
+    c->transport.overflow = 0;
+    c->stream.active = 0;
+    c->MQTTVersion = options->MQTTVersion;
+    MQTTClearTopicAliases(c);
+    readServerLimits(c, NULL);
+
+    if (c->MQTTVersion == 5)
+    {
+        MQTTProperty property;
+
+        if (!options->cleansession)
+        {   // as with MQTT 3, the session outlives the connection
+            property.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+            property.value.integer4 = 0xFFFFFFFF;
+            MQTTProperties_add(&connect_properties, &property);
+        }
+        if ((property.value.integer4 = inboundPacketLimit(c)) > 0)
+        {
+            property.identifier = MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE;
+            MQTTProperties_add(&connect_properties, &property);
+        }
+    }
+    reserveBuf(c, MQTTPacket_len(MQTTV5Serialize_connectLength(options, &connect_properties)));
+    if ((len = MQTTV5Serialize_connect(c->buf, c->buf_size, options, &connect_properties)) <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
@@ -348,18 +1100,26 @@ int MQTTConnect(Client* c, MQTTPacket_connectData* options)
     if (waitfor(c, CONNACK, &connect_timer) == CONNACK)
     {
         unsigned char connack_rc = 255;
-        char sessionPresent = 0;
-        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
-            rc = connack_rc;
+        c->sessionPresent = 0;
+        if (MQTTV5Deserialize_connack((c->MQTTVersion == 5) ? &connack_properties : NULL, &c->sessionPresent, &connack_rc,
+                c->readbuf, c->readbuf_size) == 1)
+            rc = connack_rc;    // MQTT 5 reason codes for a refusal are 0x80 and up
         else
             rc = FAILURE;
+        if (rc == SUCCESS && c->MQTTVersion == 5)
+            readServerLimits(c, &connack_properties);
+        // a new session knows nothing of our subscriptions, a resumed one has them all: no SUBSCRIBE then
+        if (rc == SUCCESS && !c->sessionPresent)
+            rc = resubscribe(c, &connect_timer);
+        if (rc == SUCCESS && c->inflight_count > 0)
+            rc = resendInflight(c, &connect_timer);
     }
     else
         rc = FAILURE;
     
 exit:
     if (rc == SUCCESS)
-        c->isconnected = 1;
+        atomic_store_explicit(&c->isconnected, 1, memory_order_release);
     return rc;
 }
 
@@ -369,16 +1129,26 @@ int MQTTSubscribe(Client* c, const char* topicFilter, enum QoS qos, messageHandl
     int rc = FAILURE;  
     Timer timer;
     int len = 0;
+    TopicNode* node;
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
     
     InitTimer(&timer);
     countdown_ms(&timer, c->command_timeout_ms);
 
-    if (!c->isconnected)
+    if (!atomic_load_explicit(&c->isconnected, memory_order_acquire))
         goto exit;
+
+    // already known to the broker, from this connection or the session it resumed: just the handler changes
+    if ((node = MQTTTopicTree_find(&c->subscriptions, topicFilter)) != NULL && node->qos == qos)
+    {
+        node->fp = messageHandler;
+        rc = SUCCESS;
+        goto exit;
+    }
     
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
+    reserveBuf(c, MQTTPacket_len(MQTTV5Serialize_subscribeLength(1, &topic, PROPERTIES(c))));
+    len = MQTTV5Serialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), PROPERTIES(c), 1, &topic, (int*)&qos);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
@@ -388,23 +1158,10 @@ int MQTTSubscribe(Client* c, const char* topicFilter, enum QoS qos, messageHandl
     {
         int count = 0, grantedQoS = -1;
         unsigned short mypacketid;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
-            rc = grantedQoS; // 0, 1, 2 or 0x80 
-        if (rc != 0x80)
-        {
-            int i;
-            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == NULL)
-                {
-                    c->messageHandlers[i].topicFilter = malloc(strlen(topicFilter)+1);
-                    strcpy(c->messageHandlers[i].topicFilter, topicFilter);
-                    c->messageHandlers[i].fp = messageHandler;
-                    rc = 0;
-                    break;
-                }
-            }
-        }
+        if (readSuback(c, &mypacketid, 1, &count, &grantedQoS) == 1)
+            rc = grantedQoS; // 0, 1, 2 or 0x80; MQTT 5 has more reasons to refuse, all from 0x80
+        if (rc < 0x80)
+            rc = MQTTTopicTree_add(&c->subscriptions, topicFilter, qos, messageHandler);
     }
     else 
         rc = FAILURE;
@@ -425,10 +1182,11 @@ int MQTTUnsubscribe(Client* c, const char* topicFilter)
     InitTimer(&timer);
     countdown_ms(&timer, c->command_timeout_ms);
     
-    if (!c->isconnected)
+    if (!atomic_load_explicit(&c->isconnected, memory_order_acquire))
         goto exit;
     
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
+    reserveBuf(c, MQTTPacket_len(MQTTV5Serialize_unsubscribeLength(1, &topic, PROPERTIES(c))));
+    if ((len = MQTTV5Serialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), PROPERTIES(c), 1, &topic)) <= 0)
         goto exit;
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
         goto exit; // there was a problem
@@ -439,20 +1197,7 @@ int MQTTUnsubscribe(Client* c, const char* topicFilter)
         if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
             rc = 0; 
 
-        int i;
-        for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        {
-            if (c->messageHandlers[i].topicFilter != NULL)
-            {
-                if (strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)
-                {
-                    free(c->messageHandlers[i].topicFilter);
-                    c->messageHandlers[i].topicFilter = NULL;
-                    c->messageHandlers[i].fp = NULL;
-                    break;
-                }
-            }
-        }
+        MQTTTopicTree_remove(&c->subscriptions, topicFilter);
     }
     else
         rc = FAILURE;
@@ -468,47 +1213,114 @@ int MQTTPublish(Client* c, const char* topicName, MQTTMessage* message)
     Timer timer;   
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicName;
-    int len = 0;
+    unsigned long long sent_us;
 
     InitTimer(&timer);
     countdown_ms(&timer, c->command_timeout_ms);
     
-    if (!c->isconnected)
+    if (!atomic_load_explicit(&c->isconnected, memory_order_acquire) || (rc = withinServerLimits(c, topic, message)) != SUCCESS)
         goto exit;
 
     if (message->qos == QOS1 || message->qos == QOS2)
         message->id = getNextPacketId(c);
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id, 
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
+    sent_us = monotonic_us();
+    if ((rc = sendPublish(c, topic, message, &timer)) != SUCCESS) // send the publish packet
         goto exit; // there was a problem
-    if (message->qos == QOS1)
+    if (message->qos == QOS1 || message->qos == QOS2)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
+        // acks of asynchronous publishes may come first, wait for the one matching our packet id
+        int ack_type = (message->qos == QOS1) ? PUBACK : PUBCOMP;
+        unsigned short mypacketid = 0;
+        unsigned char dup, type, reason = 0;
+        do
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            if (waitfor(c, ack_type, &timer) != ack_type ||
+                    MQTTV5Deserialize_ack(&type, &dup, &mypacketid, &reason, NULL, c->readbuf, c->readbuf_size) != 1)
+            {
                 rc = FAILURE;
-        }
-        else
-            rc = FAILURE;
+                break;
+            }
+        } while (mypacketid != message->id);
+        if (reason >= 0x80)
+            rc = FAILURE;   // MQTT 5: refused by the broker
+        if (rc == SUCCESS)
+            countRoundTrip(c, message->qos, sent_us);
     }
-    else if (message->qos == QOS2)
+    
+exit:
+    return rc;
+}
+
+
+/* Sends a publish without waiting for its acknowledgement: up to inflight_window QoS1/2 publishes can be
+   outstanding, fp is called when the broker acknowledges one.  When the window is full this call keeps
+   processing incoming packets until a slot frees up, for at most command_timeout_ms.
+   Unacknowledged publishes are sent again by the next successful MQTTConnect, see resendInflight.
+   SUCCESS once a QoS1/2 publish is in flight, even if sending it failed: fp reports its outcome.  FAILURE when it
+   could not be taken in flight, SERVER_LIMITS when the broker would not take it: fp is not called then */
+int MQTTPublishAsync(Client* c, const char* topicName, MQTTMessage* message, publishCompletionHandler fp, void* context)
+{
+    int rc = FAILURE;
+    Timer timer;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicName;
+    int len = 0;
+    struct InflightMessage* m = NULL;
+
+    InitTimer(&timer);
+    countdown_ms(&timer, c->command_timeout_ms);
+
+    if (!atomic_load_explicit(&c->isconnected, memory_order_acquire) || (rc = withinServerLimits(c, topic, message)) != SUCCESS)
+        goto exit;
+
+    if (message->qos == QOS0)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
-        }
-        else
-            rc = FAILURE;
+        message->id = 0;
+        if ((rc = sendPublish(c, topic, message, &timer)) == SUCCESS && fp != NULL)
+            fp(0, SUCCESS, context);
+        goto exit;
     }
-    
+
+    while (c->inflight_count >= inflightWindow(c))
+    {
+        if (expired(&timer) || cycle(c, &timer) == FAILURE)
+            goto exit;
+    }
+
+    do
+        message->id = getNextPacketId(c);
+    while (c->inflight[message->id % MAX_INFLIGHT_MESSAGES].id != 0); // the window is not full: a slot is free
+
+    /* the packet is kept for retransmission, so it is serialized once, straight into its own allocation.
+       With its topic in full: an alias would not hold on the connection it may be sent again on */
+    len = MQTTPacket_len(MQTTV5Serialize_publishLength(message->qos, topic, message->payloadlen, PROPERTIES(c)));
+    m = &c->inflight[message->id % MAX_INFLIGHT_MESSAGES];
+    m->size = len;
+    if ((m->packet = allocPacket(c, &m->size)) == NULL)
+        goto exit;
+    if (MQTTV5Serialize_publish(m->packet, len, 0, message->qos, message->retained, message->id,
+              topic, PROPERTIES(c), (unsigned char*)message->payload, message->payloadlen) != len)
+    {
+        freePacket(c, m->packet, m->size);
+        m->packet = NULL;
+        goto exit;
+    }
+    m->len = len;
+    m->id = message->id;
+    m->pubrel = 0;
+    m->version = c->MQTTVersion;
+    m->fp = fp;
+    m->context = context;
+    m->sent_us = monotonic_us();
+    c->inflight_count++;
+
+    // a failed send keeps the message in flight, it goes again on reconnect
+    if (c->server.topic_alias_maximum > 0)
+        sendPublishPayload(c, topic, message, m->packet + len - message->payloadlen, &timer);
+    else
+        sendBuffer(c, m->packet, len, &timer);
+    rc = SUCCESS;
+
 exit:
     return rc;
 }
@@ -525,19 +1337,11 @@ int MQTTDisconnect(Client* c)
 
     if (len > 0)
         rc = sendPacket(c, len, &timer);            // send the disconnect packet
+    if (rc == SUCCESS && c->ipstack->txlen > 0)
+        rc = (c->ipstack->mqttflush(c->ipstack, left_ms(&timer)) == 0) ? SUCCESS : FAILURE;
         
-    c->isconnected = 0;
-
-    int i;
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-    {
-        if (c->messageHandlers[i].topicFilter != NULL)
-        {
-            free(c->messageHandlers[i].topicFilter);
-            c->messageHandlers[i].topicFilter = NULL;
-            c->messageHandlers[i].fp = NULL;
-        }
-    }
+    atomic_store_explicit(&c->isconnected, 0, memory_order_release);
+    MQTTClearTopicAliases(c);
 
     return rc;
 }
@@ -19,15 +19,22 @@
 
 #include "MQTTPacket.h"
 #include "stdio.h"
+#include <stdatomic.h>
 #include "MQTTLinux.h" //Platform specific implementation header file
+#include "MQTTTopicTree.h"
 
 #define MAX_PACKET_ID 65535
-#define MAX_MESSAGE_HANDLERS 5
+#define MAX_INFLIGHT_MESSAGES 64    // QoS1/2 publishes awaiting their acknowledgement, see MQTTPublishAsync
+#define MAX_RESUBSCRIBE_BATCH 16    // topic filters per SUBSCRIBE when a new session is set up, see MQTTConnect
+#define MIN_BUFFER_SIZE 128         // arena mode: what buf and readbuf shrink back to, see MQTTSetBufferArena
+#define MQTT_STATS_RTT_BUCKETS 26   // acknowledgement round trips: bucket i counts those under 2^i us, the last one the rest
+#define MAX_TOPIC_ALIASES 8         // MQTT 5: topics sent by alias on a connection, the others go in full every time
 
 enum QoS { QOS0, QOS1, QOS2 };
 
 // all failure return codes must be negative
-enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+// SERVER_LIMITS: a publish the broker announced it would not take (MQTT 5 Maximum QoS, Maximum Packet Size)
+enum returnCode { SERVER_LIMITS = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
 void NewTimer(Timer*);
 
@@ -53,17 +60,48 @@ struct MessageData
 
 typedef void (*messageHandler)(MessageData*);
 
+// receives a payload too big for readbuf in chunks: message->payload/payloadlen is the chunk found at offset in the total length
+typedef void (*streamMessageHandler)(MessageData*, size_t offset, size_t total);
+
+// invoked once the broker has acknowledged an asynchronous publish (rc SUCCESS), or when it is dropped (rc FAILURE,
+// SERVER_LIMITS when refused before being sent)
+typedef void (*publishCompletionHandler)(unsigned short packetid, int rc, void* context);
+
+typedef struct MQTTStats MQTTStats;
+
+/* Counters kept by the client, see MQTTGetStats.  Packet types index the per-type arrays (PUBLISH is 3) */
+struct MQTTStats
+{
+    unsigned long long packets_out[16], bytes_out[16];     // packets written in full
+    unsigned long long packets_in[16], bytes_in[16];       // packets read, their streamed part included
+    unsigned long long ack_rtt[2][MQTT_STATS_RTT_BUCKETS]; // QoS1 PUBLISH to PUBACK, QoS2 PUBLISH to PUBCOMP
+    unsigned long long yield_calls;
+    unsigned long long yield_us;                           // time spent in MQTTYield and MQTTProcess
+    unsigned long long publishes_refused;                  // beyond the broker's Maximum QoS or Maximum Packet Size
+};
+
 typedef struct Client Client;
-typedef struct MessageHandlers MessageHandlers;
 
 int MQTTConnect (Client*, MQTTPacket_connectData*);
 int MQTTPublish (Client*, const char*, MQTTMessage*);
+int MQTTPublishAsync (Client*, const char*, MQTTMessage*, publishCompletionHandler, void*);
 int MQTTSubscribe (Client*, const char*, enum QoS, messageHandler);
 int MQTTUnsubscribe (Client*, const char*);
 int MQTTDisconnect (Client*);
 int MQTTYield (Client*, int);
+int MQTTProcess (Client*);
+int MQTTNextTimeout (Client*);
 
 void setDefaultMessageHandler(Client*, messageHandler);
+void setStreamMessageHandler(Client*, streamMessageHandler);
+void MQTTSetInflightWindow(Client*, unsigned int);
+void MQTTDropInflight(Client*);
+void MQTTClearSubscriptions(Client*);
+void MQTTClearTopicAliases(Client*);
+int MQTTSetBufferArena(Client*, MQTTArena*, size_t, unsigned int);
+void MQTTFreeBuffers(Client*);
+size_t MQTTBufferUsage(Client*);
+void MQTTGetStats(Client*, MQTTStats*);
 
 void MQTTClient(Client*, Network*, unsigned int, unsigned char*, size_t, unsigned char*, size_t);
 
@@ -75,18 +113,67 @@ struct Client {
     unsigned char *readbuf; 
     unsigned int keepAliveInterval;
     char ping_outstanding;
-    int isconnected;
+    atomic_int isconnected;     // threaded mode: set by the network thread, read by publishers (acquire/release)
+    unsigned char sessionPresent;   // the broker kept our session (subscriptions included) at the last connect
+    unsigned char MQTTVersion;      // of the last connect: 5 brings properties, reason codes and topic aliases
 
-    struct MessageHandlers
+    struct ServerLimits
     {
-        char* topicFilter;
-        void (*fp) (MessageData*);
-    } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+        unsigned int receive_maximum;       // QoS1/2 publishes it takes unacknowledged: caps inflight_window
+        unsigned int maximum_packet_size;   // larger publishes fail here rather than get us disconnected, 0: no limit
+        unsigned short topic_alias_maximum; // aliases we may use
+        unsigned char maximum_qos;          // publishes asking for more are refused: SERVER_LIMITS
+        unsigned char disconnect_reason;    // of the DISCONNECT it sent before closing the connection, if any
+    } server;                       // MQTT 5: what the broker announced in its CONNACK; MQTT 3: no limits
+
+    char* topic_aliases[MAX_TOPIC_ALIASES];     // MQTT 5: topic of alias i + 1, for this connection only
+    unsigned short topic_alias_count;
+
+    TopicNode subscriptions;    // Message handlers are indexed by subscription topic, one trie level per topic level.
+                                // Kept across connections: what the broker is to know, see MQTTConnect
     
     void (*defaultMessageHandler) (MessageData*);
+    streamMessageHandler streamHandler;
+
+    struct StreamedMessage
+    {
+        MQTTMessage message;        // payload/payloadlen: the current chunk
+        MQTTString topicName;       // points into readbuf, chunks are read after it
+        size_t offset, total;
+        int hdr;                    // where the payload starts in readbuf, -1 when the message is skipped
+        int active;
+    } stream;                       // inbound PUBLISH being streamed, see setStreamMessageHandler
+
+    struct InflightMessage
+    {
+        unsigned short id;          // 0 when the slot is free
+        unsigned char pubrel;       // PUBREC received, PUBREL sent: now waiting for PUBCOMP
+        unsigned char version;      // MQTTVersion the packet was serialized for
+        unsigned char* packet;      // serialized PUBLISH, kept for retransmission
+        int len;
+        size_t size;                // of the packet's buffer, drawn from the arena in arena mode
+        publishCompletionHandler fp;
+        void* context;
+        unsigned long long sent_us;     // first sent at, for the round trip statistics
+    } inflight[MAX_INFLIGHT_MESSAGES];  // indexed by packet id modulo MAX_INFLIGHT_MESSAGES
+    unsigned int inflight_window;
+    unsigned int inflight_count;
     
     Network* ipstack;
     Timer ping_timer;
+
+    MQTTTransport transport;    // packet read state, survives across non-blocking reads
+    Timer* read_timer;          // set while a blocking read is in progress, NULL for non-blocking
+
+    MQTTArena* arena;           // buf and readbuf are drawn from there, NULL when the application gave them
+    size_t max_packet_size;     // arena mode: what they may grow to
+    unsigned int buffer_idle_ms;
+    Timer idle_timer;           // arena mode: the buffers shrink back once it runs out, see trimBuffers
+    int delivering;             // message handlers running, they may hold pointers into readbuf
+    unsigned char* retired;     // readbuf as it was when they were called, if it had to grow since
+    size_t retired_size;
+
+    MQTTStats stats;            // written by the thread driving the client only, readable from any
 };
 
 #define DefaultClient {0, 0, 0, 0, NULL, NULL, 0, 0, 0}
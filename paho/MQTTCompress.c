@@ -0,0 +1,346 @@
+/*******************************************************************************
+ * MQTT payload compression
+ *
+ *    LZ77 codec for small, repetitive payloads such as the JSON published to
+ *    AirVantage. Matches may point back into a dictionary both ends know in
+ *    advance, so even a 40 byte message finds its keys and punctuation there.
+ *    A compressed payload starts with a marker byte no text payload starts
+ *    with, then the dictionary id and the original length, for the receiver
+ *
+ *******************************************************************************/
+
+#include "MQTTCompress.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12                        // 16 KB tables: the dictionary's, built once, the payload's on the stack
+#define SMALL_HASH_BITS 9                   // ... of which 2 KB are cleared for the usual small payload
+#define SMALL_INPUT 1024
+#define HEADER_MAX 6                        // marker, dictionary id, 4 byte length
+
+static const char airvantage_dictionary[] =
+    "\"luminosity\":\"\"humidity\":\"\"temperature\":\"\"light\":\"\"counter\":\""
+    "\"TurnOn\":{\"Light\":\"\"Message\":{\"msg\":\""
+    "[{\"uid\": \"\", \"status\" : \"ERROR\", \"message\" : \"\"}][{\"uid\": \"\", \"status\" : \"OK\"}]"
+    "{\"timestamp\" : \"\", \"value\" : \"\"}, {\"timestamp\" : 1500000000000, \"value\" : \"\"}]}"
+    "\"1500000000000\":{\"\"1600000000000\":{\"\"1700000000000\":{\"\"}, \"000\":{\""
+    "0.00\"}\"1.00\"}\"true\"}\"false\"}\"}}\"},{\"\":\"";
+
+static const struct
+{
+    const unsigned char* data;
+    size_t len;
+} dictionaries[] =
+{
+    {NULL, 0},
+    {(const unsigned char*)airvantage_dictionary, sizeof(airvantage_dictionary) - 1},
+};
+
+#define DICTIONARY_COUNT (int)(sizeof(dictionaries) / sizeof(dictionaries[0]))
+
+static uint32_t dictionary_tables[DICTIONARY_COUNT][1 << HASH_BITS];   // position + 1 of 4 bytes with that hash: 0 for none
+static pthread_once_t tables_built = PTHREAD_ONCE_INIT;
+
+
+static unsigned int hash(const unsigned char* p, int bits)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+
+static void buildTables(void)
+{
+    int i;
+    size_t pos;
+
+    for (i = 0; i < DICTIONARY_COUNT; ++i)
+    {
+        for (pos = 0; pos + MIN_MATCH <= dictionaries[i].len; ++pos)
+            dictionary_tables[i][hash(dictionaries[i].data + pos, HASH_BITS)] = pos + 1;
+    }
+}
+
+
+static size_t matchLength(const unsigned char* src, const unsigned char* send, const unsigned char* ip, const unsigned char* iend)
+{
+    const unsigned char* start = ip;
+
+    while (src < send && ip < iend && *src == *ip)
+    {
+        src++;
+        ip++;
+    }
+    return ip - start;
+}
+
+
+// 255-continued count, as in LZ4; NULL when it does not fit
+static unsigned char* writeCount(unsigned char* op, unsigned char* oend, size_t count)
+{
+    for (; count >= 255; count -= 255)
+    {
+        if (op == oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return NULL;
+    *op++ = (unsigned char)count;
+    return op;
+}
+
+
+static unsigned char* writeSequence(unsigned char* op, unsigned char* oend, const unsigned char* literals, size_t litlen,
+                                    size_t offset, size_t matchlen)
+{
+    unsigned char* token = op++;
+
+    if (token >= oend)
+        return NULL;
+    *token = (unsigned char)(((litlen < 15) ? litlen : 15) << 4);
+    if (litlen >= 15 && (op = writeCount(op, oend, litlen - 15)) == NULL)
+        return NULL;
+    if ((size_t)(oend - op) < litlen)
+        return NULL;
+    memcpy(op, literals, litlen);
+    op += litlen;
+    if (matchlen == 0)
+        return op;      // last sequence
+
+    matchlen -= MIN_MATCH;
+    *token |= (matchlen < 15) ? matchlen : 15;
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (matchlen >= 15 && (op = writeCount(op, oend, matchlen - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+
+/**
+ * Room to give MQTTCompress so that it cannot fail
+ */
+size_t MQTTCompressBound(size_t len)
+{
+    return HEADER_MAX + 1 + len + len / 255 + 1;
+}
+
+
+/**
+ * Compresses a payload
+ * @param in, inlen the payload
+ * @param out, outsize where to write the compressed payload: compression gives up once it is full,
+ *        so outsize = inlen - 1 only keeps the results worth sending
+ * @param dictionary MQTT_DICTIONARY_AIRVANTAGE, or MQTT_DICTIONARY_NONE
+ * @return the compressed length, -1 if it did not fit in outsize
+ */
+int MQTTCompress(const void* in, size_t inlen, void* out, size_t outsize, int dictionary)
+{
+    const unsigned char* ip = in;
+    const unsigned char* dict;
+    unsigned char* op = out;
+    unsigned char* oend = op + outsize;
+    uint32_t table[1 << HASH_BITS];     // position + 1 in the payload of 4 bytes with that hash: 0 for none
+    const uint32_t* dict_table;
+    size_t dictlen, pos, anchor = 0;
+    int bits = (inlen <= SMALL_INPUT) ? SMALL_HASH_BITS : HASH_BITS;
+
+    if (dictionary < 0 || dictionary >= DICTIONARY_COUNT || inlen > 0x0FFFFFFF || outsize < HEADER_MAX)
+        return -1;
+    pthread_once(&tables_built, buildTables);
+    dict = dictionaries[dictionary].data;
+    dictlen = dictionaries[dictionary].len;
+    dict_table = dictionary_tables[dictionary];
+
+    *op++ = MQTT_COMPRESS_MARKER;
+    *op++ = (unsigned char)dictionary;
+    pos = inlen;
+    do
+    {   // variable byte integer, as in the MQTT fixed header
+        unsigned char digit = pos % 128;
+
+        if ((pos /= 128) > 0)
+            digit |= 0x80;
+        *op++ = digit;
+    } while (pos > 0);
+
+    /* offsets count back through the payload, then on through the dictionary: a match is taken from
+       one or the other, the longer, never straddles both */
+    memset(table, 0, sizeof(uint32_t) << bits);
+    for (pos = 0; pos + MIN_MATCH <= inlen; )
+    {
+        unsigned int h = hash(ip + pos, bits);
+        size_t candidate = table[h], offset = 0, len = 0;
+
+        table[h] = pos + 1;
+        if (candidate-- > 0 && pos - candidate <= MAX_OFFSET)
+        {   // may overlap what it copies: the decoder goes byte by byte
+            len = matchLength(ip + candidate, ip + inlen, ip + pos, ip + inlen);
+            offset = pos - candidate;
+        }
+        if ((candidate = dict_table[hash(ip + pos, HASH_BITS)]) > 0 && dictlen + pos - --candidate <= MAX_OFFSET)
+        {
+            size_t dictmatch = matchLength(dict + candidate, dict + dictlen, ip + pos, ip + inlen);
+
+            if (dictmatch > len)
+            {
+                len = dictmatch;
+                offset = dictlen + pos - candidate;
+            }
+        }
+        if (len < MIN_MATCH)
+        {
+            pos++;
+            continue;
+        }
+
+        if ((op = writeSequence(op, oend, ip + anchor, pos - anchor, offset, len)) == NULL)
+            return -1;
+        pos += len;
+        anchor = pos;
+        if (pos + MIN_MATCH <= inlen)
+            table[hash(ip + pos - 2, bits)] = pos - 2 + 1;
+    }
+    if (anchor < inlen && (op = writeSequence(op, oend, ip + anchor, inlen - anchor, 0, 0)) == NULL)
+        return -1;
+    return op - (unsigned char*)out;
+}
+
+
+/**
+ * Whether a payload was produced by MQTTCompress : it starts with the marker, then a known dictionary id
+ */
+int MQTTIsCompressed(const void* in, size_t inlen)
+{
+    const unsigned char* ip = in;
+
+    return inlen >= 3 && ip[0] == MQTT_COMPRESS_MARKER && ip[1] < DICTIONARY_COUNT;
+}
+
+
+static int readHeader(const unsigned char** pptr, const unsigned char* iend, size_t* len)
+{
+    const unsigned char* ip = *pptr + 2;
+    size_t multiplier = 1;
+    int i;
+
+    *len = 0;
+    for (i = 0; i < 4; ++i)
+    {
+        if (ip == iend)
+            return 0;
+        *len += (*ip & 127) * multiplier;
+        multiplier *= 128;
+        if ((*ip++ & 128) == 0)
+        {
+            *pptr = ip;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * The length a compressed payload decompresses to, for sizing the buffer given to MQTTDecompress
+ * @return the length, -1 if the payload is not compressed
+ */
+int MQTTDecompressedLength(const void* in, size_t inlen)
+{
+    const unsigned char* ip = in;
+    size_t len;
+
+    if (!MQTTIsCompressed(in, inlen) || !readHeader(&ip, ip + inlen, &len))
+        return -1;
+    return (int)len;
+}
+
+
+// a 255-continued count; 0 if it runs past the input
+static int readCount(const unsigned char** pptr, const unsigned char* iend, size_t* count)
+{
+    unsigned char byte;
+
+    do
+    {
+        if (*pptr == iend)
+            return 0;
+        byte = *(*pptr)++;
+        *count += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+
+/**
+ * Decompresses a payload produced by MQTTCompress
+ * @param in, inlen the compressed payload
+ * @param out, outsize room for MQTTDecompressedLength bytes at least
+ * @return the decompressed length, -1 if the payload is malformed, or does not fit
+ */
+int MQTTDecompress(const void* in, size_t inlen, void* out, size_t outsize)
+{
+    const unsigned char* ip = in;
+    const unsigned char* iend = ip + inlen;
+    const unsigned char* dict;
+    unsigned char* op = out;
+    unsigned char* oend;
+    size_t len, dictlen;
+
+    if (!MQTTIsCompressed(in, inlen) || !readHeader(&ip, iend, &len) || len > outsize)
+        return -1;
+    dict = dictionaries[((const unsigned char*)in)[1]].data;
+    dictlen = dictionaries[((const unsigned char*)in)[1]].len;
+    oend = op + len;
+
+    while (ip < iend)
+    {
+        unsigned char token = *ip++;
+        size_t litlen = token >> 4, matchlen = token & 15, offset, produced;
+
+        if (litlen == 15 && !readCount(&ip, iend, &litlen))
+            return -1;
+        if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen)
+            return -1;
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == iend)
+            break;      // last sequence
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (matchlen == 15 && !readCount(&ip, iend, &matchlen))
+            return -1;
+        matchlen += MIN_MATCH;
+        produced = op - (unsigned char*)out;
+        if (offset == 0 || offset > produced + dictlen || (size_t)(oend - op) < matchlen)
+            return -1;
+        if (offset > produced)
+        {   // from the dictionary, and on into the output if the match is long enough
+            const unsigned char* src = dict + dictlen - (offset - produced);
+            size_t n = offset - produced;
+
+            if (n > matchlen)
+                n = matchlen;
+            memcpy(op, src, n);
+            op += n;
+            matchlen -= n;
+            offset = op - (unsigned char*)out;      // the rest starts over from the start of the output
+        }
+        for (; matchlen > 0; --matchlen, ++op)
+            *op = *(op - offset);
+    }
+    return (op == oend) ? (int)len : -1;
+}
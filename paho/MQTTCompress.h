@@ -0,0 +1,33 @@
+/*******************************************************************************
+ * MQTT payload compression
+ *
+ *    LZ77 codec for small, repetitive payloads such as the JSON published to
+ *    AirVantage. Matches may point back into a dictionary both ends know in
+ *    advance, so even a 40 byte message finds its keys and punctuation there.
+ *    A compressed payload starts with a marker byte no text payload starts
+ *    with, then the dictionary id and the original length, for the receiver
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_COMPRESS_
+#define __MQTT_COMPRESS_
+
+#include <stddef.h>
+
+#define MQTT_COMPRESS_MARKER 0x00           // first byte of a compressed payload
+#define MQTT_DICTIONARY_NONE 0
+#define MQTT_DICTIONARY_AIRVANTAGE 1        // JSON shapes of mqttAirVantage and swir_json, see MQTTCompress.c
+
+/* Layout :  marker, dictionary id, original length (MQTT variable byte integer), then sequences of
+   token (literal count << 4 | match length - 4), literal count extension, literals, match offset
+   (2 bytes, little endian, reaching back into the dictionary past the start of the output),
+   match length extension.  Extensions are bytes added up while they are 255, as in LZ4.  The last
+   sequence has literals only */
+
+size_t MQTTCompressBound(size_t);
+int MQTTCompress(const void*, size_t, void*, size_t, int);
+int MQTTIsCompressed(const void*, size_t);
+int MQTTDecompressedLength(const void*, size_t);
+int MQTTDecompress(const void*, size_t, void*, size_t);
+
+#endif
@@ -91,7 +91,7 @@ typedef struct
 	char struct_id[4];
 	/** The version number of this structure.  Must be 0 */
 	int struct_version;
-	/** Version of MQTT to be used.  3 = 3.1 4 = 3.1.1
+	/** Version of MQTT to be used.  3 = 3.1 4 = 3.1.1 5 = 5.0
 	  */
 	unsigned char MQTTVersion;
 	MQTTString clientID;
@@ -109,14 +109,14 @@ typedef union
 #if defined(REVERSED)
 	struct
 	{
-		unsigned int sessionpresent : 1;    /**< session present flag */
 		unsigned int : 7;	  	          /**< unused */
+		unsigned int sessionpresent : 1;    /**< session present flag, bit 0 */
 	} bits;
 #else
 	struct
 	{
+		unsigned int sessionpresent : 1;    /**< session present flag, bit 0 */
 		unsigned int : 7;	     			/**< unused */
-		unsigned int sessionpresent : 1;    /**< session present flag */
 	} bits;
 #endif
 } MQTTConnackFlags;	/**< connack flags byte */
@@ -124,12 +124,19 @@ typedef union
 #define MQTTPacket_connectData_initializer { {'M', 'Q', 'T', 'C'}, 0, 4, {NULL, {0, NULL}}, 60, 1, 0, \
 		MQTTPacket_willOptions_initializer, {NULL, {0, NULL}}, {NULL, {0, NULL}} }
 
+DLLExport int MQTTSerialize_connectLength(MQTTPacket_connectData* options);
 DLLExport int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options);
 DLLExport int MQTTDeserialize_connect(MQTTPacket_connectData* data, unsigned char* buf, int len);
 
 DLLExport int MQTTSerialize_connack(unsigned char* buf, int buflen, unsigned char connack_rc, unsigned char sessionPresent);
 DLLExport int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, unsigned char* buf, int buflen);
 
+DLLExport int MQTTV5Serialize_connectLength(MQTTPacket_connectData* options, MQTTProperties* connectProperties);
+DLLExport int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options, MQTTProperties* connectProperties);
+DLLExport int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent, unsigned char* connack_rc,
+		unsigned char* buf, int buflen);
+DLLExport int MQTTV5Deserialize_disconnect(MQTTProperties* properties, unsigned char* reasonCode, unsigned char* buf, int buflen);
+
 DLLExport int MQTTSerialize_disconnect(unsigned char* buf, int buflen);
 DLLExport int MQTTSerialize_pingreq(unsigned char* buf, int buflen);
 
@@ -22,22 +22,29 @@
 /**
   * Determines the length of the MQTT connect packet that would be produced using the supplied connect options.
   * @param options the options to be used to build the connect packet
+  * @param connectProperties MQTT 5 only: the CONNECT properties, NULL for none
   * @return the length of buffer needed to contain the serialized version of the packet
   */
-int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
+int MQTTV5Serialize_connectLength(MQTTPacket_connectData* options, MQTTProperties* connectProperties)
 {
+	MQTTProperties empty = MQTTProperties_initializer;
 	int len = 0;
 
 	FUNC_ENTRY;
 
 	if (options->MQTTVersion == 3)
 		len = 12; /* variable depending on MQTT or MQIsdp */
-	else if (options->MQTTVersion == 4)
+	else if (options->MQTTVersion >= 4)
 		len = 10;
 
+	if (options->MQTTVersion == 5)
+		len += MQTTProperties_len(connectProperties ? connectProperties : &empty);
+
 	len += MQTTstrlen(options->clientID)+2;
 	if (options->willFlag)
 		len += MQTTstrlen(options->will.topicName)+2 + MQTTstrlen(options->will.message)+2;
+	if (options->willFlag && options->MQTTVersion == 5)
+		len += MQTTProperties_len(&empty); /* no will properties */
 	if (options->username.cstring || options->username.lenstring.data)
 		len += MQTTstrlen(options->username)+2;
 	if (options->password.cstring || options->password.lenstring.data)
@@ -48,23 +55,35 @@ int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
 }
 
 
+int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
+{
+	return MQTTV5Serialize_connectLength(options, NULL);
+}
+
+
 /**
   * Serializes the connect options into the buffer.
   * @param buf the buffer into which the packet will be serialized
   * @param len the length in bytes of the supplied buffer
   * @param options the options to be used to build the connect packet
+  * @param connectProperties MQTT 5 only: the CONNECT properties, NULL for none
   * @return serialized length, or error if 0
   */
-int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options)
+int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options, MQTTProperties* connectProperties)
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
 	MQTTConnectFlags flags = {0};
+	MQTTProperties empty = MQTTProperties_initializer;
 	int len = 0;
 	int rc = -1;
 
 	FUNC_ENTRY;
-	if (MQTTPacket_len(len = MQTTSerialize_connectLength(options)) > buflen)
+	if (options->MQTTVersion == 5 && connectProperties == NULL)
+		connectProperties = &empty;
+	else if (options->MQTTVersion != 5)
+		connectProperties = NULL;
+	if (MQTTPacket_len(len = MQTTV5Serialize_connectLength(options, connectProperties)) > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -76,10 +95,10 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	ptr += MQTTPacket_encode(ptr, len); /* write remaining length */
 
-	if (options->MQTTVersion == 4)
+	if (options->MQTTVersion >= 4)
 	{
 		writeCString(&ptr, "MQTT");
-		writeChar(&ptr, (char) 4);
+		writeChar(&ptr, (char) options->MQTTVersion);
 	}
 	else
 	{
@@ -103,9 +122,12 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	writeChar(&ptr, flags.all);
 	writeInt(&ptr, options->keepAliveInterval);
+	MQTTProperties_write(&ptr, connectProperties);
 	writeMQTTString(&ptr, options->clientID);
 	if (options->willFlag)
 	{
+		if (connectProperties != NULL)
+			MQTTProperties_write(&ptr, &empty);
 		writeMQTTString(&ptr, options->will.topicName);
 		writeMQTTString(&ptr, options->will.message);
 	}
@@ -121,15 +143,23 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 }
 
 
+int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options)
+{
+	return MQTTV5Serialize_connect(buf, buflen, options, NULL);
+}
+
+
 /**
   * Deserializes the supplied (wire) buffer into connack data - return code
+  * @param connackProperties MQTT 5 only: returned CONNACK properties, NULL for an MQTT 3 CONNACK
   * @param sessionPresent the session present flag returned (only for MQTT 3.1.1)
-  * @param connack_rc returned integer value of the connack return code
+  * @param connack_rc returned integer value of the connack return code, the reason code for MQTT 5
   * @param buf the raw buffer data, of the correct length determined by the remaining length field
   * @param len the length in bytes of the data in the supplied buffer
   * @return error code.  1 is success, 0 is failure
   */
-int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, unsigned char* buf, int buflen)
+int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent, unsigned char* connack_rc,
+		unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -143,7 +173,7 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 	if (header.bits.type != CONNACK)
 		goto exit;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
 	enddata = curdata + mylen;
 	if (enddata - curdata < 2)
 		goto exit;
@@ -152,6 +182,14 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 	*sessionPresent = flags.bits.sessionpresent;
 	*connack_rc = readChar(&curdata);
 
+	/* a refusal from an MQTT 3 server, to an MQTT 5 CONNECT, comes without properties */
+	if (connackProperties != NULL)
+	{
+		connackProperties->count = connackProperties->length = 0;
+		if (curdata < enddata && !MQTTProperties_read(connackProperties, &curdata, enddata))
+			goto exit;
+	}
+
 	rc = 1;
 exit:
 	FUNC_EXIT_RC(rc);
@@ -159,6 +197,12 @@ exit:
 }
 
 
+int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_connack(NULL, sessionPresent, connack_rc, buf, buflen);
+}
+
+
 /**
   * Serializes a 0-length packet into the supplied buffer, ready for writing to a socket
   * @param buf the buffer into which the packet will be serialized
@@ -202,6 +246,45 @@ int MQTTSerialize_disconnect(unsigned char* buf, int buflen)
 }
 
 
+/**
+  * Deserializes a disconnect packet sent by an MQTT 5 server
+  * @param properties returned DISCONNECT properties (reason string, server reference...), may be NULL
+  * @param reasonCode returned reason code, 0 (normal disconnection) when the packet has none
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_disconnect(MQTTProperties* properties, unsigned char* reasonCode, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != DISCONNECT)
+		goto exit;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+
+	*reasonCode = (enddata - curdata > 0) ? readChar(&curdata) : 0;
+	if (properties != NULL)
+	{
+		properties->count = properties->length = 0;
+		if (curdata < enddata && !MQTTProperties_read(properties, &curdata, enddata))
+			goto exit;
+	}
+
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
   * Serializes a disconnect packet into the supplied buffer, ready for writing to a socket
   * @param buf the buffer into which the packet will be serialized
@@ -27,14 +27,15 @@
   * @param retained returned integer - the MQTT retained flag
   * @param packetid returned integer - the MQTT packet identifier
   * @param topicName returned MQTTString - the MQTT topic in the publish
+  * @param properties returned MQTTProperties - MQTT 5 only: the PUBLISH properties, NULL for an MQTT 3 publish
   * @param payload returned byte buffer - the MQTT publish payload
   * @param payloadlen returned integer - the length of the MQTT payload
   * @param buf the raw buffer data, of the correct length determined by the remaining length field
   * @param buflen the length in bytes of the data in the supplied buffer
   * @return error code.  1 is success
   */
-int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
-		unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
+		MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -50,7 +51,7 @@ int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retaine
 	*qos = header.bits.qos;
 	*retained = header.bits.retain;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
 	enddata = curdata + mylen;
 
 	if (!readMQTTLenString(topicName, &curdata, enddata) ||
@@ -60,6 +61,9 @@ int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retaine
 	if (*qos > 0)
 		*packetid = readInt(&curdata);
 
+	if (properties != NULL && !MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
 	*payloadlen = enddata - curdata;
 	*payload = curdata;
 	rc = 1;
@@ -69,17 +73,27 @@ exit:
 }
 
 
+int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
+		unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_publish(dup, qos, retained, packetid, topicName, NULL, payload, payloadlen, buf, buflen);
+}
+
+
 
 /**
   * Deserializes the supplied (wire) buffer into an ack
   * @param packettype returned integer - the MQTT packet type
   * @param dup returned integer - the MQTT dup flag
   * @param packetid returned integer - the MQTT packet identifier
+  * @param reasonCode returned integer - MQTT 5 only: the reason code, 0 (success) when the ack has none.  May be NULL
+  * @param properties returned MQTTProperties - MQTT 5 only: the ack properties, NULL for an MQTT 3 ack
   * @param buf the raw buffer data, of the correct length determined by the remaining length field
   * @param buflen the length in bytes of the data in the supplied buffer
   * @return error code.  1 is success, 0 is failure
   */
-int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen)
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* reasonCode,
+		MQTTProperties* properties, unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -92,16 +106,31 @@ int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned
 	*dup = header.bits.dup;
 	*packettype = header.bits.type;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
 	enddata = curdata + mylen;
 
 	if (enddata - curdata < 2)
 		goto exit;
 	*packetid = readInt(&curdata);
 
+	if (reasonCode != NULL)
+		*reasonCode = (enddata - curdata > 0) ? readChar(&curdata) : 0;
+	if (properties != NULL)
+	{
+		properties->count = properties->length = 0;
+		if (curdata < enddata && !MQTTProperties_read(properties, &curdata, enddata))
+			goto exit;
+	}
+
 	rc = 1;
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
+
+int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_ack(packettype, dup, packetid, NULL, NULL, buf, buflen);
+}
+
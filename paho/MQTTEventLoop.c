@@ -0,0 +1,178 @@
+/*******************************************************************************
+ * MQTT event loop
+ *
+ *    epoll driven runtime for the paho Client : many clients are served from a
+ *    single thread, which only wakes up when a socket is readable or when a
+ *    keepalive is due. Built on MQTTPacket_readnb (see MQTTProcess), keepalives
+ *    are kept in a timer wheel so that a wake-up costs nothing per idle client
+ *
+ *******************************************************************************/
+
+#include "MQTTEventLoop.h"
+
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64   // readable sockets handled per epoll_wait
+
+
+int EventLoopInit(EventLoop* loop, clientErrorHandler onError)
+{
+    loop->clients = NULL;
+    loop->count = loop->size = 0;
+    loop->onError = onError;
+    TimerWheelInit(&loop->wheel, monotonic_ms());
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    return (loop->epfd < 0) ? FAILURE : SUCCESS;
+}
+
+
+void EventLoopClose(EventLoop* loop)
+{
+    int i;
+
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = -1;
+
+    for (i = 0; i < loop->count; ++i)
+        free(loop->clients[i]);
+    free(loop->clients);
+    loop->clients = NULL;
+    loop->count = loop->size = 0;
+}
+
+
+// when the client next needs attention without its socket becoming readable
+static void schedule(struct EventLoopClient* entry)
+{
+    int next = linux_pending(entry->c->ipstack) > 0 ? 0 : MQTTNextTimeout(entry->c);
+
+    if (next < 0)
+        TimerWheelCancel(&entry->loop->wheel, &entry->keepalive);
+    else
+        TimerWheelAdd(&entry->loop->wheel, &entry->keepalive, monotonic_ms() + next);
+}
+
+
+static void removeEntry(EventLoop* loop, struct EventLoopClient* entry)
+{
+    int fd = linux_getfd(entry->c->ipstack);
+
+    if (fd >= 0)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    TimerWheelCancel(&loop->wheel, &entry->keepalive);
+    loop->clients[entry->index] = loop->clients[--loop->count];
+    loop->clients[entry->index]->index = entry->index;
+    free(entry);
+}
+
+
+static void process(struct EventLoopClient* entry)
+{
+    EventLoop* loop = entry->loop;
+    Client* c = entry->c;
+
+    if (MQTTProcess(c) != SUCCESS)
+    {
+        void* context = entry->context;
+
+        removeEntry(loop, entry);  // no search: a broker going down drops every client at once
+        atomic_store_explicit(&c->isconnected, 0, memory_order_release);
+        if (loop->onError)
+            loop->onError(c, context);
+    }
+    else
+        schedule(entry);
+}
+
+
+static void onKeepalive(WheelTimer* t, void* context)
+{
+    process((struct EventLoopClient*)context);
+}
+
+
+// the client must be connected: its socket is registered with the loop.  context goes to onError, should it fail
+struct EventLoopClient* EventLoopAdd(EventLoop* loop, Client* c, void* context)
+{
+    struct epoll_event ev;
+    struct EventLoopClient* entry;
+    int fd = linux_getfd(c->ipstack);
+
+    if (fd < 0)
+        return NULL;
+
+    if (loop->count == loop->size)
+    {
+        int size = (loop->size == 0) ? 16 : loop->size * 2;
+        struct EventLoopClient** clients = realloc(loop->clients, size * sizeof(struct EventLoopClient*));
+        if (clients == NULL)
+            return NULL;
+        loop->clients = clients;
+        loop->size = size;
+    }
+    if ((entry = malloc(sizeof(struct EventLoopClient))) == NULL)
+        return NULL;
+    entry->c = c;
+    entry->loop = loop;
+    entry->context = context;
+    WheelTimerInit(&entry->keepalive, onKeepalive, entry);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = entry;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    entry->index = loop->count;
+    loop->clients[loop->count++] = entry;
+    schedule(entry);
+    return entry;
+}
+
+
+void EventLoopRemove(struct EventLoopClient* entry)
+{
+    removeEntry(entry->loop, entry);
+}
+
+
+/* To be called after using the client outside the loop (publishing from the application, say): packets
+   held back by a coalescing Network then get written out in time */
+void EventLoopSchedule(struct EventLoopClient* entry)
+{
+    schedule(entry);
+}
+
+
+/* Waits until a socket is readable or a timer is due, at most timeout_ms (-1: no limit, 0: just poll),
+   and processes those clients.  Returns the number of clients processed, FAILURE if epoll fails */
+int EventLoopRun(EventLoop* loop, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int wait_ms = timeout_ms;
+    int i, n, next, processed = 0;
+
+    processed += TimerWheelAdvance(&loop->wheel, monotonic_ms());
+
+    next = TimerWheelNextTimeout(&loop->wheel);
+    if (next >= 0 && (wait_ms < 0 || next < wait_ms))
+        wait_ms = next;
+
+    if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, wait_ms)) < 0)
+        return (errno == EINTR) ? processed : FAILURE;
+
+    // timers run afterwards: a client they remove on failure could still have an event in the list
+    for (i = 0; i < n; ++i)
+    {
+        process((struct EventLoopClient*)events[i].data.ptr);
+        processed++;
+    }
+
+    processed += TimerWheelAdvance(&loop->wheel, monotonic_ms());
+    return processed;
+}
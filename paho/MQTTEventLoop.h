@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * MQTT event loop
+ *
+ *    epoll driven runtime for the paho Client : many clients are served from a
+ *    single thread, which only wakes up when a socket is readable or when a
+ *    keepalive is due. Built on MQTTPacket_readnb (see MQTTProcess), keepalives
+ *    are kept in a timer wheel so that a wake-up costs nothing per idle client
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_EVENT_LOOP_
+#define __MQTT_EVENT_LOOP_
+
+#include "MQTTClient.h"
+#include "MQTTTimerWheel.h"
+
+typedef struct EventLoop EventLoop;
+struct EventLoopClient;
+
+// invoked from EventLoopRun when a client's connection has failed, with the context it was added with; the client
+// is already removed from the loop. It may add the client back, but must not remove other clients
+typedef void (*clientErrorHandler)(Client*, void*);
+
+// EventLoopAdd returns the client's entry in the loop, NULL on failure: removing or scheduling it then costs no search.
+// The entry is freed when the client leaves the loop, on EventLoopRemove or before onError is invoked
+int EventLoopInit(EventLoop*, clientErrorHandler);
+struct EventLoopClient* EventLoopAdd(EventLoop*, Client*, void*);
+void EventLoopRemove(struct EventLoopClient*);
+void EventLoopSchedule(struct EventLoopClient*);
+int EventLoopRun(EventLoop*, int);
+void EventLoopClose(EventLoop*);
+
+struct EventLoopClient {
+    Client* c;
+    EventLoop* loop;
+    WheelTimer keepalive;       // fires when MQTTProcess may have a PINGREQ or coalesced writes to send
+    void* context;              // for onError
+    int index;                  // in loop->clients
+};
+
+struct EventLoop {
+    int epfd;
+    struct EventLoopClient** clients;
+    int count, size;
+    TimerWheel wheel;           // other timers (time-outs, reconnect delays) can be armed on it too
+
+    clientErrorHandler onError;
+};
+
+#endif
@@ -22,64 +22,84 @@
 #include "SocketInterface.h"
 #endif
 
+/* Milliseconds on a clock that wall-clock changes (NTP, date) do not move.  The coarse variant is a plain
+   memory read, its few ms of resolution are plenty for keepalives and command time-outs */
+unsigned long long monotonic_ms(void)
+{
+	struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* Microseconds on the same clock, at full resolution: for measuring, not for time-outs */
+unsigned long long monotonic_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
 char expired(Timer* timer)
 {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);		
-	return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+	return monotonic_ms() >= timer->end_ms;
 }
 
 
 void countdown_ms(Timer* timer, unsigned int timeout)
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = {timeout / 1000, (timeout % 1000) * 1000};
-	timeradd(&now, &interval, &timer->end_time);
+	timer->end_ms = monotonic_ms() + timeout;
 }
 
 
 void countdown(Timer* timer, unsigned int timeout)
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = {timeout, 0};
-	timeradd(&now, &interval, &timer->end_time);
+	timer->end_ms = monotonic_ms() + (unsigned long long)timeout * 1000;
 }
 
 
 int left_ms(Timer* timer)
 {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);
-	//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-	return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+	unsigned long long now = monotonic_ms();
+	return (now >= timer->end_ms) ? 0 : (int)(timer->end_ms - now);
 }
 
 
 void InitTimer(Timer* timer)
 {
-	timer->end_time = (struct timeval){0, 0};
+	timer->end_ms = 0;
 }
 
 
-int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+/* One receive call into the read-ahead buffer (or straight into dst when it is the bigger one).
+   Returns the number of bytes received, 0 on time-out, -1 on error.
+   A timeout_ms of 0 means do not wait at all */
+static int linux_fill(Network* n, unsigned char* dst, int len, int timeout_ms)
 {
-	if (timeout_ms <= 0)
-	{
-		timeout_ms = 500;
-	}
-	
 #ifdef USE_SOCKET_CLASS
 	if (n->pSocketInstance)
 	{
-		SOCKET_setTimeout(n->pSocketInstance, timeout_ms);
-		return SOCKET_receive(n->pSocketInstance, (char *) buffer, len);
+		if (timeout_ms == 0)
+			SOCKET_setNonBlocking(n->pSocketInstance);
+		else
+			SOCKET_setTimeout(n->pSocketInstance, timeout_ms);
+		return SOCKET_receiveSome(n->pSocketInstance, (char *) dst, len);
 	}
 	return -1;
 #else
+	if (timeout_ms == 0)
+	{
+		int rc = recv(n->my_socket, dst, (size_t)len, MSG_DONTWAIT);
+		if (rc == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		return (rc == 0) ? -1 : rc;
+	}
+
 	struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
 	if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
 	{
@@ -89,27 +109,111 @@ int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
 
 	setsockopt(n->my_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
 
+	int rc = recv(n->my_socket, dst, (size_t)len, 0);
+	if (rc == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	return (rc == 0) ? -1 : rc;
+#endif
+}
+
+
+static unsigned char* linux_alloc(Network* n, size_t size)
+{
+	if (n->arena)
+		return MQTTArenaAlloc(n->arena, &size);
+	return malloc(size);
+}
+
+
+static void linux_free(Network* n, unsigned char* buf, size_t size)
+{
+	if (n->arena)
+		MQTTArenaFree(n->arena, buf, size);
+	else
+		free(buf);
+}
+
+
+int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	Timer timer;
 	int bytes = 0;
+
+	if (timeout_ms <= 0)
+	{
+		timeout_ms = 500;
+	}
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
+
+	/* about to wait for the peer: it may well be waiting for what we held back */
+	if (n->txlen > 0 && n->rxpos + len > n->rxlen && linux_flush(n, timeout_ms) < 0)
+		return -1;
+
 	while (bytes < len)
 	{
-		int rc = recv(n->my_socket, &buffer[bytes], (size_t)(len - bytes), 0);
-		if (rc == -1)
+		int rc, wait_ms;
+
+		if (n->rxpos < n->rxlen)
+		{	/* serve from what previous receive calls already brought in */
+			int chunk = MIN(len - bytes, n->rxlen - n->rxpos);
+			memcpy(&buffer[bytes], &n->rxbuf[n->rxpos], chunk);
+			n->rxpos += chunk;
+			bytes += chunk;
+			continue;
+		}
+
+		if ((wait_ms = left_ms(&timer)) <= 0)
 		{
-			if (errno != ENOTCONN && errno != ECONNRESET)
-			{
-				bytes = -1;
+			if (bytes > 0)
 				break;
-			}
+			wait_ms = 1;
 		}
-		else
-			bytes += rc;
+
+		n->rxpos = n->rxlen = 0;
+		if (n->rxbuf == NULL)
+			n->rxbuf = linux_alloc(n, NETWORK_RX_BUFFER_SIZE);
+		if (len - bytes >= NETWORK_RX_BUFFER_SIZE || n->rxbuf == NULL)
+		{	/* big payload: no point in staging it */
+			rc = linux_fill(n, &buffer[bytes], len - bytes, wait_ms);
+			if (rc > 0)
+				bytes += rc;
+		}
+		else if ((rc = linux_fill(n, n->rxbuf, NETWORK_RX_BUFFER_SIZE, wait_ms)) > 0)
+			n->rxlen = rc;
+
+		if (rc < 0)
+			return (bytes > 0) ? bytes : -1;
+		if (rc == 0)
+			break;	/* timed out */
 	}
 	return bytes;
-#endif
 }
 
 
-int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+int linux_read_nb(Network* n, unsigned char* buffer, int len)
+{
+	int rc;
+
+	if (n->rxpos == n->rxlen)
+	{
+		n->rxpos = n->rxlen = 0;
+		if (n->rxbuf == NULL && (n->rxbuf = linux_alloc(n, NETWORK_RX_BUFFER_SIZE)) == NULL)
+			return linux_fill(n, buffer, len, 0);
+		if ((rc = linux_fill(n, n->rxbuf, NETWORK_RX_BUFFER_SIZE, 0)) <= 0)
+			return rc;
+		n->rxlen = rc;
+	}
+
+	rc = MIN(len, n->rxlen - n->rxpos);
+	memcpy(buffer, &n->rxbuf[n->rxpos], rc);
+	n->rxpos += rc;
+	return rc;
+}
+
+
+static int linux_send(Network* n, unsigned char* buffer, int len, int timeout_ms)
 {
 #ifdef USE_SOCKET_CLASS
 	if (n->pSocketInstance)
@@ -131,12 +235,166 @@ int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
 }
 
 
+static int linux_sendv(Network* n, struct iovec* iov, int iovcnt, int timeout_ms)
+{
+#ifdef USE_SOCKET_CLASS
+	if (n->pSocketInstance)
+	{
+		SOCKET_setTimeout(n->pSocketInstance, timeout_ms);
+		return SOCKET_sendVector(n->pSocketInstance, iov, iovcnt);
+	}
+	return 0;
+#else
+	struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+	if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
+	{
+		interval.tv_sec = 0;
+		interval.tv_usec = 100;
+	}
+
+	setsockopt(n->my_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&interval, sizeof(struct timeval));
+	return writev(n->my_socket, iov, iovcnt);
+#endif
+}
+
+
+/* Writes out the coalesced packets, resuming after partial writes.  Returns 0, or -1 if they could not all go */
+int linux_flush(Network* n, int timeout_ms)
+{
+	Timer timer;
+	int sent = 0;
+
+	InitTimer(&timer);
+	countdown_ms(&timer, timeout_ms);
+	while (sent < n->txlen)
+	{
+		int rc = linux_send(n, &n->txbuf[sent], n->txlen - sent, left_ms(&timer));
+		if (rc < 0 || (rc == 0 && expired(&timer)))
+			break;
+		sent += rc;
+	}
+	if (sent > 0)
+		memmove(n->txbuf, &n->txbuf[sent], n->txlen - sent);
+	n->txlen -= sent;
+	return (n->txlen == 0) ? 0 : -1;
+}
+
+
+/* Copies a packet behind those already waiting, writing them all out once the threshold is reached.
+   Returns the packet length, -1 on error, 0 if the packet has to be written directly */
+static int linux_stage(Network* n, struct iovec* iov, int iovcnt, int len, int timeout_ms)
+{
+	int i;
+
+	if (n->txbuf == NULL && (n->txbuf = linux_alloc(n, NETWORK_TX_BUFFER_SIZE)) == NULL)
+		return 0;
+	if (n->txlen + len > NETWORK_TX_BUFFER_SIZE && linux_flush(n, timeout_ms) < 0)
+		return -1;
+
+	if (n->txlen == 0)
+		countdown_ms(&n->txtimer, n->txdelay_ms);
+	for (i = 0; i < iovcnt; ++i)
+	{
+		memcpy(&n->txbuf[n->txlen], iov[i].iov_base, iov[i].iov_len);
+		n->txlen += iov[i].iov_len;
+	}
+
+	if (n->txlen >= n->txthreshold && linux_flush(n, timeout_ms) < 0)
+		return -1;
+	return len;
+}
+
+
+int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	if (n->txthreshold > 0 && len < n->txthreshold)
+	{
+		struct iovec iov = {buffer, (size_t)len};
+		int rc = linux_stage(n, &iov, 1, len, timeout_ms);
+		if (rc != 0)
+			return rc;
+	}
+	if (n->txlen > 0 && linux_flush(n, timeout_ms) < 0)	/* keep the packets in order */
+		return -1;
+	return linux_send(n, buffer, len, timeout_ms);
+}
+
+
+int linux_writev(Network* n, struct iovec* iov, int iovcnt, int timeout_ms)
+{
+	if (n->txthreshold > 0)
+	{
+		int i, len = 0;
+
+		for (i = 0; i < iovcnt; ++i)
+			len += iov[i].iov_len;
+		if (len < n->txthreshold)
+		{
+			int rc = linux_stage(n, iov, iovcnt, len, timeout_ms);
+			if (rc != 0)
+				return rc;
+		}
+	}
+	if (n->txlen > 0 && linux_flush(n, timeout_ms) < 0)
+		return -1;
+	return linux_sendv(n, iov, iovcnt, timeout_ms);
+}
+
+
+/* Coalescing mode: packets smaller than threshold bytes are held back and written out together, once
+   threshold bytes are waiting or the oldest has waited delay_ms.  Whoever drives the client must then
+   call MQTTProcess (or a blocking read) by MQTTNextTimeout.  A threshold of 0 turns coalescing off */
+void linux_coalesce(Network* n, int threshold, int delay_ms)
+{
+	if (threshold > NETWORK_TX_BUFFER_SIZE)
+		threshold = NETWORK_TX_BUFFER_SIZE;
+	n->txthreshold = (threshold > 0) ? threshold : 0;
+	n->txdelay_ms = (delay_ms > 0) ? delay_ms : 0;
+}
+
+
+/* Buffers come from arena from now on (NULL: the heap again).  To be set while they are not held */
+void linux_arena(Network* n, MQTTArena* arena)
+{
+	linux_trim(n);
+	n->arena = arena;
+}
+
+
+/* Gives back the read-ahead and coalescing buffers if nothing is waiting in them: an idle connection holds neither */
+void linux_trim(Network* n)
+{
+	if (n->rxbuf != NULL && n->rxpos == n->rxlen)
+	{
+		linux_free(n, n->rxbuf, NETWORK_RX_BUFFER_SIZE);
+		n->rxbuf = NULL;
+		n->rxpos = n->rxlen = 0;
+	}
+	if (n->txbuf != NULL && n->txlen == 0)
+	{
+		linux_free(n, n->txbuf, NETWORK_TX_BUFFER_SIZE);
+		n->txbuf = NULL;
+	}
+}
+
+
+// bytes of buffers held right now
+size_t linux_buffered(Network* n)
+{
+	return (n->rxbuf ? NETWORK_RX_BUFFER_SIZE : 0) + (n->txbuf ? NETWORK_TX_BUFFER_SIZE : 0);
+}
+
+
 void linux_disconnect(Network* n)
 {
 	if (!n->disconnect)
 	{
 		return;
 	}
+
+	n->rxpos = n->rxlen = 0;
+	n->txlen = 0;
+	linux_trim(n);
 	
 #ifdef USE_SOCKET_CLASS
 	if (n->pSocketInstance)
@@ -158,18 +416,68 @@ void linux_disconnect(Network* n)
 void NewNetwork(Network* n)
 {
 	n->pSocketInstance = NULL;
+	n->rxpos = n->rxlen = 0;
+	n->rxbuf = n->txbuf = NULL;
+	n->arena = NULL;
+	n->txlen = n->txthreshold = n->txdelay_ms = 0;
+	InitTimer(&n->txtimer);
 	n->my_socket = -1;
 	n->mqttread = linux_read;
+	n->mqttreadnb = linux_read_nb;
 	n->mqttwrite = linux_write;
+	n->mqttwritev = linux_writev;
+	n->mqttflush = linux_flush;
 	n->connect = linux_connect;
 	n->disconnect = linux_disconnect;
 }
 
 
+int linux_getfd(Network* n)
+{
+#ifdef USE_SOCKET_CLASS
+	return SOCKET_getFd(n->pSocketInstance);
+#else
+	return n->my_socket;
+#endif
+}
+
+
+/* Bytes that can be read without the descriptor being readable: our read-ahead plus the socket layer's own buffer */
+int linux_pending(Network* n)
+{
+	int pending = n->rxlen - n->rxpos;
+
+#ifdef USE_SOCKET_CLASS
+	pending += SOCKET_pending(n->pSocketInstance);
+#endif
+	return pending;
+}
+
+
+/* TLS records written and read by the current connection, 0 when there is none or it is not secured */
+void linux_records(Network* n, unsigned long* sent, unsigned long* received)
+{
+#ifdef USE_SOCKET_CLASS
+	SOCKET_getRecordCounts(n->pSocketInstance, sent, received);
+#else
+	*sent = *received = 0;
+#endif
+}
+
+
 int linux_connect(Network* n, char* addr, int port, int useTLS)
 {
 	int rc = -1;
 
+	n->rxpos = n->rxlen = 0;
+	n->txlen = 0;	/* what the previous connection held back is not for this one */
+
+	/* a peer closing the connection must show up as a write error, not kill the process:
+	   unless the application handles SIGPIPE itself, it is ignored */
+	struct sigaction pipe_action;
+	if (sigaction(SIGPIPE, NULL, &pipe_action) == 0 && pipe_action.sa_handler == SIG_DFL)
+		signal(SIGPIPE, SIG_IGN);
+
 #ifdef USE_SOCKET_CLASS
 	if (n->pSocketInstance)
 	{
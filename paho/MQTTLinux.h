@@ -21,7 +21,9 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -35,24 +37,43 @@
 #include <string.h>
 #include <signal.h>
 
+#include "MQTTArena.h"
+
 typedef struct Timer Timer;
 
 struct Timer {
-	struct timeval end_time;
+	unsigned long long end_ms;	/* deadline on the monotonic clock, see monotonic_ms() */
 };
 
 typedef struct Network Network;
 
+#define NETWORK_RX_BUFFER_SIZE 4096	/* bytes pulled from the socket per receive call */
+#define NETWORK_TX_BUFFER_SIZE 16384	/* coalesced writes: the largest TLS record payload */
+
 struct Network
 {
 	int my_socket;
 	void*	pSocketInstance;
+	unsigned char* rxbuf;	/* read-ahead: several MQTT packets can be split out of one recv. Taken when reading, see linux_trim */
+	int rxpos;	/* next unread byte in rxbuf */
+	int rxlen;	/* number of valid bytes in rxbuf */
+	unsigned char* txbuf;	/* coalescing mode: small packets wait here to go out in one write, hence one TLS record */
+	int txlen;	/* bytes waiting in txbuf */
+	int txthreshold;	/* written out once that many bytes are waiting, 0 when coalescing is off */
+	int txdelay_ms;	/* ... or once the oldest has waited that long */
+	Timer txtimer;	/* deadline of the oldest waiting byte */
+	MQTTArena* arena;	/* where rxbuf and txbuf come from, NULL for the heap */
 	int (*mqttread) (Network*, unsigned char*, int, int);
+	int (*mqttreadnb) (Network*, unsigned char*, int);	/* never blocks: bytes read, 0 if nothing readable, -1 on error */
 	int (*mqttwrite) (Network*, unsigned char*, int, int);
+	int (*mqttwritev) (Network*, struct iovec*, int, int);	/* gathers the buffers on the wire, not in memory */
+	int (*mqttflush) (Network*, int);	/* coalescing mode: writes out whatever is waiting, 0 or -1 on error */
 	void (*disconnect) (Network*);
 	int (*connect)(Network*, char*, int, int);
 };
 
+unsigned long long monotonic_ms(void);
+unsigned long long monotonic_us(void);
 char expired(Timer*);
 void countdown_ms(Timer*, unsigned int);
 void countdown(Timer*, unsigned int);
@@ -63,8 +84,18 @@ void InitTimer(Timer*);
 void NewNetwork(Network*);
 
 int linux_read(Network*, unsigned char*, int, int);
+int linux_read_nb(Network*, unsigned char*, int);
 int linux_write(Network*, unsigned char*, int, int);
+int linux_writev(Network*, struct iovec*, int, int);
+int linux_flush(Network*, int);
+void linux_coalesce(Network*, int, int);
+void linux_arena(Network*, MQTTArena*);
+void linux_trim(Network*);
+size_t linux_buffered(Network*);
 int linux_connect(Network*, char*, int, int);
 void linux_disconnect(Network*);
+int linux_getfd(Network*);
+int linux_pending(Network*);
+void linux_records(Network*, unsigned long*, unsigned long*);
 
 #endif
\ No newline at end of file
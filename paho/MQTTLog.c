@@ -0,0 +1,238 @@
+/*******************************************************************************
+ * MQTT log
+ *
+ *    Leveled traces for the client and the layers around it. A call costs
+ *    the caller a level test, the formatting of the line into a slot of a
+ *    lock-free ring and a timestamp: a background thread writes the lines
+ *    out, so a slow terminal or pipe never holds up a publish. Calls above
+ *    MQTT_LOG_MAX_LEVEL are compiled out, arguments included
+ *
+ *******************************************************************************/
+
+#include "MQTTLog.h"
+#include "MQTTQueue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_FLUSH_MS 50             // lines are written out at least that often
+#define LOG_OUTPUT_SIZE 16384       // written out in chunks of up to that size
+
+struct LogCell {
+    struct MQTTQueueCell cell;
+    int level;
+    struct timespec time;
+    char text[MQTT_LOG_LINE_SIZE];
+};
+
+int MQTTLogLevel = MQTT_LOG_DEFAULT_LEVEL;
+
+static struct LogCell ring[MQTT_LOG_RING_SIZE];
+static MQTTQueue queue;             // drained under drain_lock, by the writer thread or MQTTLogFlush
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static int output = STDOUT_FILENO;
+static atomic_ulong dropped;
+static unsigned long reported;      // dropped count last written out
+
+static const char* level_names[] = {"", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+
+// MQTT_LOG_LEVEL=debug, or 4, in the environment sets the level the process starts with
+__attribute__((constructor)) static void levelFromEnvironment(void)
+{
+    const char* value = getenv("MQTT_LOG_LEVEL");
+    int i;
+
+    if (value == NULL)
+        return;
+    if (value[0] >= '0' && value[0] <= '9')
+        MQTTLogLevel = atoi(value);
+    else if (strcasecmp(value, "none") == 0)
+        MQTTLogLevel = MQTT_LOG_NONE;
+    for (i = MQTT_LOG_ERROR; i <= MQTT_LOG_TRACE; ++i)
+    {
+        if (strcasecmp(value, level_names[i]) == 0)
+            MQTTLogLevel = i;
+    }
+}
+
+
+// under drain_lock
+static int append(char* out, int len, struct LogCell* cell)
+{
+    static struct tm tm;
+    static time_t tm_sec = -1;      // localtime_r once a second, not once a line
+    size_t textlen = strnlen(cell->text, MQTT_LOG_LINE_SIZE);
+
+    while (textlen > 0 && cell->text[textlen - 1] == '\n')
+        textlen--;
+    if (cell->time.tv_sec != tm_sec)
+    {
+        localtime_r(&cell->time.tv_sec, &tm);
+        tm_sec = cell->time.tv_sec;
+    }
+    len += snprintf(out + len, LOG_OUTPUT_SIZE - len, "%02d:%02d:%02d.%03ld %-5s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                    cell->time.tv_nsec / 1000000, level_names[cell->level]);
+    memcpy(out + len, cell->text, textlen);
+    len += textlen;
+    out[len++] = '\n';
+    return len;
+}
+
+
+static void writeOut(const char* out, int len)
+{
+    while (len > 0)
+    {
+        ssize_t rc = write(output, out, len);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;      // nowhere to put them: the lines are lost, the callers are not held up
+        out += rc;
+        len -= rc;
+    }
+}
+
+
+// writes out every line completely queued so far, in order
+static void drain(void)
+{
+    char out[LOG_OUTPUT_SIZE];
+    int len = 0;
+    struct LogCell* cell;
+
+    pthread_mutex_lock(&drain_lock);
+    while ((cell = MQTTQueuePeek(&queue)) != NULL)
+    {
+        if (len + MQTT_LOG_LINE_SIZE + 64 > LOG_OUTPUT_SIZE)
+        {
+            writeOut(out, len);
+            len = 0;
+        }
+        len = append(out, len, cell);
+        MQTTQueueRelease(&queue, cell);
+    }
+    if (atomic_load(&dropped) != reported)
+    {
+        reported = atomic_load(&dropped);
+        len += snprintf(out + len, LOG_OUTPUT_SIZE - len, "(%lu lines dropped so far)\n", reported);
+    }
+    writeOut(out, len);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+static void* run(void* arg)
+{
+    struct pollfd fd;
+
+    (void)arg;
+    do
+        drain();
+    while (MQTTQueueWait(&queue, &fd, 1, LOG_FLUSH_MS) == 0);
+    return NULL;
+}
+
+
+static void start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    atomic_init(&dropped, 0);
+    atexit(MQTTLogFlush);
+
+    // without the thread, lines are written out by MQTTLogFlush and whenever the ring is half full
+    if (MQTTQueueInit(&queue, ring, sizeof(struct LogCell), MQTT_LOG_RING_SIZE) != 0)
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, run, NULL) != 0)
+        MQTTQueueClose(&queue);
+    pthread_attr_destroy(&attr);
+}
+
+
+/* The writer thread is only woken up for errors and every half ring of lines, it otherwise catches
+   up every LOG_FLUSH_MS: most calls make no system call at all */
+static void wakeup(void)
+{
+    if (queue.wakefd < 0)
+        drain();
+    else
+        MQTTQueueWakeup(&queue, 0);
+}
+
+
+/* Queues a line, of MQTT_LOG_LINE_SIZE at most, a trailing '\n' is optional.  Never blocks:
+   when the writer cannot keep up, the line is dropped and counted */
+void MQTTLogWrite(int level, const char* format, ...)
+{
+    size_t pos;
+    struct LogCell* cell;
+    va_list args;
+
+    if (level <= MQTT_LOG_NONE || level > MQTT_LOG_TRACE)
+        return;
+    pthread_once(&started, start);
+
+    if ((cell = MQTTQueueClaim(&queue, &pos)) == NULL)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        wakeup();
+        return;
+    }
+
+    cell->level = level;
+    clock_gettime(CLOCK_REALTIME_COARSE, &cell->time);
+    va_start(args, format);
+    if (vsnprintf(cell->text, MQTT_LOG_LINE_SIZE, format, args) >= MQTT_LOG_LINE_SIZE)
+        memcpy(cell->text + MQTT_LOG_LINE_SIZE - 4, "...", 4);
+    va_end(args);
+    MQTTQueuePublish(&queue, cell, pos);
+
+    if (level == MQTT_LOG_ERROR || pos % (MQTT_LOG_RING_SIZE / 2) == 0)
+        wakeup();
+}
+
+
+// writes out the lines queued so far before returning; done at exit too
+void MQTTLogFlush(void)
+{
+    pthread_once(&started, start);
+    drain();
+}
+
+
+void MQTTLogSetLevel(int level)
+{
+    MQTTLogLevel = level;
+}
+
+
+// where the lines go, standard output by default
+void MQTTLogSetOutput(int fd)
+{
+    MQTTLogFlush();
+    pthread_mutex_lock(&drain_lock);
+    output = fd;
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+// lines lost because the ring was full
+unsigned long MQTTLogDropped(void)
+{
+    return atomic_load(&dropped);
+}
@@ -0,0 +1,56 @@
+/*******************************************************************************
+ * MQTT log
+ *
+ *    Leveled traces for the client and the layers around it. A call costs
+ *    the caller a level test, the formatting of the line into a slot of a
+ *    lock-free ring and a timestamp: a background thread writes the lines
+ *    out, so a slow terminal or pipe never holds up a publish. Calls above
+ *    MQTT_LOG_MAX_LEVEL are compiled out, arguments included
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_LOG_
+#define __MQTT_LOG_
+
+#define MQTT_LOG_NONE 0
+#define MQTT_LOG_ERROR 1
+#define MQTT_LOG_WARN 2
+#define MQTT_LOG_INFO 3
+#define MQTT_LOG_DEBUG 4
+#define MQTT_LOG_TRACE 5
+
+// build with -DMQTT_LOG_MAX_LEVEL=MQTT_LOG_INFO, say, to leave the debug traces out of the binary
+#ifndef MQTT_LOG_MAX_LEVEL
+#define MQTT_LOG_MAX_LEVEL MQTT_LOG_DEBUG
+#endif
+
+#define MQTT_LOG_DEFAULT_LEVEL MQTT_LOG_INFO    // at run time, unless MQTT_LOG_LEVEL says otherwise in the environment
+#define MQTT_LOG_LINE_SIZE 256                  // longer lines are truncated
+#define MQTT_LOG_RING_SIZE 1024                 // lines waiting to be written, a power of 2; past that they are dropped, not waited for
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int MQTTLogLevel;
+
+void MQTTLogSetLevel(int);
+void MQTTLogSetOutput(int);
+void MQTTLogFlush(void);
+unsigned long MQTTLogDropped(void);
+void MQTTLogWrite(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#define MQTT_LOG(level, ...) \
+    do { if ((level) <= MQTT_LOG_MAX_LEVEL && (level) <= MQTTLogLevel) MQTTLogWrite(level, __VA_ARGS__); } while (0)
+
+#define MQTT_ERROR(...) MQTT_LOG(MQTT_LOG_ERROR, __VA_ARGS__)
+#define MQTT_WARN(...) MQTT_LOG(MQTT_LOG_WARN, __VA_ARGS__)
+#define MQTT_INFO(...) MQTT_LOG(MQTT_LOG_INFO, __VA_ARGS__)
+#define MQTT_DEBUG(...) MQTT_LOG(MQTT_LOG_DEBUG, __VA_ARGS__)
+#define MQTT_TRACE(...) MQTT_LOG(MQTT_LOG_TRACE, __VA_ARGS__)
+
+#endif
@@ -81,20 +81,27 @@ exit:
 }
 
 
+/**
+ * Size of a length encoded by MQTTPacket_encode, a variable byte integer
+ * @param length the length to be encoded
+ * @return the number of bytes it takes
+ */
+int MQTTPacket_VBIlen(int length)
+{
+	if (length < 128)
+		return 1;
+	else if (length < 16384)
+		return 2;
+	else if (length < 2097152)
+		return 3;
+	return 4;
+}
+
+
 int MQTTPacket_len(int rem_len)
 {
-	rem_len += 1; /* header byte */
-
-	/* now remaining_length field */
-	if (rem_len < 128)
-		rem_len += 1;
-	else if (rem_len < 16384)
-		rem_len += 2;
-	else if (rem_len < 2097151)
-		rem_len += 3;
-	else
-		rem_len += 4;
-	return rem_len;
+	/* header byte, then the remaining_length field, its size depends on the remaining length alone */
+	return rem_len + 1 + MQTTPacket_VBIlen(rem_len);
 }
 
 
@@ -333,7 +340,7 @@ static int MQTTPacket_decodenb(MQTTTransport *trp)
 	}
 	do {
 		int frc;
-		if (++(trp->len) > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+		if (trp->len >= MAX_NO_OF_REMAINING_LENGTH_BYTES)
 			goto exit;
 		if ((frc=(*trp->getfn)(trp->sck, &c, 1)) == -1)
 			goto exit;
@@ -341,6 +348,7 @@ static int MQTTPacket_decodenb(MQTTTransport *trp)
 			rc = 0;
 			goto exit;
 		}
+		++(trp->len);	/* only count bytes actually read, so that a later call resumes correctly */
 		trp->rem_len += (c & 127) * trp->multiplier;
 		trp->multiplier *= 128;
 	} while ((c & 128) != 0);
@@ -356,13 +364,21 @@ exit:
  * @param buflen the length in bytes of the supplied buffer
  * @param trp pointer to a transport structure holding what is needed to solve getting data from it
  * @return integer MQTT packet type, 0 for call again, or -1 on error
- * @note  the whole message must fit into the caller's buffer
+ * @note  a packet bigger than the buffer is returned once the buffer is full, trp->overflow then holds
+ *        the number of bytes still to be read with MQTTPacket_readnbChunk.  Any left over are skipped
+ *        by the next call
  */
 int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 {
 	int rc = -1, frc;
 	MQTTHeader header = {0};
 
+	while (trp->overflow > 0)
+	{
+		if ((frc=MQTTPacket_readnbChunk(buf, buflen, trp)) <= 0)
+			return frc;
+	}
+
 	switch(trp->state){
 	default:
 		trp->state = 0;
@@ -377,26 +393,45 @@ int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 		++trp->state;
 		/*FALLTHROUGH*/
 		/* 2. read the remaining length.  This is variable in itself */
-	case 2:
+	case 1:
 		if((frc=MQTTPacket_decodenb(trp)) == MQTTPACKET_READ_ERROR)
 			goto exit;
 		if(frc == 0)
 			return 0;
 		trp->len = 1 + MQTTPacket_encode(buf + 1, trp->rem_len); /* put the original remaining length back into the buffer */
-		if((trp->rem_len + trp->len) > buflen)
+		if (trp->len > buflen)
 			goto exit;
+		if ((trp->rem_len + trp->len) > buflen && trp->growfn != NULL)
+		{	/* the caller may have more room elsewhere, if not for all of it */
+			int size = trp->rem_len + trp->len;
+			unsigned char* grown = (*trp->growfn)(trp->sck, &size);
+			if (grown != NULL)
+			{
+				buf = grown;
+				buflen = size;
+			}
+		}
+		trp->overflow = 0;
+		if((trp->rem_len + trp->len) > buflen)
+		{	/* read what fits, the caller takes the rest in chunks */
+			trp->overflow = trp->rem_len + trp->len - buflen;
+			trp->rem_len -= trp->overflow;
+		}
 		++trp->state;
 		/*FALLTHROUGH*/
-	case 3:
+	case 2:
 		/* 3. read the rest of the buffer using a callback to supply the rest of the data */
-		if ((frc=(*trp->getfn)(trp->sck, buf + trp->len, trp->rem_len)) == -1)
-			goto exit;
-		if (frc == 0)
-			return 0;
-		trp->rem_len -= frc;
-		trp->len += frc;
-		if(trp->rem_len)
-			return 0;
+		if (trp->rem_len > 0)
+		{
+			if ((frc=(*trp->getfn)(trp->sck, buf + trp->len, trp->rem_len)) == -1)
+				goto exit;
+			if (frc == 0)
+				return 0;
+			trp->rem_len -= frc;
+			trp->len += frc;
+			if(trp->rem_len)
+				return 0;
+		}
 
 		header.byte = buf[0];
 		rc = header.bits.type;
@@ -408,3 +443,22 @@ exit:
 	return rc;
 }
 
+
+/**
+ * Reads the next part of a packet that did not fit into the buffer given to MQTTPacket_readnb, non-blocking
+ * @param buf the buffer into which the data will be read
+ * @param buflen the length in bytes of the supplied buffer
+ * @param trp pointer to a transport structure holding what is needed to solve getting data from it
+ * @return number of bytes read (at most trp->overflow), 0 for call again, or -1 on error
+ */
+int MQTTPacket_readnbChunk(unsigned char* buf, int buflen, MQTTTransport *trp)
+{
+	int frc;
+
+	if (trp->overflow <= 0)
+		return -1;
+	if ((frc=(*trp->getfn)(trp->sck, buf, (buflen < trp->overflow) ? buflen : trp->overflow)) > 0)
+		trp->overflow -= frc;
+	return frc;
+}
+
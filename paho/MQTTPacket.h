@@ -88,6 +88,7 @@ typedef struct
 
 int MQTTstrlen(MQTTString mqttstring);
 
+#include "MQTTProperties.h"
 #include "MQTTConnect.h"
 #include "MQTTPublish.h"
 #include "MQTTSubscribe.h"
@@ -96,8 +97,11 @@ int MQTTstrlen(MQTTString mqttstring);
 
 int MQTTSerialize_ack(unsigned char* buf, int buflen, unsigned char type, unsigned char dup, unsigned short packetid);
 int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen);
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* reasonCode,
+		MQTTProperties* properties, unsigned char* buf, int buflen);
 
 int MQTTPacket_len(int rem_len);
+int MQTTPacket_VBIlen(int length);
 int MQTTPacket_equals(MQTTString* a, char* b);
 
 int MQTTPacket_encode(unsigned char* buf, int length);
@@ -120,10 +124,14 @@ typedef struct {
 	int multiplier;
 	int rem_len;
 	int len;
+	int overflow;	/* bytes of the last packet read that did not fit into the buffer, see MQTTPacket_readnbChunk */
+	unsigned char* (*growfn)(void *, int*);	/* optional: a bigger buffer for a packet too big for the one given, with the bytes
+	                                    already read carried over. In: the size wanted, out: the size given, which may be less */
 	char state;
 }MQTTTransport;
 
 int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp);
+int MQTTPacket_readnbChunk(unsigned char* buf, int buflen, MQTTTransport *trp);
 
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
 }
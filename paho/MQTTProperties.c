@@ -0,0 +1,310 @@
+/*******************************************************************************
+ * MQTT properties
+ *
+ *    MQTT 5.0 property lists, as found in CONNECT, CONNACK, PUBLISH, the
+ *    acks, SUBSCRIBE, UNSUBSCRIBE and DISCONNECT.  The MQTTV5 serialize
+ *    functions take one of these where the MQTT 3 ones take nothing: a
+ *    NULL list means the packet is laid out the MQTT 3 way
+ *
+ *******************************************************************************/
+
+#include "StackTrace.h"
+#include "MQTTPacket.h"
+
+#include <string.h>
+
+
+/**
+ * The type of a property, which gives its layout
+ * @param identifier one of MQTTPropertyCodes
+ * @return one of MQTTPropertyTypes, -1 for an unknown identifier
+ */
+int MQTTProperty_getType(int identifier)
+{
+	switch (identifier)
+	{
+	case MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR:
+	case MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION:
+	case MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION:
+	case MQTTPROPERTY_CODE_MAXIMUM_QOS:
+	case MQTTPROPERTY_CODE_RETAIN_AVAILABLE:
+	case MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE:
+	case MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE:
+	case MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE:
+		return MQTTPROPERTY_TYPE_BYTE;
+	case MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE:
+	case MQTTPROPERTY_CODE_RECEIVE_MAXIMUM:
+	case MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM:
+	case MQTTPROPERTY_CODE_TOPIC_ALIAS:
+		return MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL:
+	case MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL:
+	case MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL:
+	case MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE:
+		return MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER:
+		return MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER;
+	case MQTTPROPERTY_CODE_CORRELATION_DATA:
+	case MQTTPROPERTY_CODE_AUTHENTICATION_DATA:
+		return MQTTPROPERTY_TYPE_BINARY_DATA;
+	case MQTTPROPERTY_CODE_CONTENT_TYPE:
+	case MQTTPROPERTY_CODE_RESPONSE_TOPIC:
+	case MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFIER:
+	case MQTTPROPERTY_CODE_AUTHENTICATION_METHOD:
+	case MQTTPROPERTY_CODE_RESPONSE_INFORMATION:
+	case MQTTPROPERTY_CODE_SERVER_REFERENCE:
+	case MQTTPROPERTY_CODE_REASON_STRING:
+		return MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING;
+	case MQTTPROPERTY_CODE_USER_PROPERTY:
+		return MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR;
+	}
+	return -1;
+}
+
+
+static int propertyLength(const MQTTProperty* prop)
+{
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+	case MQTTPROPERTY_TYPE_BYTE:
+		return 1;
+	case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+		return 2;
+	case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+		return 4;
+	case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+		return MQTTPacket_VBIlen(prop->value.integer4);
+	case MQTTPROPERTY_TYPE_BINARY_DATA:
+	case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+		return 2 + prop->value.data.len;
+	case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+		return 2 + prop->value.data.len + 2 + prop->value.value.len;
+	}
+	return -1;
+}
+
+
+/**
+ * Length of a property list once serialized, its length field included
+ * @param props the property list, NULL when there is none to write (MQTT 3)
+ * @return the number of bytes MQTTProperties_write will write
+ */
+int MQTTProperties_len(MQTTProperties* props)
+{
+	return (props == NULL) ? 0 : props->length + MQTTPacket_VBIlen(props->length);
+}
+
+
+/**
+ * Appends a property to a list.  Strings and data are not copied, they must outlive the list
+ * @param props the property list
+ * @param prop the property to add
+ * @return 0 if successful, -1 if the list is full or the property unknown
+ */
+int MQTTProperties_add(MQTTProperties* props, const MQTTProperty* prop)
+{
+	int len = propertyLength(prop);
+
+	if (len < 0 || props->count >= props->max_count)
+		return -1;
+	props->array[props->count++] = *prop;
+	props->length += MQTTPacket_VBIlen(prop->identifier) + len;
+	return 0;
+}
+
+
+static void writeLenString(unsigned char** pptr, MQTTLenString string)
+{
+	writeInt(pptr, string.len);
+	memcpy(*pptr, string.data, string.len);
+	*pptr += string.len;
+}
+
+
+/**
+ * Writes a property list, length first
+ * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
+ * @param properties the list to write, nothing is written for NULL
+ * @return the number of bytes written
+ */
+int MQTTProperties_write(unsigned char** pptr, const MQTTProperties* properties)
+{
+	unsigned char* start = *pptr;
+	int i;
+
+	if (properties == NULL)
+		return 0;
+	*pptr += MQTTPacket_encode(*pptr, properties->length);
+	for (i = 0; i < properties->count; ++i)
+	{
+		const MQTTProperty* prop = &properties->array[i];
+
+		*pptr += MQTTPacket_encode(*pptr, prop->identifier);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			writeChar(pptr, prop->value.byte);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			writeInt(pptr, prop->value.integer2);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			writeInt(pptr, prop->value.integer4 >> 16);
+			writeInt(pptr, prop->value.integer4 & 0xFFFF);
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			*pptr += MQTTPacket_encode(*pptr, prop->value.integer4);
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			writeLenString(pptr, prop->value.data);
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			writeLenString(pptr, prop->value.data);
+			writeLenString(pptr, prop->value.value);
+			break;
+		}
+	}
+	return *pptr - start;
+}
+
+
+/* A variable byte integer that does not run past enddata, 0 if it does or is too long */
+static int readVBI(unsigned char** pptr, unsigned char* enddata, unsigned int* value)
+{
+	unsigned char* ptr = *pptr;
+	unsigned int multiplier = 1;
+
+	*value = 0;
+	do
+	{
+		if (ptr >= enddata || ptr - *pptr == 4)
+			return 0;
+		*value += (*ptr & 127) * multiplier;
+		multiplier *= 128;
+	} while ((*ptr++ & 128) != 0);
+	*pptr = ptr;
+	return 1;
+}
+
+
+static int readLenString(MQTTLenString* string, unsigned char** pptr, unsigned char* enddata)
+{
+	MQTTString s;
+
+	if (!readMQTTLenString(&s, pptr, enddata))
+		return 0;
+	*string = s.lenstring;
+	return 1;
+}
+
+
+/**
+ * Reads a property list, length first.  The first max_count properties are kept, the others skipped
+ * @param properties the list to fill in: count and length are set, array must hold max_count entries
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @param enddata pointer to the end of the data: do not read beyond
+ * @return 1 if successful, 0 if the list is malformed
+ */
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata)
+{
+	unsigned char* curdata = *pptr;
+	unsigned char* propend;
+	unsigned int length;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	properties->count = 0;
+	properties->length = 0;
+	if (!readVBI(&curdata, enddata, &length) || length > (unsigned int)(enddata - curdata))
+		goto exit;
+	propend = curdata + length;
+
+	while (curdata < propend)
+	{
+		MQTTProperty prop;
+		unsigned int identifier;
+
+		if (!readVBI(&curdata, propend, &identifier))
+			goto exit;
+		prop.identifier = identifier;
+		switch (MQTTProperty_getType(prop.identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			if (propend - curdata < 1)
+				goto exit;
+			prop.value.byte = readChar(&curdata);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			if (propend - curdata < 2)
+				goto exit;
+			prop.value.integer2 = readInt(&curdata);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			if (propend - curdata < 4)
+				goto exit;
+			prop.value.integer4 = (unsigned int)readInt(&curdata) << 16;
+			prop.value.integer4 |= readInt(&curdata);
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			if (!readVBI(&curdata, propend, &prop.value.integer4))
+				goto exit;
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			if (!readLenString(&prop.value.data, &curdata, propend))
+				goto exit;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			if (!readLenString(&prop.value.data, &curdata, propend) || !readLenString(&prop.value.value, &curdata, propend))
+				goto exit;
+			break;
+		default:
+			goto exit;	/* unknown: its length cannot be known either */
+		}
+		if (properties->count < properties->max_count)
+			properties->array[properties->count++] = prop;
+	}
+	properties->length = length;
+	*pptr = curdata;
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Looks up a numeric property
+ * @param props the property list, may be NULL
+ * @param identifier the property wanted, the first one is taken
+ * @param value returned value of the property, left alone if it is not there
+ * @return 1 if found, 0 if not
+ */
+int MQTTProperties_getNumber(const MQTTProperties* props, int identifier, unsigned int* value)
+{
+	int i;
+
+	for (i = 0; props != NULL && i < props->count; ++i)
+	{
+		const MQTTProperty* prop = &props->array[i];
+
+		if (prop->identifier != identifier)
+			continue;
+		switch (MQTTProperty_getType(identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			*value = prop->value.byte;
+			return 1;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			*value = prop->value.integer2;
+			return 1;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			*value = prop->value.integer4;
+			return 1;
+		}
+		return 0;
+	}
+	return 0;
+}
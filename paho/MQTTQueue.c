@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * MQTT bounded queue
+ *
+ *    Lock-free multi-producer ring with a single consumer at a time, after
+ *    D. Vyukov's MPMC design, and the eventfd the consumer sleeps on. The
+ *    cells are the caller's: any structure whose first member is a
+ *    MQTTQueueCell, filled in between MQTTQueueClaim and MQTTQueuePublish.
+ *    Producers only make a system call to wake a consumer that sleeps
+ *
+ *******************************************************************************/
+
+#include "MQTTQueue.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+static struct MQTTQueueCell* cellAt(MQTTQueue* q, size_t pos)
+{
+    return (struct MQTTQueueCell*)(q->cells + (pos & q->mask) * q->cell_size);
+}
+
+
+/* count cells of cell_size bytes each, count a power of 2.  0 once ready, -1 when the eventfd could not be
+   created: the queue works, but MQTTQueueWait cannot be used and MQTTQueueWakeup does nothing */
+int MQTTQueueInit(MQTTQueue* q, void* cells, size_t cell_size, size_t count)
+{
+    size_t i;
+
+    q->cells = (unsigned char*)cells;
+    q->cell_size = cell_size;
+    q->mask = count - 1;
+    for (i = 0; i < count; ++i)
+        atomic_init(&cellAt(q, i)->sequence, i);
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    atomic_init(&q->sleeping, 0);
+    q->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (q->wakefd < 0) ? -1 : 0;
+}
+
+
+// the cells stay the caller's
+void MQTTQueueClose(MQTTQueue* q)
+{
+    if (q->wakefd >= 0)
+        close(q->wakefd);
+    q->wakefd = -1;
+}
+
+
+/* Producer: a free cell to fill in, and its position for MQTTQueuePublish.  NULL when the queue is full */
+void* MQTTQueueClaim(MQTTQueue* q, size_t* pos)
+{
+    size_t p = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;)
+    {
+        struct MQTTQueueCell* cell = cellAt(q, p);
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)p;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &p, p + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *pos = p;
+                return cell;
+            }
+        }
+        else if (diff < 0)
+            return NULL;
+        else
+            p = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+}
+
+
+// producer: the cell filled in goes to the consumer
+void MQTTQueuePublish(MQTTQueue* q, void* cell, size_t pos)
+{
+    (void)q;
+    atomic_store_explicit(&((struct MQTTQueueCell*)cell)->sequence, pos + 1, memory_order_release);
+}
+
+
+/* Consumer: the oldest cell published, NULL when there is none.  It stays the consumer's until MQTTQueueRelease;
+   cells published after it are not seen until then */
+void* MQTTQueuePeek(MQTTQueue* q)
+{
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    struct MQTTQueueCell* cell = cellAt(q, pos);
+
+    if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1)
+        return NULL;
+    return cell;
+}
+
+
+// consumer: the cell peeked goes back to the producers
+void MQTTQueueRelease(MQTTQueue* q, void* cell)
+{
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    atomic_store_explicit(&((struct MQTTQueueCell*)cell)->sequence, pos + q->mask + 1, memory_order_release);
+    atomic_store_explicit(&q->dequeue_pos, pos + 1, memory_order_relaxed);
+}
+
+
+/* Consumer: polls fds[0] (set here to the eventfd) and the nfds - 1 descriptors after it for up to timeout_ms,
+   unless something is queued already.  From the time it sleeps, producers write to the eventfd; whatever they
+   queued before is seen by MQTTQueuePeek.  -1 when the eventfd failed */
+int MQTTQueueWait(MQTTQueue* q, struct pollfd* fds, int nfds, int timeout_ms)
+{
+    uint64_t count;
+
+    fds[0].fd = q->wakefd;
+    fds[0].events = POLLIN;
+    atomic_store(&q->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (MQTTQueuePeek(q) == NULL)
+        poll(fds, nfds, timeout_ms);
+    atomic_store(&q->sleeping, 0);
+
+    if (read(q->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+
+/* Producer: wakes the consumer up if it sleeps in MQTTQueueWait, or whatever it is doing when force is set */
+void MQTTQueueWakeup(MQTTQueue* q, int force)
+{
+    uint64_t one = 1;
+
+    if (q->wakefd < 0)
+        return;
+    atomic_thread_fence(memory_order_seq_cst);
+    if ((force || atomic_load(&q->sleeping)) && write(q->wakefd, &one, sizeof(one)) < 0)
+        ; // the counter can only overflow if nobody reads it: the consumer is awake anyway
+}
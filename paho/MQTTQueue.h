@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * MQTT bounded queue
+ *
+ *    Lock-free multi-producer ring with a single consumer at a time, after
+ *    D. Vyukov's MPMC design, and the eventfd the consumer sleeps on. The
+ *    cells are the caller's: any structure whose first member is a
+ *    MQTTQueueCell, filled in between MQTTQueueClaim and MQTTQueuePublish.
+ *    Producers only make a system call to wake a consumer that sleeps
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_QUEUE_
+#define __MQTT_QUEUE_
+
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct MQTTQueue MQTTQueue;
+
+struct MQTTQueueCell {
+    atomic_size_t sequence;     // tells producers and the consumer whose turn it is on this cell
+};
+
+int MQTTQueueInit(MQTTQueue*, void*, size_t, size_t);
+void MQTTQueueClose(MQTTQueue*);
+void* MQTTQueueClaim(MQTTQueue*, size_t*);
+void MQTTQueuePublish(MQTTQueue*, void*, size_t);
+void* MQTTQueuePeek(MQTTQueue*);
+void MQTTQueueRelease(MQTTQueue*, void*);
+int MQTTQueueWait(MQTTQueue*, struct pollfd*, int, int);
+void MQTTQueueWakeup(MQTTQueue*, int);
+
+struct MQTTQueue {
+    unsigned char* cells;
+    size_t cell_size;
+    size_t mask;                // queue size - 1, the size is a power of 2
+    atomic_size_t enqueue_pos;  // claimed by producers with a CAS
+    char pad[64];               // keeps the producers' cache line away from the consumer's
+    atomic_size_t dequeue_pos;  // written by the consumer only; read by MQTTQueueWait outside a consumer's lock
+
+    int wakefd;                 // eventfd, written only while the consumer sleeps; -1 if there is none
+    atomic_int sleeping;
+};
+
+#endif
@@ -0,0 +1,308 @@
+/*******************************************************************************
+ * MQTT store-and-forward queue
+ *
+ *    Publishes made while the broker is unreachable are appended to a ring
+ *    kept in a memory-mapped file, to be replayed once connected again.
+ *    Entries are CRC-framed: a process killed half-way through an append
+ *    loses that entry, not the queue. When the ring is full the oldest
+ *    entries make room for the new ones
+ *
+ *******************************************************************************/
+
+#include "MQTTStore.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+#define STORE_MAGIC 0x4d515346          // "MQSF"
+#define STORE_VERSION 1
+#define ENTRY_MAGIC 0x4d514531          // "MQE1"
+#define WRAP_MAGIC 0x4d515752           // "MQWR": the ring continues at offset 0
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct StoreEntry {
+    uint32_t magic;                     // written last
+    uint32_t crc;                       // of the rest of the entry, from len on
+    uint32_t len;                       // bytes after this structure: topic with its '\0', then payload
+    uint16_t topiclen;
+    uint8_t qos;
+    uint8_t retained;
+    uint64_t expires;                   // time(), 0 for never: the queue outlives the process, so wall-clock
+};
+
+#define ENTRY_CRC_OFFSET offsetof(struct StoreEntry, len)
+#define ENTRY_SIZE(e) ALIGN8(sizeof(struct StoreEntry) + (e)->len)
+
+
+static uint32_t crc_table[256];
+
+static void crcInit(void)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (j = 0; j < 8; ++j)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        crc_table[i] = crc;
+    }
+}
+
+
+static uint32_t crc32(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static uint32_t entryCrc(struct StoreEntry* e)
+{
+    return crc32(0, (unsigned char*)e + ENTRY_CRC_OFFSET, sizeof(struct StoreEntry) - ENTRY_CRC_OFFSET + e->len);
+}
+
+
+static int entryValid(MQTTStore* s, uint64_t pos)
+{
+    struct StoreEntry* e = (struct StoreEntry*)&s->ring[pos];
+
+    return pos + sizeof(struct StoreEntry) <= s->header->capacity && e->magic == ENTRY_MAGIC
+        && pos + sizeof(struct StoreEntry) + e->len <= s->header->capacity
+        && e->topiclen > 0 && e->topiclen <= e->len && entryCrc(e) == e->crc;
+}
+
+
+// the oldest entry sits past the end of the ring when the writer had to wrap around
+static void wrapHead(MQTTStore* s)
+{
+    struct MQTTStoreHeader* h = s->header;
+
+    if (h->count > 0 && (h->head == h->capacity || *(uint32_t*)&s->ring[h->head] == WRAP_MAGIC))
+        h->head = 0;
+}
+
+
+static void dropHead(MQTTStore* s)
+{
+    struct MQTTStoreHeader* h = s->header;
+
+    wrapHead(s);
+    h->head += ENTRY_SIZE((struct StoreEntry*)&s->ring[h->head]);
+    if (--h->count == 0)
+        h->head = h->tail = 0;
+}
+
+
+// where an entry of size bytes can go without overwriting anything, -1 if nowhere
+static int64_t place(MQTTStore* s, uint64_t size)
+{
+    struct MQTTStoreHeader* h = s->header;
+
+    wrapHead(s);    // dropHead leaves head on the wrap marker once the last entry before it goes
+    if (h->count == 0)
+    {
+        h->head = h->tail = 0;
+        return 0;
+    }
+    if (h->tail > h->head)
+    {
+        if (h->capacity - h->tail >= size)
+            return h->tail;
+        return (h->head >= size) ? 0 : -1;
+    }
+    return (h->head - h->tail >= size) ? (int64_t)h->tail : -1;
+}
+
+
+// keeps the entries that check out, from the oldest on; the first damaged one ends the queue
+static void recover(MQTTStore* s)
+{
+    struct MQTTStoreHeader* h = s->header;
+    uint64_t pos = h->head, n = 0;
+
+    if (h->head > h->capacity || h->tail > h->capacity)
+        h->count = 0;
+    while (n < h->count)
+    {
+        if (pos == h->capacity || *(uint32_t*)&s->ring[pos] == WRAP_MAGIC)
+            pos = 0;
+        if (!entryValid(s, pos))
+            break;
+        pos += ENTRY_SIZE((struct StoreEntry*)&s->ring[pos]);
+        n++;
+    }
+    h->dropped += h->count - n;
+    h->count = n;
+    h->tail = pos;
+    if (n == 0)
+        h->head = h->tail = 0;
+}
+
+
+/* Opens the queue kept in file path, creating it with a ring of capacity bytes if need be.
+   An existing queue keeps its own capacity; a file that is not a queue is overwritten */
+int MQTTStoreOpen(MQTTStore* s, const char* path, size_t capacity)
+{
+    struct MQTTStoreHeader existing;
+    struct stat st;
+    int fresh = 1;
+
+    memset(s, 0, sizeof(MQTTStore));
+    crcInit();
+    if ((s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return FAILURE;
+
+    if (fstat(s->fd, &st) == 0 && st.st_size >= MQTT_STORE_HEADER_SIZE
+            && pread(s->fd, &existing, sizeof(existing), 0) == sizeof(existing)
+            && existing.magic == STORE_MAGIC && existing.version == STORE_VERSION
+            && (uint64_t)st.st_size == MQTT_STORE_HEADER_SIZE + existing.capacity)
+    {
+        capacity = existing.capacity;
+        fresh = 0;
+    }
+    else
+    {
+        capacity = ALIGN8(capacity < MQTT_STORE_HEADER_SIZE ? MQTT_STORE_HEADER_SIZE : capacity);
+        if (ftruncate(s->fd, 0) != 0 || ftruncate(s->fd, MQTT_STORE_HEADER_SIZE + capacity) != 0)
+            goto error;
+    }
+
+    s->maplen = MQTT_STORE_HEADER_SIZE + capacity;
+    s->map = mmap(NULL, s->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED)
+        goto error;
+    s->header = (struct MQTTStoreHeader*)s->map;
+    s->ring = s->map + MQTT_STORE_HEADER_SIZE;
+
+    if (fresh)
+    {
+        memset(s->header, 0, sizeof(struct MQTTStoreHeader));
+        s->header->version = STORE_VERSION;
+        s->header->capacity = capacity;
+        s->header->magic = STORE_MAGIC;
+    }
+    else
+        recover(s);
+    return SUCCESS;
+
+error:
+    close(s->fd);
+    s->map = NULL;
+    return FAILURE;
+}
+
+
+void MQTTStoreClose(MQTTStore* s)
+{
+    if (s->map == NULL)
+        return;
+    msync(s->map, s->maplen, MS_SYNC);
+    munmap(s->map, s->maplen);
+    close(s->fd);
+    s->map = NULL;
+}
+
+
+int MQTTStoreIsOpen(MQTTStore* s)
+{
+    return s->map != NULL;
+}
+
+
+/* Queues a copy of the message, to expire ttl_s seconds from now (0: never).  Makes room by dropping
+   the oldest entries when the ring is full.  The entry is in the page cache, and so survives the
+   process, as soon as this returns; it reaches the disk when the kernel writes the pages back */
+int MQTTStoreAppend(MQTTStore* s, const char* topicName, MQTTMessage* message, unsigned int ttl_s)
+{
+    struct MQTTStoreHeader* h = s->header;
+    size_t topiclen = strlen(topicName) + 1;
+    uint64_t size = ALIGN8(sizeof(struct StoreEntry) + topiclen + message->payloadlen);
+    struct StoreEntry* e;
+    int64_t pos;
+
+    if (s->map == NULL || topiclen > UINT16_MAX || size > h->capacity)
+        return FAILURE;
+
+    while ((pos = place(s, size)) < 0)
+    {
+        dropHead(s);
+        h->dropped++;
+    }
+    if (pos == 0 && h->tail != 0 && h->tail < h->capacity)
+        *(uint32_t*)&s->ring[h->tail] = WRAP_MAGIC;
+
+    e = (struct StoreEntry*)&s->ring[pos];
+    e->magic = 0;
+    e->len = topiclen + message->payloadlen;
+    e->topiclen = topiclen;
+    e->qos = message->qos;
+    e->retained = message->retained;
+    e->expires = (ttl_s == 0) ? 0 : (uint64_t)time(NULL) + ttl_s;
+    memcpy(e + 1, topicName, topiclen);
+    memcpy((char*)(e + 1) + topiclen, message->payload, message->payloadlen);
+    e->crc = entryCrc(e);
+    e->magic = ENTRY_MAGIC;
+
+    h->tail = pos + size;
+    h->count++;
+    return SUCCESS;
+}
+
+
+/* Points topicName and message at the oldest entry still valid, dropping the expired ones on the way.
+   Returns 0 when the queue is empty.  The pointers are into the map: good until the next append or pop */
+int MQTTStorePeek(MQTTStore* s, char** topicName, MQTTMessage* message)
+{
+    struct MQTTStoreHeader* h = s->header;
+    time_t now = time(NULL);
+
+    while (s->map != NULL && h->count > 0)
+    {
+        struct StoreEntry* e;
+
+        wrapHead(s);
+        if (!entryValid(s, h->head))
+        {   // nothing past a damaged entry can be trusted
+            h->dropped += h->count;
+            h->count = 0;
+            h->head = h->tail = 0;
+            break;
+        }
+
+        e = (struct StoreEntry*)&s->ring[h->head];
+        if (e->expires != 0 && e->expires <= (uint64_t)now)
+        {
+            dropHead(s);
+            h->dropped++;
+            continue;
+        }
+
+        *topicName = (char*)(e + 1);
+        message->qos = e->qos;
+        message->retained = e->retained;
+        message->dup = 0;
+        message->id = 0;
+        message->payload = (char*)(e + 1) + e->topiclen;
+        message->payloadlen = e->len - e->topiclen;
+        return 1;
+    }
+    return 0;
+}
+
+
+// removes the entry returned by the last MQTTStorePeek, once it is safely on its way
+void MQTTStorePop(MQTTStore* s)
+{
+    if (s->map != NULL && s->header->count > 0)
+        dropHead(s);
+}
+
+
+unsigned long MQTTStoreCount(MQTTStore* s)
+{
+    return (s->map != NULL) ? s->header->count : 0;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * MQTT store-and-forward queue
+ *
+ *    Publishes made while the broker is unreachable are appended to a ring
+ *    kept in a memory-mapped file, to be replayed once connected again.
+ *    Entries are CRC-framed: a process killed half-way through an append
+ *    loses that entry, not the queue. When the ring is full the oldest
+ *    entries make room for the new ones
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_STORE_
+#define __MQTT_STORE_
+
+#include "MQTTClient.h"
+
+#include <stdint.h>
+
+#define MQTT_STORE_HEADER_SIZE 4096     // one page, the ring follows
+
+typedef struct MQTTStore MQTTStore;
+
+int MQTTStoreOpen(MQTTStore*, const char*, size_t);
+void MQTTStoreClose(MQTTStore*);
+int MQTTStoreIsOpen(MQTTStore*);
+int MQTTStoreAppend(MQTTStore*, const char*, MQTTMessage*, unsigned int);
+int MQTTStorePeek(MQTTStore*, char**, MQTTMessage*);
+void MQTTStorePop(MQTTStore*);
+unsigned long MQTTStoreCount(MQTTStore*);
+
+// on disk, at the start of the file
+struct MQTTStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;          // bytes in the ring, a multiple of 8
+    uint64_t head;              // offset of the oldest entry
+    uint64_t tail;              // offset where the next entry goes
+    uint64_t count;             // entries between head and tail, tells a full ring from an empty one
+    uint64_t dropped;           // entries overwritten or expired before they could be replayed
+};
+
+struct MQTTStore {
+    int fd;
+    unsigned char* map;         // NULL while closed
+    size_t maplen;
+    struct MQTTStoreHeader* header;
+    unsigned char* ring;
+};
+
+#endif
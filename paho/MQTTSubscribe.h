@@ -25,9 +25,19 @@
   #define DLLExport
 #endif
 
+DLLExport int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[]);
+
 DLLExport int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
 		int count, MQTTString topicFilters[], int requestedQoSs[]);
 
+DLLExport int MQTTV5Serialize_subscribeLength(int count, MQTTString topicFilters[], MQTTProperties* properties);
+
+DLLExport int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int requestedQoSs[]);
+
+DLLExport int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count,
+		int grantedQoSs[], unsigned char* buf, int len);
+
 DLLExport int MQTTDeserialize_subscribe(unsigned char* dup, unsigned short* packetid,
 		int maxcount, int* count, MQTTString topicFilters[], int requestedQoSs[], unsigned char* buf, int len);
 
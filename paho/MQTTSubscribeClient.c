@@ -23,32 +23,41 @@
   * Determines the length of the MQTT subscribe packet that would be produced using the supplied parameters
   * @param count the number of topic filter strings in topicFilters
   * @param topicFilters the array of topic filter strings to be used in the publish
+  * @param properties MQTT 5 only: the SUBSCRIBE properties, NULL for an MQTT 3 subscribe
   * @return the length of buffer needed to contain the serialized version of the packet
   */
-int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
+int MQTTV5Serialize_subscribeLength(int count, MQTTString topicFilters[], MQTTProperties* properties)
 {
 	int i;
 	int len = 2; /* packetid */
 
+	len += MQTTProperties_len(properties);
 	for (i = 0; i < count; ++i)
 		len += 2 + MQTTstrlen(topicFilters[i]) + 1; /* length + topic + req_qos */
 	return len;
 }
 
 
+int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
+{
+	return MQTTV5Serialize_subscribeLength(count, topicFilters, NULL);
+}
+
+
 /**
   * Serializes the supplied subscribe data into the supplied buffer, ready for sending
   * @param buf the buffer into which the packet will be serialized
   * @param buflen the length in bytes of the supplied bufferr
   * @param dup integer - the MQTT dup flag
   * @param packetid integer - the MQTT packet identifier
+  * @param properties - MQTT 5 only: the SUBSCRIBE properties, NULL for an MQTT 3 subscribe
   * @param count - number of members in the topicFilters and reqQos arrays
   * @param topicFilters - array of topic filter names
-  * @param requestedQoSs - array of requested QoS
+  * @param requestedQoSs - array of requested QoS; for MQTT 5 the whole subscription options byte, QoS in its low bits
   * @return the length of the serialized data.  <= 0 indicates error
   */
-int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
-		MQTTString topicFilters[], int requestedQoSs[])
+int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int requestedQoSs[])
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -57,7 +66,7 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 	int i = 0;
 
 	FUNC_ENTRY;
-	if (MQTTPacket_len(rem_len = MQTTSerialize_subscribeLength(count, topicFilters)) > buflen)
+	if (MQTTPacket_len(rem_len = MQTTV5Serialize_subscribeLength(count, topicFilters, properties)) > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -73,6 +82,8 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 
 	writeInt(&ptr, packetid);
 
+	MQTTProperties_write(&ptr, properties);
+
 	for (i = 0; i < count; ++i)
 	{
 		writeMQTTString(&ptr, topicFilters[i]);
@@ -86,18 +97,27 @@ exit:
 }
 
 
+int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
+		MQTTString topicFilters[], int requestedQoSs[])
+{
+	return MQTTV5Serialize_subscribe(buf, buflen, dup, packetid, NULL, count, topicFilters, requestedQoSs);
+}
+
+
 
 /**
   * Deserializes the supplied (wire) buffer into suback data
   * @param packetid returned integer - the MQTT packet identifier
+  * @param properties returned MQTTProperties - MQTT 5 only: the SUBACK properties, NULL for an MQTT 3 suback
   * @param maxcount - the maximum number of members allowed in the grantedQoSs array
   * @param count returned integer - number of members in the grantedQoSs array
-  * @param grantedQoSs returned array of integers - the granted qualities of service
+  * @param grantedQoSs returned array of integers - the granted qualities of service; MQTT 5 reason codes, 0x80 and up are failures
   * @param buf the raw buffer data, of the correct length determined by the remaining length field
   * @param buflen the length in bytes of the data in the supplied buffer
   * @return error code.  1 is success, 0 is failure
   */
-int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[], unsigned char* buf, int buflen)
+int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count, int grantedQoSs[],
+		unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -117,6 +137,12 @@ int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, i
 
 	*packetid = readInt(&curdata);
 
+	if (properties != NULL && !MQTTProperties_read(properties, &curdata, enddata))
+	{
+		rc = 0;
+		goto exit;
+	}
+
 	*count = 0;
 	while (curdata < enddata)
 	{
@@ -135,3 +161,7 @@ exit:
 }
 
 
+int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[], unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_suback(packetid, NULL, maxcount, count, grantedQoSs, buf, buflen);
+}
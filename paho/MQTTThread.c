@@ -0,0 +1,216 @@
+/*******************************************************************************
+ * MQTT network thread
+ *
+ *    Threaded mode of the paho Client : a single thread owns the socket and
+ *    does all the MQTT I/O, application threads hand their publishes over
+ *    through a bounded lock-free multi-producer queue. Producers neither take
+ *    a lock nor wait for the broker; a full queue is the only back-pressure
+ *
+ *******************************************************************************/
+
+#include "MQTTThread.h"
+
+#include <poll.h>
+#include <sched.h>
+
+struct QueuedPublish {
+    MQTTMessage message;
+    publishCompletionHandler fp;
+    void* context;
+    char* topicName;            // topic and payload are copied behind the structure, in the same allocation
+};
+
+
+// the queue's producer side, see MQTTQueue.  Returns 0 when the queue is full
+static int enqueue(MQTTThread* t, struct QueuedPublish* item)
+{
+    struct MQTTThreadCell* cell;
+    size_t pos;
+
+    if ((cell = MQTTQueueClaim(&t->queue, &pos)) == NULL)
+        return 0;
+    cell->item = item;
+    MQTTQueuePublish(&t->queue, cell, pos);
+    return 1;
+}
+
+
+static struct QueuedPublish* dequeue(MQTTThread* t)
+{
+    struct MQTTThreadCell* cell;
+    struct QueuedPublish* item;
+
+    if ((cell = MQTTQueuePeek(&t->queue)) == NULL)
+        return NULL;
+    item = cell->item;
+    MQTTQueueRelease(&t->queue, cell);
+    return item;
+}
+
+
+static void publishQueued(MQTTThread* t, struct QueuedPublish* item)
+{
+    Client* c = t->c;
+    int rc = FAILURE;
+
+    if (atomic_load_explicit(&c->isconnected, memory_order_acquire))
+        rc = MQTTPublishAsync(c, item->topicName, &item->message, item->fp, item->context);
+
+    // once taken, a publish reports its outcome itself
+    if (rc != SUCCESS && item->fp != NULL)
+        item->fp(0, (rc == SERVER_LIMITS) ? SERVER_LIMITS : FAILURE, item->context);
+    free(item);
+}
+
+
+static void failQueued(MQTTThread* t)
+{
+    struct QueuedPublish* item;
+
+    while ((item = dequeue(t)) != NULL)
+    {
+        if (item->fp != NULL)
+            item->fp(0, FAILURE, item->context);
+        free(item);
+    }
+}
+
+
+static void* run(void* arg)
+{
+    MQTTThread* t = (MQTTThread*)arg;
+    Client* c = t->c;
+    struct QueuedPublish* item;
+
+    while (atomic_load(&t->running))
+    {
+        struct pollfd fds[2];
+        int nfds = 1, timeout = -1;
+
+        while ((item = dequeue(t)) != NULL)
+            publishQueued(t, item);
+
+        if (atomic_load_explicit(&c->isconnected, memory_order_acquire))
+        {
+            if (MQTTProcess(c) != SUCCESS)
+            {
+                atomic_store_explicit(&c->isconnected, 0, memory_order_release);
+                if (t->onError)
+                    t->onError(c, t->context);
+            }
+            else
+            {
+                timeout = (linux_pending(c->ipstack) > 0) ? 0 : MQTTNextTimeout(c);
+                fds[1].fd = linux_getfd(c->ipstack);
+                fds[1].events = POLLIN;
+                nfds = (fds[1].fd >= 0) ? 2 : 1;
+            }
+        }
+        if (MQTTQueueWait(&t->queue, fds, nfds, timeout) != 0)
+            break;
+    }
+
+    failQueued(t);
+    return NULL;
+}
+
+
+/* Hands the client over to a new network thread.  From then on only MQTTThreadPublish may be used
+   on this client, until MQTTThreadStop.  queue_size is rounded up to a power of 2 */
+int MQTTThreadStart(MQTTThread* t, Client* c, unsigned int queue_size, threadErrorHandler onError, void* context)
+{
+    size_t size = 2;
+
+    while (size < queue_size)
+        size *= 2;
+
+    memset(t, 0, sizeof(MQTTThread));
+    t->c = c;
+    t->onError = onError;
+    t->context = context;
+    if ((t->cells = malloc(size * sizeof(struct MQTTThreadCell))) == NULL)
+        return FAILURE;
+    atomic_init(&t->running, 1);
+
+    if (MQTTQueueInit(&t->queue, t->cells, sizeof(struct MQTTThreadCell), size) != 0)
+    {
+        MQTTQueueClose(&t->queue);
+        free(t->cells);
+        t->cells = NULL;
+        return FAILURE;
+    }
+    if (pthread_create(&t->thread, NULL, run, t) != 0)
+    {
+        MQTTQueueClose(&t->queue);
+        free(t->cells);
+        t->cells = NULL;
+        atomic_store(&t->running, 0);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+/* Stops the network thread once it is done with the publish it may be sending; those still queued
+   complete with FAILURE.  The client can then be used directly again.  No MQTTThreadPublish may
+   still be running */
+int MQTTThreadStop(MQTTThread* t)
+{
+    if (t->cells == NULL)
+        return FAILURE;
+
+    atomic_store(&t->running, 0);
+    MQTTQueueWakeup(&t->queue, 1);
+    pthread_join(t->thread, NULL);
+    failQueued(t);  // queued while the thread was stopping
+
+    MQTTQueueClose(&t->queue);
+    free(t->cells);
+    t->cells = NULL;
+    return SUCCESS;
+}
+
+
+int MQTTThreadRunning(MQTTThread* t)
+{
+    return t->cells != NULL && atomic_load(&t->running);
+}
+
+
+/* Queues a publish for the network thread; topic and payload are copied, the caller's buffers can be reused
+   right away.  fp is called from the network thread: on acknowledgement for QoS1/2, once sent for QoS0, or
+   with FAILURE.  When the queue is full, waits up to wait_ms for room (0: fail straight away) */
+int MQTTThreadPublish(MQTTThread* t, const char* topicName, MQTTMessage* message, publishCompletionHandler fp, void* context, int wait_ms)
+{
+    size_t topiclen = strlen(topicName) + 1;
+    struct QueuedPublish* item;
+    Timer timer;
+
+    if (!MQTTThreadRunning(t))
+        return FAILURE;
+    if ((item = malloc(sizeof(struct QueuedPublish) + topiclen + message->payloadlen)) == NULL)
+        return FAILURE;
+
+    item->message = *message;
+    item->message.payload = (char*)(item + 1) + topiclen;
+    memcpy(item->message.payload, message->payload, message->payloadlen);
+    item->topicName = (char*)(item + 1);
+    memcpy(item->topicName, topicName, topiclen);
+    item->fp = fp;
+    item->context = context;
+
+    InitTimer(&timer);
+    countdown_ms(&timer, wait_ms);
+    while (!enqueue(t, item))
+    {
+        if (expired(&timer) || !atomic_load(&t->running))
+        {
+            free(item);
+            return FAILURE;
+        }
+        MQTTQueueWakeup(&t->queue, 0);
+        sched_yield();
+    }
+    MQTTQueueWakeup(&t->queue, 0);
+    return SUCCESS;
+}
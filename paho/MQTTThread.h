@@ -0,0 +1,51 @@
+/*******************************************************************************
+ * MQTT network thread
+ *
+ *    Threaded mode of the paho Client : a single thread owns the socket and
+ *    does all the MQTT I/O, application threads hand their publishes over
+ *    through a bounded lock-free multi-producer queue. Producers neither take
+ *    a lock nor wait for the broker; a full queue is the only back-pressure
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_THREAD_
+#define __MQTT_THREAD_
+
+#include "MQTTClient.h"
+#include "MQTTQueue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_PUBLISH_QUEUE_SIZE 256
+
+typedef struct MQTTThread MQTTThread;
+
+// invoked from the network thread when the connection has failed; queued publishes then complete with FAILURE
+typedef void (*threadErrorHandler)(Client*, void*);
+
+int MQTTThreadStart(MQTTThread*, Client*, unsigned int, threadErrorHandler, void*);
+int MQTTThreadStop(MQTTThread*);
+int MQTTThreadPublish(MQTTThread*, const char*, MQTTMessage*, publishCompletionHandler, void*, int);
+int MQTTThreadRunning(MQTTThread*);
+
+struct QueuedPublish;
+
+struct MQTTThreadCell {
+    struct MQTTQueueCell cell;
+    struct QueuedPublish* item;
+};
+
+struct MQTTThread {
+    Client* c;
+    pthread_t thread;
+    atomic_int running;
+
+    struct MQTTThreadCell* cells;
+    MQTTQueue queue;            // the network thread is its consumer
+
+    threadErrorHandler onError;
+    void* context;
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*******************************************************************************
+ * MQTT timer wheel
+ *
+ *    Hierarchical timing wheel for the timers of many clients (keepalives,
+ *    time-outs, reconnect delays) : arming, cancelling and firing a timer
+ *    are O(1), whatever the number of timers. One tick is one millisecond of
+ *    monotonic_ms(); 4 levels of 64 slots cover delays of up to 4.6 hours,
+ *    longer ones are clamped
+ *
+ *******************************************************************************/
+
+#include "MQTTTimerWheel.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define LEVEL_SHIFT(level) ((level) * WHEEL_SLOT_BITS)
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE (1ULL << LEVEL_SHIFT(WHEEL_LEVELS))     // ticks the wheel can look ahead
+
+
+// level 0 holds the timers due within WHEEL_SLOTS ticks, one tick per slot; level n slots span WHEEL_SLOTS^n ticks
+static void linkTimer(TimerWheel* w, WheelTimer* t)
+{
+    unsigned long long delta = t->expires - w->now;
+    WheelTimer** slot;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << LEVEL_SHIFT(level + 1)))
+        level++;
+
+    slot = &w->slots[level][(t->expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    t->level = level;
+    t->next = *slot;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    w->count[level]++;
+}
+
+
+static void unlinkTimer(TimerWheel* w, WheelTimer* t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count[t->level]--;
+}
+
+
+// moves the timers of one slot down to the levels they now belong to
+static void cascade(TimerWheel* w, int level, int index)
+{
+    WheelTimer* t;
+
+    while ((t = w->slots[level][index]) != NULL)
+    {
+        unlinkTimer(w, t);
+        linkTimer(w, t);
+    }
+}
+
+
+void WheelTimerInit(WheelTimer* t, wheelTimerHandler fp, void* context)
+{
+    memset(t, 0, sizeof(WheelTimer));
+    t->fp = fp;
+    t->context = context;
+}
+
+
+int WheelTimerArmed(WheelTimer* t)
+{
+    return t->pprev != NULL;
+}
+
+
+void TimerWheelInit(TimerWheel* w, unsigned long long now_ms)
+{
+    memset(w, 0, sizeof(TimerWheel));
+    w->now = now_ms;
+}
+
+
+/* Arms the timer for a monotonic_ms() deadline, re-arming it if it already was.
+   A deadline the wheel has already passed fires on its next tick */
+void TimerWheelAdd(TimerWheel* w, WheelTimer* t, unsigned long long expires_ms)
+{
+    if (t->pprev != NULL)
+        unlinkTimer(w, t);
+    if (expires_ms <= w->now)
+        expires_ms = w->now + 1;
+    else if (expires_ms - w->now >= WHEEL_RANGE)
+        expires_ms = w->now + WHEEL_RANGE - 1;
+    t->expires = expires_ms;
+    linkTimer(w, t);
+}
+
+
+void TimerWheelCancel(TimerWheel* w, WheelTimer* t)
+{
+    if (t->pprev != NULL)
+        unlinkTimer(w, t);
+}
+
+
+/* Moves the wheel forward to now_ms, firing every timer that fell due.  Returns the number fired.
+   Stretches without any timer close enough to matter are skipped, not walked tick by tick */
+int TimerWheelAdvance(TimerWheel* w, unsigned long long now_ms)
+{
+    int fired = 0;
+
+    while (w->now < now_ms)
+    {
+        unsigned long long tick;
+        WheelTimer* t;
+        int level = 0;
+
+        while (level < WHEEL_LEVELS && w->count[level] == 0)
+            level++;
+        if (level == WHEEL_LEVELS)
+        {   // nothing armed
+            w->now = now_ms;
+            break;
+        }
+        if (level > 0)
+        {   // nothing can fire before the next cascade of that level
+            unsigned long long boundary = (w->now | ((1ULL << LEVEL_SHIFT(level)) - 1)) + 1;
+            if (boundary > now_ms)
+            {
+                w->now = now_ms;
+                break;
+            }
+            w->now = boundary - 1;
+        }
+
+        tick = ++w->now;
+        for (level = 1; level < WHEEL_LEVELS && (tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) == 0; ++level)
+            cascade(w, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+
+        while ((t = w->slots[0][tick & SLOT_MASK]) != NULL)
+        {
+            unlinkTimer(w, t);
+            fired++;
+            if (t->fp != NULL)
+                t->fp(t, t->context);
+        }
+    }
+    return fired;
+}
+
+
+/* Milliseconds from the wheel's current time until it next has work to do, -1 if no timer is armed.
+   For far timers that is the cascade that brings them closer, not necessarily their expiry */
+int TimerWheelNextTimeout(TimerWheel* w)
+{
+    unsigned long long best = ULLONG_MAX;
+    int level, k;
+
+    for (level = 0; level < WHEEL_LEVELS; ++level)
+    {
+        int shift = LEVEL_SHIFT(level);
+
+        if (w->count[level] == 0)
+            continue;
+        for (k = 1; k <= WHEEL_SLOTS; ++k)
+        {
+            unsigned long long block = (w->now >> shift) + k;
+            if (w->slots[level][block & SLOT_MASK] != NULL)
+            {
+                unsigned long long due = (level == 0) ? block : (block << shift);
+                if (due - w->now < best)
+                    best = due - w->now;
+                break;
+            }
+        }
+    }
+
+    if (best == ULLONG_MAX)
+        return -1;
+    return (best > INT_MAX) ? INT_MAX : (int)best;
+}
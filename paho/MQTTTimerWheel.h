@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * MQTT timer wheel
+ *
+ *    Hierarchical timing wheel for the timers of many clients (keepalives,
+ *    time-outs, reconnect delays) : arming, cancelling and firing a timer
+ *    are O(1), whatever the number of timers. One tick is one millisecond of
+ *    monotonic_ms(); 4 levels of 64 slots cover delays of up to 4.6 hours,
+ *    longer ones are clamped
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_TIMER_WHEEL_
+#define __MQTT_TIMER_WHEEL_
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+typedef struct WheelTimer WheelTimer;
+typedef struct TimerWheel TimerWheel;
+
+// called from TimerWheelAdvance once the timer is due; it is no longer armed and may be re-armed from here
+typedef void (*wheelTimerHandler)(WheelTimer*, void*);
+
+void WheelTimerInit(WheelTimer*, wheelTimerHandler, void*);
+int WheelTimerArmed(WheelTimer*);
+
+void TimerWheelInit(TimerWheel*, unsigned long long);
+void TimerWheelAdd(TimerWheel*, WheelTimer*, unsigned long long);
+void TimerWheelCancel(TimerWheel*, WheelTimer*);
+int TimerWheelAdvance(TimerWheel*, unsigned long long);
+int TimerWheelNextTimeout(TimerWheel*);
+
+struct WheelTimer {
+    WheelTimer* next;
+    WheelTimer** pprev;         // NULL while the timer is not armed
+    unsigned long long expires; // tick
+    int level;
+
+    wheelTimerHandler fp;
+    void* context;
+};
+
+struct TimerWheel {
+    unsigned long long now;     // last tick processed
+    WheelTimer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    int count[WHEEL_LEVELS];    // timers armed per level
+};
+
+#endif
@@ -0,0 +1,380 @@
+/*******************************************************************************
+ * MQTT topic tree
+ *
+ *    Subscription index of the paho Client : topic filters are split on '/'
+ *    and stored one level per node, so an inbound topic is dispatched in
+ *    O(topic depth) whatever the number of subscriptions. Exact levels are
+ *    kept sorted for a binary search, '+' and '#' have a slot of their own
+ *
+ *******************************************************************************/
+
+#include "MQTTClient.h"
+#include "MQTTTopicTree.h"
+
+
+static int compareLevel(const char* a, int alen, const char* b, int blen)
+{
+    int rc = memcmp(a, b, (alen < blen) ? alen : blen);
+    return (rc != 0) ? rc : alen - blen;
+}
+
+
+// index of the exact child for this level, or where it would have to be inserted
+static int findChild(TopicNode* node, const char* level, int len, int* found)
+{
+    int lo = 0, hi = node->count;
+
+    *found = 0;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        int rc = compareLevel(level, len, node->children[mid]->level, node->children[mid]->levellen);
+        if (rc == 0)
+        {
+            *found = 1;
+            return mid;
+        }
+        if (rc < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+
+static TopicNode* newNode(const char* level, int len)
+{
+    TopicNode* node = calloc(1, sizeof(TopicNode));
+
+    if (node != NULL && (node->level = malloc(len + 1)) == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    if (node != NULL)
+    {
+        memcpy(node->level, level, len);
+        node->level[len] = '\0';
+        node->levellen = len;
+    }
+    return node;
+}
+
+
+static TopicNode* addChild(TopicNode* node, const char* level, int len)
+{
+    TopicNode* child;
+    int found, i;
+
+    if (len == 1 && level[0] == '+')
+        return (node->plus != NULL) ? node->plus : (node->plus = newNode(level, len));
+    if (len == 1 && level[0] == '#')
+        return (node->hash != NULL) ? node->hash : (node->hash = newNode(level, len));
+
+    i = findChild(node, level, len, &found);
+    if (found)
+        return node->children[i];
+
+    if (node->count == node->size)
+    {
+        int size = (node->size == 0) ? 4 : node->size * 2;
+        TopicNode** children = realloc(node->children, size * sizeof(TopicNode*));
+        if (children == NULL)
+            return NULL;
+        node->children = children;
+        node->size = size;
+    }
+    if ((child = newNode(level, len)) == NULL)
+        return NULL;
+
+    memmove(&node->children[i + 1], &node->children[i], (node->count - i) * sizeof(TopicNode*));
+    node->children[i] = child;
+    node->count++;
+    return child;
+}
+
+
+static int isEmpty(TopicNode* node)
+{
+    return !node->subscribed && node->count == 0 && node->plus == NULL && node->hash == NULL;
+}
+
+
+static void freeNode(TopicNode* node)
+{
+    int i;
+
+    for (i = 0; i < node->count; ++i)
+        freeNode(node->children[i]);
+    if (node->plus != NULL)
+        freeNode(node->plus);
+    if (node->hash != NULL)
+        freeNode(node->hash);
+    free(node->children);
+    free(node->level);
+    free(node);
+}
+
+
+static int isValidFilter(const char* topicFilter)
+{
+    const char* level = topicFilter;
+
+    while (1)
+    {
+        const char* end = strchr(level, '/');
+        int len = (end == NULL) ? strlen(level) : end - level;
+
+        if ((memchr(level, '+', len) != NULL || memchr(level, '#', len) != NULL) && len != 1)
+            return 0;
+        if (level[0] == '#' && end != NULL)
+            return 0;
+        if (end == NULL)
+            return 1;
+        level = end + 1;
+    }
+}
+
+
+/* Registers (or replaces) the handler and QoS of a topic filter.
+   '+' must be a whole level, '#' a whole level and the last one */
+int MQTTTopicTree_add(TopicNode* root, const char* topicFilter, int qos, topicHandler fp)
+{
+    TopicNode* node = root;
+    const char* level = topicFilter;
+
+    if (!isValidFilter(topicFilter))
+        return FAILURE;
+
+    while (node != NULL)
+    {
+        const char* end = strchr(level, '/');
+
+        node = addChild(node, level, (end == NULL) ? strlen(level) : end - level);
+        if (end == NULL)
+            break;
+        level = end + 1;
+    }
+    if (node == NULL)
+        return FAILURE;
+
+    node->subscribed = 1;
+    node->qos = qos;
+    node->fp = fp;
+    return SUCCESS;
+}
+
+
+static int removeLevel(TopicNode* node, const char* level)
+{
+    const char* end = strchr(level, '/');
+    int len = (end == NULL) ? strlen(level) : end - level;
+    TopicNode** slot = NULL;
+    int found = 0, i = 0, rc;
+
+    if (len == 1 && level[0] == '+')
+        slot = &node->plus;
+    else if (len == 1 && level[0] == '#')
+        slot = &node->hash;
+    else
+    {
+        i = findChild(node, level, len, &found);
+        if (found)
+            slot = &node->children[i];
+    }
+
+    if (slot == NULL || *slot == NULL)
+        return FAILURE;
+
+    if (end == NULL)
+    {
+        if (!(*slot)->subscribed)
+            return FAILURE;
+        (*slot)->subscribed = 0;
+        (*slot)->fp = NULL;
+        rc = SUCCESS;
+    }
+    else
+        rc = removeLevel(*slot, end + 1);
+
+    if (rc == SUCCESS && isEmpty(*slot))
+    {   // prune the branch nobody subscribes to any more
+        freeNode(*slot);
+        if (slot == &node->plus || slot == &node->hash)
+            *slot = NULL;
+        else
+            memmove(&node->children[i], &node->children[i + 1], (--node->count - i) * sizeof(TopicNode*));
+    }
+    return rc;
+}
+
+
+int MQTTTopicTree_remove(TopicNode* root, const char* topicFilter)
+{
+    return removeLevel(root, topicFilter);
+}
+
+
+// the node a filter ends at, NULL if nobody subscribes to that exact filter
+TopicNode* MQTTTopicTree_find(TopicNode* root, const char* topicFilter)
+{
+    TopicNode* node = root;
+    const char* level = topicFilter;
+
+    while (node != NULL)
+    {
+        const char* end = strchr(level, '/');
+        int len = (end == NULL) ? strlen(level) : end - level;
+
+        if (len == 1 && level[0] == '+')
+            node = node->plus;
+        else if (len == 1 && level[0] == '#')
+            node = node->hash;
+        else
+        {
+            int found, i = findChild(node, level, len, &found);
+            node = found ? node->children[i] : NULL;
+        }
+        if (end == NULL)
+            break;
+        level = end + 1;
+    }
+    return (node != NULL && node->subscribed) ? node : NULL;
+}
+
+
+static int matchLevel(TopicNode* node, const char* level, const char* topic_end, MessageData* md)
+{
+    int matches = 0;
+
+    // '#' also matches the parent level: "a/#" takes "a"
+    if (node->hash != NULL && node->hash->subscribed && node->hash->fp != NULL)
+    {
+        node->hash->fp(md);
+        matches++;
+    }
+
+    if (level == NULL)
+    {   // topic exhausted
+        if (node->subscribed && node->fp != NULL)
+        {
+            node->fp(md);
+            matches++;
+        }
+    }
+    else
+    {
+        const char* end = memchr(level, '/', topic_end - level);
+        const char* next = (end == NULL) ? NULL : end + 1;
+        int len = (end == NULL) ? topic_end - level : end - level;
+        int found, i = findChild(node, level, len, &found);
+
+        if (found)
+            matches += matchLevel(node->children[i], next, topic_end, md);
+        if (node->plus != NULL)
+            matches += matchLevel(node->plus, next, topic_end, md);
+    }
+    return matches;
+}
+
+
+/* Calls the handler of every filter matching the topic, returns how many were called.
+   Wildcards at the first level do not match topics starting with '$' */
+int MQTTTopicTree_match(TopicNode* root, MQTTString* topicName, MessageData* md)
+{
+    const char* topic = topicName->lenstring.data;
+    int len = topicName->lenstring.len;
+
+    if (topic == NULL)
+    {
+        topic = topicName->cstring;
+        len = (topic == NULL) ? 0 : strlen(topic);
+    }
+    if (topic == NULL)
+        return 0;
+
+    if (len > 0 && topic[0] == '$')
+    {   // system topics: exact first level only
+        const char* end = memchr(topic, '/', len);
+        int found, i = findChild(root, topic, (end == NULL) ? len : end - topic, &found);
+        return found ? matchLevel(root->children[i], (end == NULL) ? NULL : end + 1, topic + len, md) : 0;
+    }
+    return matchLevel(root, topic, topic + len, md);
+}
+
+
+struct WalkPath {
+    char* buf;
+    int len, size;
+};
+
+
+static int walkNode(TopicNode* node, struct WalkPath* path, int depth, topicFilterVisitor fp, void* context)
+{
+    int start = path->len, rc = SUCCESS, i;
+
+    if (depth > 0)
+    {   // the filter so far, then "/level" (no separator before the first level, which may be empty)
+        int need = start + node->levellen + 2;
+        if (need > path->size)
+        {
+            char* buf = realloc(path->buf, need * 2);
+            if (buf == NULL)
+                return FAILURE;
+            path->buf = buf;
+            path->size = need * 2;
+        }
+        if (depth > 1)
+            path->buf[path->len++] = '/';
+        memcpy(&path->buf[path->len], node->level, node->levellen);
+        path->len += node->levellen;
+        path->buf[path->len] = '\0';
+    }
+
+    if (node->subscribed)
+        rc = fp(path->buf, node->qos, context);
+    for (i = 0; rc == SUCCESS && i < node->count; ++i)
+        rc = walkNode(node->children[i], path, depth + 1, fp, context);
+    if (rc == SUCCESS && node->plus != NULL)
+        rc = walkNode(node->plus, path, depth + 1, fp, context);
+    if (rc == SUCCESS && node->hash != NULL)
+        rc = walkNode(node->hash, path, depth + 1, fp, context);
+
+    path->len = start;
+    path->buf[start] = '\0';
+    return rc;
+}
+
+
+/* Calls fp with every filter in the tree and its QoS, until fp returns something else than SUCCESS,
+   which is then returned */
+int MQTTTopicTree_walk(TopicNode* root, topicFilterVisitor fp, void* context)
+{
+    struct WalkPath path = {NULL, 0, 0};
+    int rc;
+
+    if ((path.buf = malloc(64)) == NULL)
+        return FAILURE;
+    path.size = 64;
+    path.buf[0] = '\0';
+    rc = walkNode(root, &path, 0, fp, context);
+    free(path.buf);
+    return rc;
+}
+
+
+// frees every node below the root, the root itself is left empty
+void MQTTTopicTree_free(TopicNode* root)
+{
+    int i;
+
+    for (i = 0; i < root->count; ++i)
+        freeNode(root->children[i]);
+    if (root->plus != NULL)
+        freeNode(root->plus);
+    if (root->hash != NULL)
+        freeNode(root->hash);
+    free(root->children);
+    memset(root, 0, sizeof(TopicNode));
+}
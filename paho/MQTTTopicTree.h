@@ -0,0 +1,48 @@
+/*******************************************************************************
+ * MQTT topic tree
+ *
+ *    Subscription index of the paho Client : topic filters are split on '/'
+ *    and stored one level per node, so an inbound topic is dispatched in
+ *    O(topic depth) whatever the number of subscriptions. Exact levels are
+ *    kept sorted for a binary search, '+' and '#' have a slot of their own
+ *
+ *******************************************************************************/
+
+#ifndef __MQTT_TOPIC_TREE_
+#define __MQTT_TOPIC_TREE_
+
+#include "MQTTPacket.h"
+
+struct MessageData;
+
+typedef struct TopicNode TopicNode;
+
+// handler invoked for every filter matching an inbound topic (same signature as messageHandler)
+typedef void (*topicHandler)(struct MessageData*);
+
+// invoked by MQTTTopicTree_walk for every filter, the string is only valid during the call
+typedef int (*topicFilterVisitor)(const char*, int, void*);
+
+int MQTTTopicTree_add(TopicNode*, const char*, int, topicHandler);
+int MQTTTopicTree_remove(TopicNode*, const char*);
+TopicNode* MQTTTopicTree_find(TopicNode*, const char*);
+int MQTTTopicTree_match(TopicNode*, MQTTString*, struct MessageData*);
+int MQTTTopicTree_walk(TopicNode*, topicFilterVisitor, void*);
+void MQTTTopicTree_free(TopicNode*);
+
+struct TopicNode {
+    char* level;                // NULL for the root
+    int levellen;
+    char subscribed;            // a filter ends at this node
+    char qos;                   // requested for that filter, to subscribe again on a new session
+    topicHandler fp;            // may be NULL: the subscription then falls back to the default handler
+
+    TopicNode** children;       // exact levels, sorted
+    int count, size;
+    TopicNode* plus;            // '+' child
+    TopicNode* hash;            // '#' child
+};
+
+#define TopicNode_initializer {NULL, 0, 0, 0, NULL, NULL, 0, 0, NULL, NULL}
+
+#endif
@@ -0,0 +1,147 @@
+/*******************************************************************************************************************
+
+ Heap allocations on the publish and ack path
+
+	Once a session is up and warmed up, publishing must not touch the heap : mqtt_avPublishData in either encoding
+	(mqtt_avSetEncoding), mqtt_avPublishAck and mqtt_PublishKeyValue, at QoS 0 and at QoS 1, are called against a
+	stand-in broker on the loopback with malloc, calloc and realloc counted.  This file defines them, in front of
+	glibc's, so that the libraries' calls land here whichever object makes them
+
+	usage : allocationTest [calls per measure]		(1000)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttAirVantage.h"
+#include "mqttInterface.h"
+#include "MQTTLog.h"
+#include "../mqttInterface/tests/standInBroker.h"
+#include "../mqttInterface/tests/testCheck.h"
+
+
+#define		WARM_UP					16			//calls before counting : lazy set-ups, buffers growing to size
+
+//the AirVantage layer's own, not in its header : the instance it drives
+extern mqtt_interface_st*		g_mqttObject;
+
+//glibc's allocator, under the names it exports for those replacing malloc
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+static const char*		g_encodingNames[] = {"json", "cbor"};
+static unsigned long	g_allocations = 0;
+
+
+//-------------------------------------------------------------------------------------------------------
+void* malloc(size_t size)
+{
+	__atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+//-------------------------------------------------------------------------------------------------------
+void* calloc(size_t count, size_t size)
+{
+	__atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+//-------------------------------------------------------------------------------------------------------
+void* realloc(void* ptr, size_t size)
+{
+	__atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned long allocations(void)
+{
+	return __atomic_load_n(&g_allocations, __ATOMIC_RELAXED);
+}
+
+//-------------------------------------------------------------------------------------------------------
+//makes the call WARM_UP times, then calls more times : none of those may allocate, nor fail
+#define MEASURE(what, calls, call)																						\
+	do {																												\
+		unsigned long	before;																							\
+		int				failed = 0;																						\
+		for (long i = 0; i < WARM_UP; i++)																				\
+		{																												\
+			failed += (call) != SUCCESS;																				\
+		}																												\
+		before = allocations();																							\
+		for (long i = 0; i < (calls); i++)																				\
+		{																												\
+			failed += (call) != SUCCESS;																				\
+		}																												\
+		CHECK(failed == 0, "%s : %d calls failed", what, failed);														\
+		CHECK(allocations() == before, "%s : %lu allocations in %ld calls", what, allocations() - before, (long) (calls));	\
+		printf("%-40s %lu allocations in %ld calls\n", what, allocations() - before, (long) (calls));					\
+	} while (0)
+
+//-------------------------------------------------------------------------------------------------------
+static int testSession(int encoding, enum QoS qos, int port, long calls)
+{
+	char			deviceId[32], what[64];
+	unsigned long	setUp = allocations();
+
+	//created here for the broker on the loopback : mqtt_avStartSession takes it as it is
+	snprintf(deviceId, sizeof(deviceId), "alloc-%s-%d", g_encodingNames[encoding], qos);
+	g_mqttObject = mqtt_CreateInstance("127.0.0.1", port, 0, deviceId, "secret", 30, qos);
+	mqtt_avSetEncoding(encoding);
+	if (mqtt_avStartSession(deviceId, "secret", 0) != SUCCESS)
+	{
+		fprintf(stderr, "%s : no session with the stand-in broker\n", deviceId);
+		return 1;
+	}
+	//setting a session up does allocate : zero later on would mean nothing if it counted none
+	CHECK(allocations() > setUp, "%s : the allocations of the session set-up were not counted", deviceId);
+
+	snprintf(what, sizeof(what), "%s QoS%d mqtt_avPublishData", g_encodingNames[encoding], qos);
+	MEASURE(what, calls, mqtt_avPublishData("temperature", "21.5"));
+
+	snprintf(what, sizeof(what), "%s QoS%d mqtt_avPublishAck", g_encodingNames[encoding], qos);
+	MEASURE(what, calls, mqtt_avPublishAck("5cd1e4a1b7c54c6f9d1a", 0, (char*) "done"));
+
+	if (encoding == AV_ENCODING_JSON)
+	{
+		snprintf(what, sizeof(what), "QoS%d mqtt_PublishKeyValue", qos);
+		MEASURE(what, calls, mqtt_PublishKeyValue(g_mqttObject, "temperature", "21.5", "alloc/data"));
+	}
+
+	mqtt_avStopSession();
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	long	calls = (argc > 1) ? atol(argv[1]) : 1000;
+	int		port, rc = 0;
+	pid_t	broker;
+
+	if ((broker = standInBrokerStart(4, &port)) < 0)
+	{
+		fprintf(stderr, "cannot start the stand-in broker\n");
+		return 1;
+	}
+	MQTTLogSetLevel(MQTT_LOG_WARN);
+
+	for (int encoding = AV_ENCODING_JSON; encoding <= AV_ENCODING_CBOR && rc == 0; encoding++)
+	{
+		for (int qos = QOS0; qos <= QOS1 && rc == 0; qos++)
+		{
+			rc = testSession(encoding, (enum QoS) qos, port, calls);
+		}
+	}
+
+	standInBrokerStop(broker);
+	//a session that could not start was reported already : counted as a failure
+	g_failures += (rc != 0);
+	return testResult(NULL);
+}
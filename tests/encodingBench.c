@@ -0,0 +1,223 @@
+/*******************************************************************************************************************
+
+ CBOR against JSON
+
+	Size and time of what a session publishes and takes in, in either encoding (mqtt_avSetEncoding) : data with
+	mqtt_avPublishData, samples gathered by mqtt_avBatchAdd, acks with mqtt_avPublishAck, and commands handed to
+	onIncomingMessage as the client would, their ack included.  Each goes through the whole stack to a stand-in
+	broker on the loopback, which drops it : bytes are PUBLISH packets as written to the socket, times include the
+	send.  The encoding alone, without the stack, is measured on the key-value sample first
+
+	usage : encodingBench [calls per measure]		(200000)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttAirVantage.h"
+#include "mqttInterface.h"
+#include "MQTTLog.h"
+#include "swir_json.h"
+#include "swir_cbor.h"
+#include "../mqttInterface/tests/standInBroker.h"
+
+
+#define		SAMPLES_PER_TIMESTAMP	3
+#define		BATCH_BYTES				4096
+
+//the AirVantage layer's own, not in its header : the instance it drives, and the handler it subscribes with
+extern mqtt_interface_st*		g_mqttObject;
+void onIncomingMessage(MessageData* md);
+
+static const char*	g_encodingNames[] = {"json", "cbor"};
+static volatile int	g_sink;
+
+
+//-------------------------------------------------------------------------------------------------------
+static int onTurnOn(const char* uid, const char* id, const av_param_st* params, int count, const char* timestamp, void* context)
+{
+	g_sink += count;
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static unsigned long long publishedBytes(void)
+{
+	mqtt_stats_st	stats;
+
+	mqtt_GetStats(g_mqttObject, &stats);
+	return stats.client.bytes_out[PUBLISH];
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void report(int encoding, const char* what, long calls, unsigned long long bytes, unsigned long long us)
+{
+	printf("%-4s  %-28s %8.1f bytes %9.3f us\n", g_encodingNames[encoding], what, (double) bytes / calls, (double) us / calls);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void benchEncodeOnly(long calls)
+{
+	//{"temperature":"21.5"} as each encodes it, into a buffer on the stack
+	unsigned char		buffer[64];
+	unsigned long long	start, us;
+	int					len = 0;
+
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		len = swirjson_szSerializeTo((char*) buffer, sizeof(buffer), "temperature", "21.5", 0);
+		g_sink += buffer[len - 1];
+	}
+	us = monotonic_us() - start;
+	report(AV_ENCODING_JSON, "encode key-value", calls, (unsigned long long) len * calls, us);
+
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		len = swircbor_szSerializeTo(buffer, sizeof(buffer), "temperature", "21.5", 0);
+		g_sink += buffer[len - 1];
+	}
+	us = monotonic_us() - start;
+	report(AV_ENCODING_CBOR, "encode key-value", calls, (unsigned long long) len * calls, us);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int commandPayload(int encoding, unsigned char* buffer, size_t size)
+{
+	static const char	szCommand[] = "[{\"uid\": \"5cd1e4a1b7c54c6f9d1a\", \"timestamp\": 1700000000000, \"command\": "
+									  "{\"id\": \"TurnOn\", \"params\": {\"Light\": \"true\", \"Level\": \"80\"}}}]";
+	swirjson_writer		writer;
+
+	swirjson_writerInit(&writer, (char*) buffer, size);
+	if (encoding == AV_ENCODING_JSON)
+	{
+		swirjson_writeRaw(&writer, szCommand, sizeof(szCommand) - 1);
+	}
+	else
+	{
+		swircbor_writeArray(&writer, 1);
+		swircbor_writeMap(&writer, 3);
+		swircbor_writeString(&writer, "uid");
+		swircbor_writeString(&writer, "5cd1e4a1b7c54c6f9d1a");
+		swircbor_writeString(&writer, "timestamp");
+		swircbor_writeUInt(&writer, 1700000000000ULL);
+		swircbor_writeString(&writer, "command");
+		swircbor_writeMap(&writer, 2);
+		swircbor_writeString(&writer, "id");
+		swircbor_writeString(&writer, "TurnOn");
+		swircbor_writeString(&writer, "params");
+		swircbor_writeMap(&writer, 2);
+		swircbor_writeString(&writer, "Light");
+		swircbor_writeString(&writer, "true");
+		swircbor_writeString(&writer, "Level");
+		swircbor_writeString(&writer, "80");
+	}
+	return swirjson_writerEnd(&writer);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int benchSession(int encoding, int port, long calls)
+{
+	char				deviceId[32];
+	unsigned char		payload[256];
+	unsigned long long	start, us, bytes;
+	av_batch_stats_st	batchBefore, batchAfter;
+	MQTTMessage			message;
+	MQTTString			topic = MQTTString_initializer;
+	MessageData			md;
+
+	//created here for the broker on the loopback : mqtt_avStartSession takes it as it is
+	snprintf(deviceId, sizeof(deviceId), "bench-%s", g_encodingNames[encoding]);
+	g_mqttObject = mqtt_CreateInstance("127.0.0.1", port, 0, deviceId, "secret", 30, QOS0);
+	mqtt_avSetEncoding(encoding);
+	if (mqtt_avStartSession(deviceId, "secret", 0) != SUCCESS)
+	{
+		fprintf(stderr, "%s : no session with the stand-in broker\n", g_encodingNames[encoding]);
+		return 1;
+	}
+
+	bytes = publishedBytes();
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		mqtt_avPublishData("temperature", "21.5");
+	}
+	us = monotonic_us() - start;
+	report(encoding, "mqtt_avPublishData", calls, publishedBytes() - bytes, us);
+
+	//samples at 3 keys a timestamp, in documents of up to 4 KB
+	mqtt_avBatchStart(BATCH_BYTES, 0, 0);
+	mqtt_avGetBatchStats(&batchBefore);
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		static const char*	keys[SAMPLES_PER_TIMESTAMP] = {"temperature", "humidity", "luminosity"};
+		static const char*	values[SAMPLES_PER_TIMESTAMP] = {"21.5", "40", "412"};
+
+		mqtt_avBatchAdd(keys[i % SAMPLES_PER_TIMESTAMP], values[i % SAMPLES_PER_TIMESTAMP],
+						1700000000000ULL + (i / SAMPLES_PER_TIMESTAMP) * 1000);
+	}
+	mqtt_avBatchFlush();
+	us = monotonic_us() - start;
+	mqtt_avGetBatchStats(&batchAfter);
+	report(encoding, "mqtt_avBatchAdd, per sample", calls, batchAfter.bytes - batchBefore.bytes, us);
+	mqtt_avBatchStop();
+
+	bytes = publishedBytes();
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		mqtt_avPublishAck("5cd1e4a1b7c54c6f9d1a", 0, (char*) "");
+	}
+	us = monotonic_us() - start;
+	report(encoding, "mqtt_avPublishAck", calls, publishedBytes() - bytes, us);
+
+	//a command as the client hands it over, with its ack
+	memset(&message, 0, sizeof(message));
+	message.payload = payload;
+	message.payloadlen = commandPayload(encoding, payload, sizeof(payload));
+	topic.cstring = deviceId;
+	md.message = &message;
+	md.topicName = &topic;
+	mqtt_avRegisterCommandHandler("TurnOn", onTurnOn, NULL);
+
+	start = monotonic_us();
+	for (long i = 0; i < calls; i++)
+	{
+		onIncomingMessage(&md);
+	}
+	us = monotonic_us() - start;
+	report(encoding, "command received", calls, (unsigned long long) message.payloadlen * calls, us);
+
+	mqtt_avStopSession();
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	long	calls = (argc > 1) ? atol(argv[1]) : 200000;
+	int		port, rc;
+	pid_t	broker;
+
+	if ((broker = standInBrokerStart(1, &port)) < 0)
+	{
+		fprintf(stderr, "cannot start the stand-in broker\n");
+		return 1;
+	}
+	MQTTLogSetLevel(MQTT_LOG_WARN);
+
+	benchEncodeOnly(calls * 10);
+	rc = benchSession(AV_ENCODING_JSON, port, calls);
+	if (rc == 0)
+	{
+		rc = benchSession(AV_ENCODING_CBOR, port, calls);
+	}
+
+	standInBrokerStop(broker);
+	return rc;
+}
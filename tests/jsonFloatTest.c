@@ -0,0 +1,167 @@
+/*******************************************************************************************************************
+
+ swirjson_writeFloat and swirjson_writeDouble against printf
+
+	swirjson_writeFloat(value, n) must write what printf's %.*f does, digit for digit : values whose scaled form
+	rounds to a tie in double but is not one (34.945), true ties (0.125), subnormals, values on either side of
+	the fast path's 64-bit limit, nan and inf, then random values of every magnitude.  swirjson_writeDouble(value,
+	n) must write what %.*g does, null for nan and inf.  With a locale writing decimal commas, when one is
+	installed, both must still write a point
+
+	usage : jsonFloatTest [random values]		(1000000)
+
+*******************************************************************************************************************/
+
+
+#include <float.h>
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "swir_json.h"
+#include "../mqttInterface/tests/testCheck.h"
+
+
+static const double g_values[] = {
+	0.0, 1.0, 0.5, 1.5, 2.5, 0.125, 0.375, 0.625, 34.945, 34.955, 1.005, 1.015, 2.675, 0.045, 1e-5, 5e-10, 4.9999999e-10,
+	0.1, 0.2, 0.3, 123456.789, 9007199254740993.0, 4503599627370495.5, 1e15 + 0.5, 18446744073.709553, 1.8e18, 1.8e19,
+	1e19, 1e100, 1e300, DBL_MAX, DBL_MIN, DBL_MIN / 3, 4.9e-324, DBL_EPSILON,
+};
+
+
+//-------------------------------------------------------------------------------------------------------
+static int compare(double value, int decimals)
+{
+	char			expected[400], written[400];
+	swirjson_writer	writer;
+
+	snprintf(expected, sizeof(expected), "%.*f", decimals, value);
+	swirjson_writerInit(&writer, written, sizeof(written));
+	swirjson_writeFloat(&writer, value, decimals);
+	swirjson_writerEnd(&writer);
+
+	if (strcmp(expected, written) != 0)
+	{
+		if (g_failures < 20)
+		{
+			CHECK(0, "%.17g with %d decimals : wrote %s, printf %s", value, decimals, written, expected);
+		}
+		else
+		{
+			g_failures++;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void compareDigits(double value, int digits)
+{
+	char			expected[400], written[400];
+	swirjson_writer	writer;
+
+	if (value - value == 0)
+	{
+		snprintf(expected, sizeof(expected), "%.*g", digits, value);
+	}
+	else
+	{
+		strcpy(expected, "null");
+	}
+	swirjson_writerInit(&writer, written, sizeof(written));
+	swirjson_writeDouble(&writer, value, digits);
+	swirjson_writerEnd(&writer);
+	CHECK(strcmp(expected, written) == 0, "%.17g with %d digits : wrote %s, not %s", value, digits, written, expected);
+}
+
+//-------------------------------------------------------------------------------------------------------
+static double randomValue(unsigned int* seed)
+{
+	//every magnitude from 1e-12 to 1e20, plain decimals near ties, or bits taken at random
+	switch (rand_r(seed) % 3)
+	{
+		case 0:
+			return (rand_r(seed) / (double) RAND_MAX) * pow(10, rand_r(seed) % 33 - 12) * ((rand_r(seed) & 1) ? -1 : 1);
+		case 1:
+			return (rand_r(seed) % 2000000 - 1000000) / pow(10, rand_r(seed) % 10);
+		default:
+		{
+			unsigned long long	bits = ((unsigned long long) rand_r(seed) << 33) ^ ((unsigned long long) rand_r(seed) << 11) ^ rand_r(seed);
+			double				value;
+
+			memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	long			count = (argc > 1) ? atol(argv[1]) : 1000000;
+	long			matched = 0;
+	unsigned int	seed = 1;
+	const char*		commaLocales[] = {"de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "fr_FR", "ru_RU.UTF-8"};
+	char			written[400];
+	swirjson_writer	writer;
+
+	for (size_t i = 0; i < sizeof(g_values) / sizeof(g_values[0]); i++)
+	{
+		for (int decimals = 0; decimals <= 9; decimals++)
+		{
+			compare(g_values[i], decimals);
+			compare(-g_values[i], decimals);
+		}
+	}
+	compare(-0.0, 2);
+	compare(NAN, 2);
+	compare(INFINITY, 2);
+	compare(-INFINITY, 2);
+
+	//the precisions swircbor_toJson writes half, single and double floats with
+	for (size_t i = 0; i < sizeof(g_values) / sizeof(g_values[0]); i++)
+	{
+		compareDigits(g_values[i], 5);
+		compareDigits(g_values[i], 9);
+		compareDigits(-g_values[i], 17);
+	}
+	compareDigits(NAN, 17);
+	compareDigits(-INFINITY, 9);
+
+	for (long i = 0; i < count; i++)
+	{
+		matched += compare(randomValue(&seed), rand_r(&seed) % 10);
+	}
+	printf("%ld of %ld random values written as printf does\n", matched, count);
+
+	for (size_t i = 0; i < sizeof(commaLocales) / sizeof(commaLocales[0]); i++)
+	{
+		if (setlocale(LC_NUMERIC, commaLocales[i]) != NULL)
+		{
+			swirjson_writerInit(&writer, written, sizeof(written));
+			swirjson_writeFloat(&writer, 1e300, 2);
+			swirjson_writerEnd(&writer);
+			CHECK(strchr(written, ',') == NULL, "in %s, a large value is written %s", commaLocales[i], written);
+			swirjson_writerInit(&writer, written, sizeof(written));
+			swirjson_writeFloat(&writer, 34.945, 2);
+			swirjson_writerEnd(&writer);
+			CHECK(strcmp(written, "34.95") == 0, "in %s, 34.945 is written %s", commaLocales[i], written);
+			swirjson_writerInit(&writer, written, sizeof(written));
+			swirjson_writeDouble(&writer, 0.1, 17);
+			swirjson_writerEnd(&writer);
+			CHECK(strcmp(written, "0.10000000000000001") == 0, "in %s, 0.1 is written %s", commaLocales[i], written);
+			printf("locale %s : points kept\n", commaLocales[i]);
+			setlocale(LC_NUMERIC, "C");
+			break;
+		}
+		if (i == sizeof(commaLocales) / sizeof(commaLocales[0]) - 1)
+		{
+			printf("no locale with decimal commas installed : not checked\n");
+		}
+	}
+
+	return testResult(NULL);
+}
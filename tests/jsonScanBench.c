@@ -0,0 +1,179 @@
+/*******************************************************************************************************************
+
+ swirjson_tokenize against swirjson_getValue
+
+	Commands of 4 to 1024 parameters are decoded as onIncomingMessage does, the uid, timestamp, id and every
+	parameter looked up, with the span index built by each scanner, then with the legacy parser, which rescans
+	the payload and copies the value at each lookup (it knows no escapes : those commands have none).  Then a
+	batch of commands, as a gateway relays them, is only tokenized, for the throughput of the scanners alone.
+	SWIRJSON_SCANNER set to scalar, sse2 or avx2 limits the run to that scanner
+
+	usage : jsonScanBench [bytes decoded per measure]		(200000000)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "swir_json.h"
+#include "MQTTLinux.h"
+
+
+#define		BATCH_COMMANDS			1000
+
+static const char*		g_scanners[] = {"scalar", "sse2", "avx2"};
+static const int		g_paramCounts[] = {4, 64, 1024};
+static volatile int		g_sink;
+
+
+//-------------------------------------------------------------------------------------------------------
+static size_t writeCommand(char* szJson, int nParams, int nSeq, int bEscapes)
+{
+	//{"uid": ..., "timestamp": ..., "command": {"id": ..., "params": {"p0": 0, ...}}}, string values with escapes now and then if asked
+	size_t	len = 0;
+	int		i;
+
+	len += sprintf(szJson + len, "{\"uid\": \"5cd1e4a1b7c54c6f%04d\", \"timestamp\": %llu, \"command\": {\"id\": \"Configure\", \"params\": {",
+				   nSeq % 10000, 1700000000000ULL + nSeq);
+	for (i = 0; i < nParams; i++)
+	{
+		len += sprintf(szJson + len, (bEscapes && i % 8 == 7) ? "%s\"p%d\": \"line \\\"%d\\\"\\n\"" : "%s\"p%d\": %d",
+					   (i == 0) ? "" : ", ", i, i * 37);
+	}
+	len += sprintf(szJson + len, "}}}");
+	return len;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int decodeIndexed(const char* szJson, size_t len, swirjson_token* pTokens, int nMaxTokens)
+{
+	//what onIncomingMessage looks up, as views
+	int		nTokens = swirjson_tokenize(szJson, len, pTokens, nMaxTokens);
+	int		nCommand, nParams, nEnd, nValue, nKey, nSum = 0;
+
+	if (nTokens < 0 || nTokens > nMaxTokens || (nCommand = swirjson_find(pTokens, 0, "command")) < 0)
+	{
+		return -1;
+	}
+	nSum += swirjson_find(pTokens, 0, "uid") + swirjson_find(pTokens, 0, "timestamp") + swirjson_find(pTokens, nCommand, "id");
+	if ((nParams = swirjson_find(pTokens, nCommand, "params")) < 0)
+	{
+		return -1;
+	}
+	//keys and values in turn, as onCommand walks them
+	nEnd = pTokens[nParams].nNext;
+	for (nKey = nParams + 1; nKey < nEnd && (nValue = pTokens[nKey].nNext) < nEnd; nKey = pTokens[nValue].nNext)
+	{
+		nSum += pTokens[nValue].nLen + pTokens[nKey].nLen;
+	}
+	return nSum;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int decodeLegacy(char* szJson)
+{
+	//the same with swirjson_getValue, as onIncomingMessage did before the span index
+	char*	pszCommand = swirjson_getValue(szJson, -1, (char*) "command");
+	char*	pszUid = swirjson_getValue(szJson, -1, (char*) "uid");
+	char*	pszTimestamp = swirjson_getValue(szJson, -1, (char*) "timestamp");
+	char*	pszId = swirjson_getValue(pszCommand, -1, (char*) "id");
+	char*	pszParams = swirjson_getValue(pszCommand, -1, (char*) "params");
+	char*	pszValue;
+	char	szKey[32];
+	int		i, nSum = (int) (strlen(pszUid) + strlen(pszTimestamp) + strlen(pszId));
+
+	for (i = 0; (pszValue = swirjson_getValue(pszParams, i, szKey)) != NULL; i++)
+	{
+		nSum += (int) (strlen(pszValue) + strlen(szKey));
+		free(pszValue);
+	}
+	free(pszCommand);
+	free(pszUid);
+	free(pszTimestamp);
+	free(pszId);
+	free(pszParams);
+	return nSum;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void report(const char* szWhat, const char* szScanner, size_t len, long calls, unsigned long long us)
+{
+	printf("%-28s %-7s %9.2f us %9.1f MB/s\n", szWhat, szScanner, (double) us / calls, (double) len * calls / (us ? us : 1));
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	long long			bytes = (argc > 1) ? atoll(argv[1]) : 200000000LL;
+	const char*			szOnly = getenv("SWIRJSON_SCANNER");
+	char*				szJson = malloc(BATCH_COMMANDS * 1024);
+	swirjson_token*		pTokens;
+	int					nMaxTokens = 4 * 1024 + 16;
+	unsigned long long	start;
+	size_t				len, c, s;
+	char				szWhat[32];
+	long				calls, i;
+
+	pTokens = malloc(nMaxTokens * sizeof(swirjson_token));
+	for (c = 0; c < sizeof(g_paramCounts) / sizeof(g_paramCounts[0]); c++)
+	{
+		len = writeCommand(szJson, g_paramCounts[c], 0, 0);
+		calls = (long) (bytes / 10 / len) + 1;
+		snprintf(szWhat, sizeof(szWhat), "command, %d params", g_paramCounts[c]);
+
+		for (s = 0; s < sizeof(g_scanners) / sizeof(g_scanners[0]); s++)
+		{
+			if ((szOnly && strcmp(szOnly, g_scanners[s]) != 0) || swirjson_setScanner(g_scanners[s]) != 0)
+			{
+				continue;
+			}
+			start = monotonic_us();
+			for (i = 0; i < calls; i++)
+			{
+				g_sink += decodeIndexed(szJson, len, pTokens, nMaxTokens);
+			}
+			report(szWhat, g_scanners[s], len, calls, monotonic_us() - start);
+		}
+
+		//quadratic in the parameters : fewer calls
+		calls = (long) (bytes / 10 / len / (g_paramCounts[c] > 64 ? g_paramCounts[c] / 4 : 1)) + 1;
+		start = monotonic_us();
+		for (i = 0; i < calls; i++)
+		{
+			g_sink += decodeLegacy(szJson);
+		}
+		report(szWhat, "legacy", len, calls, monotonic_us() - start);
+	}
+
+	//[{command}, {command}, ...] : tokens counted, then made
+	len = 0;
+	szJson[len++] = '[';
+	for (i = 0; i < BATCH_COMMANDS; i++)
+	{
+		len += writeCommand(szJson + len, 8, (int) i, 1);
+		szJson[len++] = (i == BATCH_COMMANDS - 1) ? ']' : ',';
+	}
+	nMaxTokens = swirjson_tokenize(szJson, len, NULL, 0);
+	pTokens = realloc(pTokens, nMaxTokens * sizeof(swirjson_token));
+	calls = (long) (bytes / len) + 1;
+	snprintf(szWhat, sizeof(szWhat), "batch of %d commands", BATCH_COMMANDS);
+	for (s = 0; s < sizeof(g_scanners) / sizeof(g_scanners[0]); s++)
+	{
+		if ((szOnly && strcmp(szOnly, g_scanners[s]) != 0) || swirjson_setScanner(g_scanners[s]) != 0)
+		{
+			continue;
+		}
+		start = monotonic_us();
+		for (i = 0; i < calls; i++)
+		{
+			g_sink += swirjson_tokenize(szJson, len, pTokens, nMaxTokens);
+		}
+		report(szWhat, g_scanners[s], len, calls, monotonic_us() - start);
+	}
+
+	free(pTokens);
+	free(szJson);
+	return 0;
+}
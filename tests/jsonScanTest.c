@@ -0,0 +1,252 @@
+/*******************************************************************************************************************
+
+ swir_json structural scanners against each other
+
+	The scalar, SSE2 and AVX2 classifiers must lead to the same stage 1 masks (swirjson_stage1) and the same
+	tokens, and those masks must be what a byte at a time reading of the payload gives : escaped characters
+	after odd runs of backslashes, unescaped quotes, strings, brackets outside them, where primitives start and
+	end.  Runs of backslashes before a quote are placed across the 64-byte block boundaries, where escapes and
+	strings carry over from one block to the next, then random payloads follow, bytes above 0x7F included
+
+	usage : jsonScanTest [random payloads]		(20000)
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "swir_json.h"
+#include "../mqttInterface/tests/testCheck.h"
+
+
+#define		MAX_PAYLOAD				400
+#define		MAX_BLOCKS				((MAX_PAYLOAD + 63) / 64)
+#define		MAX_TOKENS				MAX_PAYLOAD
+
+static const char*		g_scanners[] = {"scalar", "sse2", "avx2"};
+static int				g_payloads = 0;
+
+
+//-------------------------------------------------------------------------------------------------------
+static void reference(const char* szJson, size_t len, swirjson_block* pBlocks)
+{
+	//the masks read a byte at a time
+	int		bEscaped = 0, bInString = 0, bPrevPrimitive = 0;
+	size_t	i;
+
+	memset(pBlocks, 0, MAX_BLOCKS * sizeof(swirjson_block));
+	for (i = 0; i <= len; i++)
+	{
+		swirjson_block*	pBlock = &pBlocks[i / 64];
+		uint64_t		bit = (uint64_t) 1 << (i % 64);
+		unsigned char	cChar = (i < len) ? szJson[i] : ' ';
+		int				bQuote = (cChar == '"' && !bEscaped);
+		int				bBracket = (cChar == '{' || cChar == '}' || cChar == '[' || cChar == ']');
+		int				bPrimitive;
+
+		if (i == len)
+		{
+			//a primitive running to the end of the payload has no end within it
+			break;
+		}
+		if (bEscaped)
+		{
+			pBlock->escaped |= bit;
+		}
+		if (bQuote)
+		{
+			pBlock->quote |= bit;
+			bInString = !bInString;
+		}
+		//an opening quote is inside its string, a closing one is not
+		if (bInString)
+		{
+			pBlock->inString |= bit;
+		}
+		if (bBracket && !bInString)
+		{
+			pBlock->bracket |= bit;
+		}
+		bPrimitive = !bInString && !bQuote && !bBracket && cChar != ':' && cChar != ',' && cChar > ' ';
+		if (bPrimitive && !bPrevPrimitive)
+		{
+			pBlock->primitiveStart |= bit;
+		}
+		if (!bPrimitive && bPrevPrimitive)
+		{
+			pBlock->primitiveEnd |= bit;
+		}
+		bPrevPrimitive = bPrimitive;
+		bEscaped = (cChar == '\\' && !bEscaped);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int sameTokens(const swirjson_token* pTokens, const swirjson_token* pExpected, int nTokens)
+{
+	int		i;
+
+	for (i = 0; i < nTokens; i++)
+	{
+		if (pTokens[i].type != pExpected[i].type || pTokens[i].pStart != pExpected[i].pStart || pTokens[i].nLen != pExpected[i].nLen
+			|| pTokens[i].nNext != pExpected[i].nNext || pTokens[i].nCount != pExpected[i].nCount || pTokens[i].nParent != pExpected[i].nParent)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void compare(const char* szName, const char* szJson, size_t len)
+{
+	//every scanner the CPU has against the byte at a time masks, and against the scalar tokens
+	static swirjson_token	scalarTokens[MAX_TOKENS], tokens[MAX_TOKENS];
+	swirjson_block			expected[MAX_BLOCKS], blocks[MAX_BLOCKS];
+	int						nScalarTokens = 0;
+	size_t					nBlocks = (len + 63) / 64, i;
+
+	reference(szJson, len, expected);
+	for (i = 0; i < sizeof(g_scanners) / sizeof(g_scanners[0]); i++)
+	{
+		int		nTokens;
+		size_t	b;
+
+		if (swirjson_setScanner(g_scanners[i]) != 0)
+		{
+			continue;
+		}
+		memset(blocks, 0, sizeof(blocks));
+		swirjson_stage1(szJson, len, blocks);
+		for (b = 0; b < nBlocks; b++)
+		{
+			CHECK(blocks[b].escaped == expected[b].escaped, "%s, %s : escaped %016llx, not %016llx in block %zu", szName, g_scanners[i],
+				  (unsigned long long) blocks[b].escaped, (unsigned long long) expected[b].escaped, b);
+			CHECK(blocks[b].quote == expected[b].quote, "%s, %s : quote %016llx, not %016llx in block %zu", szName, g_scanners[i],
+				  (unsigned long long) blocks[b].quote, (unsigned long long) expected[b].quote, b);
+			CHECK(blocks[b].inString == expected[b].inString, "%s, %s : inString %016llx, not %016llx in block %zu", szName, g_scanners[i],
+				  (unsigned long long) blocks[b].inString, (unsigned long long) expected[b].inString, b);
+			CHECK(blocks[b].bracket == expected[b].bracket, "%s, %s : bracket %016llx, not %016llx in block %zu", szName, g_scanners[i],
+				  (unsigned long long) blocks[b].bracket, (unsigned long long) expected[b].bracket, b);
+			CHECK(blocks[b].primitiveStart == expected[b].primitiveStart && blocks[b].primitiveEnd == expected[b].primitiveEnd,
+				  "%s, %s : primitives %016llx %016llx, not %016llx %016llx in block %zu", szName, g_scanners[i],
+				  (unsigned long long) blocks[b].primitiveStart, (unsigned long long) blocks[b].primitiveEnd,
+				  (unsigned long long) expected[b].primitiveStart, (unsigned long long) expected[b].primitiveEnd, b);
+		}
+
+		nTokens = swirjson_tokenize(szJson, len, (i == 0) ? scalarTokens : tokens, MAX_TOKENS);
+		if (i == 0)
+		{
+			nScalarTokens = nTokens;
+		}
+		else
+		{
+			CHECK(nTokens == nScalarTokens, "%s, %s : %d tokens, %d with the scalar scanner", szName, g_scanners[i], nTokens, nScalarTokens);
+			CHECK(nTokens <= 0 || nTokens > MAX_TOKENS || sameTokens(tokens, scalarTokens, nTokens),
+				  "%s, %s : tokens differ from the scalar scanner's", szName, g_scanners[i]);
+		}
+	}
+	g_payloads++;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testBoundaries(void)
+{
+	/*
+		{"k":"<filler><n backslashes>"<rest>"} with the run of backslashes starting at each offset around the
+		first and second block boundaries : the quote after it is escaped or not, the string ends there or goes on
+	*/
+	char	szJson[MAX_PAYLOAD], szName[64];
+	int		nOffset, nRun, nBoundary;
+
+	for (nBoundary = 64; nBoundary <= 128; nBoundary += 64)
+	{
+		for (nOffset = nBoundary - 8; nOffset <= nBoundary + 4; nOffset++)
+		{
+			for (nRun = 0; nRun <= 9; nRun++)
+			{
+				size_t	len = 0;
+
+				len += sprintf(szJson, "{\"k\":\"");
+				while ((int) len < nOffset)
+				{
+					szJson[len] = 'a' + len % 26;
+					len++;
+				}
+				memset(szJson + len, '\\', nRun);
+				len += nRun;
+				len += sprintf(szJson + len, "\", \"n\":[1,true,{}], \"s\":\"x\\\\\"}");
+				snprintf(szName, sizeof(szName), "%d backslashes at %d", nRun, nOffset);
+				compare(szName, szJson, len);
+			}
+		}
+	}
+
+	//an escaped backslash then an escaped quote, \\\", repeated from offsets 62 to 66 on, across the boundary
+	for (nOffset = 62; nOffset <= 66; nOffset++)
+	{
+		size_t	len;
+
+		memset(szJson, ' ', nOffset);
+		szJson[0] = '[';
+		szJson[1] = '"';
+		len = nOffset;
+		while (len < 130)
+		{
+			memcpy(szJson + len, "\\\\\\\"", 4);
+			len += 4;
+		}
+		len += sprintf(szJson + len, "\"]");
+		snprintf(szName, sizeof(szName), "\\\\\\\" from %d on", nOffset);
+		compare(szName, szJson, len);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testRandom(long count)
+{
+	//mostly the characters the scanners look for, some bytes above 0x7F, lengths across 0 to 6 blocks
+	static const char	szAlphabet[] = "\"\"\"\\\\\\{}[]:,  \t\nab01tf";
+	char				szJson[MAX_PAYLOAD], szName[48];
+	unsigned int		seed = 20260101;
+	long				n;
+
+	for (n = 0; n < count; n++)
+	{
+		size_t	len = rand_r(&seed) % (MAX_PAYLOAD - 1), i;
+
+		for (i = 0; i < len; i++)
+		{
+			int		r = rand_r(&seed) % 64;
+
+			szJson[i] = (r < (int) sizeof(szAlphabet) - 1) ? szAlphabet[r] : (r < 60) ? 'a' + r % 26 : (char) (0x80 + rand_r(&seed) % 128);
+		}
+		snprintf(szName, sizeof(szName), "random payload %ld", n);
+		compare(szName, szJson, len);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	long	count = (argc > 1) ? atol(argv[1]) : 20000;
+	char	szScanners[32] = "";
+	size_t	i;
+
+	for (i = 0; i < sizeof(g_scanners) / sizeof(g_scanners[0]); i++)
+	{
+		if (swirjson_setScanner(g_scanners[i]) == 0)
+		{
+			strcat(szScanners, (szScanners[0] != 0) ? ", " : "");
+			strcat(szScanners, g_scanners[i]);
+		}
+	}
+
+	testBoundaries();
+	testRandom(count);
+
+	printf("%d payloads, scanners : %s\n", g_payloads, szScanners);
+	return testResult(NULL);
+}
@@ -0,0 +1,244 @@
+/*******************************************************************************************************************
+
+ swirjson_tokenize and its lookups
+
+	The span index of an AirVantage command must give back each value where it is in the payload, by key
+	(swirjson_find) and by index (swirjson_member), whatever the length of the keys and however many there are,
+	none of the old 32 bytes and 10 keys limits being left.  Nesting must be recorded in nNext, nCount and nParent,
+	escaped quotes must not end strings.  Payloads from the broker are not to be trusted : truncated or malformed
+	ones are refused, with or without tokens to fill, and too small an index is reported, never written past
+
+	usage : jsonTokenizeTest
+
+*******************************************************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "swir_json.h"
+#include "../mqttInterface/tests/testCheck.h"
+
+
+#define		MAX_TOKENS				1024
+#define		MANY_KEYS				100
+#define		LONG_KEY				300
+#define		DEPTH					200
+
+static swirjson_token	g_tokens[MAX_TOKENS + 1];
+
+static const char		g_szCommand[] =
+	"[{\"uid\": \"5cd1e4a1b7c54c6f9d1a\", \"timestamp\": 1700000000000, \"command\": "
+	"{\"id\": \"TurnOn\", \"params\": {\"Light\": true, \"Level\": \"80\", \"Label\": \"say \\\"hi\\\"\\\\\"}}}]";
+
+
+//-------------------------------------------------------------------------------------------------------
+static int tokenize(const char* szJson, size_t len)
+{
+	//into g_tokens, after counting them : both passes must agree
+	int		nCount = swirjson_tokenize(szJson, len, NULL, 0);
+	int		nTokens = swirjson_tokenize(szJson, len, g_tokens, MAX_TOKENS);
+
+	CHECK(nCount == nTokens || nTokens == -1, "%.40s : counted %d tokens, then made %d", szJson, nCount, nTokens);
+	return nTokens;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static int isView(int nToken, swirjson_type type, const char* szExpected)
+{
+	return nToken >= 0 && g_tokens[nToken].type == type && (int) strlen(szExpected) == g_tokens[nToken].nLen
+		   && memcmp(g_tokens[nToken].pStart, szExpected, g_tokens[nToken].nLen) == 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testCommand(void)
+{
+	int		nTokens = tokenize(g_szCommand, strlen(g_szCommand));
+	int		nRequest, nCommand, nParams, nKey = -1;
+
+	CHECK(nTokens == 18, "command : %d tokens, not 18", nTokens);
+	if (nTokens != 18)
+	{
+		return;
+	}
+	CHECK(g_tokens[0].type == SWIRJSON_ARRAY && g_tokens[0].nCount == 1 && g_tokens[0].nNext == 18 && g_tokens[0].nParent == -1,
+		  "command : the top array is not recorded as such");
+	CHECK(g_tokens[0].pStart == g_szCommand && g_tokens[0].nLen == (int) strlen(g_szCommand), "command : the top array does not span the payload");
+
+	nRequest = 1;
+	CHECK(g_tokens[nRequest].type == SWIRJSON_OBJECT && g_tokens[nRequest].nCount == 6 && g_tokens[nRequest].nParent == 0,
+		  "command : the request is not an object of 3 members in the array");
+	CHECK(isView(swirjson_find(g_tokens, nRequest, "uid"), SWIRJSON_STRING, "5cd1e4a1b7c54c6f9d1a"), "command : uid");
+	CHECK(isView(swirjson_find(g_tokens, nRequest, "timestamp"), SWIRJSON_PRIMITIVE, "1700000000000"), "command : timestamp");
+	CHECK(swirjson_find(g_tokens, nRequest, "id") == -1, "command : id found in the request, it is the command's");
+	CHECK(swirjson_find(g_tokens, nRequest, "ui") == -1 && swirjson_find(g_tokens, nRequest, "uidx") == -1,
+		  "command : a key found by a prefix, or a longer name");
+
+	nCommand = swirjson_find(g_tokens, nRequest, "command");
+	CHECK(nCommand >= 0 && g_tokens[nCommand].type == SWIRJSON_OBJECT && g_tokens[nCommand].nParent == nRequest, "command : command");
+	if (nCommand < 0)
+	{
+		return;
+	}
+	CHECK(isView(swirjson_find(g_tokens, nCommand, "id"), SWIRJSON_STRING, "TurnOn"), "command : id");
+
+	nParams = swirjson_find(g_tokens, nCommand, "params");
+	CHECK(nParams >= 0 && g_tokens[nParams].nCount == 6, "command : params");
+	if (nParams < 0)
+	{
+		return;
+	}
+	CHECK(isView(swirjson_member(g_tokens, nParams, 0, &nKey), SWIRJSON_PRIMITIVE, "true") && isView(nKey, SWIRJSON_STRING, "Light"),
+		  "command : first parameter");
+	CHECK(isView(swirjson_member(g_tokens, nParams, 1, &nKey), SWIRJSON_STRING, "80") && isView(nKey, SWIRJSON_STRING, "Level"),
+		  "command : second parameter");
+	CHECK(isView(swirjson_member(g_tokens, nParams, 2, &nKey), SWIRJSON_STRING, "say \\\"hi\\\"\\\\") && isView(nKey, SWIRJSON_STRING, "Label"),
+		  "command : escaped quotes and backslashes kept in the string, not ending it");
+	CHECK(swirjson_member(g_tokens, nParams, 3, NULL) == -1, "command : a fourth parameter");
+	CHECK(swirjson_member(g_tokens, 0, 0, NULL) == -1 && swirjson_find(g_tokens, 0, "uid") == -1, "command : members of an array");
+	CHECK(swirjson_equals(&g_tokens[swirjson_find(g_tokens, nCommand, "id")], "TurnOn")
+		  && !swirjson_equals(&g_tokens[swirjson_find(g_tokens, nCommand, "id")], "TurnOnx"), "command : swirjson_equals");
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testManyLongKeys(void)
+{
+	//MANY_KEYS keys of up to LONG_KEY bytes, found by name and by index
+	static char		szJson[MANY_KEYS * (LONG_KEY + 32)];
+	char			szKey[LONG_KEY + 1], szValue[16];
+	size_t			len = 0;
+	int				i, nTokens;
+
+	szJson[len++] = '{';
+	for (i = 0; i < MANY_KEYS; i++)
+	{
+		int		nKeyLen = 1 + i * (LONG_KEY - 1) / (MANY_KEYS - 1);
+
+		memset(szKey, 'a' + i % 26, nKeyLen);
+		szKey[nKeyLen] = 0;
+		len += sprintf(szJson + len, "%s\"%s\" : %d", (i == 0) ? "" : ", ", szKey, i);
+	}
+	szJson[len++] = '}';
+
+	nTokens = tokenize(szJson, len);
+	CHECK(nTokens == 1 + 2 * MANY_KEYS, "many keys : %d tokens, not %d", nTokens, 1 + 2 * MANY_KEYS);
+	if (nTokens != 1 + 2 * MANY_KEYS)
+	{
+		return;
+	}
+	CHECK(g_tokens[0].nCount == 2 * MANY_KEYS, "many keys : %d members recorded", g_tokens[0].nCount / 2);
+	for (i = 0; i < MANY_KEYS; i++)
+	{
+		int		nKeyLen = 1 + i * (LONG_KEY - 1) / (MANY_KEYS - 1);
+		int		nKey = -1;
+
+		memset(szKey, 'a' + i % 26, nKeyLen);
+		szKey[nKeyLen] = 0;
+		sprintf(szValue, "%d", i);
+		CHECK(isView(swirjson_find(g_tokens, 0, szKey), SWIRJSON_PRIMITIVE, szValue), "many keys : key %d (%d bytes) by name", i, nKeyLen);
+		CHECK(isView(swirjson_member(g_tokens, 0, i, &nKey), SWIRJSON_PRIMITIVE, szValue) && isView(nKey, SWIRJSON_STRING, szKey),
+			  "many keys : key %d by index", i);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testNesting(void)
+{
+	//DEPTH objects each holding the next under "k", the innermost an array of empty values and a number
+	static char		szJson[DEPTH * 16];
+	size_t			len = 0;
+	int				i, nTokens, nToken = 0;
+
+	for (i = 0; i < DEPTH; i++)
+	{
+		len += sprintf(szJson + len, "{\"k\":");
+	}
+	len += sprintf(szJson + len, "[{}, [], \"\", 0]");
+	for (i = 0; i < DEPTH; i++)
+	{
+		szJson[len++] = '}';
+	}
+
+	nTokens = tokenize(szJson, len);
+	CHECK(nTokens == 2 * DEPTH + 5, "nesting : %d tokens, not %d", nTokens, 2 * DEPTH + 5);
+	if (nTokens != 2 * DEPTH + 5)
+	{
+		return;
+	}
+	for (i = 0; i < DEPTH && nToken >= 0; i++)
+	{
+		int		nNext = swirjson_find(g_tokens, nToken, "k");
+
+		CHECK(g_tokens[nToken].nNext == nTokens && g_tokens[nToken].nCount == 2, "nesting : object at depth %d", i);
+		CHECK(nNext < 0 || g_tokens[nNext].nParent == nToken, "nesting : parent at depth %d", i);
+		CHECK(g_tokens[nToken].pStart + g_tokens[nToken].nLen == szJson + len - i, "nesting : span at depth %d", i);
+		nToken = nNext;
+	}
+	CHECK(nToken >= 0 && g_tokens[nToken].type == SWIRJSON_ARRAY && g_tokens[nToken].nCount == 4, "nesting : innermost array");
+	if (nToken >= 0)
+	{
+		CHECK(g_tokens[nToken + 1].type == SWIRJSON_OBJECT && g_tokens[nToken + 1].nLen == 2 && g_tokens[nToken + 1].nNext == nToken + 2,
+			  "nesting : empty object");
+		CHECK(g_tokens[nToken + 2].type == SWIRJSON_ARRAY && g_tokens[nToken + 2].nLen == 2 && g_tokens[nToken + 2].nNext == nToken + 3,
+			  "nesting : empty array");
+		CHECK(isView(nToken + 3, SWIRJSON_STRING, "") && isView(nToken + 4, SWIRJSON_PRIMITIVE, "0"), "nesting : empty string, number");
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testMalformed(void)
+{
+	static const char*	szMalformed[] = {
+		"]", "}", "{]", "[}", "[{]}", "{\"a\":1}}", "[1,2]]", "{\"a\":[1,2}", "\"abc", "{\"a\":\"b\\\"}",
+		"{\"a\":\"b\\\\\\\"}", "[\"\\\\\"\"]", "{{{{", "[[[[]]]",
+	};
+	size_t				i, len = strlen(g_szCommand);
+
+	for (i = 0; i < sizeof(szMalformed) / sizeof(szMalformed[0]); i++)
+	{
+		CHECK(swirjson_tokenize(szMalformed[i], strlen(szMalformed[i]), g_tokens, MAX_TOKENS) == -1, "%s accepted", szMalformed[i]);
+	}
+
+	//every truncation of a command leaves a bracket open or a string unterminated
+	for (i = 1; i < len; i++)
+	{
+		CHECK(swirjson_tokenize(g_szCommand, i, g_tokens, MAX_TOKENS) == -1, "command truncated to %zu bytes accepted", i);
+		CHECK(swirjson_tokenize(g_szCommand, i, NULL, 0) == -1, "command truncated to %zu bytes counted", i);
+	}
+	CHECK(swirjson_tokenize("", 0, g_tokens, MAX_TOKENS) == 0, "empty payload");
+}
+
+//-------------------------------------------------------------------------------------------------------
+static void testOverflow(void)
+{
+	//too few tokens : the count comes back, and nothing is written past them
+	int		nTokens = swirjson_tokenize(g_szCommand, strlen(g_szCommand), NULL, 0);
+	int		nMax;
+
+	for (nMax = 0; nMax <= nTokens; nMax++)
+	{
+		int		rc;
+
+		memset(g_tokens, 0xA5, sizeof(g_tokens));
+		rc = swirjson_tokenize(g_szCommand, strlen(g_szCommand), g_tokens, nMax);
+		CHECK(rc == nTokens, "%d tokens at most : returned %d, not %d", nMax, rc, nTokens);
+		CHECK(((unsigned char*) &g_tokens[nMax])[0] == 0xA5 && ((unsigned char*) &g_tokens[nMax + 1])[sizeof(swirjson_token) - 1] == 0xA5,
+			  "%d tokens at most : written past them", nMax);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	char	szScanner[32];
+
+	testCommand();
+	testManyLongKeys();
+	testNesting();
+	testMalformed();
+	testOverflow();
+
+	snprintf(szScanner, sizeof(szScanner), "%s scanner", swirjson_scanner());
+	return testResult(szScanner);
+}
@@ -27,10 +27,19 @@
 #include "BaseSocket.h"
 
 BaseSocket::BaseSocket() :
-        _is_connected(false)
+        _is_connected(false),
+        _is_blocking(true),
+        _records_sent(0),
+        _records_received(0)
 {
 }
 
 BaseSocket::~BaseSocket()
 {
 }
+
+void BaseSocket::get_record_counts(unsigned long* sent, unsigned long* received)
+{
+    *sent = _records_sent.load(std::memory_order_relaxed);
+    *received = _records_received.load(std::memory_order_relaxed);
+}
@@ -26,6 +26,9 @@
 #ifndef BASESOCKET_H
 #define BASESOCKET_H
 
+#include <sys/uio.h>
+#include <atomic>
+
 class BaseSocket
 {
     
@@ -51,6 +54,11 @@ public:
     \return true if connected, false otherwise.
     */
     virtual bool is_connected(void) = 0;
+
+    /** Get the underlying file descriptor, e.g. to be watched by select/poll/epoll
+    \return the socket descriptor, -1 if not connected
+    */
+    virtual int get_fd(void) = 0;
     
     /** Set blocking or non-blocking mode of the socket and a timeout on
         blocking socket operations
@@ -72,6 +80,13 @@ public:
     \return the number of written bytes on success (>=0) or -1 on failure
     */
     virtual int send_all(const char* data, int length) = 0;
+
+    /** Send several buffers to the remote host, in this order, without first gathering them.
+    \param iov The buffers to send.
+    \param iovcnt The number of buffers.
+    \return the number of written bytes on success (>=0), possibly less than the total, or -1 on failure
+    */
+    virtual int send_vector(const struct iovec* iov, int iovcnt) = 0;
     
     /** Receive data from the remote host.
     \param data The buffer in which to store the data received from the host.
@@ -80,6 +95,20 @@ public:
      */
     virtual int receive(char* data, int length) = 0;
 
+    /** Receive whatever data is available from the remote host, in a single read.
+    \param data The buffer in which to store the data received from the host.
+    \param length The maximum length of the buffer.
+    \return the number of received bytes on success (>0), 0 if nothing arrived before the timeout
+            (or nothing is readable right now in non-blocking mode) or -1 on failure
+     */
+    virtual int receive_some(char* data, int length) = 0;
+
+    /** Number of bytes already received and buffered by the socket layer (e.g. decrypted TLS data),
+        which a select/poll/epoll on the descriptor would not report
+    \return the number of bytes that can be received without touching the descriptor
+     */
+    virtual int pending(void) = 0;
+
     /** Receive data from the remote host.
     \param data The buffer in which to store the data received from the host.
     \param dataSize The maximum length of the buffer.
@@ -88,11 +117,20 @@ public:
      */
     virtual int receive(char* data, int dataSize, const char* searchPattern) = 0;
 
+    /** TLS records written and read so far on this socket, 0 for a plain one. Can be read from any thread
+    \param sent The number of records written.
+    \param received The number of records read in full.
+     */
+    void get_record_counts(unsigned long* sent, unsigned long* received);
 
     
 
 protected:
     bool    _is_connected;
+    bool    _is_blocking;
+
+    std::atomic<unsigned long>  _records_sent;          // written by the thread doing the I/O only
+    std::atomic<unsigned long>  _records_received;
 
 };
 
@@ -25,11 +25,14 @@
 
 
 #include "LinuxSocket.h"
+#include "MQTTLog.h"
 
 
 LinuxSocket::LinuxSocket() :
 		_sock_fd(-1),
-		_timeout_ms(2000)
+		_timeout_ms(2000),
+		_applied_timeout_ms(-1),
+		_applied_send_timeout_ms(-1)
 {
 }
 
@@ -80,6 +83,8 @@ int LinuxSocket::connect(const char* host, const int port)
 	if (rc == 0)
 	{
 		_sock_fd = socket(family, type, 0);
+		_applied_timeout_ms = -1;
+		_applied_send_timeout_ms = -1;
 		if (_sock_fd >= 0)
 		{
 			rc = ::connect(_sock_fd, (struct sockaddr*)&address, sizeof(address));
@@ -108,9 +113,18 @@ bool LinuxSocket::is_connected(void)
 	return _is_connected;
 }
 
+int LinuxSocket::get_fd(void)
+{
+	return _sock_fd;
+}
+
 void LinuxSocket::set_blocking(bool blocking, unsigned int timeout_ms)
 {
-	_timeout_ms = timeout_ms;
+	_is_blocking = blocking;
+	if (blocking)
+	{
+		_timeout_ms = timeout_ms;
+	}
 }
 
 int LinuxSocket::send(const char* data, int length)
@@ -119,13 +133,8 @@ int LinuxSocket::send(const char* data, int length)
 	{
 		return -1;
 	}
-	
-	struct timeval interval;
 
-	interval.tv_sec = 0;  /* Secs Timeout */
-	interval.tv_usec = _timeout_ms * 1000;
-
-	setsockopt(_sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
+	apply_send_timeout();
 
 	int rc = write(_sock_fd, data, length);
 
@@ -139,22 +148,31 @@ int LinuxSocket::send_all(const char* data, int length)
 	return send(data, length);
 }
 
-int LinuxSocket::receive(char* data, int length)
+int LinuxSocket::send_vector(const struct iovec* iov, int iovcnt)
 {
 	if ((_sock_fd < 0) || !_is_connected)
 	{
-		fprintf(stdout, "LinuxSocket::receive - oops, problem here");
 		return -1;
 	}
-	
-	struct timeval interval = {_timeout_ms / 1000, (_timeout_ms % 1000) * 1000};
-	if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
+
+	apply_send_timeout();
+
+	int rc = writev(_sock_fd, iov, iovcnt);
+
+	_is_connected = (rc != 0);
+
+	return rc;
+}
+
+int LinuxSocket::receive(char* data, int length)
+{
+	if ((_sock_fd < 0) || !_is_connected)
 	{
-		interval.tv_sec = 0;
-		interval.tv_usec = 100;
+		MQTT_ERROR("LinuxSocket::receive - oops, problem here");
+		return -1;
 	}
-
-	setsockopt(_sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
+	
+	apply_timeout();
 
 	int bytes = 0;
 	while (bytes < length)
@@ -185,6 +203,83 @@ int LinuxSocket::receive(char* data, int length)
 	return bytes;
 }
 
+int LinuxSocket::receive_some(char* data, int length)
+{
+	if ((_sock_fd < 0) || !_is_connected)
+	{
+		return -1;
+	}
+
+	int rc;
+
+	if (_is_blocking)
+	{
+		apply_timeout();
+		rc = recv(_sock_fd, data, (size_t)length, 0);
+	}
+	else
+	{
+		rc = recv(_sock_fd, data, (size_t)length, MSG_DONTWAIT);
+	}
+
+	if (rc < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			return 0;	//time-out, nothing received
+		}
+		return -1;
+	}
+	else if (rc == 0)
+	{
+		return -1;		//connection closed by peer
+	}
+
+	return rc;
+}
+
+int LinuxSocket::pending(void)
+{
+	return 0;	//nothing is buffered above the kernel socket
+}
+
+void LinuxSocket::apply_timeout()
+{
+	//Only touch the socket option when the timeout actually changes
+	if (_applied_timeout_ms == _timeout_ms)
+	{
+		return;
+	}
+
+	struct timeval interval = {_timeout_ms / 1000, (_timeout_ms % 1000) * 1000};
+	if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
+	{
+		interval.tv_sec = 0;
+		interval.tv_usec = 100;
+	}
+
+	if (setsockopt(_sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval)) == 0)
+	{
+		_applied_timeout_ms = _timeout_ms;
+	}
+}
+
+void LinuxSocket::apply_send_timeout()
+{
+	//Same for SO_SNDTIMEO, which only matters on the blocking descriptor when the send buffer is full
+	if (_applied_send_timeout_ms == _timeout_ms)
+	{
+		return;
+	}
+
+	struct timeval interval = {_timeout_ms / 1000, (_timeout_ms % 1000) * 1000};
+
+	if (setsockopt(_sock_fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&interval, sizeof(struct timeval)) == 0)
+	{
+		_applied_send_timeout_ms = _timeout_ms;
+	}
+}
+
 
 int LinuxSocket::receive(char* data, int dataSize, const char* searchPattern)
 {
@@ -195,22 +290,23 @@ int LinuxSocket::receive(char* data, int dataSize, const char* searchPattern)
     
     if (NULL == searchPattern)
     {
-    	fprintf(stdout, "LinuxSocket::receive - error : No Pattern");
+    	MQTT_ERROR("LinuxSocket::receive - error : No Pattern");
     	return 0;
     }
 
     if (strlen(searchPattern) == 0)
     {
-    	fprintf(stdout, "LinuxSocket::receive - error : Empty Pattern");
+    	MQTT_ERROR("LinuxSocket::receive - error : Empty Pattern");
     	return 0;
     }
 
-    struct timeval interval;
-
-    interval.tv_sec = 0;  /* Secs Timeout */
-    interval.tv_usec = 1000 * 1000;
+    struct timeval interval = {1, 0};  /* 1 sec Timeout */
 
-    setsockopt(_sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
+    if (_applied_timeout_ms != 1000 &&
+        setsockopt(_sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval)) == 0)
+    {
+        _applied_timeout_ms = 1000;
+    }
 
     //fprintf(stdout, "LinuxSocket::receive - search for Pattern %s", searchPattern);
 
@@ -228,7 +324,7 @@ int LinuxSocket::receive(char* data, int dataSize, const char* searchPattern)
 			nSearchIndex++;
 			if (nSearchIndex == nMatchCount)
 			{
-				fprintf(stdout, "LinuxSocket::receive - Found Pattern. Data size = %d", index);
+				MQTT_DEBUG("LinuxSocket::receive - Found Pattern. Data size = %d", index);
 				break;
 			}
 		}
@@ -239,7 +335,7 @@ int LinuxSocket::receive(char* data, int dataSize, const char* searchPattern)
 
 		if (index >= dataSize)
 		{
-			fprintf(stdout, "LinuxSocket::receive - Pattern not found. Buffer too short");
+			MQTT_WARN("LinuxSocket::receive - Pattern not found. Buffer too short");
 			break;		
 		}
 	}
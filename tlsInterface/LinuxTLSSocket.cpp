@@ -50,18 +50,21 @@
 #include <string.h>
 
 #include "LinuxTLSSocket.h"
+#include "MQTTLog.h"
 
 
 
 #define DEBUG_LEVEL 1
 
+#define TLS_GATHER_SIZE 1024	// vectored sends up to that size are copied into a single record
+
 static void my_debug( void *ctx, int level,
 					  const char *file, int line,
 					  const char *str )
 {
 	((void) level);
 
-	fprintf(stdout, "%s:%04d: %s", file, line, str );
+	MQTT_DEBUG("%s:%04d: %s", file, line, str );
 }
 
 
@@ -99,25 +102,20 @@ int LinuxTLSSocket::connect(const char* host, const int port)
 	mbedtls_x509_crt_init( &_cacert );
 	mbedtls_ctr_drbg_init( &_ctr_drbg );
 
-	fprintf(stdout,  "\n  . Seeding the random number generator..." );
-
 	mbedtls_entropy_init( &_entropy );
 	if( ( ret = mbedtls_ctr_drbg_seed( &_ctr_drbg, mbedtls_entropy_func, &_entropy,
 							   (const unsigned char *) pers,
 							   strlen( pers ) ) ) != 0 )
 	{
-		fprintf(stdout,  " failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret );
+		MQTT_ERROR("TLS : seeding the random number generator failed, mbedtls_ctr_drbg_seed returned %d", ret );
 		getSSLerror(ret);
 		freeSSL();
 		return ret;
 	}
 
-	fprintf(stdout,  " ok\n" );
-
 	/*
 	 * 0. Initialize certificates
 	 */
-	fprintf(stdout,  "  . Loading the CA root certificate ..." );
 
 	if (strlen(_trustedCaFolderName) == 0)
 	{
@@ -126,23 +124,23 @@ int LinuxTLSSocket::connect(const char* host, const int port)
 	else
 	{
 		//ret = mbedtls_x509_crt_parse_file(&_cacert, "/legato/systems/current/apps/socialService/read-only/certs/Comodo_Trusted_Services_root.pem");
-		fprintf(stdout,  " load certs from %s", _trustedCaFolderName);
+		MQTT_DEBUG("TLS : loading the CA root certificates from %s", _trustedCaFolderName);
 		ret = mbedtls_x509_crt_parse_path(&_cacert, _trustedCaFolderName);
 	}
 	if( ret < 0 )
 	{
-		fprintf(stdout,  " failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret );
+		MQTT_WARN("TLS : loading the CA root certificates failed, mbedtls_x509_crt_parse returned -0x%x", -ret );
 
 		//let's do another attempt for (Legato prior 16.04)
 		#if 1
 		if (strlen(_trustedCaFolderName) > 0)
 		{
 			strcpy(_trustedCaFolderName, "read-only/certs");
-			fprintf(stdout,  " load certs from %s", _trustedCaFolderName);
+			MQTT_DEBUG("TLS : loading the CA root certificates from %s", _trustedCaFolderName);
 			ret = mbedtls_x509_crt_parse_path(&_cacert, _trustedCaFolderName);
 			if (ret < 0)
 			{
-				fprintf(stdout,  " failed\n  !  mbedtls_x509_crt_parse returned -0x%x\n\n", -ret );
+				MQTT_ERROR("TLS : loading the CA root certificates failed, mbedtls_x509_crt_parse returned -0x%x", -ret );
 			}
 		}
 		#endif
@@ -155,42 +153,37 @@ int LinuxTLSSocket::connect(const char* host, const int port)
 		}
 	}
 
-	fprintf(stdout,  " ok (%d skipped)\n", ret );
+	MQTT_DEBUG("TLS : CA root certificates loaded (%d skipped)", ret );
 
 	/*
 	 * 1. Start the connection
 	 */
-	fprintf(stdout,  "  . Connecting to tcp/%s/%s...", host, szPort);
-	fflush(stdout);
 
 	if( ( ret = mbedtls_net_connect( &_server_fd, host, szPort, MBEDTLS_NET_PROTO_TCP ) ) != 0 )
 	{
-		fprintf(stdout,  " failed\n  ! mbedtls_net_connect returned %d\n\n", ret );
+		MQTT_ERROR("TLS : connecting to tcp/%s/%s failed, mbedtls_net_connect returned %d", host, szPort, ret );
 		getSSLerror(ret);
 		freeSSL();
 		return ret;
 	}
 
-	fprintf(stdout,  " ok\n" );
+	MQTT_DEBUG("TLS : connected to tcp/%s/%s", host, szPort);
 
 	/*
 	 * 2. Setup stuff
 	 */
-	fprintf(stdout,  "  . Setting up the TLS structure..." );
 
 	if( ( ret = mbedtls_ssl_config_defaults( &_conf,
 					MBEDTLS_SSL_IS_CLIENT,
 					MBEDTLS_SSL_TRANSPORT_STREAM,
 					MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 )
 	{
-		fprintf(stdout,  " failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret );
+		MQTT_ERROR("TLS : setting up the TLS structure failed, mbedtls_ssl_config_defaults returned %d", ret );
 		getSSLerror(ret);
 		freeSSL();
 		return ret;
 	}
 
-	fprintf(stdout,  " ok\n" );
-
 	/* OPTIONAL is not optimal for security,
 	 * but makes interop easier in this simplified example */
 	mbedtls_ssl_conf_authmode( &_conf, MBEDTLS_SSL_VERIFY_OPTIONAL );
@@ -200,7 +193,7 @@ int LinuxTLSSocket::connect(const char* host, const int port)
 
 	if( ( ret = mbedtls_ssl_setup( &_ssl, &_conf ) ) != 0 )
 	{
-		fprintf(stdout,  " failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret );
+		MQTT_ERROR("TLS : setting up the TLS structure failed, mbedtls_ssl_setup returned %d", ret );
 		getSSLerror(ret);
 		freeSSL();
 		return ret;
@@ -208,53 +201,53 @@ int LinuxTLSSocket::connect(const char* host, const int port)
 
 	if( ( ret = mbedtls_ssl_set_hostname( &_ssl, host ) ) != 0 )
 	{
-		fprintf(stdout,  " failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret );
+		MQTT_ERROR("TLS : setting up the TLS structure failed, mbedtls_ssl_set_hostname returned %d", ret );
 		getSSLerror(ret);
 		freeSSL();
 		return ret;
 	}
 
 	//mbedtls_ssl_set_bio( &_ssl, &_server_fd, mbedtls_net_send, mbedtls_net_recv, NULL );
-	mbedtls_ssl_set_bio( &_ssl, &_server_fd, mbedtls_net_send, mbedtls_net_recv, mbedtls_net_recv_timeout);
+	_is_blocking = true;
+	mbedtls_ssl_set_bio( &_ssl, this, bio_send, NULL, bio_recv_timeout);
 	mbedtls_ssl_conf_read_timeout(&_conf, 10000);
 
 	/*
 	 * 4. Handshake
 	 */
-	fprintf(stdout,  "  . Performing the TLS handshake..." );
-
 	while( ( ret = mbedtls_ssl_handshake( &_ssl ) ) != 0 )
 	{
 		if( ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
 		{
-			fprintf(stdout,  " failed\n  ! mbedtls_ssl_handshake returned -0x%x\n\n", -ret );
+			MQTT_ERROR("TLS : handshake failed, mbedtls_ssl_handshake returned -0x%x", -ret );
 			getSSLerror(ret);
 			freeSSL();
 			return ret;
 		}
 	}
 
-	fprintf(stdout,  " ok\n" );
+	MQTT_DEBUG("TLS : handshake done, %s", mbedtls_ssl_get_ciphersuite( &_ssl ) );
 
 	/*
 	 * 5. Verify the server certificate
 	 */
-	fprintf(stdout,  "  . Verifying peer X.509 certificate..." );
 
 	/* In real life, we probably want to bail out when ret != 0 */
 	if( ( flags = mbedtls_ssl_get_verify_result( &_ssl ) ) != 0 )
 	{
 		char vrfy_buf[512];
 
-		fprintf(stdout,  " failed\n" );
-
-		mbedtls_x509_crt_verify_info( vrfy_buf, sizeof( vrfy_buf ), "  ! ", flags );
+		mbedtls_x509_crt_verify_info( vrfy_buf, sizeof( vrfy_buf ), " ", flags );
+		for (char* p = strchr(vrfy_buf, '\n'); p != NULL && p[1] != '\0'; p = strchr(p, '\n'))
+		{
+			*p = ';';	//one line per reason otherwise
+		}
 
-		fprintf(stdout,  "%s\n", vrfy_buf );
+		MQTT_WARN("TLS : verifying the peer X.509 certificate failed :%s", vrfy_buf );
 	}
 	else
 	{
-		fprintf(stdout,  " ok\n" );
+		MQTT_DEBUG("TLS : peer X.509 certificate verified" );
 	}
 
 
@@ -278,9 +271,49 @@ bool LinuxTLSSocket::is_connected(void)
 	return _is_connected;
 }
 
+int LinuxTLSSocket::get_fd(void)
+{
+	return _is_connected ? _server_fd.fd : -1;
+}
+
 void LinuxTLSSocket::set_blocking(bool blocking, unsigned int timeout_ms)
 {
-	mbedtls_ssl_conf_read_timeout(&_conf, timeout_ms);
+	//the descriptor itself stays blocking : bio_recv_timeout picks the kind of read, no fcntl nor new bio per switch
+	_is_blocking = blocking;
+
+	if (blocking)
+	{
+		mbedtls_ssl_conf_read_timeout(&_conf, timeout_ms);
+	}
+}
+
+int LinuxTLSSocket::bio_send(void* ctx, const unsigned char* buf, size_t len)
+{
+	return mbedtls_net_send(&((LinuxTLSSocket*) ctx)->_server_fd, buf, len);
+}
+
+int LinuxTLSSocket::bio_recv_timeout(void* ctx, unsigned char* buf, size_t len, uint32_t timeout)
+{
+	LinuxTLSSocket*		self = (LinuxTLSSocket*) ctx;
+
+	if (self->_is_blocking)
+	{
+		return mbedtls_net_recv_timeout(&self->_server_fd, buf, len, timeout);
+	}
+
+	//non-blocking: whatever is readable right now, mbedtls_ssl_read then returns WANT_READ
+	int rc = (int) ::recv(self->_server_fd.fd, buf, len, MSG_DONTWAIT);
+
+	if (rc < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			return MBEDTLS_ERR_SSL_WANT_READ;
+		}
+		return (errno == EPIPE || errno == ECONNRESET) ? MBEDTLS_ERR_NET_CONN_RESET : MBEDTLS_ERR_NET_RECV_FAILED;
+	}
+
+	return rc;
 }
 
 int LinuxTLSSocket::send(const char* data, int length)
@@ -293,6 +326,11 @@ int LinuxTLSSocket::send(const char* data, int length)
 	int rc = mbedtls_ssl_write(&_ssl, (const unsigned char*) data, length);
 
 	//_is_connected = (rc != 0);
+	if (rc > 0)
+	{
+		//a write sends at most one record, the rest is left to the caller
+		_records_sent.store(_records_sent.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
 
 	return rc;
 }
@@ -302,6 +340,45 @@ int LinuxTLSSocket::send_all(const char* data, int length)
 	return send(data, length);
 }
 
+int LinuxTLSSocket::send_vector(const struct iovec* iov, int iovcnt)
+{
+	int sent = 0;
+	int total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		total += iov[i].iov_len;
+	}
+	if (total <= TLS_GATHER_SIZE)
+	{
+		// small packet : one record rather than one per fragment, each carrying its own header and MAC
+		unsigned char gather[TLS_GATHER_SIZE];
+		for (int i = 0; i < iovcnt; i++)
+		{
+			memcpy(&gather[sent], iov[i].iov_base, iov[i].iov_len);
+			sent += iov[i].iov_len;
+		}
+		return send((const char*) gather, total);
+	}
+
+	// one record per fragment: the payload is encrypted straight from the caller's buffer
+	for (int i = 0; i < iovcnt; i++)
+	{
+		int rc = send((const char*) iov[i].iov_base, iov[i].iov_len);
+		if (rc < 0)
+		{
+			return (sent > 0) ? sent : rc;
+		}
+		sent += rc;
+		if (rc < (int) iov[i].iov_len)
+		{
+			break;
+		}
+	}
+
+	return sent;
+}
+
 int LinuxTLSSocket::receive(char* data, int length)
 {
 	if (!_is_connected)
@@ -328,6 +405,7 @@ int LinuxTLSSocket::receive(char* data, int length)
 		else if (rc > 0)
 		{
 			bytes += rc;
+			countRecordRead();
 		}
 		else
 		{
@@ -338,6 +416,48 @@ int LinuxTLSSocket::receive(char* data, int length)
 	return bytes;
 }
 
+int LinuxTLSSocket::receive_some(char* data, int length)
+{
+	if (!_is_connected)
+	{
+		return -1;
+	}
+
+	//a single read returns up to one decrypted record, or what is left of the current one
+	int rc = mbedtls_ssl_read(&_ssl, (unsigned char*) data, (size_t) length);
+
+	if (rc == MBEDTLS_ERR_SSL_TIMEOUT || rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+	{
+		return 0;	//time-out, nothing received
+	}
+	else if (rc <= 0)
+	{
+		return -1;	//error or connection closed by peer
+	}
+
+	countRecordRead();
+	return rc;
+}
+
+void LinuxTLSSocket::countRecordRead()
+{
+	//a record may take several reads: it is counted once all of it has been handed over
+	if (mbedtls_ssl_get_bytes_avail(&_ssl) == 0)
+	{
+		_records_received.store(_records_received.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+int LinuxTLSSocket::pending(void)
+{
+	if (!_is_connected)
+	{
+		return 0;
+	}
+
+	return (int) mbedtls_ssl_get_bytes_avail(&_ssl);
+}
+
 
 int LinuxTLSSocket::receive(char* data, int dataSize, const char* searchPattern)
 {
@@ -348,17 +468,17 @@ int LinuxTLSSocket::receive(char* data, int dataSize, const char* searchPattern)
 
 	if (NULL == searchPattern)
 	{
-		fprintf(stdout, "TLS-Socket::receive - error : No Pattern");
+		MQTT_ERROR("TLS-Socket::receive - error : No Pattern");
 		return 0;
 	}
 
 	if (strlen(searchPattern) == 0)
 	{
-		fprintf(stdout, "TLS-Socket::receive - error : Empty Pattern");
+		MQTT_ERROR("TLS-Socket::receive - error : Empty Pattern");
 		return 0;
 	}
 
-	fprintf(stdout, "TLS-Socket::receive - search for Pattern %s", searchPattern);
+	MQTT_DEBUG("TLS-Socket::receive - search for Pattern %s", searchPattern);
 
 	int 	index = 0;
 	int     nMatchCount = strlen(searchPattern);
@@ -374,7 +494,7 @@ int LinuxTLSSocket::receive(char* data, int dataSize, const char* searchPattern)
 			nSearchIndex++;
 			if (nSearchIndex == nMatchCount)
 			{
-				fprintf(stdout, "TLS-Socket::receive - Found Pattern. Data size = %d", index);
+				MQTT_DEBUG("TLS-Socket::receive - Found Pattern. Data size = %d", index);
 				break;
 			}
 		}
@@ -385,12 +505,12 @@ int LinuxTLSSocket::receive(char* data, int dataSize, const char* searchPattern)
 
 		if (index >= dataSize)
 		{
-			fprintf(stdout, "TLS-Socket::receive - Pattern not found. Buffer too short");
+			MQTT_WARN("TLS-Socket::receive - Pattern not found. Buffer too short");
 			break;		
 		}
 	}
 
-	fprintf(stdout, "TLS-Socket::receive - read count = %d", index);
+	MQTT_DEBUG("TLS-Socket::receive - read count = %d", index);
 	data[index] = '\0';
 	return index;
 }
@@ -403,7 +523,7 @@ void LinuxTLSSocket::getSSLerror(int errorCode)
 	{
 		char error_buf[100];
 		mbedtls_strerror( errorCode, error_buf, 100 );
-		fprintf(stdout, "Last error was: %d - %s\n\n", errorCode, error_buf );
+		MQTT_ERROR("TLS : last error was: %d - %s", errorCode, error_buf );
 	}
 }
 
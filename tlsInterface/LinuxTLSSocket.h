@@ -92,6 +92,11 @@ public:
 	\return true if connected, false otherwise.
 	*/
 	bool is_connected(void);
+
+	/** Get the underlying file descriptor
+	\return the socket descriptor, -1 if not connected
+	*/
+	int get_fd(void);
 	
 	/** Set blocking or non-blocking mode of the socket and a timeout on
 		blocking socket operations
@@ -114,6 +119,13 @@ public:
 	*/
 	int send_all(const char* data, int length);
 	
+	/** Send several buffers to the remote host, in this order, without first gathering them.
+	\param iov The buffers to send.
+	\param iovcnt The number of buffers.
+	\return the number of written bytes on success (>=0), possibly less than the total, or -1 on failure
+	*/
+	int send_vector(const struct iovec* iov, int iovcnt);
+	
 	/** Receive data from the remote host.
 	\param data The buffer in which to store the data received from the host.
 	\param length The maximum length of the buffer.
@@ -121,6 +133,19 @@ public:
 	 */
 	int receive(char* data, int length);
 
+	/** Receive whatever data is available from the remote host, in a single read.
+	\param data The buffer in which to store the data received from the host.
+	\param length The maximum length of the buffer.
+	\return the number of received bytes on success (>0), 0 if nothing arrived before the timeout
+	        (or nothing is readable right now in non-blocking mode) or -1 on failure
+	 */
+	int receive_some(char* data, int length);
+
+	/** Number of bytes already received and buffered by the socket layer
+	\return the number of bytes that can be received without touching the descriptor
+	 */
+	int pending(void);
+
 	/** Receive data from the remote host.
 	\param data The buffer in which to store the data received from the host.
 	\param dataSize The maximum length of the buffer.
@@ -135,6 +160,10 @@ public:
 private:
 	void 						freeSSL();
 	void 						getSSLerror(int errorCode);
+	void 						countRecordRead();
+
+	static int					bio_send(void* ctx, const unsigned char* buf, size_t len);
+	static int					bio_recv_timeout(void* ctx, unsigned char* buf, size_t len, uint32_t timeout);
 
 
 	char						_trustedCaFolderName[256];
@@ -12,6 +12,7 @@
 #include "SocketInterface.h"
 #include "LinuxSocket.h"
 #include "LinuxTLSSocket.h"
+#include "MQTTLog.h"
 
 #define	MQTT_PORT			1883
 #define MQTT_SECURED_PORT	8883
@@ -38,36 +39,31 @@ void* SOCKET_connect
 
 	if (useTLS)
 	{
-		fprintf(stdout, "*** Using TLS Socket ***\n");
-		fflush(stdout);
 		pSock = new LinuxTLSSocket();
 	}
 	else
 	{
-		fprintf(stdout, "*** Using REGULAR Socket ***\n");
-		fflush(stdout);
 		pSock = new LinuxSocket();
 	}
 
 	if (pSock)
 	{
-		fprintf(stdout, "Connecting to server... ");
 		int ret = pSock->connect(serverUrl, port);
 		if (ret < 0)
 		{
 			pSock->close();
-			fprintf(stdout, "Could not connect: %d\n", ret);
+			MQTT_WARN("Could not connect to %s:%d%s : %d", serverUrl, port, useTLS ? " over TLS" : "", ret);
 			delete pSock;
 			pSock = NULL;
 		}
 		else
 		{
-			fprintf(stdout, "OK\n");
+			MQTT_DEBUG("Socket connected to %s:%d%s", serverUrl, port, useTLS ? " over TLS" : "");
 		}
 	}
 	else
 	{
-		fprintf(stdout, "Cannot instantiate Socket object");
+		MQTT_ERROR("Cannot instantiate Socket object");
 	}
 
 	return pSock;
@@ -138,6 +134,46 @@ void SOCKET_setTimeout
 	}
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * NonBlocking
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+void SOCKET_setNonBlocking
+(
+	void*  			pInstance
+)
+{
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		pSock->set_blocking(false);
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * GetFd
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_getFd
+(
+	void*  			pInstance
+)
+{
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		return pSock->get_fd();
+	}
+
+	return -1;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Receive
@@ -161,6 +197,50 @@ int SOCKET_receive
 	return -1;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * ReceiveSome
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_receiveSome
+(
+	void*  			pInstance,
+	char*			pData,
+	int 			dataLength
+)
+{
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		return pSock->receive_some(pData, dataLength);
+	}
+
+	return -1;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pending
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_pending
+(
+	void*  			pInstance
+)
+{
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		return pSock->pending();
+	}
+
+	return 0;
+}
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Send
@@ -184,6 +264,51 @@ int SOCKET_send
 	return -1;
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * SendVector
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_sendVector
+(
+	void*  				pInstance,
+	const struct iovec*	pVector,
+	int 				vectorCount
+)
+{
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		return pSock->send_vector(pVector, vectorCount);
+	}
+
+	return -1;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * GetRecordCounts
+ *
+ */
+//--------------------------------------------------------------------------------------------------
+void SOCKET_getRecordCounts
+(
+	void*  			pInstance,
+	unsigned long*	pSent,
+	unsigned long*	pReceived
+)
+{
+	*pSent = *pReceived = 0;
+	if (pInstance)
+	{
+		BaseSocket* 	pSock = (BaseSocket *) pInstance;
+
+		pSock->get_record_counts(pSent, pReceived);
+	}
+}
+
 
 #ifdef __cplusplus
 }
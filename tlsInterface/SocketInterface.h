@@ -14,6 +14,8 @@ HTTP Interface header file
 #ifndef SOCKET_INTERFACE_H
 #define SOCKET_INTERFACE_H
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -65,6 +67,29 @@ void SOCKET_setTimeout
 	unsigned int 	timeout_ms
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * NonBlocking
+ *		Subsequent receives return immediately with what is readable (0 if nothing)
+ *		until the next call to SOCKET_setTimeout
+ */
+//--------------------------------------------------------------------------------------------------
+void SOCKET_setNonBlocking
+(
+	void*  			pInstance
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * GetFd
+ *		returns the underlying socket descriptor (for select/poll/epoll), -1 if none
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_getFd
+(
+	void*  			pInstance
+);
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Receive
@@ -78,6 +103,32 @@ int SOCKET_receive
 	int 			dataLength
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * ReceiveSome
+ *		single read of whatever is available, up to dataLength
+ *		returns number of bytes received, 0 on time-out, -1 if fails
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_receiveSome
+(
+	void*  			pInstance,
+	char*			pData,
+	int 			dataLength
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Pending
+ *		returns number of bytes already buffered by the socket layer (e.g. decrypted TLS data)
+ *		that can be received although the descriptor may not be readable
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_pending
+(
+	void*  			pInstance
+);
+
 //--------------------------------------------------------------------------------------------------
 /**
  * Send
@@ -91,6 +142,33 @@ int SOCKET_send
 	int 			dataLength
 );
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * SendVector
+ *		sends the buffers in order, without gathering them first
+ *		return number of bytes sent (may be less than the total). -1 if fails
+ */
+//--------------------------------------------------------------------------------------------------
+int SOCKET_sendVector
+(
+	void*  				pInstance,
+	const struct iovec*	pVector,
+	int 				vectorCount
+);
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * GetRecordCounts
+ *		TLS records written and read in full since the connection was made, 0 for a plain socket
+ */
+//--------------------------------------------------------------------------------------------------
+void SOCKET_getRecordCounts
+(
+	void*  			pInstance,
+	unsigned long*	pSent,
+	unsigned long*	pReceived
+);
+
 
 #ifdef __cplusplus
 }